@@ -0,0 +1,65 @@
+#!/bin/sh
+# bench_h2.sh - loads a page with many small assets over HTTP/1.0 and over HTTP/2 (h2c) and prints the times.
+# HTTP/1.0 fetches the assets like a browser does: a new connection per request, 6 at a time (curl + xargs).
+# HTTP/2 fetches the page and then all its assets at once on one connection (nghttp).
+# usage: ./bench_h2.sh [port] [assets] [rounds]      needs: curl, nghttp, xargs
+
+PORT=${1:-18480}
+ASSETS=${2:-100}
+ROUNDS=${3:-20}
+ROOT=$(mktemp -d)
+SERVER=$(pwd)/server
+
+command -v nghttp > /dev/null || { echo "nghttp is missing"; exit 1; }
+[ -x "$SERVER" ] || { echo "build the server first (make)"; exit 1; }
+
+# the page: index.html with ASSETS stylesheets/scripts/images of 1K..8K
+echo "<html><head>" > "$ROOT/index.html"
+i=0
+while [ $i -lt "$ASSETS" ]; do
+    size=$(( (i % 8 + 1) * 1024 ))
+    case $((i % 3)) in
+        0) f="css/s$i.css"; echo "<link rel=\"stylesheet\" href=\"/$f\">" >> "$ROOT/index.html" ;;
+        1) f="js/s$i.js"; echo "<script src=\"/$f\"></script>" >> "$ROOT/index.html" ;;
+        *) f="img/i$i.png"; echo "<img src=\"/$f\">" >> "$ROOT/index.html" ;;
+    esac
+    mkdir -p "$ROOT/$(dirname $f)"
+    head -c $size /dev/urandom > "$ROOT/$f"
+    echo "/$f" >> "$ROOT/urls.txt"
+    i=$((i + 1))
+done
+echo "</head><body></body></html>" >> "$ROOT/index.html"
+chmod -R o+rX "$ROOT"
+
+cd "$ROOT" && "$SERVER" "$PORT" 8 1000000 > /dev/null 2>&1 &
+PID=$!
+sleep 0.5
+H2_URLS=$(sed "s|^|http://127.0.0.1:$PORT|" "$ROOT/urls.txt")
+
+now_ms() {
+    echo $(($(date +%s%N) / 1000000))
+}
+
+h1_page() {
+    curl -s -o /dev/null "http://127.0.0.1:$PORT/index.html"
+    sed "s|^|http://127.0.0.1:$PORT|" "$ROOT/urls.txt" | xargs -P 6 -n 10 curl -s -o /dev/null -o /dev/null \
+        -o /dev/null -o /dev/null -o /dev/null -o /dev/null -o /dev/null -o /dev/null -o /dev/null -o /dev/null --http1.0
+}
+
+h2_page() {
+    nghttp -n "http://127.0.0.1:$PORT/index.html" $H2_URLS > /dev/null
+}
+
+for proto in h1 h2; do
+    start=$(now_ms)
+    r=0
+    while [ $r -lt "$ROUNDS" ]; do
+        ${proto}_page
+        r=$((r + 1))
+    done
+    total=$(($(now_ms) - start))
+    echo "$proto: $ROUNDS page loads of 1 + $ASSETS assets in $total ms ($((total / ROUNDS)) ms per page)"
+done
+
+kill $PID
+rm -rf "$ROOT"
@@ -0,0 +1,74 @@
+#!/bin/sh
+# bench_tls.sh - downloads a large file over HTTPS with kernel TLS (sendfile stays zero-copy) and with
+# userspace encryption (--no-ktls, every byte goes through a relay thread), and over plain HTTP for reference.
+# Every mode runs ROUNDS downloads one after the other, and then ROUNDS downloads at once.
+# usage: ./bench_tls.sh [port] [size-MB] [rounds]      needs: curl, cert.pem/key.pem (make cert)
+
+PORT=${1:-18490}
+SIZE=${2:-256}
+ROUNDS=${3:-8}
+ROOT=$(mktemp -d)
+SERVER=$(pwd)/server
+CERT=$(pwd)/cert.pem
+KEY=$(pwd)/key.pem
+
+[ -x "$SERVER" ] || { echo "build the server first (make)"; exit 1; }
+[ -f "$CERT" ] && [ -f "$KEY" ] || { echo "create a certificate first (make cert)"; exit 1; }
+
+head -c $((SIZE * 1024 * 1024)) /dev/urandom > "$ROOT/big.bin"
+chmod -R o+rX "$ROOT"
+
+now_ms() {
+    echo $(($(date +%s%N) / 1000000))
+}
+
+# run <name> <port> <scheme> <server flags...>
+run() {
+    name=$1
+    port=$2
+    scheme=$3
+    shift 3
+    (cd "$ROOT" && exec "$SERVER" "$port" 8 1000000 "$@" > "$ROOT/server.log" 2>&1) &
+    PID=$!
+    sleep 0.5
+    url="$scheme://127.0.0.1:$port/big.bin"
+    got=$(curl -sk --http1.1 -o /dev/null -w "%{size_download}" "$url")
+    if [ "$got" != $((SIZE * 1024 * 1024)) ]; then
+        echo "$name: the download failed (port $port busy?)"
+        cat "$ROOT/server.log"
+        kill $PID 2> /dev/null
+        return
+    fi
+
+    start=$(now_ms)
+    r=0
+    while [ $r -lt "$ROUNDS" ]; do
+        curl -sk --http1.1 -o /dev/null "$url"
+        r=$((r + 1))
+    done
+    seq_ms=$(($(now_ms) - start + 1))
+
+    start=$(now_ms)
+    r=0
+    pids=""
+    while [ $r -lt "$ROUNDS" ]; do
+        curl -sk --http1.1 -o /dev/null "$url" &
+        pids="$pids $!"
+        r=$((r + 1))
+    done
+    wait $pids
+    par_ms=$(($(now_ms) - start + 1))
+
+    kill $PID
+    wait $PID 2> /dev/null
+    mb=$((SIZE * ROUNDS))
+    echo "$name: sequential $((mb * 1000 / seq_ms)) MB/s, $ROUNDS at once $((mb * 1000 / par_ms)) MB/s"
+    grep "^tls:" "$ROOT/server.log" | sed 's/^/    /'
+}
+
+# every run on its own port, the previous one may still be in TIME_WAIT
+run "https kTLS     " "$PORT" https --tls "$CERT" "$KEY"
+run "https userspace" $((PORT + 1)) https --tls "$CERT" "$KEY" --no-ktls
+run "http           " $((PORT + 2)) http
+
+rm -rf "$ROOT"
@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/time.h>
+#include "capture.h"
+
+#define FAILED -1
+
+
+/**
+ * @author: Daniel Gabay
+ * capture.c
+ * --------------------------------------------------------------------------------
+ * This file implements the functionality of capture.h
+ * Records are collected in a buffer of the process, and the buffer is appended to the file with one write()
+ * when the next record doesn't fit (and by destroy_capture). The file is opened with O_APPEND, so the
+ * buffers of the workers, all appending to the same file, never overwrite each other, and since a buffer
+ * holds whole records only, records are never mixed.
+ * Note: 1)Time: offset_us is taken from CLOCK_MONOTONIC, which is the same for the master and the workers.
+ *       2)The requests of a worker that crashed since its last write are lost.
+ *       3)A request that can't be written (the file system is full) is dropped, the server goes on.
+ */
+
+/**forward declerations*/
+int flush_buffer(capture *c);
+uint64_t elapsed_us(capture *c);
+
+
+/**
+ * create_capture creates (or truncates) path and writes the header. returns NULL on failure.
+ */
+capture *create_capture(char *path) {
+    capture *c = (capture *) malloc(sizeof(capture));
+    if (c == NULL) {
+        printf("malloc failed\n");
+        return NULL;
+    }
+    c->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (c->fd < 0) {
+        perror("open capture file");
+        free(c);
+        return NULL;
+    }
+    capture_header hdr;
+    struct timeval now;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic));
+    hdr.version = CAPTURE_VERSION;
+    gettimeofday(&now, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &c->start);
+    hdr.start_unix_us = (uint64_t) now.tv_sec * 1000000 + now.tv_usec;
+    if (write(c->fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        perror("write capture file");
+        close(c->fd);
+        free(c);
+        return NULL;
+    }
+    c->len = 0;
+    c->records = 0;
+    pthread_mutex_init(&c->lock, NULL);
+    return c;
+}
+
+/**
+ * capture_now returns the time from the start of the capture in microseconds (0 when c is NULL).
+ */
+uint64_t capture_now(capture *c) {
+    return c != NULL ? elapsed_us(c) : 0;
+}
+
+/**
+ * capture_begin starts the record of a request that arrived at arrived_us (see capture_now).
+ */
+void capture_begin(capture *c, capture_req *req, uint64_t arrived_us) {
+    (void) c;
+    memset(&req->rec, 0, sizeof(capture_record));
+    req->line[0] = '\0';
+    req->rec.offset_us = arrived_us;
+}
+
+/**
+ * capture_end sets the duration of req and appends it.
+ */
+void capture_end(capture *c, capture_req *req) {
+    if (c == NULL)
+        return;
+    uint64_t now = elapsed_us(c);
+    req->rec.duration_us = (uint32_t) (now - req->rec.offset_us);
+    size_t line_len = strnlen(req->line, CAPTURE_MAX_LINE);
+    req->rec.line_len = (uint16_t) line_len;
+    size_t size = sizeof(capture_record) + line_len;
+    pthread_mutex_lock(&c->lock);
+    if (c->len + size > CAPTURE_BUF)
+        flush_buffer(c);
+    memcpy(c->buf + c->len, &req->rec, sizeof(capture_record));
+    memcpy(c->buf + c->len + sizeof(capture_record), req->line, line_len);
+    c->len += size;
+    c->records++;
+    pthread_mutex_unlock(&c->lock);
+}
+
+/**
+ * destroy_capture writes the buffered records, closes the file and frees c.
+ */
+void destroy_capture(capture *c) {
+    if (c == NULL)
+        return;
+    pthread_mutex_lock(&c->lock);
+    flush_buffer(c);
+    pthread_mutex_unlock(&c->lock);
+    close(c->fd);
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
+
+/**appends the buffer to the file (called with the lock). returns 0 on succsess, FAILED o.w (the buffer is
+ * emptied anyway)*/
+int flush_buffer(capture *c) {
+    ssize_t n, len = (ssize_t) c->len;
+    if (len == 0)
+        return 0;
+    c->len = 0;
+    do { //one write: O_APPEND puts it at the end as a whole
+        n = write(c->fd, c->buf, len);
+    } while (n < 0 && errno == EINTR);
+    if (n != len) {
+        perror("write capture file");
+        return FAILED;
+    }
+    return 0;
+}
+
+/**returns the microseconds since the start of the capture*/
+uint64_t elapsed_us(capture *c) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) (now.tv_sec - c->start.tv_sec) * 1000000 + (now.tv_nsec - c->start.tv_nsec) / 1000;
+}
@@ -0,0 +1,103 @@
+#ifndef EX3_CAPTURE_H
+#define EX3_CAPTURE_H
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * capture.h
+ *
+ * This file declares the traffic capture (--capture <file>): one record per request the server answered,
+ * with its request line, when it arrived, how long it took and what was sent back. The replay tool (replay.c)
+ * plays a capture back against a server.
+ * Layout: [capture_header][capture_record + line_len bytes of request line]...
+ * Records are in host byte order, and are not sorted: workers and threads append them as they finish
+ * (sort them by offset_us to get the arrival order).
+ */
+
+#define CAPTURE_MAGIC "HSCAP001"
+#define CAPTURE_VERSION 1
+#define CAPTURE_BUF 65536               //records are buffered and appended to the file this many bytes at a time
+#define CAPTURE_MAX_LINE 1024           //longer request lines are cut
+
+/**flags of a record*/
+#define CAPTURE_H2 1                    //an HTTP/2 stream: bytes counts the body only (the headers are compressed)
+
+
+/**
+ * the start of the capture file
+ */
+typedef struct capture_header_st {
+    char magic[8];                      //CAPTURE_MAGIC
+    uint32_t version;                   //CAPTURE_VERSION
+    uint32_t reserved;
+    uint64_t start_unix_us;             //wall clock time of offset_us 0
+} capture_header;
+
+
+/**
+ * one request, followed by line_len bytes of its request line (not NULL terminated)
+ */
+typedef struct capture_record_st {
+    uint64_t offset_us;                 //arrival, from the start of the capture
+    uint64_t bytes;                     //the response the server sent (or handed to the streamer): headers and body
+    uint32_t duration_us;               //from the arrival until the response was sent (or handed over)
+    uint16_t status;                    //0 when not known (proxied responses, relayed as they come from the backend)
+    uint8_t flags;                      //CAPTURE_*
+    uint8_t reserved;
+    uint16_t line_len;
+    uint8_t reserved2[6];
+} capture_record;
+
+
+/**
+ * a request being captured: its record and request line, filled while the request is served
+ */
+typedef struct capture_req_st {
+    capture_record rec;
+    char line[CAPTURE_MAX_LINE];
+} capture_req;
+
+
+/**
+ * The capture file of this process
+ */
+typedef struct _capture_st {
+    int fd;                             //O_APPEND, shared with the workers
+    struct timespec start;              //CLOCK_MONOTONIC of offset_us 0 (the same clock in every process)
+    char buf[CAPTURE_BUF];
+    size_t len;
+    long records;
+    pthread_mutex_t lock;               //protects buf, len and records
+} capture;
+
+
+/**
+ * create_capture creates (or truncates) path and writes the header. returns NULL on failure.
+ * it should be called before the workers are forked: they inherit it, with an empty buffer.
+ */
+capture *create_capture(char *path);
+
+/**
+ * capture_now returns the time from the start of the capture in microseconds (0 when c is NULL), the arrival
+ * time capture_begin takes.
+ */
+uint64_t capture_now(capture *c);
+
+/**
+ * capture_begin starts the record of a request that arrived at arrived_us (see capture_now).
+ */
+void capture_begin(capture *c, capture_req *req, uint64_t arrived_us);
+
+/**
+ * capture_end sets the duration of req and appends it.
+ */
+void capture_end(capture *c, capture_req *req);
+
+/**
+ * destroy_capture writes the buffered records, closes the file and frees c.
+ */
+void destroy_capture(capture *c);
+
+
+#endif
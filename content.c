@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include "content.h"
+
+
+/**
+ * @author: Daniel Gabay
+ * content.c
+ * --------------------------------------------------------------------------------
+ * This file implements the functionality of content.h
+ * The directory listing and the mime types used to live in server.c, they are here so the
+ * offline pack builder (packbuild.c) renders exactly the same bytes as the live server.
+ * Listing: the names are read first and sorted, then stat'ed with fstatat() relative to the directory, in
+ * chunks of DIR_STAT_CHUNK names on the threads of the pool (parallel_for), each chunk into its own part of
+ * the sorted array, so the table is built in order with no merge step. Without a pool (packbuild) they are
+ * stat'ed here, the same way.
+ */
+
+/**
+ * an entry of the listing
+ */
+typedef struct dir_item_st {
+    char *name;
+    struct stat st;
+    int found;          //0 if the stat failed (the entry is not listed)
+} dir_item;
+
+/**
+ * a listing being built
+ */
+typedef struct dir_listing_st {
+    int dirfd;
+    dir_item *items;
+    int num_items;
+} dir_listing;
+
+/**forward declerations*/
+void stat_dir_items(int begin, int end, void *arg);
+int cmp_dir_items(const void *a, const void *b);
+void free_dir_items(dir_listing *listing);
+
+
+/**returns malloc'ed html table of directory content, NULL on failure*/
+char *build_dir_content(char *path, int *len) {
+    return build_dir_content_on(path, len, NULL);
+}
+
+/**returns malloc'ed html table of directory content, the entries stat'ed on the threads of tp. NULL on failure*/
+char *build_dir_content_on(char *path, int *len, threadpool *tp) {
+    if (path == NULL || len == NULL)
+        return NULL;
+    dir_listing listing;
+    struct dirent *de;
+    char timebuf[128];
+    int cap = 0;
+    size_t names_len = 0;
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+        return NULL;
+    listing.dirfd = dirfd(dir);
+    listing.items = NULL;
+    listing.num_items = 0;
+    while ((de = readdir(dir)) != NULL) {
+        if (listing.num_items == cap) {
+            cap = cap ? cap * 2 : 64;
+            dir_item *items = (dir_item *) realloc(listing.items, sizeof(dir_item) * cap);
+            if (items == NULL) {
+                printf("malloc failed\n");
+                free_dir_items(&listing);
+                closedir(dir);
+                return NULL;
+            }
+            listing.items = items;
+        }
+        dir_item *item = &listing.items[listing.num_items];
+        item->name = strdup(de->d_name);
+        if (item->name == NULL) {
+            printf("malloc failed\n");
+            free_dir_items(&listing);
+            closedir(dir);
+            return NULL;
+        }
+        item->found = 0;
+        names_len += strlen(de->d_name);
+        listing.num_items++;
+    }
+    /**sorted first, so every thread fills its own part of the table in order*/
+    qsort(listing.items, listing.num_items, sizeof(dir_item), cmp_dir_items);
+    if (parallel_for(tp, LANE_BULK, 0, listing.num_items, DIR_STAT_CHUNK, stat_dir_items, &listing) < 0)
+        stat_dir_items(0, listing.num_items, &listing);
+    closedir(dir);
+
+    size_t response_size = strlen(DIR_CONTENT_START) + strlen(path) * 2 + strlen(DIR_CONTENT_END) + 150 +
+                           listing.num_items * (strlen(DIR_CONTENT_FILE) + 100) + names_len * 2;
+    char *response = (char *) malloc(sizeof(char) * response_size);
+    if (response == NULL) {
+        free_dir_items(&listing);
+        return NULL;
+    }
+    int off = sprintf(response, DIR_CONTENT_START, path, path); /**html start, table constructing..*/
+    for (int i = 0; i < listing.num_items; i++) {
+        dir_item *item = &listing.items[i];
+        if (!item->found)
+            continue;
+        /**create <td> tag for each entity*/
+        strftime(timebuf, sizeof(timebuf), RFC1123FMT, gmtime(&item->st.st_mtime));
+        if (S_ISDIR(item->st.st_mode))
+            off += sprintf(response + off, DIR_CONTENT_FOLDER, item->name, item->name, timebuf);
+        else
+            off += sprintf(response + off, DIR_CONTENT_FILE, item->name, item->name, timebuf, item->st.st_size);
+    }
+    off += sprintf(response + off, DIR_CONTENT_END, SERVER);
+    free_dir_items(&listing);
+    *len = off;
+    return response;
+}
+
+/**stats the entries [begin, end) of the listing (relative to its directory, no path to build)*/
+void stat_dir_items(int begin, int end, void *arg) {
+    dir_listing *listing = (dir_listing *) arg;
+    for (int i = begin; i < end; i++) {
+        dir_item *item = &listing->items[i];
+        item->found = (fstatat(listing->dirfd, item->name, &item->st, 0) == 0);
+    }
+}
+
+/**orders the entries of a listing by name*/
+int cmp_dir_items(const void *a, const void *b) {
+    return strcmp(((dir_item *) a)->name, ((dir_item *) b)->name);
+}
+
+/**frees the entries of the listing*/
+void free_dir_items(dir_listing *listing) {
+    for (int i = 0; i < listing->num_items; i++)
+        free(listing->items[i].name);
+    free(listing->items);
+}
+
+char *get_mime_type(char *name) {
+    if (name == NULL)
+        return NULL;
+    char *ext = strrchr(name, '.');
+    if (!ext) return NULL;
+    if (strcmp(ext, ".html") == 0 || strcmp(ext, ".htm") == 0) return "text/html";
+    if (strcmp(ext, ".jpg") == 0 || strcmp(ext, ".jpeg") == 0) return "image/jpeg";
+    if (strcmp(ext, ".gif") == 0) return "image/gif";
+    if (strcmp(ext, ".png") == 0) return "image/png";
+    if (strcmp(ext, ".css") == 0) return "text/css";
+    if (strcmp(ext, ".au") == 0) return "audio/basic";
+    if (strcmp(ext, ".wav") == 0) return "audio/wav";
+    if (strcmp(ext, ".avi") == 0) return "video/x-msvideo";
+    if (strcmp(ext, ".mpeg") == 0 || strcmp(ext, ".mpg") == 0) return "video/mpeg";
+    if (strcmp(ext, ".mp3") == 0) return "audio/mpeg";
+    return NULL;
+}
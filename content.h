@@ -0,0 +1,42 @@
+#ifndef EX3_CONTENT_H
+#define EX3_CONTENT_H
+#include "threadpool.h"
+
+/**
+ * content.h
+ *
+ * This file declares the response content that does not depend on a specific request:
+ * the directory listing html and the mime types. It is shared by the server and the pack builder.
+ */
+
+#define SERVER "webserver/1.0"
+#define RFC1123FMT "%a, %d %b %Y %H:%M:%S GMT"
+#define INDEX_FILE "index.html"
+#define DIR_STAT_CHUNK 256 /**entries of a directory listing stat'ed per task, smaller directories by one thread*/
+
+/**Dir content defines*/
+#define DIR_CONTENT_START "<HTML>\r\n<HEAD><TITLE>Index of %s</TITLE></HEAD>\r\n<BODY>\r\n<H4>Index of %s</H4>\r\n<table CELLSPACING=8>\r\n<tr><th>Name</th><th>Last Modified</th><th>Size</th></tr>\r\n"
+#define DIR_CONTENT_FOLDER "<tr>\r\n<td><A HREF=\"%s/\">%s</td>\r\n<td>%s</td>\r\n</tr>\r\n"
+#define DIR_CONTENT_FILE "<tr>\r\n<td><A HREF=\"%s""\">%s</td>\r\n<td>%s</td>\r\n<td>%zd</td>\r\n</tr>\r\n"
+#define DIR_CONTENT_END "</table><HR>\r\n<ADDRESS>%s</ADDRESS>\r\n</BODY></HTML>\r\n"
+
+
+/**
+ * get_mime_type returns the mime type of the file name by its extension, NULL if unknown.
+ */
+char *get_mime_type(char *name);
+
+/**
+ * build_dir_content returns a malloc'ed html table of the directory path (path must end with '/'), sorted by
+ * name, and sets *len to its length. returns NULL on failure.
+ */
+char *build_dir_content(char *path, int *len);
+
+/**
+ * build_dir_content_on is build_dir_content with the entries stat'ed on the threads of tp (LANE_BULK)
+ * as well as the calling thread. tp may be NULL.
+ */
+char *build_dir_content_on(char *path, int *len, threadpool *tp);
+
+
+#endif
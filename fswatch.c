@@ -0,0 +1,355 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include "fswatch.h"
+
+#define FLAG_OFF 0
+#define FLAG_ON 1
+#define FAILED -1
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | \
+                    IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+
+/**
+ * @author: Daniel Gabay
+ * fswatch.c
+ * --------------------------------------------------------------------------------
+ * This file implements the functionality of fswatch.h
+ * Every directory of the tree has its own inotify watch (inotify is not recursive), dirs maps a watch
+ * descriptor back to the path of its directory. A directory that is created (or moved) into the tree is
+ * watched, and scanned for the directories that were created in it before its watch was added, before its
+ * event is published, so nothing created in it is missed. A directory that is removed (or moved) out of
+ * the tree drops its watches and the watches under it.
+ * Note: 1)Events of one read() are published in order, an event that repeats the one before it (a file
+ *         being written) is published once.
+ *       2)Overflow: the tree is scanned again (for the directories whose events were lost) and FSW_ALL is
+ *         published. the watches themselves are still good, so the watcher goes on.
+ *       3)fanotify could watch a whole file system with one mark, but it needs CAP_SYS_ADMIN and reports
+ *         file handles rather than names, so it's not used.
+ */
+
+/**forward declerations*/
+void *watch_loop(void *p);
+void handle_events(fswatch *w, char *buf, ssize_t len);
+int handle_event(fswatch *w, struct inotify_event *ev, char **path);
+void add_tree(fswatch *w, char *path);
+void forget_tree(fswatch *w, char *path);
+int set_dir(fswatch *w, int wd, char *path);
+void degrade(fswatch *w, char *why);
+void publish(fswatch *w, int kind, char *path);
+char *join_path(char *dir, char *name);
+
+
+/**
+ * create_fswatch watches the directory root and every directory under it. returns NULL if inotify can't
+ * be used at all.
+ */
+fswatch *create_fswatch(char *root) {
+    fswatch *w = (fswatch *) malloc(sizeof(fswatch));
+    if (w == NULL) {
+        printf("malloc failed\n");
+        return NULL;
+    }
+    memset(w, 0, sizeof(fswatch));
+    w->root = strdup(root);
+    w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    w->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (w->root == NULL || w->fd < 0 || w->wakefd < 0) {
+        perror("fswatch inotify");
+        if (w->fd >= 0) close(w->fd);
+        if (w->wakefd >= 0) close(w->wakefd);
+        free(w->root);
+        free(w);
+        return NULL;
+    }
+    add_tree(w, "");
+    return w;
+}
+
+/**
+ * fswatch_subscribe adds fn to the subscribers. returns 0 on succsess, -1 o.w
+ */
+int fswatch_subscribe(fswatch *w, fswatch_fn fn, void *arg) {
+    if (w == NULL || fn == NULL || w->started || w->num_subs == MAX_FSW_SUBSCRIBERS)
+        return FAILED;
+    w->subs[w->num_subs].fn = fn;
+    w->subs[w->num_subs].arg = arg;
+    w->num_subs++;
+    return 0;
+}
+
+/**
+ * fswatch_start starts the thread that publishes the events. returns 0 on succsess, -1 o.w
+ */
+int fswatch_start(fswatch *w) {
+    if (w == NULL || w->started)
+        return FAILED;
+    if (pthread_create(&w->thread, NULL, watch_loop, (void *) w) != 0)
+        return FAILED;
+    w->started = FLAG_ON;
+    return 0;
+}
+
+/**
+ * fswatch_degraded returns 1 if the tree is not watched completely.
+ */
+int fswatch_degraded(fswatch *w) {
+    return w == NULL || __atomic_load_n(&w->degraded, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * destroy_fswatch stops the thread, removes the watches and frees w.
+ */
+void destroy_fswatch(fswatch *w) {
+    if (w == NULL)
+        return;
+    if (w->started) {
+        uint64_t one = 1;
+        if (write(w->wakefd, &one, sizeof(one)) < 0)
+            perror("fswatch wake up");
+        pthread_join(w->thread, NULL);
+    }
+    close(w->fd); //removes all the watches
+    close(w->wakefd);
+    for (int i = 0; i < w->dirs_cap; i++)
+        free(w->dirs[i]);
+    free(w->dirs);
+    free(w->root);
+    free(w);
+}
+
+/**the watcher thread: reads the events until destroy_fswatch, or until the tree is degraded*/
+void *watch_loop(void *p) {
+    fswatch *w = (fswatch *) p;
+    char buf[FSW_BUF] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfds[2];
+    pfds[0].fd = w->fd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = w->wakefd;
+    pfds[1].events = POLLIN;
+    while (!fswatch_degraded(w)) {
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("fswatch poll");
+            degrade(w, "poll failed");
+            break;
+        }
+        if (pfds[1].revents & POLLIN) //shutdown
+            break;
+        ssize_t len = read(w->fd, buf, sizeof(buf));
+        if (len < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            perror("fswatch read");
+            degrade(w, "read failed");
+            break;
+        }
+        handle_events(w, buf, len);
+    }
+    return NULL;
+}
+
+/**publishes the events in buf, skipping an event that repeats the one before it*/
+void handle_events(fswatch *w, char *buf, ssize_t len) {
+    char *last = NULL;
+    int last_kind = 0;
+    for (char *p = buf; p < buf + len;) {
+        struct inotify_event *ev = (struct inotify_event *) p;
+        p += sizeof(struct inotify_event) + ev->len;
+        char *path = NULL;
+        int kind = handle_event(w, ev, &path);
+        if (kind == 0 || path == NULL) {
+            free(path);
+            continue;
+        }
+        if (kind != last_kind || strcmp(path, last) != 0)
+            publish(w, kind, path);
+        free(last);
+        last = path;
+        last_kind = kind;
+    }
+    free(last);
+}
+
+/**updates the watches by ev. returns the kind of event to publish and sets *path (malloc'ed) to its
+ *path, or returns 0 when there is nothing to publish*/
+int handle_event(fswatch *w, struct inotify_event *ev, char **path) {
+    if (ev->mask & IN_Q_OVERFLOW) {
+        w->overflows++;
+        add_tree(w, ""); //watches the directories created meanwhile (the existing watches are kept)
+        *path = strdup("");
+        return FSW_ALL;
+    }
+    if (ev->wd < 0 || ev->wd >= w->dirs_cap || w->dirs[ev->wd] == NULL) //a watch that was dropped
+        return 0;
+    char *dir = w->dirs[ev->wd];
+    if (ev->mask & IN_IGNORED) { //the watch was removed (its directory is gone)
+        free(dir);
+        w->dirs[ev->wd] = NULL;
+        w->num_watches--;
+        return 0;
+    }
+    if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) { //the parent reports it, unless it's the root
+        if (dir[0] == '\0')
+            degrade(w, "the root directory was removed or moved");
+        return 0;
+    }
+    if (ev->len == 0) { //the directory itself: its premissions, those of everything under it
+        *path = strdup(dir);
+        return FSW_TREE;
+    }
+    *path = join_path(dir, ev->name);
+    if (*path == NULL)
+        return 0;
+    if (ev->mask & IN_ISDIR) {
+        if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+            add_tree(w, *path);
+        else if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+            forget_tree(w, *path);
+        return FSW_TREE;
+    }
+    if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+        struct stat st;
+        char *disk = join_path(w->root, *path);
+        if (disk != NULL && lstat(disk, &st) == 0 && S_ISLNK(st.st_mode))
+            degrade(w, "a symbolic link was added to the tree");
+        free(disk);
+    }
+    return FSW_CHANGED;
+}
+
+/**watches the directory path (relative to the root) and every directory under it*/
+void add_tree(fswatch *w, char *path) {
+    if (w->degraded)
+        return;
+    char *disk = path[0] == '\0' ? strdup(w->root) : join_path(w->root, path);
+    if (disk == NULL) {
+        degrade(w, "malloc failed");
+        return;
+    }
+    int wd = inotify_add_watch(w->fd, disk, WATCH_MASK);
+    if (wd < 0) {
+        if (errno == ENOENT || errno == ENOTDIR) //gone already, its parent reports it
+            ;
+        else if (errno == ENOSPC)
+            degrade(w, "the inotify watch limit was reached (fs.inotify.max_user_watches)");
+        else {
+            perror("inotify_add_watch");
+            degrade(w, "a directory can't be watched");
+        }
+        free(disk);
+        return;
+    }
+    if (set_dir(w, wd, path) < 0) {
+        free(disk);
+        return;
+    }
+    DIR *d = opendir(disk);
+    free(disk);
+    if (d == NULL)
+        return;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL && !w->degraded) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(dirfd(d), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+                continue;
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISLNK(st.st_mode) ? DT_LNK : DT_REG;
+        }
+        if (type == DT_LNK)
+            degrade(w, "the tree has symbolic links");
+        else if (type == DT_DIR) {
+            char *sub = join_path(path, entry->d_name);
+            if (sub == NULL)
+                degrade(w, "malloc failed");
+            else
+                add_tree(w, sub);
+            free(sub);
+        }
+    }
+    closedir(d);
+}
+
+/**removes the watches of the directory path and of every directory under it*/
+void forget_tree(fswatch *w, char *path) {
+    size_t len = strlen(path);
+    for (int wd = 0; wd < w->dirs_cap; wd++) {
+        char *dir = w->dirs[wd];
+        if (dir == NULL || strncmp(dir, path, len) != 0 || (dir[len] != '\0' && dir[len] != '/'))
+            continue;
+        inotify_rm_watch(w->fd, wd); //fails when the directory is gone already
+        free(dir);
+        w->dirs[wd] = NULL;
+        w->num_watches--;
+    }
+}
+
+/**records that wd watches the directory path. returns 0 on succsess, FAILED o.w*/
+int set_dir(fswatch *w, int wd, char *path) {
+    if (wd >= w->dirs_cap) {
+        int cap = w->dirs_cap ? w->dirs_cap : 64;
+        while (cap <= wd)
+            cap *= 2;
+        char **dirs = (char **) realloc(w->dirs, sizeof(char *) * cap);
+        if (dirs == NULL) {
+            degrade(w, "malloc failed");
+            return FAILED;
+        }
+        memset(dirs + w->dirs_cap, 0, sizeof(char *) * (cap - w->dirs_cap));
+        w->dirs = dirs;
+        w->dirs_cap = cap;
+    }
+    char *copy = strdup(path);
+    if (copy == NULL) {
+        degrade(w, "malloc failed");
+        return FAILED;
+    }
+    if (w->dirs[wd] == NULL) //o.w the directory was watched already (scanned again, or moved)
+        w->num_watches++;
+    free(w->dirs[wd]);
+    w->dirs[wd] = copy;
+    return 0;
+}
+
+/**stops publishing events: the subscribers get FSW_DEGRADED, and look at the file system themselves*/
+void degrade(fswatch *w, char *why) {
+    if (w->degraded)
+        return;
+    printf("fswatch: %s, falling back to TTL validation\n", why);
+    publish(w, FSW_DEGRADED, "");
+    __atomic_store_n(&w->degraded, FLAG_ON, __ATOMIC_RELEASE);
+}
+
+/**calls every subscriber with the event*/
+void publish(fswatch *w, int kind, char *path) {
+    if (w->degraded)
+        return;
+    w->events++;
+    for (int i = 0; i < w->num_subs; i++)
+        w->subs[i].fn(kind, path, w->subs[i].arg);
+}
+
+/**returns dir/name (malloc'ed), name when dir is "". NULL on failure*/
+char *join_path(char *dir, char *name) {
+    char *path = (char *) malloc(strlen(dir) + strlen(name) + 2);
+    if (path == NULL)
+        return NULL;
+    if (dir[0] == '\0')
+        strcpy(path, name);
+    else
+        sprintf(path, "%s/%s", dir, name);
+    return path;
+}
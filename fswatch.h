@@ -0,0 +1,92 @@
+#ifndef EX3_FSWATCH_H
+#define EX3_FSWATCH_H
+#include <pthread.h>
+
+/**
+ * fswatch.h
+ *
+ * This file declares the file system watcher: one thread that watches the served tree (every directory
+ * under the root) with inotify, and tells its subscribers what changed, so a cache of what was found on
+ * the file system drops (or refreshes) exactly the paths that changed, instead of looking at the file
+ * system again every few seconds.
+ * Paths in the events are relative to the root, the way the server sees them: "a.html", "sub/a.html"
+ * ("" is the root itself).
+ * When the tree can't be watched completely (the inotify watch limit was reached, a directory can't be
+ * watched, or it holds a symbolic link that may lead out of the tree) the subscribers get FSW_DEGRADED
+ * once and no other events: from then on they should look at the file system again every few seconds.
+ */
+
+/**kinds of events*/
+#define FSW_CHANGED 1       //path was created, removed, renamed, written to or its premissions changed
+#define FSW_TREE 2          //path is a directory, it and everything under it may have changed
+#define FSW_ALL 3           //events were lost (the inotify queue overflowed): anything may have changed
+#define FSW_DEGRADED 4      //the tree is no longer watched completely
+
+#define MAX_FSW_SUBSCRIBERS 8
+#define FSW_BUF 65536       //bytes of inotify events read at a time
+
+
+/**
+ * called by the watcher thread, for every event
+ */
+typedef void (*fswatch_fn)(int kind, char *path, void *arg);
+
+
+/**
+ * one subscriber
+ */
+typedef struct fswatch_sub_st {
+    fswatch_fn fn;
+    void *arg;
+} fswatch_sub;
+
+
+/**
+ * The watcher
+ */
+typedef struct _fswatch_st {
+    int fd;                             //the inotify instance
+    int wakefd;                         //eventfd used to wake the thread (on shutdown)
+    pthread_t thread;
+    int started;
+    char *root;
+    char **dirs;                        //the path of every watch descriptor (NULL when not in use)
+    int dirs_cap;
+    int num_watches;
+    int degraded;
+    fswatch_sub subs[MAX_FSW_SUBSCRIBERS];
+    int num_subs;
+    long events;                        //events published so far
+    long overflows;
+} fswatch;
+
+
+/**
+ * create_fswatch watches the directory root and every directory under it. returns NULL if inotify can't
+ * be used at all. the tree may be degraded already (see fswatch_degraded).
+ */
+fswatch *create_fswatch(char *root);
+
+/**
+ * fswatch_subscribe adds fn to the subscribers. it should be called before fswatch_start.
+ * returns 0 on succsess, -1 o.w
+ */
+int fswatch_subscribe(fswatch *w, fswatch_fn fn, void *arg);
+
+/**
+ * fswatch_start starts the thread that publishes the events. returns 0 on succsess, -1 o.w
+ */
+int fswatch_start(fswatch *w);
+
+/**
+ * fswatch_degraded returns 1 if the tree is not watched completely.
+ */
+int fswatch_degraded(fswatch *w);
+
+/**
+ * destroy_fswatch stops the thread, removes the watches and frees w.
+ */
+void destroy_fswatch(fswatch *w);
+
+
+#endif
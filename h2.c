@@ -0,0 +1,1121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "h2.h"
+
+/**frame types*/
+#define FRAME_DATA 0x0
+#define FRAME_HEADERS 0x1
+#define FRAME_PRIORITY 0x2
+#define FRAME_RST_STREAM 0x3
+#define FRAME_SETTINGS 0x4
+#define FRAME_PUSH_PROMISE 0x5
+#define FRAME_PING 0x6
+#define FRAME_GOAWAY 0x7
+#define FRAME_WINDOW_UPDATE 0x8
+#define FRAME_CONTINUATION 0x9
+
+/**frame flags*/
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+/**error codes*/
+#define ERR_NONE -1
+#define ERR_NO_ERROR 0x0
+#define ERR_PROTOCOL 0x1
+#define ERR_INTERNAL 0x2
+#define ERR_FLOW_CONTROL 0x3
+#define ERR_FRAME_SIZE 0x6
+#define ERR_REFUSED_STREAM 0x7
+#define ERR_COMPRESSION 0x9
+
+/**settings*/
+#define SETTINGS_HEADER_TABLE_SIZE 0x1
+#define SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define SETTINGS_MAX_FRAME_SIZE 0x5
+
+#define MAX_WINDOW 0x7fffffff
+#define MAX_HEADER_BLOCK 65536
+#define READ_BUF_SIZE (2 * (H2_FRAME_HEADER_LEN + H2_MAX_FRAME))
+#define WRITE_BUF_SIZE (4 * (H2_FRAME_HEADER_LEN + H2_MAX_FRAME))
+#define HEADER_SLACK 16     //bytes a header may take in a header block beyond its name and value (HPACK prefixes)
+#define READ_CLOSED -1      //read_more: EOF or error
+#define READ_RETRY -2       //read_more: the read buffer is full, its frames must be handled first
+#define UPGRADE_RESPONSE "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n"
+
+
+/**
+ * @author: Daniel Gabay
+ * h2.c
+ * --------------------------------------------------------------------------------
+ * This file implements the functionality of h2.h
+ * One thread runs the whole connection: it reads and handles all the frames that arrived,
+ * then sends one DATA frame of the stream chosen by the scheduler, and so on.
+ * When no stream can send (no data or no flow control window) it blocks on the socket.
+ * Note: 1)Multiplexing: every DATA frame is at most H2_MAX_FRAME bytes, so a big file never
+ *         blocks the small responses of the same connection.
+ *       2)Prioritization: a stream whose parent still has data to send waits for it. Among the others,
+ *         the one with the smallest virtual time sends next, and sending n bytes advances its virtual
+ *         time by n*256/weight (weighted fair queueing), so a stream with weight 256 gets 16 times the
+ *         bandwidth of a stream with the default weight.
+ *       3)Frames are collected at a write buffer and sent together when it's full or before waiting for the
+ *         client, so many small responses cost few send() calls and no Nagle delays (TCP_NODELAY is on).
+ *       4)Flow control: we announce the default windows and give back everything we receive
+ *         (request bodies are kept for the handler up to H2_MAX_REQ_BODY), and respect the windows of the
+ *         client when sending.
+ *       5)Parking: with a parking, the connection runs as a LANE_BULK job of the pool (never on the threads
+ *         reserved for short jobs). When it has nothing to send and nothing arrived, instead of waiting for the
+ *         client it's added (EPOLLONESHOT) to the epoll of the parking and the job ends. The parking thread
+ *         dispatches it again when the client sends more, so idle clients hold no thread.
+ */
+
+/**
+ * the connection
+ */
+typedef struct h2_conn_st {
+    int sockfd;
+    unsigned char rbuf[READ_BUF_SIZE];  //bytes read and not handled yet
+    size_t rlen;
+    hpack_table decoder;                //client -> server header compression
+    hpack_table encoder;                //server -> client header compression
+    int64_t send_window;                //connection flow control window
+    int64_t peer_initial_window;        //SETTINGS_INITIAL_WINDOW_SIZE of the client
+    uint32_t peer_max_frame;            //SETTINGS_MAX_FRAME_SIZE of the client
+    uint32_t last_stream_id;            //biggest stream id opened by the client
+    h2_stream *streams;
+    int num_streams;
+    unsigned char *hblock;              //header block being collected (HEADERS + CONTINUATION)
+    size_t hblock_len;
+    uint32_t hblock_stream;             //0 when no header block is in progress
+    int hblock_end_stream;
+    int hblock_refused;                 //1 if the stream of the header block was refused
+    uint8_t hblock_weight;
+    int preface_done;                   //1 after the client preface was read
+    uint32_t hblock_depends_on;
+    uint64_t vclock;                    //virtual time of the last scheduled stream
+    int goaway;                         //1 when the client sent GOAWAY
+    int error;                          //connection error to send with GOAWAY, ERR_NONE if none
+    h2_handler_fn handler;
+    unsigned char frame[H2_FRAME_HEADER_LEN + H2_MAX_FRAME];   //outgoing frame being built
+    unsigned char wbuf[WRITE_BUF_SIZE]; //frames waiting to be sent
+    size_t wlen;
+    h2_parking *parking;                //NULL when the connection is served by one thread until it ends
+    time_t parked_at;
+    struct h2_conn_st *park_prev, *park_next;   //list of the parked connections
+} h2_conn;
+
+/**forward declerations*/
+int run_conn(void *arg);
+void close_conn(h2_conn *c, int alive);
+int park(h2_conn *c);
+void unpark(h2_parking *pk, h2_conn *c);
+void *parking_loop(void *p);
+int read_more(h2_conn *c, int timeout_ms);
+int repeated_header(char *name);
+int send_header_block(h2_conn *c, h2_stream *st, unsigned char *block, size_t len, uint8_t end_stream);
+int handle_frames(h2_conn *c);
+void handle_frame(h2_conn *c, uint8_t type, uint8_t flags, uint32_t sid, unsigned char *p, uint32_t len);
+void on_headers(h2_conn *c, uint8_t flags, uint32_t sid, unsigned char *p, uint32_t len);
+void on_continuation(h2_conn *c, uint8_t flags, uint32_t sid, unsigned char *p, uint32_t len);
+void end_header_block(h2_conn *c);
+void on_data(h2_conn *c, uint8_t flags, uint32_t sid, unsigned char *p, uint32_t len);
+void on_settings(h2_conn *c, uint8_t flags, uint32_t sid, unsigned char *p, uint32_t len);
+void on_window_update(h2_conn *c, uint32_t sid, unsigned char *p, uint32_t len);
+int apply_settings(h2_conn *c, unsigned char *p, uint32_t len);
+h2_stream *new_stream(h2_conn *c, uint32_t sid);
+h2_stream *find_stream(h2_conn *c, uint32_t sid);
+void remove_stream(h2_conn *c, h2_stream *st);
+void respond(h2_conn *c, h2_stream *st);
+int sendable(h2_stream *st);
+h2_stream *pick_stream(h2_conn *c);
+int send_data(h2_conn *c, h2_stream *st);
+int send_frame(h2_conn *c, uint8_t type, uint8_t flags, uint32_t sid, unsigned char *payload, uint32_t len);
+void send_rst(h2_conn *c, uint32_t sid, uint32_t code);
+void send_window_update(h2_conn *c, uint32_t sid, uint32_t inc);
+int flush_frames(h2_conn *c);
+int send_all(int sockfd, unsigned char *buf, size_t len);
+uint32_t get32(unsigned char *p);
+void put32(unsigned char *p, uint32_t v);
+int base64url_decode(char *in, unsigned char *out, int out_cap);
+
+
+/**
+ * h2_is_preface returns 1 if the first len bytes of buf are (the start of) the HTTP/2 client preface.
+ */
+int h2_is_preface(char *buf, int len) {
+    if (buf == NULL || len < 3) //"PRI" at least, so a normal request line is never mistaken
+        return 0;
+    return memcmp(buf, H2_PREFACE, len < H2_PREFACE_LEN ? len : H2_PREFACE_LEN) == 0;
+}
+
+/**
+ * h2_add_header adds a response header. the room for the headers grows as needed (a proxied response may
+ * have many of them). returns 0 on succsess, -1 on malloc failure.
+ */
+int h2_add_header(h2_response *res, const char *name, const char *value) {
+    size_t nlen = strlen(name) + 1, vlen = strlen(value) + 1;
+    if (res->num_headers == res->headers_cap) {
+        int cap = res->headers_cap ? res->headers_cap * 2 : H2_RESP_HEADERS;
+        size_t *offs = (size_t *) realloc(res->header_offs, sizeof(size_t) * cap);
+        if (offs == NULL)
+            return -1;
+        res->header_offs = offs;
+        res->headers_cap = cap;
+    }
+    if (res->hbuf_used + nlen + vlen > res->hbuf_cap) {
+        size_t cap = res->hbuf_cap ? res->hbuf_cap * 2 : H2_RESP_HEADER_BUF;
+        while (cap < res->hbuf_used + nlen + vlen)
+            cap *= 2;
+        char *buf = (char *) realloc(res->hbuf, cap);
+        if (buf == NULL)
+            return -1;
+        res->hbuf = buf;
+        res->hbuf_cap = cap;
+    }
+    res->header_offs[res->num_headers++] = res->hbuf_used;
+    memcpy(res->hbuf + res->hbuf_used, name, nlen);
+    memcpy(res->hbuf + res->hbuf_used + nlen, value, vlen);
+    res->hbuf_used += nlen + vlen;
+    return 0;
+}
+
+/**
+ * h2_request_header returns the value of the request header name, NULL if it's missing.
+ */
+char *h2_request_header(h2_request *req, const char *name) {
+    for (int i = 0; i < req->num_headers; i++)
+        if (strcmp(req->headers[i].name, name) == 0)
+            return req->headers[i].value;
+    return NULL;
+}
+
+/**
+ * h2_serve runs an HTTP/2 connection on sockfd until it ends (or hands it to the pool of parking), then closes sockfd.
+ */
+void h2_serve(int sockfd, char *initial, int initial_len, h2_handler_fn handler, h2_request *upgrade, char *settings,
+              h2_parking *parking) {
+    h2_conn *c = (h2_conn *) malloc(sizeof(h2_conn));
+    if (c == NULL) {
+        shutdown(sockfd, SHUT_RDWR);
+        close(sockfd);
+        return;
+    }
+    c->sockfd = sockfd;
+    c->rlen = 0;
+    c->wlen = 0;
+    int one = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); //we do our own batching
+    hpack_table_init(&c->decoder, HPACK_DEFAULT_TABLE_SIZE);
+    hpack_table_init(&c->encoder, HPACK_DEFAULT_TABLE_SIZE);
+    c->send_window = H2_INITIAL_WINDOW;
+    c->peer_initial_window = H2_INITIAL_WINDOW;
+    c->peer_max_frame = H2_MAX_FRAME;
+    c->last_stream_id = 0;
+    c->streams = NULL;
+    c->num_streams = 0;
+    c->hblock = NULL;
+    c->hblock_len = 0;
+    c->hblock_stream = 0;
+    c->vclock = 0;
+    c->goaway = 0;
+    c->error = ERR_NONE;
+    c->handler = handler;
+    c->preface_done = 0;
+    c->parking = parking;
+
+    if (upgrade != NULL) {
+        unsigned char decoded[256];
+        int n = base64url_decode(settings, decoded, sizeof(decoded));
+        if (n < 0 || n % 6 != 0 || send_all(sockfd, (unsigned char *) UPGRADE_RESPONSE, strlen(UPGRADE_RESPONSE)) < 0)
+            c->error = ERR_PROTOCOL;
+        else if (apply_settings(c, decoded, n) != ERR_NONE)
+            c->error = ERR_PROTOCOL;
+    } else if (initial_len > 0) {
+        memcpy(c->rbuf, initial, initial_len);
+        c->rlen = initial_len;
+    }
+
+    /*our SETTINGS must be the first frame we send*/
+    unsigned char my_settings[12];
+    my_settings[0] = 0;
+    my_settings[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+    put32(my_settings + 2, H2_MAX_STREAMS);
+    my_settings[6] = 0;
+    my_settings[7] = SETTINGS_MAX_FRAME_SIZE;
+    put32(my_settings + 8, H2_MAX_FRAME);
+    if (c->error == ERR_NONE && send_frame(c, FRAME_SETTINGS, 0, 0, my_settings, sizeof(my_settings)) < 0)
+        c->error = ERR_INTERNAL;
+
+    if (c->error == ERR_NONE && upgrade != NULL) { //the upgrade request is stream 1, already half closed
+        h2_stream *st = new_stream(c, 1);
+        if (st == NULL)
+            c->error = ERR_INTERNAL;
+        else {
+            st->headers[0].name = strdup(":method");
+            st->headers[0].value = strdup(upgrade->method);
+            st->headers[1].name = strdup(":path");
+            st->headers[1].value = strdup(upgrade->path);
+            st->num_headers = 2;
+            st->request_done = 1;
+            c->last_stream_id = 1;
+            respond(c, st);
+        }
+    }
+
+    if (c->error == ERR_NONE && flush_frames(c) < 0)
+        c->error = ERR_INTERNAL;
+    if (c->error != ERR_NONE) {
+        close_conn(c, 0);
+        return;
+    }
+    if (parking == NULL || dispatch_lane(parking->tp, LANE_BULK, run_conn, c) < 0)
+        run_conn(c);
+}
+
+/**the connection job: runs the connection until it ends (then closes it), or until it waits for its client
+ *with nothing to send and is parked. returns 0*/
+int run_conn(void *arg) {
+    h2_conn *c = (h2_conn *) arg;
+    int alive = 1;
+    while (1) {
+        if (!c->preface_done && c->rlen >= H2_PREFACE_LEN) { //the client preface
+            if (memcmp(c->rbuf, H2_PREFACE, H2_PREFACE_LEN) != 0) {
+                alive = 0;
+                break;
+            }
+            memmove(c->rbuf, c->rbuf + H2_PREFACE_LEN, c->rlen - H2_PREFACE_LEN);
+            c->rlen -= H2_PREFACE_LEN;
+            c->preface_done = 1;
+        }
+        if (c->preface_done && (handle_frames(c) < 0 || c->error != ERR_NONE))
+            break;
+        if (c->goaway && c->num_streams == 0)
+            break;
+        h2_stream *st = (c->send_window > 0) ? pick_stream(c) : NULL;
+        if (st != NULL) {
+            if (send_data(c, st) < 0 || read_more(c, 0) == READ_CLOSED) { //don't wait, only take what already arrived
+                alive = 0;
+                break;
+            }
+            continue;
+        }
+        if (flush_frames(c) < 0) //everything we have is out, now wait for the client
+            break;
+        int n = read_more(c, 0);
+        if (n == READ_CLOSED) {
+            alive = 0;
+            break;
+        }
+        if (n != 0)
+            continue;
+        if (c->parking != NULL && park(c) == 0) //c belongs to the parking thread now
+            return 0;
+        n = read_more(c, H2_IDLE_TIMEOUT * 1000);
+        if (n == READ_CLOSED) {
+            alive = 0;
+            break;
+        }
+        if (n == 0) //idle for too long
+            break;
+    }
+    close_conn(c, alive);
+    return 0;
+}
+
+/**sends GOAWAY (if the socket is still alive), closes the socket and frees the connection*/
+void close_conn(h2_conn *c, int alive) {
+    if (alive) { //GOAWAY can be sent only if the socket is still alive
+        unsigned char goaway[8];
+        put32(goaway, c->last_stream_id);
+        put32(goaway + 4, c->error == ERR_NONE ? ERR_NO_ERROR : (uint32_t) c->error);
+        if (send_frame(c, FRAME_GOAWAY, 0, 0, goaway, sizeof(goaway)) == 0)
+            flush_frames(c);
+    }
+    while (c->streams != NULL)
+        remove_stream(c, c->streams);
+    free(c->hblock);
+    hpack_table_free(&c->decoder);
+    hpack_table_free(&c->encoder);
+    shutdown(c->sockfd, SHUT_RDWR);
+    close(c->sockfd);
+    free(c);
+}
+
+/**
+ * create_h2_parking starts the parking thread of the connections served by tp. returns NULL on failure.
+ */
+h2_parking *create_h2_parking(threadpool *tp) {
+    h2_parking *pk = (h2_parking *) malloc(sizeof(h2_parking));
+    if (pk == NULL) {
+        printf("malloc failed\n");
+        return NULL;
+    }
+    memset(pk, 0, sizeof(h2_parking));
+    pk->tp = tp;
+    pk->epfd = epoll_create1(EPOLL_CLOEXEC);
+    pk->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL; //the wake up
+    if (tp == NULL || pk->epfd < 0 || pk->wakefd < 0 || epoll_ctl(pk->epfd, EPOLL_CTL_ADD, pk->wakefd, &ev) < 0 ||
+        pthread_mutex_init(&pk->lock, NULL) != 0) {
+        perror("h2 parking");
+        if (pk->epfd >= 0) close(pk->epfd);
+        if (pk->wakefd >= 0) close(pk->wakefd);
+        free(pk);
+        return NULL;
+    }
+    if (pthread_create(&pk->thread, NULL, parking_loop, (void *) pk) != 0) {
+        pthread_mutex_destroy(&pk->lock);
+        close(pk->epfd);
+        close(pk->wakefd);
+        free(pk);
+        return NULL;
+    }
+    pk->started = 1;
+    return pk;
+}
+
+/**
+ * h2_parking_stop stops parking connections, waits for the parked ones and stops the thread.
+ */
+void h2_parking_stop(h2_parking *pk) {
+    if (pk == NULL || !pk->started)
+        return;
+    pthread_mutex_lock(&pk->lock);
+    pk->stopped = 1;
+    pthread_mutex_unlock(&pk->lock);
+    uint64_t one = 1;
+    if (write(pk->wakefd, &one, sizeof(one)) < 0)
+        perror("h2 parking wake up");
+    pthread_join(pk->thread, NULL);
+    pk->started = 0;
+    while (pk->head != NULL) { //only if epoll failed: nobody resumes them any more
+        h2_conn *c = pk->head;
+        unpark(pk, c);
+        close_conn(c, 1);
+    }
+}
+
+/**
+ * destroy_h2_parking stops the parking (if it's not stopped yet) and frees it.
+ */
+void destroy_h2_parking(h2_parking *pk) {
+    if (pk == NULL)
+        return;
+    h2_parking_stop(pk);
+    pthread_mutex_destroy(&pk->lock);
+    close(pk->epfd);
+    close(pk->wakefd);
+    free(pk);
+}
+
+/**parks c until its client sends more. returns 0 on succsess (c may be resumed, or closed, at once), -1 if it
+ *can't be parked (the parking is stopped): then it waits for its client on its thread*/
+int park(h2_conn *c) {
+    h2_parking *pk = c->parking;
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = c;
+    pthread_mutex_lock(&pk->lock);
+    if (pk->stopped) {
+        pthread_mutex_unlock(&pk->lock);
+        return -1;
+    }
+    c->parked_at = time(NULL);
+    c->park_prev = NULL;
+    c->park_next = pk->head;
+    if (pk->head != NULL)
+        pk->head->park_prev = c;
+    pk->head = c;
+    pk->parked++;
+    if (epoll_ctl(pk->epfd, EPOLL_CTL_ADD, c->sockfd, &ev) < 0) {
+        perror("h2 park");
+        unpark(pk, c);
+        pthread_mutex_unlock(&pk->lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&pk->lock);
+    return 0;
+}
+
+/**takes c out of the parked connections (pk->lock is held, or the thread is stopped)*/
+void unpark(h2_parking *pk, h2_conn *c) {
+    epoll_ctl(pk->epfd, EPOLL_CTL_DEL, c->sockfd, NULL);
+    if (c->park_prev != NULL)
+        c->park_prev->park_next = c->park_next;
+    else
+        pk->head = c->park_next;
+    if (c->park_next != NULL)
+        c->park_next->park_prev = c->park_prev;
+    c->park_prev = c->park_next = NULL;
+    pk->parked--;
+}
+
+/**the parking thread: resumes the connections whose clients sent more, closes the ones idle for too long.
+ *once the parking is stopped it runs until no connection is parked*/
+void *parking_loop(void *p) {
+    h2_parking *pk = (h2_parking *) p;
+    struct epoll_event events[H2_PARK_EVENTS];
+    while (1) {
+        int n = epoll_wait(pk->epfd, events, H2_PARK_EVENTS, H2_PARK_TICK_MS);
+        if (n < 0 && errno != EINTR) {
+            perror("h2 parking epoll_wait");
+            break;
+        }
+        h2_conn *ready = NULL, *idle = NULL;
+        pthread_mutex_lock(&pk->lock);
+        for (int i = 0; i < n; i++) {
+            h2_conn *c = (h2_conn *) events[i].data.ptr;
+            if (c == NULL) { //the wake up of h2_parking_stop
+                uint64_t v;
+                if (read(pk->wakefd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+                    perror("h2 parking wake up");
+                continue;
+            }
+            unpark(pk, c);
+            c->park_next = ready;
+            ready = c;
+        }
+        time_t now = time(NULL);
+        for (h2_conn *c = pk->head, *next; c != NULL; c = next) {
+            next = c->park_next;
+            if (now - c->parked_at >= H2_IDLE_TIMEOUT) {
+                unpark(pk, c);
+                c->park_next = idle;
+                idle = c;
+            }
+        }
+        int done = pk->stopped && pk->head == NULL;
+        pthread_mutex_unlock(&pk->lock);
+        while (ready != NULL) {
+            h2_conn *c = ready;
+            ready = c->park_next;
+            if (dispatch_lane(pk->tp, LANE_BULK, run_conn, c) < 0) //the pool is being destroyed
+                close_conn(c, 1);
+        }
+        while (idle != NULL) {
+            h2_conn *c = idle;
+            idle = c->park_next;
+            close_conn(c, 1);
+        }
+        if (done)
+            break;
+    }
+    return NULL;
+}
+
+/**waits up to timeout_ms for data and reads it. returns bytes read, 0 on timeout, READ_CLOSED on EOF or error,
+ *READ_RETRY if the read buffer is full (nothing is read, the frames must be handled first).
+ *a signal is not a timeout: the wait is done again*/
+int read_more(h2_conn *c, int timeout_ms) {
+    if (c->rlen == READ_BUF_SIZE)
+        return READ_RETRY;
+    struct pollfd pfd;
+    pfd.fd = c->sockfd;
+    pfd.events = POLLIN;
+    int rc;
+    while ((rc = poll(&pfd, 1, timeout_ms)) < 0 && errno == EINTR);
+    if (rc < 0)
+        return READ_CLOSED;
+    if (rc == 0)
+        return 0;
+    ssize_t n;
+    while ((n = recv(c->sockfd, c->rbuf + c->rlen, READ_BUF_SIZE - c->rlen, 0)) < 0 && errno == EINTR);
+    if (n <= 0)
+        return READ_CLOSED;
+    c->rlen += n;
+    return (int) n;
+}
+
+/**handles all the complete frames at the read buffer. returns -1 if the connection must be closed*/
+int handle_frames(h2_conn *c) {
+    size_t pos = 0;
+    while (c->error == ERR_NONE && c->rlen - pos >= H2_FRAME_HEADER_LEN) {
+        unsigned char *h = c->rbuf + pos;
+        uint32_t len = ((uint32_t) h[0] << 16) | ((uint32_t) h[1] << 8) | h[2];
+        if (len > H2_MAX_FRAME) {
+            c->error = ERR_FRAME_SIZE;
+            break;
+        }
+        if (c->rlen - pos < H2_FRAME_HEADER_LEN + len) //not all of it arrived yet
+            break;
+        handle_frame(c, h[3], h[4], get32(h + 5) & MAX_WINDOW, h + H2_FRAME_HEADER_LEN, len);
+        pos += H2_FRAME_HEADER_LEN + len;
+    }
+    memmove(c->rbuf, c->rbuf + pos, c->rlen - pos);
+    c->rlen -= pos;
+    return (c->error == ERR_NONE) ? 0 : -1;
+}
+
+/**handles one frame. connection errors are set at c->error*/
+void handle_frame(h2_conn *c, uint8_t type, uint8_t flags, uint32_t sid, unsigned char *p, uint32_t len) {
+    if (c->hblock_stream != 0 && type != FRAME_CONTINUATION) { //nothing may come in the middle of a header block
+        c->error = ERR_PROTOCOL;
+        return;
+    }
+    h2_stream *st;
+    switch (type) {
+        case FRAME_HEADERS:
+            on_headers(c, flags, sid, p, len);
+            break;
+        case FRAME_CONTINUATION:
+            on_continuation(c, flags, sid, p, len);
+            break;
+        case FRAME_DATA:
+            on_data(c, flags, sid, p, len);
+            break;
+        case FRAME_SETTINGS:
+            on_settings(c, flags, sid, p, len);
+            break;
+        case FRAME_WINDOW_UPDATE:
+            on_window_update(c, sid, p, len);
+            break;
+        case FRAME_PRIORITY:
+            if (sid == 0 || len != 5) {
+                c->error = (sid == 0) ? ERR_PROTOCOL : ERR_FRAME_SIZE;
+                break;
+            }
+            if ((st = find_stream(c, sid)) != NULL && (get32(p) & MAX_WINDOW) != sid) {
+                st->depends_on = get32(p) & MAX_WINDOW;
+                st->weight = p[4] + 1;
+            }
+            break;
+        case FRAME_RST_STREAM:
+            if (sid == 0 || len != 4) {
+                c->error = (sid == 0) ? ERR_PROTOCOL : ERR_FRAME_SIZE;
+                break;
+            }
+            if ((st = find_stream(c, sid)) != NULL)
+                remove_stream(c, st);
+            break;
+        case FRAME_PING:
+            if (sid != 0 || len != 8) {
+                c->error = (sid != 0) ? ERR_PROTOCOL : ERR_FRAME_SIZE;
+                break;
+            }
+            if (!(flags & FLAG_ACK) && send_frame(c, FRAME_PING, FLAG_ACK, 0, p, len) < 0)
+                c->error = ERR_INTERNAL;
+            break;
+        case FRAME_GOAWAY:
+            c->goaway = 1;
+            break;
+        case FRAME_PUSH_PROMISE: //clients can't push
+            c->error = ERR_PROTOCOL;
+            break;
+        default: //unknown frame types must be ignored
+            break;
+    }
+}
+
+/**HEADERS: opens a stream (or trailers of an open one) and starts collecting the header block*/
+void on_headers(h2_conn *c, uint8_t flags, uint32_t sid, unsigned char *p, uint32_t len) {
+    if (sid == 0) {
+        c->error = ERR_PROTOCOL;
+        return;
+    }
+    if (flags & FLAG_PADDED) {
+        if (len < 1 || p[0] >= len) {
+            c->error = ERR_PROTOCOL;
+            return;
+        }
+        len -= p[0] + 1;
+        p++;
+    }
+    c->hblock_weight = H2_DEFAULT_WEIGHT - 1;
+    c->hblock_depends_on = 0;
+    if (flags & FLAG_PRIORITY) {
+        if (len < 5) {
+            c->error = ERR_FRAME_SIZE;
+            return;
+        }
+        c->hblock_depends_on = get32(p) & MAX_WINDOW;
+        c->hblock_weight = p[4];
+        p += 5;
+        len -= 5;
+    }
+    c->hblock_refused = 0;
+    if (find_stream(c, sid) == NULL) { //a new stream
+        if (sid % 2 == 0 || sid <= c->last_stream_id) {
+            c->error = ERR_PROTOCOL;
+            return;
+        }
+        c->last_stream_id = sid;
+        /*the header block must be decoded anyway, to keep the HPACK tables in sync*/
+        c->hblock_refused = (c->num_streams >= H2_MAX_STREAMS || c->goaway);
+    }
+    c->hblock_len = 0;
+    c->hblock_stream = sid;
+    c->hblock_end_stream = (flags & FLAG_END_STREAM) != 0;
+    on_continuation(c, flags, sid, p, len);
+}
+
+/**CONTINUATION (and the fragment of HEADERS): collects the header block until END_HEADERS*/
+void on_continuation(h2_conn *c, uint8_t flags, uint32_t sid, unsigned char *p, uint32_t len) {
+    if (c->hblock_stream == 0 || sid != c->hblock_stream) {
+        c->error = ERR_PROTOCOL;
+        return;
+    }
+    if (c->hblock_len + len > MAX_HEADER_BLOCK) {
+        c->error = ERR_INTERNAL;
+        return;
+    }
+    if (c->hblock == NULL && (c->hblock = (unsigned char *) malloc(MAX_HEADER_BLOCK)) == NULL) {
+        c->error = ERR_INTERNAL;
+        return;
+    }
+    memcpy(c->hblock + c->hblock_len, p, len);
+    c->hblock_len += len;
+    if (flags & FLAG_END_HEADERS)
+        end_header_block(c);
+}
+
+/**a complete header block: decode it, and respond if the request is complete*/
+void end_header_block(h2_conn *c) {
+    uint32_t sid = c->hblock_stream;
+    c->hblock_stream = 0;
+    hpack_header headers[H2_MAX_REQ_HEADERS];
+    int n = hpack_decode(&c->decoder, c->hblock, c->hblock_len, headers, H2_MAX_REQ_HEADERS);
+    h2_stream *st = find_stream(c, sid);
+    if (n == HPACK_MALFORMED) { //CR, LF or NUL in a field: it would end up in an HTTP/1.1 request (RFC 9113 8.2.1)
+        if (st != NULL)
+            remove_stream(c, st);
+        send_rst(c, sid, ERR_PROTOCOL);
+        return;
+    }
+    if (n < 0) {
+        c->error = ERR_COMPRESSION;
+        return;
+    }
+    if (c->hblock_refused || (st == NULL && (st = new_stream(c, sid)) == NULL)) {
+        hpack_free_headers(headers, n);
+        send_rst(c, sid, ERR_REFUSED_STREAM);
+        return;
+    }
+    if (st->num_headers == 0) { //the request headers (o.w these are trailers, ignored)
+        memcpy(st->headers, headers, sizeof(hpack_header) * n);
+        st->num_headers = n;
+        st->weight = c->hblock_weight + 1;
+        st->depends_on = (c->hblock_depends_on != sid) ? c->hblock_depends_on : 0;
+    } else
+        hpack_free_headers(headers, n);
+    if (c->hblock_end_stream && !st->request_done) {
+        st->request_done = 1;
+        respond(c, st);
+    }
+}
+
+/**DATA: the request body is collected for the handler (up to H2_MAX_REQ_BODY), and the window is given back*/
+void on_data(h2_conn *c, uint8_t flags, uint32_t sid, unsigned char *p, uint32_t len) {
+    if (sid == 0) {
+        c->error = ERR_PROTOCOL;
+        return;
+    }
+    if ((flags & FLAG_PADDED) && (len < 1 || p[0] >= len)) {
+        c->error = ERR_PROTOCOL;
+        return;
+    }
+    h2_stream *st = find_stream(c, sid);
+    unsigned char *data = p;
+    uint32_t data_len = len;
+    if (flags & FLAG_PADDED) {
+        data = p + 1;
+        data_len = len - 1 - p[0];
+    }
+    if (st != NULL && !st->request_done && data_len > 0 && !st->body_too_large) {
+        char *body = (st->body_len + data_len <= H2_MAX_REQ_BODY) ? realloc(st->body, st->body_len + data_len) : NULL;
+        if (body == NULL) { //too big (or no memory): the handler gets no body
+            free(st->body);
+            st->body = NULL;
+            st->body_len = 0;
+            st->body_too_large = 1;
+        } else {
+            memcpy(body + st->body_len, data, data_len);
+            st->body = body;
+            st->body_len += data_len;
+        }
+    }
+    if (len > 0) {
+        send_window_update(c, 0, len);
+        if (st != NULL && !st->request_done && !(flags & FLAG_END_STREAM))
+            send_window_update(c, sid, len);
+    }
+    if (st != NULL && (flags & FLAG_END_STREAM) && !st->request_done) {
+        st->request_done = 1;
+        respond(c, st);
+    }
+}
+
+/**SETTINGS: apply them and acknowledge*/
+void on_settings(h2_conn *c, uint8_t flags, uint32_t sid, unsigned char *p, uint32_t len) {
+    if (sid != 0) {
+        c->error = ERR_PROTOCOL;
+        return;
+    }
+    if (flags & FLAG_ACK) {
+        if (len != 0)
+            c->error = ERR_FRAME_SIZE;
+        return;
+    }
+    if (len % 6 != 0) {
+        c->error = ERR_FRAME_SIZE;
+        return;
+    }
+    int err = apply_settings(c, p, len);
+    if (err != ERR_NONE) {
+        c->error = err;
+        return;
+    }
+    if (send_frame(c, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0) < 0)
+        c->error = ERR_INTERNAL;
+}
+
+/**WINDOW_UPDATE of the connection (sid 0) or of a stream*/
+void on_window_update(h2_conn *c, uint32_t sid, unsigned char *p, uint32_t len) {
+    if (len != 4) {
+        c->error = ERR_FRAME_SIZE;
+        return;
+    }
+    uint32_t inc = get32(p) & MAX_WINDOW;
+    if (sid == 0) {
+        if (inc == 0 || c->send_window + inc > MAX_WINDOW)
+            c->error = (inc == 0) ? ERR_PROTOCOL : ERR_FLOW_CONTROL;
+        else
+            c->send_window += inc;
+        return;
+    }
+    h2_stream *st = find_stream(c, sid);
+    if (st == NULL)
+        return;
+    if (inc == 0 || st->window + inc > MAX_WINDOW) {
+        send_rst(c, sid, inc == 0 ? ERR_PROTOCOL : ERR_FLOW_CONTROL);
+        remove_stream(c, st);
+        return;
+    }
+    st->window += inc;
+}
+
+/**applies a SETTINGS payload. returns ERR_NONE or the error code*/
+int apply_settings(h2_conn *c, unsigned char *p, uint32_t len) {
+    for (uint32_t i = 0; i + 6 <= len; i += 6) {
+        uint16_t id = (uint16_t) ((p[i] << 8) | p[i + 1]);
+        uint32_t value = get32(p + i + 2);
+        switch (id) {
+            case SETTINGS_HEADER_TABLE_SIZE:
+                hpack_set_max_size(&c->encoder, value);
+                break;
+            case SETTINGS_INITIAL_WINDOW_SIZE:
+                if (value > MAX_WINDOW)
+                    return ERR_FLOW_CONTROL;
+                for (h2_stream *st = c->streams; st != NULL; st = st->next) //the change applies to open streams too
+                    st->window += (int64_t) value - c->peer_initial_window;
+                c->peer_initial_window = value;
+                break;
+            case SETTINGS_MAX_FRAME_SIZE:
+                if (value < H2_MAX_FRAME || value > 0xffffff)
+                    return ERR_PROTOCOL;
+                c->peer_max_frame = value;
+                break;
+            default: //push is never used, the rest don't matter to us
+                break;
+        }
+    }
+    return ERR_NONE;
+}
+
+/**creates a stream and adds it to the connection. returns NULL on malloc failure*/
+h2_stream *new_stream(h2_conn *c, uint32_t sid) {
+    h2_stream *st = (h2_stream *) malloc(sizeof(h2_stream));
+    if (st == NULL)
+        return NULL;
+    st->id = sid;
+    st->request_done = 0;
+    st->responded = 0;
+    st->window = c->peer_initial_window;
+    st->weight = H2_DEFAULT_WEIGHT;
+    st->depends_on = 0;
+    st->vtime = c->vclock; //starts "now", not ahead nor behind the others
+    bzero(&st->res, sizeof(h2_response));
+    st->res.fd = -1;
+    st->sent = 0;
+    st->num_headers = 0;
+    st->body = NULL;
+    st->body_len = 0;
+    st->body_too_large = 0;
+    st->next = c->streams;
+    c->streams = st;
+    c->num_streams++;
+    return st;
+}
+
+/**returns the stream sid, NULL if it's not open*/
+h2_stream *find_stream(h2_conn *c, uint32_t sid) {
+    for (h2_stream *st = c->streams; st != NULL; st = st->next)
+        if (st->id == sid)
+            return st;
+    return NULL;
+}
+
+/**closes the stream: frees the request and the response*/
+void remove_stream(h2_conn *c, h2_stream *st) {
+    h2_stream **pp = &c->streams;
+    while (*pp != NULL && *pp != st)
+        pp = &(*pp)->next;
+    if (*pp == NULL)
+        return;
+    *pp = st->next;
+    c->num_streams--;
+    if (st->responded && st->res.release != NULL)
+        st->res.release(&st->res);
+    hpack_free_headers(st->headers, st->num_headers);
+    free(st->res.header_offs);
+    free(st->res.hbuf);
+    free(st->body);
+    free(st);
+}
+
+/**the request of st is complete: ask the handler for the response and send its HEADERS*/
+void respond(h2_conn *c, h2_stream *st) {
+    h2_request req;
+    req.method = NULL;
+    req.path = NULL;
+    req.headers = st->headers;
+    req.num_headers = st->num_headers;
+    req.body = st->body;
+    req.body_len = st->body_len;
+    req.body_too_large = st->body_too_large;
+    for (int i = 0; i < st->num_headers; i++) {
+        if (strcmp(st->headers[i].name, ":method") == 0)
+            req.method = st->headers[i].value;
+        else if (strcmp(st->headers[i].name, ":path") == 0)
+            req.path = st->headers[i].value;
+    }
+    if (req.method == NULL || req.path == NULL) {
+        send_rst(c, st->id, ERR_PROTOCOL);
+        remove_stream(c, st);
+        return;
+    }
+    c->handler(&req, &st->res);
+    st->responded = 1;
+
+    /*the header block is built at its place in c->frame when it surely fits one frame (almost always),
+     *o.w in a buffer of its own*/
+    size_t cap = 2 * HEADER_SLACK + st->res.hbuf_used + (size_t) st->res.num_headers * HEADER_SLACK;
+    unsigned char *block = (cap <= H2_MAX_FRAME) ? c->frame + H2_FRAME_HEADER_LEN : (unsigned char *) malloc(cap);
+    if (block == NULL) {
+        c->error = ERR_INTERNAL;
+        return;
+    }
+    char status[8];
+    size_t len = 0;
+    int n;
+    snprintf(status, sizeof(status), "%d", st->res.status);
+    if ((n = hpack_encode_begin(&c->encoder, block, cap)) < 0 || (len += n,
+        (n = hpack_encode(&c->encoder, ":status", status, HPACK_INDEX, block + len, cap - len)) < 0))
+        c->error = ERR_INTERNAL;
+    else
+        len += n;
+    for (int i = 0; i < st->res.num_headers && c->error == ERR_NONE; i++) {
+        char *name = st->res.hbuf + st->res.header_offs[i], *value = name + strlen(name) + 1;
+        int mode = repeated_header(name) ? HPACK_INDEX : HPACK_NO_INDEX;
+        if ((n = hpack_encode(&c->encoder, name, value, mode, block + len, cap - len)) < 0)
+            c->error = ERR_INTERNAL;
+        else
+            len += n;
+    }
+    int has_body = st->res.body_len > 0 || st->res.fd_len > 0;
+    if (c->error == ERR_NONE && send_header_block(c, st, block, len, has_body ? 0 : FLAG_END_STREAM) < 0)
+        c->error = ERR_INTERNAL;
+    if (block != c->frame + H2_FRAME_HEADER_LEN)
+        free(block);
+    if (c->error == ERR_NONE && !has_body)
+        remove_stream(c, st);
+}
+
+/**returns 1 for the response headers whose value repeats from response to response (server, content-type..),
+ *they are added to the HPACK table and cost one byte the next time. the others (date, etag, last-modified,
+ *content-length, cookies..) are different almost every time and would only push those out of the table*/
+int repeated_header(char *name) {
+    return strcmp(name, "server") == 0 || strcmp(name, "content-type") == 0 ||
+           strcmp(name, "content-encoding") == 0 || strcmp(name, "vary") == 0 ||
+           strcmp(name, "cache-control") == 0 || strcmp(name, "accept-ranges") == 0;
+}
+
+/**queues the header block of st: one HEADERS frame, followed by CONTINUATION frames when it's bigger than a
+ *frame. end_stream is FLAG_END_STREAM for a response without a body. returns -1 if the socket failed*/
+int send_header_block(h2_conn *c, h2_stream *st, unsigned char *block, size_t len, uint8_t end_stream) {
+    if (block == c->frame + H2_FRAME_HEADER_LEN) //already at its place, only the frame header is missing
+        return send_frame(c, FRAME_HEADERS, FLAG_END_HEADERS | end_stream, st->id, NULL, (uint32_t) len);
+    size_t off = 0;
+    do {
+        size_t n = (len - off > H2_MAX_FRAME) ? H2_MAX_FRAME : len - off;
+        uint8_t type = (off == 0) ? FRAME_HEADERS : FRAME_CONTINUATION;
+        uint8_t flags = ((off == 0) ? end_stream : 0) | ((off + n == len) ? FLAG_END_HEADERS : 0);
+        if (send_frame(c, type, flags, st->id, block + off, (uint32_t) n) < 0)
+            return -1;
+        off += n;
+    } while (off < len);
+    return 0;
+}
+
+/**returns 1 if st has body left and window to send it*/
+int sendable(h2_stream *st) {
+    off_t total = st->res.body ? (off_t) st->res.body_len : st->res.fd_len;
+    return st->responded && st->sent < total && st->window > 0;
+}
+
+/**the scheduler: the sendable stream with the smallest virtual time whose parent has nothing to send*/
+h2_stream *pick_stream(h2_conn *c) {
+    h2_stream *best = NULL;
+    for (h2_stream *st = c->streams; st != NULL; st = st->next) {
+        if (!sendable(st))
+            continue;
+        if (st->depends_on != 0) {
+            h2_stream *parent = find_stream(c, st->depends_on);
+            if (parent != NULL && sendable(parent))
+                continue;
+        }
+        if (best == NULL || st->vtime <= best->vtime) //the list is newest first, so ties go to the oldest
+            best = st;
+    }
+    return best;
+}
+
+/**sends one DATA frame of st. returns -1 if the socket failed*/
+int send_data(h2_conn *c, h2_stream *st) {
+    off_t total = st->res.body ? (off_t) st->res.body_len : st->res.fd_len;
+    int64_t n = total - st->sent;
+    if (n > H2_MAX_FRAME) n = H2_MAX_FRAME;
+    if (n > c->peer_max_frame) n = c->peer_max_frame;
+    if (n > st->window) n = st->window;
+    if (n > c->send_window) n = c->send_window;
+    unsigned char *payload = c->frame + H2_FRAME_HEADER_LEN;
+    if (st->res.body != NULL)
+        memcpy(payload, st->res.body + st->sent, n);
+    else {
+        if (st->res.progress != NULL) //the handler keeps the page cache ahead of (and behind) the reads
+            st->res.progress(&st->res, st->sent);
+        if (pread(st->res.fd, payload, n, st->sent) != n) { //the file changed under us
+            send_rst(c, st->id, ERR_INTERNAL);
+            remove_stream(c, st);
+            return 0;
+        }
+    }
+    st->sent += n;
+    int last = (st->sent == total);
+    if (send_frame(c, FRAME_DATA, last ? FLAG_END_STREAM : 0, st->id, NULL, (uint32_t) n) < 0)
+        return -1;
+    st->window -= n;
+    c->send_window -= n;
+    st->vtime += (uint64_t) n * 256 / st->weight;
+    c->vclock = st->vtime;
+    if (last)
+        remove_stream(c, st);
+    return 0;
+}
+
+/**queues a frame at the write buffer. payload NULL means it's already at c->frame after the header.
+ *returns -1 if the buffer had to be flushed and the socket failed*/
+int send_frame(h2_conn *c, uint8_t type, uint8_t flags, uint32_t sid, unsigned char *payload, uint32_t len) {
+    if (c->wlen + H2_FRAME_HEADER_LEN + len > WRITE_BUF_SIZE && flush_frames(c) < 0)
+        return -1;
+    unsigned char *h = c->wbuf + c->wlen;
+    memcpy(h + H2_FRAME_HEADER_LEN, payload != NULL ? payload : c->frame + H2_FRAME_HEADER_LEN, len);
+    h[0] = (unsigned char) (len >> 16);
+    h[1] = (unsigned char) (len >> 8);
+    h[2] = (unsigned char) len;
+    h[3] = type;
+    h[4] = flags;
+    put32(h + 5, sid);
+    c->wlen += H2_FRAME_HEADER_LEN + len;
+    return 0;
+}
+
+/**sends the queued frames. returns -1 on failure*/
+int flush_frames(h2_conn *c) {
+    int rc = send_all(c->sockfd, c->wbuf, c->wlen);
+    c->wlen = 0;
+    return rc;
+}
+
+/**resets a stream*/
+void send_rst(h2_conn *c, uint32_t sid, uint32_t code) {
+    unsigned char p[4];
+    put32(p, code);
+    if (send_frame(c, FRAME_RST_STREAM, 0, sid, p, sizeof(p)) < 0)
+        c->error = ERR_INTERNAL;
+}
+
+/**gives back inc bytes of window to the client*/
+void send_window_update(h2_conn *c, uint32_t sid, uint32_t inc) {
+    unsigned char p[4];
+    put32(p, inc);
+    if (send_frame(c, FRAME_WINDOW_UPDATE, 0, sid, p, sizeof(p)) < 0)
+        c->error = ERR_INTERNAL;
+}
+
+/**sends all len bytes. returns 0 on succsess, -1 o.w*/
+int send_all(int sockfd, unsigned char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(sockfd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**big endian 32 bit read*/
+uint32_t get32(unsigned char *p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+/**big endian 32 bit write*/
+void put32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char) (v >> 24);
+    p[1] = (unsigned char) (v >> 16);
+    p[2] = (unsigned char) (v >> 8);
+    p[3] = (unsigned char) v;
+}
+
+/**decodes base64url (HTTP2-Settings, padding is optional). returns the decoded length, -1 on error*/
+int base64url_decode(char *in, unsigned char *out, int out_cap) {
+    uint32_t acc = 0;
+    int bits = 0, n = 0;
+    for (; *in != '\0' && *in != '='; in++) {
+        char ch = *in;
+        int v;
+        if (ch >= 'A' && ch <= 'Z') v = ch - 'A';
+        else if (ch >= 'a' && ch <= 'z') v = ch - 'a' + 26;
+        else if (ch >= '0' && ch <= '9') v = ch - '0' + 52;
+        else if (ch == '-' || ch == '+') v = 62;
+        else if (ch == '_' || ch == '/') v = 63;
+        else return -1;
+        acc = (acc << 6) | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (n == out_cap)
+                return -1;
+            out[n++] = (unsigned char) (acc >> bits);
+        }
+    }
+    return n;
+}
@@ -0,0 +1,163 @@
+#ifndef EX3_H2_H
+#define EX3_H2_H
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include "hpack.h"
+#include "threadpool.h"
+
+/**
+ * h2.h
+ *
+ * This file declares the HTTP/2 engine (RFC 7540, cleartext "h2c" only).
+ * The engine owns the connection: frames, streams, flow control, HPACK and the order in which
+ * streams get to send. What to answer is decided by a handler function given by the server,
+ * so HTTP/2 responses are built by the same file/listing/error code as HTTP/1.x.
+ * A connection that waits for its client with nothing to send doesn't hold a thread: it's parked (see
+ * h2_parking) and goes back to the pool when the client sends more.
+ */
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+#define H2_FRAME_HEADER_LEN 9
+#define H2_MAX_FRAME 16384          //we never send or accept frames bigger than this
+#define H2_INITIAL_WINDOW 65535
+#define H2_MAX_STREAMS 100          //SETTINGS_MAX_CONCURRENT_STREAMS we announce
+#define H2_IDLE_TIMEOUT 10          //seconds without any frame before the connection is closed
+#define H2_MAX_REQ_HEADERS 64
+#define H2_RESP_HEADERS 16          //headers a response has room for at first, it grows as needed
+#define H2_RESP_HEADER_BUF 1024     //bytes of headers a response has room for at first, it grows as needed
+#define H2_DEFAULT_WEIGHT 16
+#define H2_MAX_REQ_BODY (1024 * 1024)    //request bodies are collected up to this size
+#define H2_PARK_TICK_MS 1000        //the parking thread looks for connections idle for too long this often
+#define H2_PARK_EVENTS 64           //epoll events the parking thread takes at a time
+
+
+/**
+ * a request as seen by the handler. path is the :path pseudo header
+ */
+typedef struct h2_request_st {
+    char *method;
+    char *path;
+    hpack_header *headers;  //all the decoded headers (names are lower case)
+    int num_headers;
+    char *body;             //the request body (DATA frames), NULL when there is none
+    size_t body_len;
+    int body_too_large;     //1 if the body was bigger than H2_MAX_REQ_BODY (body is NULL then)
+} h2_request;
+
+
+/**
+ * a response filled by the handler. The body is either a buffer (body/body_len) or a file (fd/fd_len).
+ * release (may be NULL) is called once the stream is done, to free what the handler allocated (ctx).
+ * progress (may be NULL) is called before every read of a file body, with the offset it's read from.
+ */
+typedef struct h2_response_st {
+    int status;
+    size_t *header_offs;    //where every header starts in hbuf: its name (lower case), '\0', its value, '\0'
+    int num_headers;
+    int headers_cap;
+    char *hbuf;             //the headers, allocated (and grown) by h2_add_header, freed with the stream
+    size_t hbuf_used;
+    size_t hbuf_cap;
+    char *body;             //buffer body, NULL when there is none
+    size_t body_len;
+    int fd;                 //file body read with pread, -1 when there is none
+    off_t fd_len;
+    void (*release)(struct h2_response_st *res);
+    void (*progress)(struct h2_response_st *res, off_t offset);
+    void *ctx;
+} h2_response;
+
+
+/**
+ * a stream of a connection
+ */
+typedef struct h2_stream_st {
+    uint32_t id;
+    int request_done;       //1 when the client half closed the stream (END_STREAM)
+    int responded;          //1 when the response HEADERS were sent
+    int64_t window;         //how many bytes we may send on this stream
+    int weight;             //1..256
+    uint32_t depends_on;    //the parent stream (priority), 0 for none
+    uint64_t vtime;         //virtual time used for weighted fair scheduling
+    h2_response res;
+    off_t sent;             //bytes of the body already sent
+    hpack_header headers[H2_MAX_REQ_HEADERS];
+    int num_headers;
+    char *body;             //the request body collected so far
+    size_t body_len;
+    int body_too_large;
+    struct h2_stream_st *next;
+} h2_stream;
+
+
+// "h2_handler_fn" is called once for every complete request and must fill res.
+typedef void (*h2_handler_fn)(h2_request *req, h2_response *res);
+
+
+struct h2_conn_st;
+
+/**
+ * the parked connections: one thread waits (epoll) for the clients of all of them, hands a connection back to
+ * the pool (LANE_BULK) when its client sends more, and closes the ones idle for H2_IDLE_TIMEOUT seconds.
+ */
+typedef struct h2_parking_st {
+    pthread_t thread;
+    int epfd;                   //epoll instance of the parked connections
+    int wakefd;                 //eventfd used to wake the thread (on stop)
+    threadpool *tp;             //the parked connections go back to its LANE_BULK
+    pthread_mutex_t lock;       //protects head, parked and stopped
+    struct h2_conn_st *head;    //the parked connections
+    int parked;
+    int stopped;                //1 after h2_parking_stop: nothing is parked any more
+    int started;
+} h2_parking;
+
+
+/**
+ * h2_is_preface returns 1 if the first len bytes of buf are (the start of) the HTTP/2 client preface.
+ */
+int h2_is_preface(char *buf, int len);
+
+/**
+ * h2_serve runs an HTTP/2 connection on sockfd until it ends, then closes sockfd.
+ * initial/initial_len are the bytes already read from the socket (prior knowledge).
+ * For an "Upgrade: h2c" request, upgrade is that request (it becomes stream 1) and settings is the
+ * value of its HTTP2-Settings header; in that case the 101 response is sent here.
+ * With parking (may be NULL) the connection is handed to LANE_BULK of its pool and h2_serve returns right away,
+ * and it's parked whenever it waits for its client. o.w it's served here, until it ends.
+ */
+void h2_serve(int sockfd, char *initial, int initial_len, h2_handler_fn handler, h2_request *upgrade, char *settings,
+              h2_parking *parking);
+
+/**
+ * create_h2_parking starts the parking thread of the connections served by tp. returns NULL on failure.
+ */
+h2_parking *create_h2_parking(threadpool *tp);
+
+/**
+ * h2_parking_stop stops parking: from now on a connection waits for its client on its thread (as without parking).
+ * waits until the parked connections were resumed or closed (up to H2_IDLE_TIMEOUT seconds), then stops the
+ * thread. call it before tp is destroyed.
+ */
+void h2_parking_stop(h2_parking *pk);
+
+/**
+ * destroy_h2_parking stops the parking (if it's not stopped yet) and frees it. call it after tp is destroyed.
+ */
+void destroy_h2_parking(h2_parking *pk);
+
+/**
+ * h2_add_header adds a response header (name lower case). returns 0 on succsess, -1 on malloc failure.
+ */
+int h2_add_header(h2_response *res, const char *name, const char *value);
+
+/**
+ * h2_request_header returns the value of the request header name (lower case), NULL if it's missing.
+ */
+char *h2_request_header(h2_request *req, const char *name);
+
+
+#endif
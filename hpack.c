@@ -0,0 +1,563 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "hpack.h"
+
+
+/**
+ * @author: Daniel Gabay
+ * hpack.c
+ * --------------------------------------------------------------------------------
+ * This file implements the functionality of hpack.h
+ * Indexes 1..61 are the static table, 62.. are the dynamic table (62 is the newest entry).
+ * The encoder prefers (in this order): a full match in a table, a literal with an indexed name,
+ * a literal with a literal name. Strings are huffman coded when it makes them shorter.
+ * The huffman code is canonical, so the decoder only needs, for every code length,
+ * the first code and the number of codes of that length.
+ */
+
+/**RFC 7541 Appendix A: the static table, index 1..61*/
+static const hpack_field static_table[HPACK_STATIC_SIZE + 1] = {
+    {NULL, NULL},
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+/**RFC 7541 Appendix B: huffman code of every byte value*/
+static const uint32_t huff_codes[256] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+};
+
+/**RFC 7541 Appendix B: length in bits of the huffman code of every byte value*/
+static const uint8_t huff_lens[256] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+/**canonical huffman decoding tables, built once from huff_codes/huff_lens*/
+#define HUFF_MAX_LEN 30
+static uint32_t huff_first[HUFF_MAX_LEN + 1];   //first code of every length
+static int huff_count[HUFF_MAX_LEN + 1];        //number of codes of every length
+static int huff_offset[HUFF_MAX_LEN + 1];       //index at huff_syms of the first symbol of every length
+static uint8_t huff_syms[256];                  //symbols sorted by (code length, symbol)
+static pthread_once_t huff_once = PTHREAD_ONCE_INIT;
+
+/**forward declerations*/
+void huff_init();
+int huff_decode(unsigned char *in, size_t len, char *out);
+size_t huff_encoded_len(const char *str, size_t len);
+int huff_encode(const char *str, size_t len, unsigned char *out, size_t out_cap);
+int encode_int(uint32_t value, int prefix_bits, unsigned char flags, unsigned char *out, size_t out_cap);
+int decode_int(unsigned char *buf, size_t len, size_t *pos, int prefix_bits, uint32_t *value);
+int encode_string(const char *str, unsigned char *out, size_t out_cap);
+char *decode_string(unsigned char *buf, size_t len, size_t *pos, int *malformed);
+int table_get(hpack_table *t, uint32_t index, const char **name, const char **value);
+int table_add(hpack_table *t, const char *name, const char *value);
+void table_evict(hpack_table *t, size_t needed);
+int find_field(hpack_table *t, const char *name, const char *value, int *name_index);
+char *copy_string(const char *str);
+
+
+/**
+ * hpack_table_init initialize an empty table with the given maximum size.
+ */
+void hpack_table_init(hpack_table *t, size_t max_size) {
+    t->head = 0;
+    t->count = 0;
+    t->size = 0;
+    t->max_size = max_size > HPACK_DEFAULT_TABLE_SIZE ? HPACK_DEFAULT_TABLE_SIZE : max_size;
+    t->pending_update = 0;
+}
+
+/**
+ * hpack_table_free frees the entries of the table (not the table itself).
+ */
+void hpack_table_free(hpack_table *t) {
+    table_evict(t, t->size + HPACK_DEFAULT_TABLE_SIZE + 1); //more than everything
+}
+
+/**
+ * hpack_set_max_size changes the maximum size of an encoder table (we never use more than the default).
+ */
+void hpack_set_max_size(hpack_table *t, size_t max_size) {
+    if (max_size > HPACK_DEFAULT_TABLE_SIZE)
+        max_size = HPACK_DEFAULT_TABLE_SIZE;
+    if (max_size == t->max_size)
+        return;
+    t->max_size = max_size;
+    table_evict(t, 0);
+    t->pending_update = 1;
+}
+
+/**
+ * hpack_decode decodes a complete header block. returns the number of headers, -1 on error.
+ */
+int hpack_decode(hpack_table *t, unsigned char *buf, size_t len, hpack_header *out, int max_out) {
+    size_t pos = 0;
+    int n = 0, failed = 0, malformed = 0;
+    while (pos < len && !failed) {
+        unsigned char b = buf[pos];
+        uint32_t index;
+        const char *name, *value;
+        if ((b & 0xe0) == 0x20) { //dynamic table size update
+            if (decode_int(buf, len, &pos, 5, &index) < 0 || index > HPACK_DEFAULT_TABLE_SIZE) {
+                failed = 1;
+                continue;
+            }
+            t->max_size = index;
+            table_evict(t, 0);
+            continue;
+        }
+        if (n == max_out) {
+            failed = 1;
+            continue;
+        }
+        out[n].name = NULL;
+        out[n].value = NULL;
+        if (b & 0x80) { //indexed header field
+            if (decode_int(buf, len, &pos, 7, &index) == 0 && table_get(t, index, &name, &value) == 0) {
+                out[n].name = copy_string(name);
+                out[n].value = copy_string(value);
+                if (strpbrk(name, "\r\n") != NULL || strpbrk(value, "\r\n") != NULL) //added by a malformed block
+                    malformed = 1;
+            }
+        } else { //literal: with incremental indexing (01), without indexing (0000) or never indexed (0001)
+            int indexing = (b & 0x40) != 0;
+            if (decode_int(buf, len, &pos, indexing ? 6 : 4, &index) == 0) {
+                if (index == 0)
+                    out[n].name = decode_string(buf, len, &pos, &malformed);
+                else if (table_get(t, index, &name, &value) == 0) {
+                    out[n].name = copy_string(name);
+                    if (strpbrk(name, "\r\n") != NULL)
+                        malformed = 1;
+                }
+                if (out[n].name != NULL)
+                    out[n].value = decode_string(buf, len, &pos, &malformed);
+                if (out[n].value != NULL && indexing && table_add(t, out[n].name, out[n].value) < 0) {
+                    free(out[n].value);
+                    out[n].value = NULL;
+                }
+            }
+        }
+        if (out[n].name == NULL || out[n].value == NULL) { //bad index, truncated block or malloc failure
+            free(out[n].name);
+            free(out[n].value);
+            failed = 1;
+            continue;
+        }
+        n++;
+    }
+    if (failed) { //stopped in the middle -> compression error
+        hpack_free_headers(out, n);
+        return -1;
+    }
+    if (malformed) { //the whole block was read, so the table is still in sync with the encoder
+        hpack_free_headers(out, n);
+        return HPACK_MALFORMED;
+    }
+    return n;
+}
+
+/**
+ * hpack_free_headers frees n decoded headers.
+ */
+void hpack_free_headers(hpack_header *headers, int n) {
+    for (int i = 0; i < n; i++) {
+        free(headers[i].name);
+        free(headers[i].value);
+    }
+}
+
+/**
+ * hpack_encode_begin writes the pending table size update (if any). returns bytes written, -1 on failure.
+ */
+int hpack_encode_begin(hpack_table *t, unsigned char *out, size_t out_cap) {
+    if (!t->pending_update)
+        return 0;
+    int n = encode_int((uint32_t) t->max_size, 5, 0x20, out, out_cap);
+    if (n > 0)
+        t->pending_update = 0;
+    return n;
+}
+
+/**
+ * hpack_encode appends one header to out. returns bytes written, -1 if out is too small.
+ */
+int hpack_encode(hpack_table *t, const char *name, const char *value, int mode, unsigned char *out, size_t out_cap) {
+    int name_index = 0;
+    int index = find_field(t, name, value, &name_index);
+    if (index > 0) //the whole field is in a table: one indexed field
+        return encode_int(index, 7, 0x80, out, out_cap);
+    int n = (mode == HPACK_INDEX) ? encode_int(name_index, 6, 0x40, out, out_cap)
+                                  : encode_int(name_index, 4, 0x00, out, out_cap);
+    if (n < 0)
+        return -1;
+    int m;
+    if (name_index == 0) {
+        if ((m = encode_string(name, out + n, out_cap - n)) < 0)
+            return -1;
+        n += m;
+    }
+    if ((m = encode_string(value, out + n, out_cap - n)) < 0)
+        return -1;
+    n += m;
+    if (mode == HPACK_INDEX && table_add(t, name, value) < 0)
+        return -1;
+    return n;
+}
+
+/**builds the canonical decoding tables*/
+void huff_init() {
+    int k = 0;
+    for (int len = 0; len <= HUFF_MAX_LEN; len++) {
+        huff_count[len] = 0;
+        huff_offset[len] = k;
+        for (int sym = 0; sym < 256; sym++)
+            if (huff_lens[sym] == len) {
+                if (huff_count[len] == 0)
+                    huff_first[len] = huff_codes[sym];
+                huff_syms[k++] = (uint8_t) sym;
+                huff_count[len]++;
+            }
+    }
+}
+
+/**decodes len huffman coded bytes into out (large enough: len * 8 / 5). returns the decoded length, -1 on error*/
+int huff_decode(unsigned char *in, size_t len, char *out) {
+    pthread_once(&huff_once, huff_init);
+    uint32_t code = 0;
+    int code_len = 0, n = 0;
+    for (size_t i = 0; i < len; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            code = (code << 1) | ((in[i] >> bit) & 1);
+            code_len++;
+            if (code_len > HUFF_MAX_LEN) //EOS or garbage
+                return -1;
+            if (huff_count[code_len] > 0 && code >= huff_first[code_len] &&
+                code - huff_first[code_len] < (uint32_t) huff_count[code_len]) {
+                out[n++] = (char) huff_syms[huff_offset[code_len] + code - huff_first[code_len]];
+                code = 0;
+                code_len = 0;
+            }
+        }
+    }
+    /*padding: less than 8 bits, all of them 1 (the prefix of EOS)*/
+    if (code_len > 7 || code != (uint32_t) ((1 << code_len) - 1))
+        return -1;
+    return n;
+}
+
+/**returns the length of str after huffman coding*/
+size_t huff_encoded_len(const char *str, size_t len) {
+    size_t bits = 0;
+    for (size_t i = 0; i < len; i++)
+        bits += huff_lens[(unsigned char) str[i]];
+    return (bits + 7) / 8;
+}
+
+/**huffman codes str into out. returns the number of bytes written, -1 if out is too small*/
+int huff_encode(const char *str, size_t len, unsigned char *out, size_t out_cap) {
+    uint64_t acc = 0;
+    int acc_bits = 0;
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char) str[i];
+        acc = (acc << huff_lens[c]) | huff_codes[c];
+        acc_bits += huff_lens[c];
+        while (acc_bits >= 8) {
+            if (n == out_cap)
+                return -1;
+            acc_bits -= 8;
+            out[n++] = (unsigned char) (acc >> acc_bits);
+        }
+    }
+    if (acc_bits > 0) { //pad with the EOS prefix (ones)
+        if (n == out_cap)
+            return -1;
+        out[n++] = (unsigned char) ((acc << (8 - acc_bits)) | (0xff >> acc_bits));
+    }
+    return (int) n;
+}
+
+/**writes value as an HPACK integer with the given prefix. returns bytes written, -1 if out is too small*/
+int encode_int(uint32_t value, int prefix_bits, unsigned char flags, unsigned char *out, size_t out_cap) {
+    uint32_t max_prefix = (1u << prefix_bits) - 1;
+    size_t n = 0;
+    if (out_cap == 0)
+        return -1;
+    if (value < max_prefix) {
+        out[n++] = flags | (unsigned char) value;
+        return (int) n;
+    }
+    out[n++] = flags | (unsigned char) max_prefix;
+    value -= max_prefix;
+    while (value >= 128) {
+        if (n == out_cap)
+            return -1;
+        out[n++] = (unsigned char) ((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    if (n == out_cap)
+        return -1;
+    out[n++] = (unsigned char) value;
+    return (int) n;
+}
+
+/**reads an HPACK integer at *pos and advances it. returns 0 on succsess, -1 on error*/
+int decode_int(unsigned char *buf, size_t len, size_t *pos, int prefix_bits, uint32_t *value) {
+    if (*pos >= len)
+        return -1;
+    uint32_t max_prefix = (1u << prefix_bits) - 1;
+    uint32_t v = buf[(*pos)++] & max_prefix;
+    if (v < max_prefix) {
+        *value = v;
+        return 0;
+    }
+    for (int shift = 0; shift <= 21; shift += 7) { //no more than 4 continuation bytes (2^28)
+        if (*pos >= len)
+            return -1;
+        unsigned char b = buf[(*pos)++];
+        v += (uint32_t) (b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *value = v;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**writes a string literal (huffman coded if shorter). returns bytes written, -1 if out is too small*/
+int encode_string(const char *str, unsigned char *out, size_t out_cap) {
+    size_t len = strlen(str);
+    size_t hlen = huff_encoded_len(str, len);
+    int n, m;
+    if (hlen < len) {
+        if ((n = encode_int((uint32_t) hlen, 7, 0x80, out, out_cap)) < 0)
+            return -1;
+        if ((m = huff_encode(str, len, out + n, out_cap - n)) < 0)
+            return -1;
+        return n + m;
+    }
+    if ((n = encode_int((uint32_t) len, 7, 0x00, out, out_cap)) < 0 || n + len > out_cap)
+        return -1;
+    memcpy(out + n, str, len);
+    return n + (int) len;
+}
+
+/**reads a string literal at *pos and advances it. sets *malformed if it holds CR, LF or NUL.
+ * returns malloc'ed NULL terminated string, NULL on error*/
+char *decode_string(unsigned char *buf, size_t len, size_t *pos, int *malformed) {
+    if (*pos >= len)
+        return NULL;
+    int huffman = (buf[*pos] & 0x80) != 0;
+    uint32_t slen;
+    if (decode_int(buf, len, pos, 7, &slen) < 0 || slen > HPACK_MAX_STRING || *pos + slen > len)
+        return NULL;
+    char *str = (char *) malloc(sizeof(char) * (huffman ? slen * 8 / 5 + 1 : slen + 1));
+    if (str == NULL)
+        return NULL;
+    int n = (int) slen;
+    if (huffman)
+        n = huff_decode(buf + *pos, slen, str);
+    else
+        memcpy(str, buf + *pos, slen);
+    if (n < 0) {
+        free(str);
+        return NULL;
+    }
+    str[n] = '\0';
+    if (memchr(str, '\0', n) != NULL || memchr(str, '\r', n) != NULL || memchr(str, '\n', n) != NULL)
+        *malformed = 1;
+    *pos += slen;
+    return str;
+}
+
+/**finds index (static or dynamic) at the tables. returns 0 on succsess, -1 for a bad index*/
+int table_get(hpack_table *t, uint32_t index, const char **name, const char **value) {
+    if (index == 0)
+        return -1;
+    if (index <= HPACK_STATIC_SIZE) {
+        *name = static_table[index].name;
+        *value = static_table[index].value;
+        return 0;
+    }
+    index -= HPACK_STATIC_SIZE;
+    if (index > (uint32_t) t->count)
+        return -1;
+    hpack_entry *e = &t->entries[(t->head + index - 1) % HPACK_MAX_ENTRIES];
+    *name = e->name;
+    *value = e->value;
+    return 0;
+}
+
+/**adds a field as the newest dynamic entry, evicting old ones. returns 0 on succsess, -1 on malloc failure*/
+int table_add(hpack_table *t, const char *name, const char *value) {
+    size_t name_len = strlen(name), value_len = strlen(value);
+    size_t entry_size = name_len + value_len + HPACK_ENTRY_OVERHEAD;
+    if (entry_size > t->max_size) { //too big: the table is emptied and nothing is added
+        table_evict(t, t->max_size + 1);
+        return 0;
+    }
+    table_evict(t, entry_size);
+    char *n = copy_string(name), *v = copy_string(value);
+    if (n == NULL || v == NULL) {
+        free(n);
+        free(v);
+        return -1;
+    }
+    t->head = (t->head + HPACK_MAX_ENTRIES - 1) % HPACK_MAX_ENTRIES;
+    hpack_entry *e = &t->entries[t->head];
+    e->name = n;
+    e->value = v;
+    e->name_len = name_len;
+    e->value_len = value_len;
+    t->count++;
+    t->size += entry_size;
+    return 0;
+}
+
+/**evicts the oldest entries until there is room for needed more bytes*/
+void table_evict(hpack_table *t, size_t needed) {
+    while (t->count > 0 && (t->size + needed > t->max_size || t->count == HPACK_MAX_ENTRIES)) {
+        hpack_entry *e = &t->entries[(t->head + t->count - 1) % HPACK_MAX_ENTRIES];
+        t->size -= e->name_len + e->value_len + HPACK_ENTRY_OVERHEAD;
+        free(e->name);
+        free(e->value);
+        t->count--;
+    }
+}
+
+/**returns the index of name:value if it's in a table, o.w 0 and *name_index is the index of name (or 0)*/
+int find_field(hpack_table *t, const char *name, const char *value, int *name_index) {
+    *name_index = 0;
+    for (int i = 1; i <= HPACK_STATIC_SIZE; i++)
+        if (strcmp(static_table[i].name, name) == 0) {
+            if (strcmp(static_table[i].value, value) == 0)
+                return i;
+            if (*name_index == 0)
+                *name_index = i;
+        }
+    for (int i = 1; i <= t->count; i++) {
+        hpack_entry *e = &t->entries[(t->head + i - 1) % HPACK_MAX_ENTRIES];
+        if (strcmp(e->name, name) == 0) {
+            if (strcmp(e->value, value) == 0)
+                return HPACK_STATIC_SIZE + i;
+            if (*name_index == 0)
+                *name_index = HPACK_STATIC_SIZE + i;
+        }
+    }
+    return 0;
+}
+
+/**returns malloc'ed copy of str, NULL on failure*/
+char *copy_string(const char *str) {
+    char *copy = (char *) malloc(sizeof(char) * (strlen(str) + 1));
+    if (copy != NULL)
+        strcpy(copy, str);
+    return copy;
+}
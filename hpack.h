@@ -0,0 +1,113 @@
+#ifndef EX3_HPACK_H
+#define EX3_HPACK_H
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * hpack.h
+ *
+ * This file declares the HPACK header compression of HTTP/2 (RFC 7541):
+ * the static table, a dynamic table per direction, huffman coding, and the encoder/decoder.
+ */
+
+#define HPACK_STATIC_SIZE 61
+#define HPACK_DEFAULT_TABLE_SIZE 4096
+#define HPACK_ENTRY_OVERHEAD 32
+// the dynamic table never holds more entries than this (every entry costs at least 32 bytes)
+#define HPACK_MAX_ENTRIES (HPACK_DEFAULT_TABLE_SIZE / HPACK_ENTRY_OVERHEAD + 1)
+// longest header name/value the decoder accepts
+#define HPACK_MAX_STRING 8192
+
+// hpack_decode: the block was decoded, but a name or value holds CR, LF or NUL (a malformed request)
+#define HPACK_MALFORMED -2
+
+/**encoding modes*/
+#define HPACK_NO_INDEX 0    //literal, don't add it to the table (values that change every time)
+#define HPACK_INDEX 1       //literal with incremental indexing, the next time it's one byte
+
+
+/**
+ * a static table entry
+ */
+typedef struct hpack_field_st {
+    const char *name;
+    const char *value;
+} hpack_field;
+
+
+/**
+ * a decoded header (name and value are malloc'ed and NULL terminated)
+ */
+typedef struct hpack_header_st {
+    char *name;
+    char *value;
+} hpack_header;
+
+
+/**
+ * a dynamic table entry
+ */
+typedef struct hpack_entry_st {
+    char *name;
+    char *value;
+    size_t name_len;
+    size_t value_len;
+} hpack_entry;
+
+
+/**
+ * The dynamic table. it's a ring of entries, dynamic index 1 is the newest one.
+ */
+typedef struct _hpack_table_st {
+    hpack_entry entries[HPACK_MAX_ENTRIES];
+    int head;               //position of the newest entry
+    int count;              //number of entries
+    size_t size;            //size as defined by RFC 7541 (name + value + 32 for each entry)
+    size_t max_size;        //current maximum size
+    int pending_update;     //encoder only: max_size changed, a size update must start the next block
+} hpack_table;
+
+
+/**
+ * hpack_table_init initialize an empty table with the given maximum size.
+ */
+void hpack_table_init(hpack_table *t, size_t max_size);
+
+/**
+ * hpack_table_free frees the entries of the table (not the table itself).
+ */
+void hpack_table_free(hpack_table *t);
+
+/**
+ * hpack_set_max_size changes the maximum size of an encoder table (the peer's SETTINGS_HEADER_TABLE_SIZE),
+ * the change is announced at the start of the next header block.
+ */
+void hpack_set_max_size(hpack_table *t, size_t max_size);
+
+/**
+ * hpack_decode decodes a complete header block into out (at most max_out headers).
+ * returns the number of headers, -1 on a compression error (the connection must be closed), or HPACK_MALFORMED
+ * when a name or value holds CR, LF or NUL (the table was updated, only the request must be refused).
+ * the headers must be freed with hpack_free_headers().
+ */
+int hpack_decode(hpack_table *t, unsigned char *buf, size_t len, hpack_header *out, int max_out);
+
+/**
+ * hpack_free_headers frees n decoded headers.
+ */
+void hpack_free_headers(hpack_header *headers, int n);
+
+/**
+ * hpack_encode_begin must be called at the start of every header block, it writes the pending
+ * table size update (if any) to out. returns the number of bytes written, -1 if out is too small.
+ */
+int hpack_encode_begin(hpack_table *t, unsigned char *out, size_t out_cap);
+
+/**
+ * hpack_encode appends one header (name must be lower case) to out using mode (HPACK_INDEX / HPACK_NO_INDEX).
+ * returns the number of bytes written, -1 if out is too small.
+ */
+int hpack_encode(hpack_table *t, const char *name, const char *value, int mode, unsigned char *out, size_t out_cap);
+
+
+#endif
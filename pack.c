@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pack.h"
+
+
+/**
+ * @author: Daniel Gabay
+ * pack.c
+ * --------------------------------------------------------------------------------
+ * This file implements the reading side of pack.h
+ * The whole pack is mapped read only once, entries are found by binary search on the path hash,
+ * and everything the server sends (headers and bodies) is pointed to inside the mapping.
+ * Note: every offset of the pack is checked against its size once, in open_pack, so a truncated or corrupt
+ *       pack is rejected instead of being read out of bounds later.
+ */
+
+/**forward declerations*/
+int in_range(uint64_t off, uint64_t len, uint64_t size);
+int check_entries(char *base, uint64_t size, pack_header *hdr);
+
+
+/**
+ * open_pack maps the pack file and checks its header. returns NULL on failure.
+ */
+asset_pack *open_pack(char *file) {
+    if (file == NULL)
+        return NULL;
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) {
+        perror("open pack");
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(pack_header)) {
+        close(fd);
+        return NULL;
+    }
+    char *base = (char *) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); //the mapping keeps the file
+    if (base == MAP_FAILED) {
+        perror("mmap pack");
+        return NULL;
+    }
+    pack_header *hdr = (pack_header *) base;
+    if (memcmp(hdr->magic, PACK_MAGIC, sizeof(hdr->magic)) != 0 || hdr->version != PACK_VERSION ||
+        !check_entries(base, st.st_size, hdr)) {
+        printf("bad pack file\n");
+        munmap(base, st.st_size);
+        return NULL;
+    }
+    asset_pack *pack = (asset_pack *) malloc(sizeof(asset_pack));
+    if (pack == NULL) {
+        munmap(base, st.st_size);
+        return NULL;
+    }
+    pack->base = base;
+    pack->size = st.st_size;
+    pack->entries = (pack_entry *) (base + hdr->entries_off);
+    pack->num_entries = hdr->num_entries;
+    madvise(base, st.st_size, MADV_WILLNEED);
+    return pack;
+}
+
+/**returns 1 if [off, off + len) is inside a file of size bytes (without overflowing), 0 o.w*/
+int in_range(uint64_t off, uint64_t len, uint64_t size) {
+    return off <= size && len <= size - off;
+}
+
+/**returns 1 if the entries array and everything every entry points to are inside the pack, 0 o.w*/
+int check_entries(char *base, uint64_t size, pack_header *hdr) {
+    if (!in_range(hdr->entries_off, (uint64_t) hdr->num_entries * sizeof(pack_entry), size))
+        return 0;
+    pack_entry *entries = (pack_entry *) (base + hdr->entries_off);
+    for (uint32_t i = 0; i < hdr->num_entries; i++) {
+        pack_entry *e = &entries[i];
+        if (!in_range(e->path_off, e->path_len, size) || !in_range(e->body_off, e->body_len, size) ||
+            !in_range(e->headers_off, e->headers_len, size) || !in_range(e->gzip_off, e->gzip_len, size) ||
+            !in_range(e->gzip_headers_off, e->gzip_headers_len, size) ||
+            memchr(e->etag, '\0', PACK_ETAG_LEN) == NULL)
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * pack_lookup returns the entry of path, or NULL if the path is not in the pack.
+ */
+pack_entry *pack_lookup(asset_pack *pack, char *path) {
+    if (pack == NULL || path == NULL)
+        return NULL;
+    size_t len = strlen(path);
+    uint64_t h = pack_hash(path, len);
+    uint32_t lo = 0, hi = pack->num_entries;
+    while (lo < hi) { //find the first entry with hash >= h
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (pack->entries[mid].hash < h)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (; lo < pack->num_entries && pack->entries[lo].hash == h; lo++) { //same hash, compare the paths
+        pack_entry *e = &pack->entries[lo];
+        if (e->path_len == len && memcmp(pack->base + e->path_off, path, len) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+/**
+ * close_pack unmaps the pack and frees it.
+ */
+void close_pack(asset_pack *pack) {
+    if (pack == NULL)
+        return;
+    munmap(pack->base, pack->size);
+    free(pack);
+}
+
+/**
+ * pack_hash is the FNV-1a hash of the first len bytes of str.
+ */
+uint64_t pack_hash(char *str, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) str[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
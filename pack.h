@@ -0,0 +1,88 @@
+#ifndef EX3_PACK_H
+#define EX3_PACK_H
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * pack.h
+ *
+ * This file declares the asset pack: an immutable file built offline from a document root
+ * by packbuild, and memory mapped by the server at startup.
+ * Layout: [pack_header][strings, bodies and pre rendered headers][pack_entry array sorted by hash]
+ * All offsets are from the start of the file.
+ */
+
+#define PACK_MAGIC "HSPACK01"
+#define PACK_VERSION 1
+#define PACK_ETAG_LEN 24
+
+/**kinds of entries*/
+#define PACK_KIND_FILE 1        //body is the file (or the index.html of a directory)
+#define PACK_KIND_LISTING 2     //body is a pre rendered directory listing
+#define PACK_KIND_REDIRECT 3    //directory requested without the ending '/'
+
+
+/**
+ * the start of the pack file
+ */
+typedef struct pack_header_st {
+    char magic[8];          //PACK_MAGIC
+    uint32_t version;       //PACK_VERSION
+    uint32_t num_entries;   //number of pack_entry at entries_off
+    uint64_t entries_off;   //offset of the entries array
+} pack_header;
+
+
+/**
+ * one servable path. headers are everything after the "Date:" line, including the empty line.
+ */
+typedef struct pack_entry_st {
+    uint64_t hash;              //pack_hash() of the path
+    uint64_t path_off;          //the request path, as the server sees it (without the first '/')
+    uint32_t path_len;
+    uint32_t kind;              //PACK_KIND_*
+    uint64_t body_off;          //identity body
+    uint64_t body_len;
+    uint64_t headers_off;       //pre rendered headers for the identity body
+    uint64_t headers_len;
+    uint64_t gzip_off;          //precompressed body, gzip_len is 0 when there is no such variant
+    uint64_t gzip_len;
+    uint64_t gzip_headers_off;  //pre rendered headers for the gzip body
+    uint64_t gzip_headers_len;
+    char etag[PACK_ETAG_LEN];   //quoted etag, NULL terminated
+} pack_entry;
+
+
+/**
+ * The mapped pack
+ */
+typedef struct _asset_pack_st {
+    char *base;             //start of the mapping
+    size_t size;            //size of the mapping
+    pack_entry *entries;    //entries array inside the mapping
+    uint32_t num_entries;
+} asset_pack;
+
+
+/**
+ * open_pack maps the pack file and checks its header. returns NULL on failure.
+ */
+asset_pack *open_pack(char *file);
+
+/**
+ * pack_lookup returns the entry of path, or NULL if the path is not in the pack.
+ */
+pack_entry *pack_lookup(asset_pack *pack, char *path);
+
+/**
+ * close_pack unmaps the pack and frees it.
+ */
+void close_pack(asset_pack *pack);
+
+/**
+ * pack_hash is the FNV-1a hash of the first len bytes of str.
+ */
+uint64_t pack_hash(char *str, size_t len);
+
+
+#endif
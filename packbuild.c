@@ -0,0 +1,320 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <zlib.h>
+#include "pack.h"
+#include "content.h"
+
+#define USAGE_ERROR "Usage: packbuild <docroot> <output-pack>\n"
+#define MAX_PACK_HEADER 512
+#define GZIP_MIN_GAIN 0.9   /**keep the gzip variant only if it is at least 10% smaller*/
+#define FAILED -1
+
+/**
+ * @author: Daniel Gabay
+ * packbuild.c
+ * -----------------------------------------------
+ * This program builds an asset pack (see pack.h) from a document root.
+ * It walks the tree from the docroot and adds every path that the live server would answer with 200
+ * (same "other" read/execute premission rules): files, directories (their index.html or a
+ * pre rendered listing) and the 302 redirect of every directory requested without '/'.
+ * For each entry the mime type, an etag (hash of the body), the headers and (when it helps)
+ * a gzip variant are computed here, so the server has nothing left to do per request.
+ * Paths that are not in the pack are served from the file system by the server as before.
+ * Command line usage: packbuild <docroot> <output-pack>  (the output should be outside the docroot, o.w it's
+ *                    skipped, but the live server would still serve it)
+ */
+
+/**forward declaration*/
+int walk_dir(char *rel, int comps_ok);
+
+int add_entry(char *path, int kind, char *body, size_t body_len, char *mime, time_t mtime);
+
+uint64_t write_blob(char *data, size_t len);
+
+char *gzip_body(char *body, size_t len, size_t *out_len);
+
+int render_headers(char *res, char *mime, size_t length, char *last_modified, char *etag, char *encoding, int vary);
+
+char *read_whole_file(char *path, size_t *len);
+
+int cmp_entries(const void *a, const void *b);
+
+FILE *out = NULL;
+struct stat out_st; //the output file, skipped if it's inside the docroot
+pack_entry *entries = NULL;
+uint32_t num_entries = 0, cap_entries = 0;
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        printf(USAGE_ERROR);
+        exit(EXIT_FAILURE);
+    }
+    char *out_path = realpath(".", NULL);
+    if (out_path == NULL) {
+        perror("realpath");
+        exit(EXIT_FAILURE);
+    }
+    /*output path is relative to where we started, we are going to chdir to the docroot*/
+    char *full_out = (char *) malloc(strlen(out_path) + strlen(argv[2]) + 2);
+    if (full_out == NULL) {
+        free(out_path);
+        exit(EXIT_FAILURE);
+    }
+    if (argv[2][0] == '/')
+        strcpy(full_out, argv[2]);
+    else
+        sprintf(full_out, "%s/%s", out_path, argv[2]);
+    free(out_path);
+
+    out = fopen(full_out, "wb");
+    if (out == NULL || fstat(fileno(out), &out_st) < 0) {
+        perror("fopen output");
+        if (out != NULL)
+            fclose(out);
+        free(full_out);
+        exit(EXIT_FAILURE);
+    }
+    if (chdir(argv[1]) < 0) {
+        perror("chdir docroot");
+        fclose(out);
+        free(full_out);
+        exit(EXIT_FAILURE);
+    }
+    pack_header hdr;
+    bzero(&hdr, sizeof(hdr));
+    fwrite(&hdr, sizeof(hdr), 1, out); //placeholder, written again at the end
+
+    if (walk_dir("", 1) == FAILED) {
+        fclose(out);
+        unlink(full_out);
+        free(full_out);
+        free(entries);
+        exit(EXIT_FAILURE);
+    }
+    qsort(entries, num_entries, sizeof(pack_entry), cmp_entries);
+    memcpy(hdr.magic, PACK_MAGIC, sizeof(hdr.magic));
+    hdr.version = PACK_VERSION;
+    hdr.num_entries = num_entries;
+    hdr.entries_off = (uint64_t) ftell(out);
+    fwrite(entries, sizeof(pack_entry), num_entries, out);
+    fseek(out, 0, SEEK_SET);
+    fwrite(&hdr, sizeof(hdr), 1, out);
+    if (fclose(out) != 0) {
+        perror("write pack");
+        unlink(full_out);
+        free(full_out);
+        free(entries);
+        exit(EXIT_FAILURE);
+    }
+    printf("%s: %u entries\n", full_out, num_entries);
+    free(full_out);
+    free(entries);
+    return 0;
+}
+
+/**adds the directory rel ("" for the docroot, o.w ends with '/') and everything under it.
+ * comps_ok is 1 if other has execute premission on every folder of rel (like folderExecutePremession)*/
+int walk_dir(char *rel, int comps_ok) {
+    char *dir_path = (rel[0] == '\0') ? "./" : rel; //the server maps "/" to "./"
+    struct stat st;
+    if (stat(dir_path, &st) < 0)
+        return 0;
+    size_t rel_len = strlen(rel);
+    /*the docroot itself is a path component only for "./"*/
+    int listing_ok = (rel[0] == '\0') ? (st.st_mode & S_IXOTH) != 0 : comps_ok;
+    if (listing_ok) {
+        char *index = (char *) malloc(rel_len + strlen(INDEX_FILE) + 1);
+        if (index == NULL)
+            return FAILED;
+        sprintf(index, "%s"INDEX_FILE, rel);
+        struct stat ist;
+        size_t len;
+        char *body;
+        if (stat(index, &ist) >= 0 && S_ISREG(ist.st_mode) && (ist.st_mode & S_IROTH)) {
+            body = read_whole_file(index, &len);
+            if (body == NULL || add_entry(dir_path, PACK_KIND_FILE, body, len, "text/html", ist.st_mtime) == FAILED) {
+                free(body);
+                free(index);
+                return FAILED;
+            }
+        } else {
+            int ilen = 0;
+            body = build_dir_content(dir_path, &ilen);
+            len = ilen;
+            if (body == NULL || add_entry(dir_path, PACK_KIND_LISTING, body, len, "text/html", st.st_mtime) == FAILED) {
+                free(body);
+                free(index);
+                return FAILED;
+            }
+        }
+        free(body);
+        free(index);
+    }
+
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL)
+        return 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        char *child = (char *) malloc(rel_len + strlen(de->d_name) + 2);
+        if (child == NULL) {
+            closedir(dir);
+            return FAILED;
+        }
+        sprintf(child, "%s%s", rel, de->d_name);
+        struct stat cst, lst;
+        if (stat(child, &cst) < 0 || lstat(child, &lst) < 0 ||
+            (cst.st_dev == out_st.st_dev && cst.st_ino == out_st.st_ino)) { //don't pack the pack being written
+            free(child);
+            continue;
+        }
+        int rc = 0;
+        if (S_ISDIR(cst.st_mode)) {
+            rc = add_entry(child, PACK_KIND_REDIRECT, NULL, 0, NULL, 0); //"dir" -> 302
+            int child_ok = comps_ok && (cst.st_mode & S_IXOTH);
+            if (rc != FAILED && child_ok && !S_ISLNK(lst.st_mode)) { //don't follow links, they may loop
+                strcat(child, "/");
+                rc = walk_dir(child, child_ok);
+            }
+        } else if (comps_ok && S_ISREG(cst.st_mode) && (cst.st_mode & S_IROTH)) {
+            size_t len;
+            char *body = read_whole_file(child, &len);
+            if (body == NULL)
+                rc = FAILED;
+            else
+                rc = add_entry(child, PACK_KIND_FILE, body, len, get_mime_type(child), cst.st_mtime);
+            free(body);
+        }
+        free(child);
+        if (rc == FAILED) {
+            closedir(dir);
+            return FAILED;
+        }
+    }
+    closedir(dir);
+    return 0;
+}
+
+/**writes the entry data into the pack and remember its pack_entry. returns FAILED on failure*/
+int add_entry(char *path, int kind, char *body, size_t body_len, char *mime, time_t mtime) {
+    if (num_entries == cap_entries) {
+        cap_entries = cap_entries ? cap_entries * 2 : 64;
+        pack_entry *tmp = (pack_entry *) realloc(entries, sizeof(pack_entry) * cap_entries);
+        if (tmp == NULL) {
+            printf("malloc failed\n");
+            return FAILED;
+        }
+        entries = tmp;
+    }
+    pack_entry *e = &entries[num_entries];
+    bzero(e, sizeof(pack_entry));
+    e->path_len = strlen(path);
+    e->hash = pack_hash(path, e->path_len);
+    e->path_off = write_blob(path, e->path_len);
+    e->kind = kind;
+    if (kind != PACK_KIND_REDIRECT) {
+        char header[MAX_PACK_HEADER];
+        char timebuf[128];
+        strftime(timebuf, sizeof(timebuf), RFC1123FMT, gmtime(&mtime));
+        snprintf(e->etag, PACK_ETAG_LEN, "\"%016llx\"", (unsigned long long) pack_hash(body, body_len));
+        e->body_off = write_blob(body, body_len);
+        e->body_len = body_len;
+
+        size_t gz_len = 0;
+        char *gz = gzip_body(body, body_len, &gz_len);
+        if (gz != NULL && gz_len < body_len * GZIP_MIN_GAIN) {
+            e->gzip_off = write_blob(gz, gz_len);
+            e->gzip_len = gz_len;
+            e->gzip_headers_len = render_headers(header, mime, gz_len, timebuf, e->etag, "gzip", 1);
+            e->gzip_headers_off = write_blob(header, e->gzip_headers_len);
+        }
+        free(gz);
+        e->headers_len = render_headers(header, mime, body_len, timebuf, e->etag, NULL, e->gzip_len != 0);
+        e->headers_off = write_blob(header, e->headers_len);
+    }
+    num_entries++;
+    return 0;
+}
+
+/**appends data to the pack, returns its offset*/
+uint64_t write_blob(char *data, size_t len) {
+    uint64_t off = (uint64_t) ftell(out);
+    if (len > 0)
+        fwrite(data, 1, len, out);
+    return off;
+}
+
+/**returns malloc'ed gzip of body (and its length at out_len), NULL on failure*/
+char *gzip_body(char *body, size_t len, size_t *out_len) {
+    if (len == 0)
+        return NULL;
+    z_stream zs;
+    bzero(&zs, sizeof(zs));
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) //+16 = gzip wrapper
+        return NULL;
+    size_t bound = deflateBound(&zs, len);
+    char *gz = (char *) malloc(bound);
+    if (gz == NULL) {
+        deflateEnd(&zs);
+        return NULL;
+    }
+    zs.next_in = (Bytef *) body;
+    zs.avail_in = len;
+    zs.next_out = (Bytef *) gz;
+    zs.avail_out = bound;
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+        deflateEnd(&zs);
+        free(gz);
+        return NULL;
+    }
+    *out_len = zs.total_out;
+    deflateEnd(&zs);
+    return gz;
+}
+
+/**renders the headers that come after the Date header, returns their length.
+ * vary is 1 when the entry has more than one variant*/
+int render_headers(char *res, char *mime, size_t length, char *last_modified, char *etag, char *encoding, int vary) {
+    res[0] = '\0';
+    if (mime) sprintf(res + strlen(res), "Content-Type: %s\r\n", mime);
+    sprintf(res + strlen(res), "Content-Length: %zu\r\n", length);
+    sprintf(res + strlen(res), "Last-Modified: %s\r\n", last_modified);
+    sprintf(res + strlen(res), "ETag: %s\r\n", etag);
+    if (encoding != NULL) sprintf(res + strlen(res), "Content-Encoding: %s\r\n", encoding);
+    if (vary) sprintf(res + strlen(res), "Vary: Accept-Encoding\r\n");
+    sprintf(res + strlen(res), "Connection: close\r\n\r\n");
+    return (int) strlen(res);
+}
+
+/**returns malloc'ed content of the file at path (and its length at len), NULL on failure*/
+char *read_whole_file(char *path, size_t *len) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return NULL;
+    struct stat st;
+    if (fstat(fileno(f), &st) < 0) {
+        fclose(f);
+        return NULL;
+    }
+    char *data = (char *) malloc(st.st_size + 1);
+    if (data == NULL) {
+        fclose(f);
+        return NULL;
+    }
+    *len = fread(data, 1, st.st_size, f);
+    fclose(f);
+    return data;
+}
+
+/**qsort compare by hash, so the server can binary search*/
+int cmp_entries(const void *a, const void *b) {
+    uint64_t ha = ((pack_entry *) a)->hash, hb = ((pack_entry *) b)->hash;
+    return (ha > hb) - (ha < hb);
+}
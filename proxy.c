@@ -0,0 +1,1195 @@
+#define _GNU_SOURCE /**memmem, strcasestr, timegm*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include "proxy.h"
+#include "pack.h"
+
+#define FLAG_OFF 0
+#define FLAG_ON 1
+#define BAD_REQUEST 400
+#define HEADERS_TOO_LARGE 431
+#define BAD_GATEWAY 502
+#define SERVICE_UNAVAILABLE 503
+#define GATEWAY_TIMEOUT 504
+#define PROXY_STALE -1          //a reused connection was closed by the backend before it answered
+#define RELAY_OK 0
+#define RELAY_IN_FAILED -1      //the side we read from failed (or broke the framing)
+#define RELAY_OUT_FAILED -2     //the side we write to failed
+#define READ_CHUNK PROXY_HEAD_MAX
+#define MAX_ATTEMPTS 3
+#define RFC1123FMT_GMT "%a, %d %b %Y %H:%M:%S GMT"
+
+
+/**
+ * @author: Daniel Gabay
+ * proxy.c
+ * --------------------------------------------------------------------------------
+ * This file implements the functionality of proxy.h
+ * A proxied request is sent to the backend as HTTP/1.1 with "Connection: keep-alive", and the response
+ * is sent to the client as HTTP/1.0 with "Connection: close", like every other response of the server.
+ * The body is relayed as it arrives: Content-Length bodies byte for byte, chunked bodies are decoded
+ * (an HTTP/1.0 client can't get chunks, the end of the body is the end of the connection).
+ * When the backend response was complete and it didn't ask to close, the connection goes back to the
+ * idle pool of the backend. A pooled connection may have been closed by the backend in the meantime:
+ * if it ends before any response byte and the request can be sent again, it's retried on a new one.
+ * Note: 1)Balancing: the healthy backend with the least outstanding requests, ties are rotated.
+ *       2)Health: the health check thread connects to every backend each PROXY_HEALTH_INTERVAL seconds,
+ *         and a failed connect of a request marks the backend down right away (until the next check).
+ *       3)Cache: only GET without Authorization, status 200/203/301/404/410, with max-age/s-maxage or
+ *         Expires, and without no-store/no-cache/private, Set-Cookie or Vary. Entries are evicted
+ *         oldest first when the cache is full, and dropped when they expire.
+ */
+
+/**
+ * a request to forward
+ */
+typedef struct proxy_req_st {
+    char *method;
+    char *target;
+    char *headers;              //"Name: value\r\n" lines, without the empty line
+    size_t headers_len;
+    int client_fd;              //the rest of the body is read from here, -1 when all of it is in body
+    char *body;                 //body bytes that were already read
+    size_t body_len;
+    char client_ip[INET6_ADDRSTRLEN];
+} proxy_req;
+
+/**
+ * where the bytes of a relay go: a socket, and/or a collected copy
+ */
+typedef struct proxy_out_st {
+    int sockfd;                 //-1 when the bytes are only collected
+    int collect;                //1 to keep a copy at data
+    char *data;
+    size_t len, cap, limit;
+    int overflow;               //the copy got bigger than limit (and was dropped)
+    int failed;                 //writing to sockfd failed
+} proxy_out;
+
+/**
+ * buffered reading of a socket
+ */
+typedef struct reader_st {
+    int fd;
+    char buf[READ_CHUNK];
+    size_t pos, len;
+} reader;
+
+/**forward declerations*/
+proxy_route *match_route(proxy *p, char *target);
+int parse_backend(proxy_backend *b, char *spec);
+int forward(proxy *p, proxy_route *route, proxy_req *req, proxy_out *out);
+int exchange(proxy_req *req, proxy_backend *b, int fd, int reused, proxy_out *out, proxy_cache *cache, char *key,
+             int *keep);
+char *build_request_head(proxy_req *req, proxy_backend *b, size_t *head_len);
+int request_body_length(proxy_req *req, long *length, int *chunked);
+proxy_backend *pick_backend(proxy *p, proxy_route *route, proxy_backend *avoid);
+void done_backend(proxy *p, proxy_backend *b);
+void mark_down(proxy *p, proxy_backend *b);
+int get_connection(proxy *p, proxy_backend *b, int *reused);
+void put_connection(proxy *p, proxy_backend *b, int fd);
+int connect_backend(proxy_backend *b);
+void close_idle(proxy_backend *b, int only_stale);
+void *health_loop(void *arg);
+int out_write(proxy_out *out, char *buf, size_t len);
+void reader_init(reader *r, int fd, char *initial, size_t len);
+ssize_t reader_fill(reader *r);
+int reader_line(reader *r, char *line, size_t cap, proxy_out *raw);
+int relay_exact(reader *r, proxy_out *out, long n);
+int relay_chunked(reader *r, proxy_out *out, int raw);
+int relay_until_eof(reader *r, proxy_out *out);
+int next_header(char **p, char *end, char **name, size_t *name_len, char **value, size_t *value_len);
+int get_header(char *block, size_t len, char *name, char *out, size_t cap);
+size_t headers_size(char *block, size_t len);
+int is_hop_by_hop(char *head, size_t head_len, char *name, size_t len);
+time_t cache_expiry(char *block, size_t len, int status, time_t now);
+proxy_cache *create_cache(size_t max_size);
+proxy_cache_entry *cache_get(proxy_cache *c, char *key);
+void cache_put(proxy_cache *c, char *key, char *data, size_t len, time_t expires);
+void cache_release(proxy_cache *c, proxy_cache_entry *e);
+void cache_unlink(proxy_cache *c, proxy_cache_entry *e);
+void destroy_cache(proxy_cache *c);
+int send_all_fd(int fd, char *buf, size_t len);
+
+
+/**
+ * create_proxy creates an empty configuration. returns NULL on failure.
+ */
+proxy *create_proxy() {
+    proxy *p = (proxy *) malloc(sizeof(proxy));
+    if (p == NULL)
+        return NULL;
+    p->num_routes = 0;
+    p->cache = NULL;
+    p->started = FLAG_OFF;
+    p->stop = FLAG_OFF;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->stop_cond, NULL);
+    return p;
+}
+
+/**
+ * proxy_add_route adds "<prefix>=<backend>[,<backend>...]". returns 0 on succsess, -1 if spec is invalid.
+ */
+int proxy_add_route(proxy *p, char *spec) {
+    char *eq = strchr(spec, '=');
+    if (p == NULL || eq == NULL || spec[0] != '/' || eq - spec >= (int) sizeof(p->routes[0].prefix) ||
+        p->num_routes == PROXY_MAX_ROUTES) {
+        printf("bad proxy route: %s\n", spec);
+        return -1;
+    }
+    proxy_route *route = &p->routes[p->num_routes];
+    route->prefix_len = (int) (eq - spec);
+    memcpy(route->prefix, spec, route->prefix_len);
+    route->prefix[route->prefix_len] = '\0';
+    route->num_backends = 0;
+    route->rr = 0;
+    char *backends = strdup(eq + 1), *save = NULL;
+    if (backends == NULL)
+        return -1;
+    for (char *b = strtok_r(backends, ",", &save); b != NULL; b = strtok_r(NULL, ",", &save)) {
+        if (route->num_backends == PROXY_MAX_BACKENDS || parse_backend(&route->backends[route->num_backends], b) < 0) {
+            printf("bad proxy backend: %s\n", b);
+            free(backends);
+            return -1;
+        }
+        route->num_backends++;
+    }
+    free(backends);
+    if (route->num_backends == 0) {
+        printf("bad proxy route: %s\n", spec);
+        return -1;
+    }
+    p->num_routes++;
+    return 0;
+}
+
+/**
+ * proxy_start enables the cache (cache_bytes > 0) and starts the health check thread.
+ */
+int proxy_start(proxy *p, size_t cache_bytes) {
+    if (p == NULL)
+        return -1;
+    if (cache_bytes > 0 && (p->cache = create_cache(cache_bytes)) == NULL)
+        return -1;
+    if (pthread_create(&p->health_thread, NULL, health_loop, p) != 0)
+        return -1;
+    p->started = FLAG_ON;
+    return 0;
+}
+
+/**
+ * proxy_serve handles a raw HTTP/1.x request if its path is proxied.
+ */
+int proxy_serve(proxy *p, int sockfd, char *buf, int len, int cap) {
+    if (p == NULL || p->num_routes == 0 || len <= 0)
+        return PROXY_NOT_MINE;
+    /*the request line: "<method> <target> <version>", parsed without changing buf (it's not ours yet)*/
+    char method[32], *target;
+    char *sp1 = memchr(buf, ' ', len), *eol = memmem(buf, len, "\r\n", 2);
+    if (sp1 == NULL || eol == NULL || sp1 > eol || sp1 - buf >= (int) sizeof(method))
+        return PROXY_NOT_MINE;
+    char *sp2 = memchr(sp1 + 1, ' ', eol - sp1 - 1);
+    if (sp2 == NULL)
+        return PROXY_NOT_MINE;
+    memcpy(method, buf, sp1 - buf);
+    method[sp1 - buf] = '\0';
+    if ((target = strndup(sp1 + 1, sp2 - sp1 - 1)) == NULL)
+        return PROXY_NOT_MINE;
+    proxy_route *route = match_route(p, target);
+    if (route == NULL) {
+        free(target);
+        return PROXY_NOT_MINE;
+    }
+    /*it's ours: read the rest of the head*/
+    char *end;
+    while ((end = memmem(buf, len, "\r\n\r\n", 4)) == NULL) {
+        if (len >= cap - 1) {
+            free(target);
+            return HEADERS_TOO_LARGE;
+        }
+        ssize_t n = read(sockfd, buf + len, cap - 1 - len);
+        if (n <= 0) {
+            free(target);
+            return (n == 0) ? PROXY_DONE : BAD_REQUEST;
+        }
+        len += (int) n;
+        eol = memmem(buf, len, "\r\n", 2);
+    }
+    proxy_req req;
+    req.method = method;
+    req.target = target;
+    req.headers = eol + 2;
+    req.headers_len = (end + 2) - (eol + 2);
+    req.client_fd = sockfd;
+    req.body = end + 4;
+    req.body_len = len - (req.body - buf);
+    req.client_ip[0] = '\0';
+    struct sockaddr_storage peer;
+    socklen_t peer_len = sizeof(peer);
+    if (getpeername(sockfd, (struct sockaddr *) &peer, &peer_len) == 0) {
+        if (peer.ss_family == AF_INET)
+            inet_ntop(AF_INET, &((struct sockaddr_in *) &peer)->sin_addr, req.client_ip, sizeof(req.client_ip));
+        else if (peer.ss_family == AF_INET6)
+            inet_ntop(AF_INET6, &((struct sockaddr_in6 *) &peer)->sin6_addr, req.client_ip, sizeof(req.client_ip));
+    }
+    proxy_out out;
+    bzero(&out, sizeof(out));
+    out.sockfd = sockfd;
+    int rc = forward(p, route, &req, &out);
+    free(out.data);
+    free(target);
+    return rc;
+}
+
+/**
+ * proxy_fetch is proxy_serve for requests that are already in memory, collecting the whole response.
+ */
+int proxy_fetch(proxy *p, char *method, char *target, char *headers, char *body, size_t body_len, char **out_data,
+                size_t *out_len) {
+    proxy_route *route = (p != NULL) ? match_route(p, target) : NULL;
+    if (route == NULL)
+        return PROXY_NOT_MINE;
+    proxy_req req;
+    req.method = method;
+    req.target = target;
+    req.headers = headers;
+    req.headers_len = strlen(headers);
+    req.client_fd = -1;
+    req.body = body;
+    req.body_len = body_len;
+    req.client_ip[0] = '\0';
+    proxy_out out;
+    bzero(&out, sizeof(out));
+    out.sockfd = -1;
+    out.collect = 1;
+    out.limit = PROXY_MAX_BUFFERED;
+    int rc = forward(p, route, &req, &out);
+    if (rc == PROXY_DONE && (out.overflow || out.data == NULL))
+        rc = BAD_GATEWAY;
+    if (rc != PROXY_DONE) {
+        free(out.data);
+        return rc;
+    }
+    *out_data = out.data;
+    *out_len = out.len;
+    return PROXY_DONE;
+}
+
+/**
+ * returns 1 if target is under a proxy prefix
+ */
+int proxy_is_proxied(proxy *p, char *target) {
+    return p != NULL && match_route(p, target) != NULL;
+}
+
+/**
+ * destroy_proxy stops the health check thread, closes all the idle connections and frees everything.
+ */
+void destroy_proxy(proxy *p) {
+    if (p == NULL)
+        return;
+    if (p->started) {
+        pthread_mutex_lock(&p->lock);
+        p->stop = FLAG_ON;
+        pthread_cond_signal(&p->stop_cond);
+        pthread_mutex_unlock(&p->lock);
+        pthread_join(p->health_thread, NULL);
+    }
+    for (int i = 0; i < p->num_routes; i++)
+        for (int j = 0; j < p->routes[i].num_backends; j++)
+            close_idle(&p->routes[i].backends[j], 0);
+    destroy_cache(p->cache);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->stop_cond);
+    free(p);
+}
+
+/**returns the route of target (the longest matching prefix), NULL if it's not proxied*/
+proxy_route *match_route(proxy *p, char *target) {
+    proxy_route *best = NULL;
+    for (int i = 0; i < p->num_routes; i++) {
+        proxy_route *r = &p->routes[i];
+        if (strncmp(target, r->prefix, r->prefix_len) != 0)
+            continue;
+        char next = target[r->prefix_len];
+        /*"/api" is "/api", "/api/.." and "/api?.." but not "/apix"*/
+        if (r->prefix[r->prefix_len - 1] != '/' && next != '\0' && next != '/' && next != '?')
+            continue;
+        if (best == NULL || r->prefix_len > best->prefix_len)
+            best = r;
+    }
+    return best;
+}
+
+/**parses host:port, [v6]:port or unix:path into b. returns 0 on succsess, -1 o.w*/
+int parse_backend(proxy_backend *b, char *spec) {
+    bzero(b, sizeof(proxy_backend));
+    if (strlen(spec) >= sizeof(b->name))
+        return -1;
+    strcpy(b->name, spec);
+    b->healthy = FLAG_ON;
+    if (strncmp(spec, "unix:", 5) == 0) {
+        struct sockaddr_un *un = (struct sockaddr_un *) &b->addr;
+        if (strlen(spec + 5) == 0 || strlen(spec + 5) >= sizeof(un->sun_path))
+            return -1;
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, spec + 5);
+        b->addrlen = sizeof(struct sockaddr_un);
+        return 0;
+    }
+    char host[128];
+    char *colon = strrchr(spec, ':');
+    if (colon == NULL || colon == spec || colon[1] == '\0')
+        return -1;
+    size_t host_len = colon - spec;
+    if (spec[0] == '[' && spec[host_len - 1] == ']') { //[::1]:8080
+        spec++;
+        host_len -= 2;
+    }
+    memcpy(host, spec, host_len);
+    host[host_len] = '\0';
+    struct addrinfo hints, *res;
+    bzero(&hints, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, colon + 1, &hints, &res) != 0)
+        return -1;
+    memcpy(&b->addr, res->ai_addr, res->ai_addrlen);
+    b->addrlen = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+/**forwards the request (from the cache, or to a backend of route). returns PROXY_DONE or an error status*/
+int forward(proxy *p, proxy_route *route, proxy_req *req, proxy_out *out) {
+    char *key = NULL;
+    if (p->cache != NULL && strcmp(req->method, "GET") == 0 &&
+        get_header(req->headers, req->headers_len, "Authorization", NULL, 0) < 0) {
+        key = (char *) malloc(strlen(req->target) + 8);
+        if (key != NULL) {
+            sprintf(key, "%d %s", (int) (route - p->routes), req->target);
+            proxy_cache_entry *hit = cache_get(p->cache, key);
+            if (hit != NULL) {
+                out_write(out, hit->data, hit->len);
+                cache_release(p->cache, hit);
+                free(key);
+                return PROXY_DONE;
+            }
+        }
+    }
+    long length;
+    int chunked;
+    if (request_body_length(req, &length, &chunked) < 0) {
+        free(key);
+        return BAD_REQUEST;
+    }
+    /*a request whose body is all in memory can be sent again*/
+    int replayable = !chunked && (size_t) length <= req->body_len;
+    int rc = BAD_GATEWAY;
+    proxy_backend *failed = NULL;
+    for (int attempt = 0; attempt < MAX_ATTEMPTS; attempt++) {
+        proxy_backend *b = pick_backend(p, route, failed);
+        if (b == NULL) {
+            rc = (failed != NULL) ? BAD_GATEWAY : SERVICE_UNAVAILABLE;
+            break;
+        }
+        int reused, keep = 0;
+        int fd = get_connection(p, b, &reused);
+        if (fd < 0) {
+            mark_down(p, b);
+            done_backend(p, b);
+            failed = b;
+            rc = BAD_GATEWAY;
+            continue;
+        }
+        rc = exchange(req, b, fd, reused, out, p->cache, key, &keep);
+        if (keep)
+            put_connection(p, b, fd);
+        else
+            close(fd);
+        done_backend(p, b);
+        if (rc == PROXY_STALE && replayable)
+            continue;
+        if (rc == PROXY_STALE)
+            rc = BAD_GATEWAY;
+        break;
+    }
+    if (rc == PROXY_STALE)
+        rc = BAD_GATEWAY;
+    free(key);
+    return rc;
+}
+
+/**one request/response on the backend connection fd. *keep is set to 1 if fd can be used again.
+ * returns PROXY_DONE, PROXY_STALE, or an error status (nothing was written to out)*/
+int exchange(proxy_req *req, proxy_backend *b, int fd, int reused, proxy_out *out, proxy_cache *cache, char *key,
+             int *keep) {
+    size_t head_len;
+    char *head = build_request_head(req, b, &head_len);
+    if (head == NULL)
+        return BAD_GATEWAY;
+    int rc = send_all_fd(fd, head, head_len);
+    free(head);
+    if (rc < 0)
+        return reused ? PROXY_STALE : BAD_GATEWAY;
+
+    /*the request body: what was already read, then the rest from the client*/
+    long length;
+    int chunked;
+    request_body_length(req, &length, &chunked);
+    if (req->client_fd < 0 && length > 0) { //all of it is in memory (proxy_fetch)
+        if (send_all_fd(fd, req->body, req->body_len) < 0)
+            return reused ? PROXY_STALE : BAD_GATEWAY;
+    } else if (chunked || length > 0) {
+        reader *in = (reader *) malloc(sizeof(reader));
+        if (in == NULL)
+            return BAD_GATEWAY;
+        proxy_out up;
+        bzero(&up, sizeof(up));
+        up.sockfd = fd;
+        reader_init(in, req->client_fd, req->body, req->body_len);
+        rc = chunked ? relay_chunked(in, &up, 1) : relay_exact(in, &up, length);
+        free(in);
+        if (rc == RELAY_IN_FAILED) //the client is gone, or sent a broken body
+            return BAD_REQUEST;
+        if (rc == RELAY_OUT_FAILED)
+            return (reused && (size_t) length <= req->body_len && !chunked) ? PROXY_STALE : BAD_GATEWAY;
+    }
+
+    /*the response head (1xx responses are skipped)*/
+    reader *r = (reader *) malloc(sizeof(reader));
+    if (r == NULL)
+        return BAD_GATEWAY;
+    char *rhead = r->buf, *end;
+    size_t hlen = 0;
+    int status;
+    while (1) {
+        while ((end = memmem(rhead, hlen, "\r\n\r\n", 4)) == NULL) {
+            if (hlen == READ_CHUNK) {
+                free(r);
+                return BAD_GATEWAY;
+            }
+            ssize_t n = recv(fd, rhead + hlen, READ_CHUNK - hlen, 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                int timeout = (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+                free(r);
+                if (hlen == 0 && reused && !timeout)
+                    return PROXY_STALE;
+                return timeout ? GATEWAY_TIMEOUT : BAD_GATEWAY;
+            }
+            hlen += n;
+        }
+        if (hlen < 12 || strncmp(rhead, "HTTP/1.", 7) != 0) {
+            free(r);
+            return BAD_GATEWAY;
+        }
+        status = atoi(rhead + 9);
+        if (status >= 200 || status == 101)
+            break;
+        size_t used = end + 4 - rhead; //1xx: drop it, the real response follows
+        memmove(rhead, end + 4, hlen - used);
+        hlen -= used;
+    }
+    if (status < 200) {
+        free(r);
+        return BAD_GATEWAY;
+    }
+    char *status_eol = memmem(rhead, hlen, "\r\n", 2);
+    char *block = status_eol + 2;
+    size_t block_len = (end + 2) - block;
+    char value[256];
+    long content_length = -1;
+    int resp_chunked = 0, close_after = (strncmp(rhead, "HTTP/1.0", 8) == 0);
+    if (get_header(block, block_len, "Content-Length", value, sizeof(value)) == 0)
+        content_length = atol(value);
+    if (get_header(block, block_len, "Transfer-Encoding", value, sizeof(value)) == 0 && strcasestr(value, "chunked"))
+        resp_chunked = 1;
+    if (get_header(block, block_len, "Connection", value, sizeof(value)) == 0) {
+        if (strcasestr(value, "close"))
+            close_after = 1;
+        else if (strcasestr(value, "keep-alive"))
+            close_after = 0;
+    }
+    int no_body = strcmp(req->method, "HEAD") == 0 || status == 204 || status == 304;
+    time_t now = time(NULL), expires = 0;
+    if (key != NULL && (expires = cache_expiry(block, block_len, status, now)) > now &&
+        (resp_chunked || content_length <= PROXY_CACHE_MAX_OBJECT)) {
+        if (!out->collect) {
+            out->collect = 1;
+            out->limit = PROXY_CACHE_MAX_OBJECT + READ_CHUNK;
+        }
+    } else
+        expires = 0;
+
+    /*the head for the client: HTTP/1.0, without the hop by hop headers. the status line is at most the one of
+     *the backend (the status is an int), a header line may grow ("a:b\n" -> "a: b\r\n")*/
+    char *client_head = (char *) malloc((status_eol - rhead) + headers_size(block, block_len) + 64);
+    if (client_head == NULL) {
+        free(r);
+        return BAD_GATEWAY;
+    }
+    size_t reason_len = status_eol - rhead > 12 ? status_eol - rhead - 13 : 0;
+    int chlen = sprintf(client_head, "HTTP/1.0 %d %.*s\r\n", status, (int) reason_len, rhead + 13);
+    char *p = block, *name, *val;
+    size_t name_len, val_len;
+    while (next_header(&p, block + block_len, &name, &name_len, &val, &val_len) == 0) {
+        if (is_hop_by_hop(block, block_len, name, name_len))
+            continue;
+        memcpy(client_head + chlen, name, name_len);
+        chlen += (int) name_len;
+        chlen += sprintf(client_head + chlen, ": %.*s\r\n", (int) val_len, val);
+    }
+    chlen += sprintf(client_head + chlen, "Connection: close\r\n\r\n");
+    size_t body_start = end + 4 - rhead;
+    r->fd = fd;
+    r->pos = body_start;
+    r->len = hlen;
+    rc = out_write(out, client_head, chlen);
+    free(client_head);
+    if (rc < 0) {
+        free(r);
+        return (out->sockfd < 0) ? BAD_GATEWAY : PROXY_DONE;
+    }
+
+    /*the body*/
+    if (no_body)
+        rc = RELAY_OK;
+    else if (resp_chunked)
+        rc = relay_chunked(r, out, 0);
+    else if (content_length >= 0)
+        rc = relay_exact(r, out, content_length);
+    else { //the body ends when the backend closes
+        rc = relay_until_eof(r, out);
+        close_after = 1;
+    }
+    int leftover = (r->pos < r->len);
+    free(r);
+    *keep = (rc == RELAY_OK && !close_after && !leftover);
+    if (rc == RELAY_OK && expires > now && !out->overflow && out->data != NULL)
+        cache_put(cache, key, out->data, out->len, expires);
+    if (rc != RELAY_OK && out->sockfd < 0) //nothing reached a client yet
+        return BAD_GATEWAY;
+    return PROXY_DONE;
+}
+
+/**builds the HTTP/1.1 request head for the backend. returns it malloc'ed, NULL on failure*/
+char *build_request_head(proxy_req *req, proxy_backend *b, size_t *head_len) {
+    /*the headers as they're written, and the lines added below (Host, X-Forwarded-For, framing, Connection)*/
+    char *head = (char *) malloc(strlen(req->method) + strlen(req->target) +
+                                 headers_size(req->headers, req->headers_len) + strlen(b->name) + 256);
+    if (head == NULL)
+        return NULL;
+    long length;
+    int chunked;
+    int framed = (request_body_length(req, &length, &chunked) == 0);
+    size_t len = sprintf(head, "%s %s HTTP/1.1\r\n", req->method, req->target);
+    char *p = req->headers, *name, *value;
+    size_t name_len, value_len;
+    while (next_header(&p, req->headers + req->headers_len, &name, &name_len, &value, &value_len) == 0) {
+        if (is_hop_by_hop(req->headers, req->headers_len, name, name_len) || (name_len == 6 && strncasecmp(name, "Expect", 6) == 0))
+            continue;
+        /*proxy_fetch: added below, from the body we really have. chunked: the framing is Transfer-Encoding only,
+         *a backend that trusts Content-Length as well would lose the framing of the pooled connection*/
+        if ((req->client_fd < 0 || (framed && chunked)) && name_len == 14 &&
+            strncasecmp(name, "Content-Length", 14) == 0)
+            continue;
+        memcpy(head + len, name, name_len);
+        len += name_len;
+        len += sprintf(head + len, ": %.*s\r\n", (int) value_len, value);
+    }
+    if (get_header(req->headers, req->headers_len, "Host", NULL, 0) < 0) //HTTP/1.0 clients may not send it
+        len += sprintf(head + len, "Host: %s\r\n", strncmp(b->name, "unix:", 5) == 0 ? "localhost" : b->name);
+    if (req->client_ip[0] != '\0')
+        len += sprintf(head + len, "X-Forwarded-For: %s\r\n", req->client_ip);
+    if (framed && chunked) //dropped above with the hop by hop headers
+        len += sprintf(head + len, "Transfer-Encoding: chunked\r\n");
+    if (req->client_fd < 0 && length > 0)
+        len += sprintf(head + len, "Content-Length: %ld\r\n", length);
+    len += sprintf(head + len, "Connection: keep-alive\r\n\r\n");
+    *head_len = len;
+    return head;
+}
+
+/**sets the framing of the request body. returns 0, or -1 if it's invalid*/
+int request_body_length(proxy_req *req, long *length, int *chunked) {
+    char value[64];
+    *length = 0;
+    *chunked = 0;
+    if (req->client_fd < 0) { //proxy_fetch: the body (if any) is in memory
+        *length = (long) req->body_len;
+        return 0;
+    }
+    if (get_header(req->headers, req->headers_len, "Transfer-Encoding", value, sizeof(value)) == 0) {
+        if (!strcasestr(value, "chunked"))
+            return -1;
+        *chunked = 1;
+        return 0;
+    }
+    if (get_header(req->headers, req->headers_len, "Content-Length", value, sizeof(value)) == 0) {
+        char *end;
+        *length = strtol(value, &end, 10);
+        if (end == value || *length < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/**the healthy backend with the least outstanding requests (not avoid), its outstanding is increased.
+ * returns NULL if there is none*/
+proxy_backend *pick_backend(proxy *p, proxy_route *route, proxy_backend *avoid) {
+    proxy_backend *best = NULL;
+    pthread_mutex_lock(&p->lock);
+    for (int i = 0; i < route->num_backends; i++) {
+        proxy_backend *b = &route->backends[(route->rr + i) % route->num_backends];
+        if (!b->healthy || b == avoid)
+            continue;
+        if (best == NULL || b->outstanding < best->outstanding)
+            best = b;
+    }
+    route->rr = (route->rr + 1) % route->num_backends;
+    if (best != NULL)
+        best->outstanding++;
+    pthread_mutex_unlock(&p->lock);
+    return best;
+}
+
+/**the request on b is over*/
+void done_backend(proxy *p, proxy_backend *b) {
+    pthread_mutex_lock(&p->lock);
+    b->outstanding--;
+    pthread_mutex_unlock(&p->lock);
+}
+
+/**a connect to b failed: no more requests to it until the health check sees it up*/
+void mark_down(proxy *p, proxy_backend *b) {
+    pthread_mutex_lock(&p->lock);
+    if (b->healthy) {
+        fprintf(stderr, "proxy: backend %s is down\n", b->name);
+        b->healthy = FLAG_OFF;
+        close_idle(b, 0);
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+/**returns a connection to b: an idle one if there is (*reused = 1), o.w a new one. -1 on failure*/
+int get_connection(proxy *p, proxy_backend *b, int *reused) {
+    time_t now = time(NULL);
+    pthread_mutex_lock(&p->lock);
+    while (b->num_idle > 0) {
+        b->num_idle--;
+        int fd = b->idle[b->num_idle];
+        time_t since = b->idle_since[b->num_idle];
+        pthread_mutex_unlock(&p->lock);
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        /*readable while idle means the backend closed it (or sent garbage)*/
+        if (now - since <= PROXY_IDLE_TIMEOUT && poll(&pfd, 1, 0) == 0) {
+            *reused = 1;
+            return fd;
+        }
+        close(fd);
+        pthread_mutex_lock(&p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+    *reused = 0;
+    return connect_backend(b);
+}
+
+/**keeps fd as an idle connection of b (or closes it if there are enough)*/
+void put_connection(proxy *p, proxy_backend *b, int fd) {
+    pthread_mutex_lock(&p->lock);
+    if (b->num_idle < PROXY_MAX_IDLE && b->healthy) {
+        b->idle[b->num_idle] = fd;
+        b->idle_since[b->num_idle] = time(NULL);
+        b->num_idle++;
+        fd = -1;
+    }
+    pthread_mutex_unlock(&p->lock);
+    if (fd >= 0)
+        close(fd);
+}
+
+/**connects to b within PROXY_CONNECT_TIMEOUT. returns a blocking socket with PROXY_IO_TIMEOUT, -1 on failure*/
+int connect_backend(proxy_backend *b) {
+    int fd = socket(b->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *) &b->addr, b->addrlen) < 0) {
+        struct pollfd pfd;
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        if ((errno != EINPROGRESS && errno != EAGAIN) || poll(&pfd, 1, PROXY_CONNECT_TIMEOUT) <= 0 ||
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0 || err != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+    struct timeval tv;
+    tv.tv_sec = PROXY_IO_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (b->addr.ss_family != AF_UNIX) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+/**closes the idle connections of b (only the expired or closed ones if only_stale). called with the lock held*/
+void close_idle(proxy_backend *b, int only_stale) {
+    time_t now = time(NULL);
+    int kept = 0;
+    for (int i = 0; i < b->num_idle; i++) {
+        struct pollfd pfd;
+        pfd.fd = b->idle[i];
+        pfd.events = POLLIN;
+        if (only_stale && now - b->idle_since[i] <= PROXY_IDLE_TIMEOUT && poll(&pfd, 1, 0) == 0) {
+            b->idle[kept] = b->idle[i];
+            b->idle_since[kept] = b->idle_since[i];
+            kept++;
+        } else
+            close(b->idle[i]);
+    }
+    b->num_idle = kept;
+}
+
+/**the health check thread: connects to every backend every PROXY_HEALTH_INTERVAL seconds*/
+void *health_loop(void *arg) {
+    proxy *p = (proxy *) arg;
+    pthread_mutex_lock(&p->lock);
+    while (!p->stop) {
+        pthread_mutex_unlock(&p->lock);
+        for (int i = 0; i < p->num_routes; i++) {
+            for (int j = 0; j < p->routes[i].num_backends; j++) {
+                proxy_backend *b = &p->routes[i].backends[j];
+                int fd = connect_backend(b);
+                if (fd >= 0)
+                    close(fd);
+                pthread_mutex_lock(&p->lock);
+                if ((fd >= 0) != b->healthy)
+                    fprintf(stderr, "proxy: backend %s is %s\n", b->name, fd >= 0 ? "up" : "down");
+                b->healthy = (fd >= 0);
+                close_idle(b, b->healthy);
+                pthread_mutex_unlock(&p->lock);
+            }
+        }
+        pthread_mutex_lock(&p->lock);
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += PROXY_HEALTH_INTERVAL;
+        while (!p->stop && pthread_cond_timedwait(&p->stop_cond, &p->lock, &until) != ETIMEDOUT);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+/**writes to the socket of out and/or collects a copy. returns 0, or -1 if nothing more should be written*/
+int out_write(proxy_out *out, char *buf, size_t len) {
+    if (out->failed)
+        return -1;
+    if (out->sockfd >= 0 && send_all_fd(out->sockfd, buf, len) < 0) {
+        out->failed = 1;
+        return -1;
+    }
+    if (out->collect && !out->overflow) {
+        if (out->len + len > out->limit) {
+            out->overflow = 1;
+            free(out->data);
+            out->data = NULL;
+            out->len = 0;
+        } else {
+            if (out->len + len > out->cap) {
+                size_t cap = (out->cap == 0) ? READ_CHUNK : out->cap;
+                while (cap < out->len + len)
+                    cap *= 2;
+                char *data = (char *) realloc(out->data, cap);
+                if (data == NULL) {
+                    out->overflow = 1;
+                    free(out->data);
+                    out->data = NULL;
+                    out->len = 0;
+                    return (out->sockfd < 0) ? -1 : 0;
+                }
+                out->data = data;
+                out->cap = cap;
+            }
+            memcpy(out->data + out->len, buf, len);
+            out->len += len;
+        }
+    }
+    return (out->sockfd < 0 && out->overflow) ? -1 : 0;
+}
+
+/**starts a reader of fd with len bytes that were already read*/
+void reader_init(reader *r, int fd, char *initial, size_t len) {
+    r->fd = fd;
+    r->pos = 0;
+    r->len = (len < READ_CHUNK) ? len : READ_CHUNK;
+    if (r->len > 0)
+        memcpy(r->buf, initial, r->len);
+}
+
+/**makes sure there are bytes to read. returns how many, 0 on EOF, -1 on error*/
+ssize_t reader_fill(reader *r) {
+    if (r->pos < r->len)
+        return (ssize_t) (r->len - r->pos);
+    if (r->fd < 0)
+        return 0;
+    ssize_t n;
+    do
+        n = recv(r->fd, r->buf, READ_CHUNK, 0);
+    while (n < 0 && errno == EINTR);
+    if (n <= 0)
+        return (n == 0) ? 0 : -1;
+    r->pos = 0;
+    r->len = n;
+    return n;
+}
+
+/**reads one line (without its CRLF) into line. if raw isn't NULL the line is also written to it (with CRLF).
+ * returns the line length, RELAY_IN_FAILED or RELAY_OUT_FAILED*/
+int reader_line(reader *r, char *line, size_t cap, proxy_out *raw) {
+    size_t n = 0;
+    while (1) {
+        if (reader_fill(r) <= 0)
+            return RELAY_IN_FAILED;
+        char c = r->buf[r->pos++];
+        if (c == '\n')
+            break;
+        if (n == cap - 1)
+            return RELAY_IN_FAILED;
+        line[n++] = c;
+    }
+    if (n > 0 && line[n - 1] == '\r')
+        n--;
+    line[n] = '\0';
+    if (raw != NULL && (out_write(raw, line, n) < 0 || out_write(raw, "\r\n", 2) < 0))
+        return RELAY_OUT_FAILED;
+    return (int) n;
+}
+
+/**relays exactly n bytes. returns RELAY_OK, RELAY_IN_FAILED or RELAY_OUT_FAILED*/
+int relay_exact(reader *r, proxy_out *out, long n) {
+    while (n > 0) {
+        ssize_t avail = reader_fill(r);
+        if (avail <= 0)
+            return RELAY_IN_FAILED;
+        size_t take = (avail < n) ? (size_t) avail : (size_t) n;
+        if (out_write(out, r->buf + r->pos, take) < 0)
+            return RELAY_OUT_FAILED;
+        r->pos += take;
+        n -= (long) take;
+    }
+    return RELAY_OK;
+}
+
+/**relays a chunked body: as is (raw) or only the data of the chunks. returns like relay_exact*/
+int relay_chunked(reader *r, proxy_out *out, int raw) {
+    char line[256];
+    proxy_out *line_out = raw ? out : NULL;
+    while (1) {
+        int rc = reader_line(r, line, sizeof(line), line_out);
+        if (rc < 0)
+            return rc;
+        char *end;
+        long size = strtol(line, &end, 16);
+        if (end == line || size < 0)
+            return RELAY_IN_FAILED;
+        if (size == 0) { //the trailers, until the empty line
+            while ((rc = reader_line(r, line, sizeof(line), line_out)) > 0);
+            return (rc == 0) ? RELAY_OK : rc;
+        }
+        if ((rc = relay_exact(r, out, size)) != RELAY_OK)
+            return rc;
+        if ((rc = reader_line(r, line, sizeof(line), line_out)) != 0) //the CRLF after the data
+            return (rc > 0) ? RELAY_IN_FAILED : rc;
+    }
+}
+
+/**relays until the other side closes. returns like relay_exact*/
+int relay_until_eof(reader *r, proxy_out *out) {
+    while (1) {
+        ssize_t avail = reader_fill(r);
+        if (avail == 0)
+            return RELAY_OK;
+        if (avail < 0)
+            return RELAY_IN_FAILED;
+        if (out_write(out, r->buf + r->pos, avail) < 0)
+            return RELAY_OUT_FAILED;
+        r->pos += avail;
+    }
+}
+
+/**the next "Name: value" line of a header block (value without the spaces around it).
+ * returns 0, or -1 at the end of the block*/
+int next_header(char **p, char *end, char **name, size_t *name_len, char **value, size_t *value_len) {
+    while (*p < end) {
+        char *line = *p, *eol = memchr(line, '\n', end - line);
+        if (eol == NULL)
+            eol = end;
+        *p = (eol < end) ? eol + 1 : end;
+        char *line_end = (eol > line && eol[-1] == '\r') ? eol - 1 : eol;
+        char *colon = memchr(line, ':', line_end - line);
+        if (colon == NULL || colon == line) //not a header (the request line leftovers, or the empty line)
+            continue;
+        *name = line;
+        *name_len = colon - line;
+        char *v = colon + 1;
+        while (v < line_end && (*v == ' ' || *v == '\t'))
+            v++;
+        char *v_end = line_end;
+        while (v_end > v && (v_end[-1] == ' ' || v_end[-1] == '\t'))
+            v_end--;
+        *value = v;
+        *value_len = v_end - v;
+        return 0;
+    }
+    return -1;
+}
+
+/**copies the value of header name (case insensitive) to out. out may be NULL to only check it exists.
+ * returns 0 if found, -1 o.w*/
+int get_header(char *block, size_t len, char *name, char *out, size_t cap) {
+    char *p = block, *n, *v;
+    size_t n_len, v_len, name_len = strlen(name);
+    while (next_header(&p, block + len, &n, &n_len, &v, &v_len) == 0) {
+        if (n_len != name_len || strncasecmp(n, name, name_len) != 0)
+            continue;
+        if (out != NULL) {
+            if (v_len >= cap)
+                v_len = cap - 1;
+            memcpy(out, v, v_len);
+            out[v_len] = '\0';
+        }
+        return 0;
+    }
+    return -1;
+}
+
+/**returns the bytes the headers of block take written as "Name: value\r\n" lines*/
+size_t headers_size(char *block, size_t len) {
+    char *p = block, *n, *v;
+    size_t n_len, v_len, size = 0;
+    while (block != NULL && next_header(&p, block + len, &n, &n_len, &v, &v_len) == 0)
+        size += n_len + v_len + 4;
+    return size;
+}
+
+/**
+ * is_hop_by_hop returns 1 if the header name (len bytes) belongs to one connection and must not be forwarded.
+ */
+int is_hop_by_hop(char *head, size_t head_len, char *name, size_t len) {
+    char *hop[] = {"Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer", "Transfer-Encoding", "Upgrade",
+                   "HTTP2-Settings"};
+    for (size_t i = 0; i < sizeof(hop) / sizeof(hop[0]); i++)
+        if (strlen(hop[i]) == len && strncasecmp(name, hop[i], len) == 0)
+            return 1;
+    /*the headers named by Connection ("Connection: keep-alive, X-Hop") are hop by hop too*/
+    char *p = head, *n, *v;
+    size_t n_len, v_len;
+    while (head != NULL && next_header(&p, head + head_len, &n, &n_len, &v, &v_len) == 0) {
+        if (n_len != 10 || strncasecmp(n, "Connection", 10) != 0)
+            continue;
+        for (char *t = v, *end = v + v_len; t < end;) {
+            char *t_end = memchr(t, ',', end - t);
+            if (t_end == NULL)
+                t_end = end;
+            char *s = t, *e = t_end;
+            while (s < e && (*s == ' ' || *s == '\t'))
+                s++;
+            while (e > s && (e[-1] == ' ' || e[-1] == '\t'))
+                e--;
+            if ((size_t) (e - s) == len && strncasecmp(s, name, len) == 0)
+                return 1;
+            t = t_end + 1;
+        }
+    }
+    return 0;
+}
+
+/**returns when a response may be served from the cache until, 0 if it may not be cached*/
+time_t cache_expiry(char *block, size_t len, int status, time_t now) {
+    char value[256];
+    if (status != 200 && status != 203 && status != 301 && status != 404 && status != 410)
+        return 0;
+    if (get_header(block, len, "Set-Cookie", NULL, 0) == 0 || get_header(block, len, "Vary", NULL, 0) == 0)
+        return 0;
+    if (get_header(block, len, "Cache-Control", value, sizeof(value)) == 0) {
+        if (strcasestr(value, "no-store") || strcasestr(value, "no-cache") || strcasestr(value, "private"))
+            return 0;
+        char *age = strcasestr(value, "s-maxage=");
+        if (age != NULL)
+            return now + atol(age + 9);
+        if ((age = strcasestr(value, "max-age=")) != NULL)
+            return now + atol(age + 8);
+    }
+    if (get_header(block, len, "Expires", value, sizeof(value)) == 0) {
+        struct tm tm;
+        bzero(&tm, sizeof(tm));
+        if (strptime(value, RFC1123FMT_GMT, &tm) == NULL)
+            return 0;
+        time_t expires = timegm(&tm);
+        /*relative to the clock of the backend, when it sent its Date*/
+        if (get_header(block, len, "Date", value, sizeof(value)) == 0) {
+            bzero(&tm, sizeof(tm));
+            if (strptime(value, RFC1123FMT_GMT, &tm) != NULL)
+                return now + (expires - timegm(&tm));
+        }
+        return expires;
+    }
+    return 0;
+}
+
+/**creates an empty cache of max_size bytes. returns NULL on failure*/
+proxy_cache *create_cache(size_t max_size) {
+    proxy_cache *c = (proxy_cache *) malloc(sizeof(proxy_cache));
+    if (c == NULL)
+        return NULL;
+    for (int i = 0; i < PROXY_CACHE_BUCKETS; i++)
+        c->buckets[i] = NULL;
+    c->oldest = NULL;
+    c->newest = NULL;
+    c->size = 0;
+    c->max_size = max_size;
+    pthread_mutex_init(&c->lock, NULL);
+    return c;
+}
+
+/**returns the fresh entry of key (release it with cache_release), NULL if there is none*/
+proxy_cache_entry *cache_get(proxy_cache *c, char *key) {
+    uint64_t hash = pack_hash(key, strlen(key));
+    time_t now = time(NULL);
+    pthread_mutex_lock(&c->lock);
+    proxy_cache_entry *e = c->buckets[hash % PROXY_CACHE_BUCKETS];
+    while (e != NULL && (e->hash != hash || strcmp(e->key, key) != 0))
+        e = e->next;
+    if (e != NULL && e->expires <= now) { //stale
+        cache_unlink(c, e);
+        e = NULL;
+    }
+    if (e != NULL)
+        e->refs++;
+    pthread_mutex_unlock(&c->lock);
+    return e;
+}
+
+/**adds a copy of data as the entry of key, evicting the oldest entries to make room*/
+void cache_put(proxy_cache *c, char *key, char *data, size_t len, time_t expires) {
+    if (c == NULL || len > c->max_size)
+        return;
+    proxy_cache_entry *e = (proxy_cache_entry *) malloc(sizeof(proxy_cache_entry));
+    if (e == NULL)
+        return;
+    e->key = strdup(key);
+    e->data = (char *) malloc(len);
+    if (e->key == NULL || e->data == NULL) {
+        free(e->key);
+        free(e->data);
+        free(e);
+        return;
+    }
+    memcpy(e->data, data, len);
+    e->len = len;
+    e->hash = pack_hash(key, strlen(key));
+    e->expires = expires;
+    e->refs = 1; //the cache's own
+    pthread_mutex_lock(&c->lock);
+    proxy_cache_entry **bucket = &c->buckets[e->hash % PROXY_CACHE_BUCKETS];
+    for (proxy_cache_entry *old = *bucket; old != NULL; old = old->next)
+        if (old->hash == e->hash && strcmp(old->key, key) == 0) { //replaced by the newer response
+            cache_unlink(c, old);
+            break;
+        }
+    while (c->oldest != NULL && c->size + len > c->max_size)
+        cache_unlink(c, c->oldest);
+    e->next = *bucket;
+    *bucket = e;
+    e->older = c->newest;
+    e->newer = NULL;
+    if (c->newest != NULL)
+        c->newest->newer = e;
+    else
+        c->oldest = e;
+    c->newest = e;
+    c->size += len;
+    pthread_mutex_unlock(&c->lock);
+}
+
+/**a reader is done with e*/
+void cache_release(proxy_cache *c, proxy_cache_entry *e) {
+    pthread_mutex_lock(&c->lock);
+    int last = (--e->refs == 0);
+    pthread_mutex_unlock(&c->lock);
+    if (last) {
+        free(e->key);
+        free(e->data);
+        free(e);
+    }
+}
+
+/**removes e from the cache and drops the cache's reference. called with the lock held*/
+void cache_unlink(proxy_cache *c, proxy_cache_entry *e) {
+    proxy_cache_entry **pp = &c->buckets[e->hash % PROXY_CACHE_BUCKETS];
+    while (*pp != e)
+        pp = &(*pp)->next;
+    *pp = e->next;
+    if (e->older != NULL)
+        e->older->newer = e->newer;
+    else
+        c->oldest = e->newer;
+    if (e->newer != NULL)
+        e->newer->older = e->older;
+    else
+        c->newest = e->older;
+    c->size -= e->len;
+    if (--e->refs == 0) {
+        free(e->key);
+        free(e->data);
+        free(e);
+    }
+}
+
+/**frees the cache and all its entries (no reader may hold one)*/
+void destroy_cache(proxy_cache *c) {
+    if (c == NULL)
+        return;
+    while (c->oldest != NULL)
+        cache_unlink(c, c->oldest);
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
+
+/**sends all len bytes. returns 0 on succsess, -1 o.w*/
+int send_all_fd(int fd, char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
@@ -0,0 +1,156 @@
+#ifndef EX3_PROXY_H
+#define EX3_PROXY_H
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/socket.h>
+
+/**
+ * proxy.h
+ *
+ * This file declares the reverse proxy: requests whose path starts with a configured prefix
+ * are forwarded to HTTP/1.1 backends (host:port or unix:/path) instead of being served from files.
+ * Every backend keeps a pool of idle keep-alive connections. A health check thread marks backends
+ * up/down, and every request goes to the healthy backend with the least outstanding requests.
+ * Request and response bodies are streamed, never buffered whole (except for HTTP/2 clients, see
+ * proxy_fetch). Optionally, responses with explicit freshness (Cache-Control max-age / Expires)
+ * are kept in a small in-memory cache.
+ */
+
+#define PROXY_MAX_ROUTES 8
+#define PROXY_MAX_BACKENDS 8        //per route
+#define PROXY_MAX_IDLE 16           //idle keep-alive connections kept per backend
+#define PROXY_IDLE_TIMEOUT 30       //idle connections older than this (seconds) are closed
+#define PROXY_HEALTH_INTERVAL 2     //seconds between health checks
+#define PROXY_CONNECT_TIMEOUT 1000  //ms
+#define PROXY_IO_TIMEOUT 30         //seconds without progress on an upstream connection
+#define PROXY_HEAD_MAX 16384        //longest response head accepted from a backend
+#define PROXY_MAX_BUFFERED (8 * 1024 * 1024)    //longest response proxy_fetch collects
+#define PROXY_CACHE_BUCKETS 256
+#define PROXY_CACHE_MAX_OBJECT (1024 * 1024)    //bigger responses are never cached
+
+/**return values of proxy_serve / proxy_fetch (o.w they return the HTTP error status to send)*/
+#define PROXY_NOT_MINE 0    //the path is not under a proxy prefix
+#define PROXY_DONE 1        //the response was sent (or the client is gone)
+
+
+/**
+ * one upstream server
+ */
+typedef struct proxy_backend_st {
+    char name[128];                 //as given at the command line, for messages
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int healthy;                    //set by the health check thread and by failed connects
+    int outstanding;                //requests in progress on this backend
+    int idle[PROXY_MAX_IDLE];       //idle keep-alive connections (a stack, the newest on top)
+    time_t idle_since[PROXY_MAX_IDLE];
+    int num_idle;
+} proxy_backend;
+
+
+/**
+ * a prefix and its backends
+ */
+typedef struct proxy_route_st {
+    char prefix[256];
+    int prefix_len;
+    proxy_backend backends[PROXY_MAX_BACKENDS];
+    int num_backends;
+    int rr;                         //round robin start, so ties don't always go to the first backend
+} proxy_route;
+
+
+/**
+ * a cached response (as sent to HTTP/1.0 clients: status line, headers, body)
+ */
+typedef struct proxy_cache_entry_st {
+    char *key;
+    uint64_t hash;
+    char *data;
+    size_t len;
+    time_t expires;
+    int refs;                       //the cache itself + readers sending it right now
+    struct proxy_cache_entry_st *next;              //next entry in the same bucket
+    struct proxy_cache_entry_st *older, *newer;     //insertion order, the oldest is evicted first
+} proxy_cache_entry;
+
+
+/**
+ * The cache
+ */
+typedef struct proxy_cache_st {
+    proxy_cache_entry *buckets[PROXY_CACHE_BUCKETS];
+    proxy_cache_entry *oldest, *newest;
+    size_t size;                    //bytes of all the entries
+    size_t max_size;
+    pthread_mutex_t lock;
+} proxy_cache;
+
+
+/**
+ * The proxy configuration and state
+ */
+typedef struct _proxy_st {
+    proxy_route routes[PROXY_MAX_ROUTES];
+    int num_routes;
+    proxy_cache *cache;             //NULL when caching is off
+    pthread_mutex_t lock;           //protects the backends state (healthy, outstanding, idle)
+    pthread_t health_thread;
+    int started;                    //1 when the health check thread runs
+    int stop;
+    pthread_cond_t stop_cond;
+} proxy;
+
+
+/**
+ * create_proxy creates an empty configuration. returns NULL on failure.
+ */
+proxy *create_proxy();
+
+/**
+ * proxy_add_route adds "<prefix>=<backend>[,<backend>...]", a backend is host:port or unix:<path>.
+ * returns 0 on succsess, -1 if spec is invalid (a message is printed).
+ */
+int proxy_add_route(proxy *p, char *spec);
+
+/**
+ * proxy_start enables the cache (cache_bytes > 0) and starts the health check thread.
+ * returns 0 on succsess, -1 o.w
+ */
+int proxy_start(proxy *p, size_t cache_bytes);
+
+/**
+ * proxy_serve handles a raw HTTP/1.x request: buf holds the len bytes read so far from sockfd (cap is the size of buf).
+ * returns PROXY_NOT_MINE if the path is not proxied (nothing was done), PROXY_DONE if the response was sent,
+ * or an error status to send to the client. The caller closes sockfd in all cases.
+ */
+int proxy_serve(proxy *p, int sockfd, char *buf, int len, int cap);
+
+/**
+ * proxy_fetch is proxy_serve for requests that can't be streamed (HTTP/2): the request is all in memory
+ * (headers is the header block, "Name: value\r\n" lines, and body_len bytes of body, body may be NULL)
+ * and the whole HTTP/1.0 response is collected into *out (malloc'ed, *out_len bytes). returns like proxy_serve.
+ */
+int proxy_fetch(proxy *p, char *method, char *target, char *headers, char *body, size_t body_len, char **out,
+                size_t *out_len);
+
+/**
+ * proxy_is_proxied returns 1 if target is under a proxy prefix, 0 o.w
+ */
+int proxy_is_proxied(proxy *p, char *target);
+
+/**
+ * is_hop_by_hop returns 1 if the header name (len bytes) belongs to one connection and must not be forwarded:
+ * Connection, Keep-Alive, Transfer-Encoding, Upgrade.. and the headers named by the Connection header of the
+ * header lines at head (head_len bytes, head may be NULL).
+ */
+int is_hop_by_hop(char *head, size_t head_len, char *name, size_t len);
+
+/**
+ * destroy_proxy stops the health check thread, closes all the idle connections and frees everything.
+ */
+void destroy_proxy(proxy *p);
+
+
+#endif
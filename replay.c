@@ -0,0 +1,556 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include "capture.h"
+
+#define USAGE_ERROR "Usage: replay <capture> <host> <port> [--speed <x>|max] [--connections <n>] [--timeout <sec>]\n" \
+                    "       replay --dump <capture>\n"
+#define MAX_EVENTS 256
+#define HEAD_MAX 1024               //bytes of a response kept to find its status and the end of its headers
+#define MAX_IN_FLIGHT 1000          //open loop: requests due while this many are in flight wait (their latency grows)
+#define DEFAULT_CONNECTIONS 64      //requests in flight at --speed max
+#define DEFAULT_TIMEOUT 10          //seconds for a whole request
+#define CHECK_INTERVAL_US 100000    //timeouts are checked this often
+#define MAX_DIFF_KINDS 32
+#define FAILED -1
+
+/**the result of a request that did not get a response*/
+#define REPLAY_PENDING 0
+#define REPLAY_CONNECT_FAILED -1
+#define REPLAY_TIMEOUT -2
+#define REPLAY_BAD_RESPONSE -3      //reset, or closed before a status line
+
+
+/**
+ * @author: Daniel Gabay
+ * replay.c
+ * --------------------------------------------------------------------------------
+ * This program plays a capture of the server (--capture, see capture.h) back against a server, and compares.
+ * The requests are sent in their arrival order, each on its own connection (the server answers HTTP/1.0).
+ * Timing:
+ *      1)--speed <x> (default 1): open loop. every request is sent when it's due, its capture time divided by x,
+ *        whether the earlier ones were answered or not, like the real clients did. its latency is measured from
+ *        the time it was due, so a server (or a replay) that falls behind shows it in the latency.
+ *      2)--speed max: closed loop. --connections <n> requests in flight, the next one is sent as soon as one ends.
+ *        latency is measured from the time it was sent.
+ * Report: latency percentiles, errors (connect, timeout, reset), and the diffs against the capture: requests
+ * that got another status, and requests with the same status and another response size.
+ * Note: 1)Only the request line is captured: a request that had conditional headers (304 in the capture) or
+ *         was proxied (no status in the capture) is sent, but not compared.
+ *       2)HTTP/2 streams are sent as HTTP/1.1 requests, their body size is compared.
+ *       3)exit status is 0 when there were no errors and no status diffs, 1 o.w
+ * Command line usage: replay <capture> <host> <port> [--speed <x>|max] [--connections <n>] [--timeout <sec>]
+ *                     replay --dump <capture>   (prints the records in arrival order)
+ */
+
+/**
+ * one request of the capture, and what happened when it was replayed
+ */
+typedef struct replay_req_st {
+    capture_record rec;
+    char *line;                 //inside the capture buffer, rec.line_len bytes
+    uint64_t due_us;            //when to send it, from the start of the replay
+    uint64_t start_us;
+    uint64_t done_us;
+    int status;                 //HTTP status, or REPLAY_*
+    uint64_t bytes;             //headers and body received
+    uint64_t body_bytes;
+} replay_req;
+
+
+/**
+ * a request in flight
+ */
+typedef struct replay_conn_st {
+    int fd;
+    replay_req *r;
+    char out[CAPTURE_MAX_LINE + 256];
+    size_t out_len, out_sent;
+    char head[HEAD_MAX];
+    size_t head_len;
+    int connected;
+    int head_done;
+    struct replay_conn_st *prev, *next;     //the list of connections in flight
+} replay_conn;
+
+
+/**
+ * one kind of status diff
+ */
+typedef struct diff_kind_st {
+    int captured, replayed;
+    long count;
+    replay_req *example;
+} diff_kind;
+
+/**forward declaration*/
+replay_req *load_capture(char *path, size_t *num, char **buf, capture_header *hdr);
+
+int cmp_offset(const void *a, const void *b);
+
+int cmp_u64(const void *a, const void *b);
+
+uint64_t now_us();
+
+int start_request(replay_req *r);
+
+void on_event(replay_conn *c, uint32_t events);
+
+void finish_request(replay_conn *c, int status);
+
+void check_timeouts();
+
+void report(replay_req *reqs, size_t n, uint64_t elapsed);
+
+void print_percentiles(char *title, uint64_t *values, size_t n);
+
+int dump_capture(char *path);
+
+struct addrinfo *server_addr = NULL;
+char host_header[300];
+int epfd = -1;
+replay_conn *in_flight = NULL;
+long num_in_flight = 0, num_done = 0;
+uint64_t replay_start = 0, timeout_us = 0;
+int max_speed = 0;
+
+int main(int argc, char *argv[]) {
+    if (argc == 3 && strcmp(argv[1], "--dump") == 0)
+        return dump_capture(argv[2]);
+    if (argc < 4) {
+        printf(USAGE_ERROR);
+        exit(EXIT_FAILURE);
+    }
+    double speed = 1;
+    long connections = DEFAULT_CONNECTIONS, timeout = DEFAULT_TIMEOUT;
+    for (int i = 4; i < argc; i++) {
+        if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc && strcmp(argv[i + 1], "max") == 0) {
+            max_speed = 1;
+            i++;
+        } else if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc && atof(argv[i + 1]) > 0)
+            speed = atof(argv[++i]);
+        else if (strcmp(argv[i], "--connections") == 0 && i + 1 < argc && atol(argv[i + 1]) > 0)
+            connections = atol(argv[++i]);
+        else if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc && atol(argv[i + 1]) > 0)
+            timeout = atol(argv[++i]);
+        else {
+            printf(USAGE_ERROR);
+            exit(EXIT_FAILURE);
+        }
+    }
+    timeout_us = (uint64_t) timeout * 1000000;
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int rc = getaddrinfo(argv[2], argv[3], &hints, &server_addr);
+    if (rc != 0) {
+        printf("replay: %s: %s\n", argv[2], gai_strerror(rc));
+        exit(EXIT_FAILURE);
+    }
+    snprintf(host_header, sizeof(host_header), "%s:%s", argv[2], argv[3]);
+
+    capture_header hdr;
+    char *buf;
+    size_t n;
+    replay_req *reqs = load_capture(argv[1], &n, &buf, &hdr);
+    if (reqs == NULL) {
+        freeaddrinfo(server_addr);
+        exit(EXIT_FAILURE);
+    }
+    struct rlimit rl; //one descriptor per request in flight
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        perror("epoll_create1");
+        free(reqs);
+        free(buf);
+        freeaddrinfo(server_addr);
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t first = n > 0 ? reqs[0].rec.offset_us : 0;
+    for (size_t i = 0; i < n; i++)
+        reqs[i].due_us = max_speed ? 0 : (uint64_t) ((reqs[i].rec.offset_us - first) / speed);
+    long limit = max_speed ? connections : MAX_IN_FLIGHT;
+    struct epoll_event events[MAX_EVENTS];
+    size_t next = 0;
+    uint64_t last_check = 0;
+    replay_start = now_us();
+    while ((size_t) num_done < n) {
+        uint64_t now = now_us() - replay_start;
+        while (next < n && num_in_flight < limit && reqs[next].due_us <= now)
+            if (start_request(&reqs[next++]) == FAILED)
+                num_done++;
+        int wait_ms = CHECK_INTERVAL_US / 1000;
+        if (next < n && num_in_flight < limit && reqs[next].due_us > now &&
+            (reqs[next].due_us - now + 999) / 1000 < (uint64_t) wait_ms)
+            wait_ms = (int) ((reqs[next].due_us - now + 999) / 1000);
+        int nev = epoll_wait(epfd, events, MAX_EVENTS, wait_ms);
+        if (nev < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < nev; i++)
+            on_event((replay_conn *) events[i].data.ptr, events[i].events);
+        now = now_us() - replay_start;
+        if (now - last_check >= CHECK_INTERVAL_US) {
+            check_timeouts();
+            last_check = now;
+        }
+    }
+    uint64_t elapsed = now_us() - replay_start;
+
+    time_t captured_at = (time_t) (hdr.start_unix_us / 1000000);
+    char timebuf[64];
+    strftime(timebuf, sizeof(timebuf), "%Y-%m-%d %H:%M:%S", localtime(&captured_at));
+    printf("capture: %s, %zu requests over %.1fs, recorded at %s\n", argv[1], n,
+           n > 0 ? (reqs[n - 1].rec.offset_us - first) / 1e6 : 0.0, timebuf);
+    if (max_speed)
+        printf("replay:  speed max (closed loop, %ld connections)\n", connections);
+    else
+        printf("replay:  speed %gx (open loop)\n", speed);
+    report(reqs, n, elapsed);
+
+    int ret = EXIT_SUCCESS;
+    for (size_t i = 0; i < n; i++) {
+        int comparable = reqs[i].rec.status != 0 && reqs[i].rec.status != 304;
+        if (reqs[i].status < 0 || (comparable && reqs[i].status != reqs[i].rec.status))
+            ret = EXIT_FAILURE;
+    }
+    close(epfd);
+    free(reqs);
+    free(buf);
+    freeaddrinfo(server_addr);
+    return ret;
+}
+
+/**reads the capture at path into *buf and returns its requests sorted by arrival (malloc'ed, *num of them).
+ *returns NULL on failure (a message is printed)*/
+replay_req *load_capture(char *path, size_t *num, char **buf, capture_header *hdr) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        perror("open capture");
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    *buf = (char *) malloc(size > 0 ? size : 1);
+    if (*buf == NULL || size < (long) sizeof(capture_header) || fread(*buf, 1, size, f) != (size_t) size) {
+        printf("replay: %s is not a capture\n", path);
+        free(*buf);
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+    memcpy(hdr, *buf, sizeof(capture_header));
+    if (memcmp(hdr->magic, CAPTURE_MAGIC, sizeof(hdr->magic)) != 0 || hdr->version != CAPTURE_VERSION) {
+        printf("replay: %s is not a capture (or of another version)\n", path);
+        free(*buf);
+        return NULL;
+    }
+    size_t n = 0, cap = 1024;
+    replay_req *reqs = (replay_req *) malloc(sizeof(replay_req) * cap);
+    long pos = sizeof(capture_header);
+    while (reqs != NULL && pos + (long) sizeof(capture_record) <= size) {
+        capture_record rec;
+        memcpy(&rec, *buf + pos, sizeof(rec));
+        if (pos + (long) sizeof(rec) + rec.line_len > size) //cut in the middle (the server was killed)
+            break;
+        if (n == cap) {
+            replay_req *bigger = (replay_req *) realloc(reqs, sizeof(replay_req) * cap * 2);
+            if (bigger == NULL) {
+                free(reqs);
+                reqs = NULL;
+                break;
+            }
+            reqs = bigger;
+            cap *= 2;
+        }
+        memset(&reqs[n], 0, sizeof(replay_req));
+        reqs[n].rec = rec;
+        reqs[n].line = *buf + pos + sizeof(rec);
+        n++;
+        pos += sizeof(rec) + rec.line_len;
+    }
+    if (reqs == NULL) {
+        printf("malloc failed\n");
+        free(*buf);
+        return NULL;
+    }
+    qsort(reqs, n, sizeof(replay_req), cmp_offset); //workers append their records in batches
+    *num = n;
+    return reqs;
+}
+
+/**qsort compare: arrival time*/
+int cmp_offset(const void *a, const void *b) {
+    uint64_t x = ((replay_req *) a)->rec.offset_us, y = ((replay_req *) b)->rec.offset_us;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/**qsort compare: uint64_t*/
+int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(uint64_t *) a, y = *(uint64_t *) b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/**returns CLOCK_MONOTONIC in microseconds*/
+uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**connects (non-blocking) and prepares the request of r. returns 0 on succsess, FAILED if the request ended
+ *already (r->status is set)*/
+int start_request(replay_req *r) {
+    r->start_us = now_us() - replay_start;
+    replay_conn *c = (replay_conn *) calloc(1, sizeof(replay_conn));
+    if (c == NULL) {
+        printf("malloc failed\n");
+        r->status = REPLAY_CONNECT_FAILED;
+        r->done_us = r->start_us;
+        return FAILED;
+    }
+    c->r = r;
+    /**the captured line as it came, HTTP/2 streams as HTTP/1.1*/
+    int len = r->rec.line_len;
+    if (len > 7 && memcmp(r->line + len - 7, " HTTP/2", 7) == 0)
+        c->out_len = snprintf(c->out, sizeof(c->out), "%.*s HTTP/1.1\r\n", len - 7, r->line);
+    else
+        c->out_len = snprintf(c->out, sizeof(c->out), "%.*s\r\n", len, r->line);
+    c->out_len += snprintf(c->out + c->out_len, sizeof(c->out) - c->out_len,
+                           "Host: %s\r\nConnection: close\r\n\r\n", host_header);
+    c->fd = socket(server_addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd < 0 || (connect(c->fd, server_addr->ai_addr, server_addr->ai_addrlen) < 0 && errno != EINPROGRESS)) {
+        if (c->fd >= 0)
+            close(c->fd);
+        free(c);
+        r->status = REPLAY_CONNECT_FAILED;
+        r->done_us = r->start_us;
+        return FAILED;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLOUT;
+    ev.data.ptr = c;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    c->next = in_flight;
+    if (in_flight != NULL)
+        in_flight->prev = c;
+    in_flight = c;
+    num_in_flight++;
+    return 0;
+}
+
+/**moves a request forward: connected, request sent, response read*/
+void on_event(replay_conn *c, uint32_t events) {
+    (void) events; //every step is tried, the socket says what's possible
+    if (!c->connected) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+            finish_request(c, REPLAY_CONNECT_FAILED);
+            return;
+        }
+        c->connected = 1;
+    }
+    if (c->out_sent < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL);
+        if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            finish_request(c, REPLAY_BAD_RESPONSE);
+            return;
+        }
+        if (n > 0)
+            c->out_sent += n;
+        if (c->out_sent == c->out_len) {
+            struct epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.ptr = c;
+            epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        }
+        return;
+    }
+    char buf[65536];
+    while (1) {
+        ssize_t n = read(c->fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            return;
+        if (n <= 0) { //the end of the response (a reset after the whole head is the server closing early)
+            int status = REPLAY_BAD_RESPONSE;
+            if ((n == 0 || c->head_done) && sscanf(c->head, "HTTP/%*s %d", &status) != 1)
+                status = REPLAY_BAD_RESPONSE;
+            finish_request(c, status);
+            return;
+        }
+        c->r->bytes += n;
+        if (c->head_done) {
+            c->r->body_bytes += n;
+            continue;
+        }
+        size_t copy = (size_t) n < sizeof(c->head) - 1 - c->head_len ? (size_t) n : sizeof(c->head) - 1 - c->head_len;
+        memcpy(c->head + c->head_len, buf, copy);
+        c->head_len += copy;
+        c->head[c->head_len] = '\0';
+        char *end = strstr(c->head, "\r\n\r\n");
+        if (end != NULL) {
+            c->head_done = 1;
+            c->r->body_bytes = c->r->bytes - (end + 4 - c->head);
+        } else if (c->head_len == sizeof(c->head) - 1) //headers longer than that: count them as body
+            c->head_done = 1;
+    }
+}
+
+/**ends the request of c with status, and frees c*/
+void finish_request(replay_conn *c, int status) {
+    c->r->status = status;
+    c->r->done_us = now_us() - replay_start;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    if (c->prev != NULL)
+        c->prev->next = c->next;
+    else
+        in_flight = c->next;
+    if (c->next != NULL)
+        c->next->prev = c->prev;
+    num_in_flight--;
+    num_done++;
+    free(c);
+}
+
+/**ends the requests that are in flight for more than the timeout*/
+void check_timeouts() {
+    uint64_t now = now_us() - replay_start;
+    replay_conn *c = in_flight;
+    while (c != NULL) {
+        replay_conn *next = c->next;
+        if (now - c->r->start_us > timeout_us)
+            finish_request(c, REPLAY_TIMEOUT);
+        c = next;
+    }
+}
+
+/**prints the results of the replay*/
+void report(replay_req *reqs, size_t n, uint64_t elapsed) {
+    uint64_t *latency = (uint64_t *) malloc(sizeof(uint64_t) * (n + 1));
+    uint64_t *server = (uint64_t *) malloc(sizeof(uint64_t) * (n + 1));
+    if (latency == NULL || server == NULL) {
+        printf("malloc failed\n");
+        free(latency);
+        free(server);
+        return;
+    }
+    size_t answered = 0;
+    long connect_failed = 0, timed_out = 0, bad = 0, not_compared = 0, size_diffs = 0, status_diffs = 0;
+    uint64_t max_lag = 0;
+    diff_kind kinds[MAX_DIFF_KINDS];
+    int num_kinds = 0;
+    replay_req *size_example = NULL;
+    for (size_t i = 0; i < n; i++) {
+        replay_req *r = &reqs[i];
+        server[i] = r->rec.duration_us;
+        if (r->start_us > r->due_us && r->start_us - r->due_us > max_lag)
+            max_lag = r->start_us - r->due_us;
+        if (r->status == REPLAY_CONNECT_FAILED)
+            connect_failed++;
+        else if (r->status == REPLAY_TIMEOUT)
+            timed_out++;
+        else if (r->status < 0)
+            bad++;
+        else
+            latency[answered++] = r->done_us - (max_speed ? r->start_us : r->due_us);
+        if (r->rec.status == 0 || r->rec.status == 304) {
+            not_compared++;
+            continue;
+        }
+        if (r->status < 0)
+            continue;
+        if (r->status != r->rec.status) {
+            status_diffs++;
+            int k = 0;
+            while (k < num_kinds && (kinds[k].captured != r->rec.status || kinds[k].replayed != r->status))
+                k++;
+            if (k == num_kinds && num_kinds < MAX_DIFF_KINDS) {
+                kinds[k].captured = r->rec.status;
+                kinds[k].replayed = r->status;
+                kinds[k].count = 0;
+                kinds[k].example = r;
+                num_kinds++;
+            }
+            if (k < num_kinds)
+                kinds[k].count++;
+            continue;
+        }
+        uint64_t got = (r->rec.flags & CAPTURE_H2) ? r->body_bytes : r->bytes;
+        if (got != r->rec.bytes) {
+            size_diffs++;
+            if (size_example == NULL)
+                size_example = r;
+        }
+    }
+    printf("         %zu requests in %.2fs (%.0f req/s)", n, elapsed / 1e6, elapsed > 0 ? n * 1e6 / elapsed : 0.0);
+    if (!max_speed) //more than a few ms: the replay (or MAX_IN_FLIGHT) could not keep up, not only the server
+        printf(", sending fell behind by %.1fms at most", max_lag / 1000.0);
+    printf("\n");
+    print_percentiles(max_speed ? "latency (ms, from sending)" : "latency (ms, from the time it was due)", latency,
+                      answered);
+    print_percentiles("server time in the capture (ms)", server, n);
+    printf("errors: %ld connect, %ld timeout, %ld reset/bad response\n", connect_failed, timed_out, bad);
+    printf("not compared: %ld (proxied or conditional in the capture)\n", not_compared);
+    printf("status diffs: %ld\n", status_diffs);
+    for (int k = 0; k < num_kinds; k++)
+        printf("    %d -> %d  x%ld  e.g. %.*s\n", kinds[k].captured, kinds[k].replayed, kinds[k].count,
+               kinds[k].example->rec.line_len, kinds[k].example->line);
+    printf("size diffs (same status): %ld\n", size_diffs);
+    if (size_example != NULL)
+        printf("    e.g. %.*s: %lu bytes in the capture, %lu now\n", size_example->rec.line_len, size_example->line,
+               (unsigned long) size_example->rec.bytes, (unsigned long) ((size_example->rec.flags & CAPTURE_H2) ?
+                                                                          size_example->body_bytes : size_example->bytes));
+    free(latency);
+    free(server);
+}
+
+/**prints p50/p90/p99/p99.9/max of n values (microseconds) in ms. sorts values*/
+void print_percentiles(char *title, uint64_t *values, size_t n) {
+    if (n == 0) {
+        printf("%s: -\n", title);
+        return;
+    }
+    qsort(values, n, sizeof(uint64_t), cmp_u64);
+    printf("%s: p50 %.2f  p90 %.2f  p99 %.2f  p99.9 %.2f  max %.2f\n", title, values[(size_t) (0.5 * (n - 1))] / 1000.0,
+           values[(size_t) (0.9 * (n - 1))] / 1000.0, values[(size_t) (0.99 * (n - 1))] / 1000.0,
+           values[(size_t) (0.999 * (n - 1))] / 1000.0, values[n - 1] / 1000.0);
+}
+
+/**--dump: prints the records of the capture at path in arrival order. returns the exit status*/
+int dump_capture(char *path) {
+    capture_header hdr;
+    char *buf;
+    size_t n;
+    replay_req *reqs = load_capture(path, &n, &buf, &hdr);
+    if (reqs == NULL)
+        return EXIT_FAILURE;
+    printf("%-12s%-8s%-12s%-12s%s\n", "at(ms)", "status", "bytes", "took(ms)", "request");
+    for (size_t i = 0; i < n; i++)
+        printf("%-12.3f%-8d%-12lu%-12.3f%.*s%s\n", reqs[i].rec.offset_us / 1000.0, reqs[i].rec.status,
+               (unsigned long) reqs[i].rec.bytes, reqs[i].rec.duration_us / 1000.0, reqs[i].rec.line_len,
+               reqs[i].line, (reqs[i].rec.flags & CAPTURE_H2) ? "  (h2)" : "");
+    free(reqs);
+    free(buf);
+    return EXIT_SUCCESS;
+}
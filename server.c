@@ -1,7 +1,10 @@
+#define _GNU_SOURCE /**accept4*/
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netdb.h>
@@ -11,22 +14,60 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <errno.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
 #include "threadpool.h"
+#include "singleflight.h"
+#include "content.h"
+#include "pack.h"
+#include "streamer.h"
+#include "h2.h"
+#include "proxy.h"
+#include "shm.h"
+#include "capture.h"
+#include "fswatch.h"
+#ifdef USE_TLS
+#include "tls.h"
+#else
+/**built without OpenSSL (make TLS=0): --tls is refused*/
+typedef void tls_server;
+#define create_tls(cert, key, use_ktls, threads) \
+    ((void) (key), (void) (use_ktls), printf("this server was built without TLS (make TLS=1)\n"), NULL)
+#define tls_accept(t, sockfd) (sockfd)
+#define destroy_tls(t)
+#endif
 
 /**define of sizes:*/
 #define BUFF_SIZE 4000
-#define MAX_ERROR_SIZE 320
-#define MAX_BODY_SIZE 150
-#define MAX_READ 1024
+#define MAX_ERROR_SIZE 370
+#define MAX_BODY_SIZE 200
+#define MAX_READ 65536 /**bytes of a file read at a time, when it's not sent by the streaming engine*/
 #define MAX_HEADER 350
+#define MAX_SHARED_FILE 65536 /**files up to this size are read once and shared by concurrent requests*/
+#define LARGE_FILE (1024 * 1024) /**files above this size are handed to the streaming engine*/
+#define STREAM_THREADS 2
+#define TLS_THREADS 2 /**relay threads of the connections that are encrypted in userspace*/
+#define MAX_ACCEPT_BATCH 64 /**connections accepted per wake up of the main thread, dispatched together*/
+#define ACCEPT_POLL_MS 1000 /**the accept loop wakes up at least this often, to see if other workers used the quota*/
+#define LISTEN_BACKLOG 128
+#define MAX_H2_SETTINGS 256 /**longest HTTP2-Settings header of an h2c upgrade we accept*/
 
 /**define of erros*/
 #define FOUND 302
 #define BAD_REQUEST 400
 #define FORBIDDEN 403
 #define NOT_FOUND 404
+#define PAYLOAD_TOO_LARGE 413
+#define HEADERS_TOO_LARGE 431
 #define NOT_SUPPORTED 501
-#define USAGE_ERROR "Usage: server <port> <pool-size> <max-number-of-request>\n"
+#define INTERNAL_SERVER_ERROR 500
+#define BAD_GATEWAY 502
+#define SERVICE_UNAVAILABLE 503
+#define GATEWAY_TIMEOUT 504
+#define USAGE_ERROR "Usage: server <port> <pool-size> <max-number-of-request> [--pack <file>] [--reserve <n>]" \
+                    " [--proxy <prefix>=<backend>[,<backend>...]]... [--proxy-cache <MB>]" \
+                    " [--tls <cert.pem> <key.pem> [--no-ktls]] [--workers <n>] [--capture <file>] [--no-watch]\n"
 
 /**define of "private" methods internal uses*/
 #define IS_A_NUMBER 0
@@ -36,19 +77,14 @@
 #define INTERNAL_ERROR 0
 #define FAILED -1
 
+/**define of routes (what resolve_path found)*/
+#define ROUTE_FILE 1
+#define ROUTE_DIR 2
+
 /**define for headers*/
-#define SERVER "webserver/1.0"
 #define PROTOCOL "HTTP/1.0"
-#define RFC1123FMT "%a, %d %b %Y %H:%M:%S GMT"
 #define ERROR_RESPONSE_HTML "<HTML><HEAD><TITLE>%d %s</TITLE></HEAD>\r\n<BODY><H4>%d %s</H4>\r\n%s\r\n</BODY></HTML>\r\n"
 
-/**Dir content defines*/
-#define DIR_CONTENT_START "<HTML>\r\n<HEAD><TITLE>Index of %s</TITLE></HEAD>\r\n<BODY>\r\n<H4>Index of %s</H4>\r\n<table CELLSPACING=8>\r\n<tr><th>Name</th><th>Last Modified</th><th>Size</th></tr>\r\n"
-#define DIR_CONTENT_FOLDER "<tr>\r\n<td><A HREF=\"%s/\">%s</td>\r\n<td>%s</td>\r\n</tr>\r\n"
-#define DIR_CONTENT_FILE "<tr>\r\n<td><A HREF=\"%s""\">%s</td>\r\n<td>%s</td>\r\n<td>%zd</td>\r\n</tr>\r\n"
-#define DIR_CONTENT_END "</table><HR>\r\n<ADDRESS>%s</ADDRESS>\r\n</BODY></HTML>\r\n"
-
-#define INDEX_FILE "index.html"
 /**
  * @author: Daniel Gabay
  * server.c
@@ -65,7 +101,33 @@
  * for each client it talks to. In order to enable multithreaded program,
  * the server should create threads that handle the connections withthe clients.
  * Since, the server should maintain a limited number of threads, it constructs a thread pool.
- * Command line usage: server <port> <pool-size> <max-number-of-request>
+ * Command line usage: server <port> <pool-size> <max-number-of-request> [--pack <file>] [--workers <n>] ...
+ * With --pack, paths found in the asset pack (see pack.h, built by packbuild) are served from memory,
+ * all the other paths are served from the file system.
+ * Scheduling: new connections, small files and errors run on LANE_SMALL of the threadpool,
+ * directory listings are moved to LANE_BULK, and files above LARGE_FILE are handed to the streaming
+ * engine (see streamer.h) so they don't hold a thread. --reserve <n> threads (default pool-size/4)
+ * never take LANE_BULK jobs.
+ * HTTP/2 (cleartext only): a connection that starts with the HTTP/2 preface, or an HTTP/1.1 request with
+ * "Upgrade: h2c", is handed to the h2 engine (see h2.h) for its whole life. Its requests are answered by
+ * h2_handle with the same checks, caches and pack as HTTP/1.x, many of them at once on the same connection.
+ * Reverse proxy: with --proxy <prefix>=<backend>[,<backend>...] (host:port or unix:<path>, may be repeated),
+ * requests under prefix are forwarded to the backends (see proxy.h) with any method, before any of the checks
+ * above. --proxy-cache <MB> keeps their cacheable responses in memory.
+ * HTTPS: with --tls <cert.pem> <key.pem> every connection starts with a TLS handshake (see tls.h). When the
+ * kernel can take over the encryption (kTLS) the connection is served as is, sendfile included; o.w
+ * (or with --no-ktls) it's served on a socketpair whose other end is encrypted by a relay thread.
+ * Workers: with --workers <n> the welcome socket is created once and n worker processes are forked, each with
+ * its own threadpool and engines, accepting from it (<max-number-of-request> is shared by all of them).
+ * The master restarts a worker that crashed, and prints the counters of all the workers on SIGUSR1 and when
+ * they exit. The workers share the metadata cache of resolved paths (see shm.h), so a path looked up by one
+ * of them is not stat'ed again by the others. File responses carry an ETag, If-None-Match gets a 304.
+ * Capture: with --capture <file> every request is recorded (see capture.h): its request line, arrival time,
+ * status and response size. replay (replay.c) plays the file back against a server.
+ * Watching: the served tree is watched with inotify (see fswatch.h), a change drops the cached metadata of the
+ * paths it affects (and looks them up again if they were asked for lately), so the rest of the metadata cache
+ * is trusted without looking at the file system. --no-watch (or a tree that can't be watched completely) goes
+ * back to looking again every META_TTL seconds.
  * The response of the server depends on the the client's request.
  * There are 3 main response categories:
  *      1)Error -> internal error or client's request error
@@ -73,87 +135,577 @@
  *      3)Dir content -> an HTML table contains all folder content
  */
 
+/**the configuration every worker starts from*/
+typedef struct server_args_st {
+    int main_sockfd;
+    int pool_size;
+    int reserved;
+    int max_requests;
+    long proxy_cache_mb;
+    char *cert_file, *key_file;
+    int use_ktls;
+} server_args;
+
+/**an accepted connection waiting at LANE_SMALL*/
+typedef struct accepted_conn_st {
+    int sockfd;
+    uint64_t arrived_us;    //when accept returned it (see capture_now), when capturing
+} accepted_conn;
+
 /**forward declaration*/
 int is_a_number(char *str);
 
 int create_server(int port);
 
+int serve(server_args *args);
+
+int supervise_workers(server_args *args, int num_workers);
+
+int start_worker(server_args *args, int id);
+
+void stop_workers();
+
+void on_signal(int sig);
+
+void print_stats();
+
+void print_page_cache(FILE *out);
+
+void accept_loop(int main_sockfd, accepted_conn *conns, int maxNumOfRequests);
+
 int handel_request(void *arg);
 
-char *get_mime_type(char *name);
+void serve_request(int new_sockfd);
+
+void captured(int status, size_t bytes);
+
+char *normalize_path(char *path);
+
+int resolve_path(char *path, struct stat *statbuf, char **index_html);
 
-void send_file(char *path, struct stat *statbuf, int sockfd);
+int lookup_path(char *path, struct stat *statbuf, char **index_html, char *etag);
 
-void construct_headers(char *res, int status, char *title, char *location, char *mime, int length, char *last_modified);
+void remember_path(char *path, int route, struct stat *statbuf, int index_html, char *etag, uint64_t gen);
+
+int watched_path(char *path);
+
+void on_fs_change(int kind, char *path, void *arg);
+
+void refresh_path(char *path);
+
+void send_file(char *path, struct stat *statbuf, char *etag, int sockfd);
+
+void send_small_file(char *path, char *header, char *last_modified, char *etag, int sockfd);
+
+void send_not_modified(char *etag, int vary, int sockfd);
+
+void construct_headers(char *res, int status, char *title, char *location, char *mime, long length, char *last_modified,
+                       char *etag);
 
 void send_dir_content(char *path, struct stat *statbuf, int sockfd);
 
+void send_dir_content_later(char *path, struct stat *statbuf, int sockfd);
+
+int dir_content_job(void *arg);
+
 void send_error_response(char *path, int status, int sockfd);
 
 void send_internal_error500(int sockfd);
 
+void error_strings(int status, char **title, char **text);
+
 int folderExecutePremession(char *path);
 
-int dirContentSizeToAllocate(char *path);
+int fill_dir_content(sf_call *call, void *arg);
+
+int fill_file_content(sf_call *call, void *arg);
+
+char *make_sf_key(char type, char *path);
+
+void send_packed(pack_entry *e, char *path, char *req_headers, int sockfd);
+
+int header_has_token(char *headers, char *name, char *token);
+
+int header_matches_etag(char *headers, char *etag);
+
+char *find_header(char *headers, char *name, char **end);
+
+int list_has_token(char *v, char *end, char *token);
+
+int refused_by_q(char *p, char *end);
+
+int etag_list_matches(char *v, char *end, char *etag);
+
+int write_all(int sockfd, char *buf, size_t len);
+
+int get_header_value(char *headers, char *name, char *out, size_t cap);
+
+void h2_handle(h2_request *req, h2_response *res);
+
+void h2_respond(h2_request *req, h2_response *res);
+
+void h2_file_response(char *path, struct stat *statbuf, char *etag, h2_response *res);
+
+void h2_dir_response(char *path, struct stat *statbuf, h2_response *res);
+
+void h2_packed_response(pack_entry *e, char *path, h2_request *req, h2_response *res);
+
+void h2_proxy_response(h2_request *req, h2_response *res);
+
+int has_space_or_ctl(char *str);
+
+int h2_add_header_lines(h2_response *res, char *headers, size_t headers_len);
+
+void h2_error_response(char *path, int status, h2_response *res);
+
+void h2_release_call(h2_response *res);
+
+void h2_release_buffer(h2_response *res);
+
+void h2_file_progress(h2_response *res, off_t offset);
+
+void h2_release_file(h2_response *res);
+
+/**concurrent misses for the same path are coalesced here (see singleflight.h)*/
+singleflight *inflight = NULL;
+
+/**the mapped asset pack, NULL when running without --pack*/
+asset_pack *pack = NULL;
+
+/**the threadpool, handel_request moves slow work to its LANE_BULK*/
+threadpool *pool = NULL;
+
+/**large files are sent by this engine, NULL if it could not be created*/
+streamer *streams = NULL;
+
+/**idle HTTP/2 connections wait here without a thread, NULL if it could not be created*/
+h2_parking *parking = NULL;
+
+/**the reverse proxy routes, NULL when running without --proxy*/
+proxy *proxies = NULL;
+
+/**HTTPS, NULL when running without --tls*/
+tls_server *tls = NULL;
+
+/**the segment shared by the workers (see shm.h): request quota, counters and the metadata cache*/
+shm_segment *shared = NULL;
+
+/**the slot of this process in shared->workers (0 when running without --workers)*/
+int worker_id = 0;
+
+/**the watcher of the served tree, NULL with --no-watch (or when the tree can't be watched)*/
+fswatch *watcher = NULL;
+
+/**the traffic capture (--capture), NULL when not capturing*/
+capture *capture_log = NULL;
+
+/**the request this thread is serving, when capturing. the send functions fill its status and size
+ *(NULL when not capturing, or when the request was handed to another thread that records it)*/
+__thread capture_req *capturing = NULL;
+
+/**set by on_signal*/
+volatile sig_atomic_t stats_wanted = 0;
+volatile sig_atomic_t stop_wanted = 0;
+
+/**the signals on_signal handles are blocked in every thread, they're taken only while the accept loop (or the
+ *master) waits, with the mask the process started with*/
+sigset_t handled_signals;
+sigset_t wait_mask;
+
+/**counts one event of this worker*/
+#define COUNT(stat) shm_count(shared, worker_id, stat)
+
+/**a directory listing waiting at LANE_BULK*/
+typedef struct dir_job_st {
+    char *path;
+    struct stat st;
+    int sockfd;
+    capture_req *creq;  //the record of the request, when capturing
+} dir_job;
+
+/**a large file body of HTTP/2: its page cache is handled like the transfers of the streamer (see streamer.h)*/
+typedef struct h2_file_st {
+    stream_cache cache;
+    off_t offset;       //where the last read started
+} h2_file;
 
 int main(int argc, char *argv[]) {
 
-    /*user must insert 4 arguments*/
-    if (argc != 4) {
+    /*user must insert at least 4 arguments*/
+    if (argc < 4) {
         printf(USAGE_ERROR);
         exit(EXIT_FAILURE);
     }
     /*check that argv[1],argv[2],argv[3] is numbers*/
-    for (int i = 1; i < argc; i++)
+    for (int i = 1; i < 4; i++)
         if (is_a_number(argv[i]) == NOT_A_NUMBER) {
             printf(USAGE_ERROR);
             exit(EXIT_FAILURE);
         }
 
     int port = atoi(argv[1]);
-    int poolSize = atoi(argv[2]);
-    int maxNumOfRequests = atoi(argv[3]);
+    server_args args;
+    bzero(&args, sizeof(args));
+    args.pool_size = atoi(argv[2]);
+    args.max_requests = atoi(argv[3]);
 
-    if(port <= 0 || poolSize <= 0 || maxNumOfRequests <= 0){
+    if(port <= 0 || args.pool_size <= 0 || args.max_requests <= 0){
         printf(USAGE_ERROR);
         exit(EXIT_FAILURE);
     }
 
-    int *sock_fds = (int *) malloc(sizeof(int) * maxNumOfRequests);
-    if (sock_fds == NULL) {
-        printf("malloc sock_fds array failed\n");
+    /*optional flags after the 3 numbers*/
+    char *pack_file = NULL, *capture_file = NULL;
+    int num_workers = 0, watch = 1;
+    args.reserved = args.pool_size / 4;
+    args.use_ktls = 1;
+    for (int i = 4; i < argc; i++) {
+        if (strcmp(argv[i], "--pack") == 0 && i + 1 < argc)
+            pack_file = argv[++i];
+        else if (strcmp(argv[i], "--proxy") == 0 && i + 1 < argc) {
+            if (proxies == NULL && (proxies = create_proxy()) == NULL) {
+                printf("malloc proxy failed\n");
+                exit(EXIT_FAILURE);
+            }
+            if (proxy_add_route(proxies, argv[++i]) < 0) {
+                destroy_proxy(proxies);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--proxy-cache") == 0 && i + 1 < argc && is_a_number(argv[i + 1]) == IS_A_NUMBER)
+            args.proxy_cache_mb = atol(argv[++i]);
+        else if (strcmp(argv[i], "--tls") == 0 && i + 2 < argc) {
+            args.cert_file = argv[++i];
+            args.key_file = argv[++i];
+        } else if (strcmp(argv[i], "--no-ktls") == 0)
+            args.use_ktls = 0;
+        else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc)
+            capture_file = argv[++i];
+        else if (strcmp(argv[i], "--no-watch") == 0)
+            watch = 0;
+        else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc && is_a_number(argv[i + 1]) == IS_A_NUMBER &&
+                 atoi(argv[i + 1]) >= 1 && atoi(argv[i + 1]) <= MAX_WORKERS)
+            num_workers = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--reserve") == 0 && i + 1 < argc && is_a_number(argv[i + 1]) == IS_A_NUMBER &&
+                 atoi(argv[i + 1]) < args.pool_size)
+            args.reserved = atoi(argv[++i]);
+        else {
+            printf(USAGE_ERROR);
+            destroy_proxy(proxies);
+            exit(EXIT_FAILURE);
+        }
+    }
+    /*before any thread is created (and before the fork): the threads inherit the mask, so a signal never
+     *interrupts a pool, streamer or relay thread with EINTR*/
+    sigemptyset(&handled_signals);
+    sigaddset(&handled_signals, SIGUSR1);
+    sigaddset(&handled_signals, SIGTERM);
+    sigaddset(&handled_signals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &handled_signals, &wait_mask);
+    if (pack_file != NULL && (pack = open_pack(pack_file)) == NULL) {
+        destroy_proxy(proxies);
         exit(EXIT_FAILURE);
     }
+    shared = create_shm(num_workers > 0 ? num_workers : 1, args.max_requests);
+    if (shared == NULL) {
+        printf("creating the shared segment failed\n");
+        close_pack(pack);
+        destroy_proxy(proxies);
+        exit(EXIT_FAILURE);
+    }
+    if (capture_file != NULL && (capture_log = create_capture(capture_file)) == NULL) { //before the fork: one file
+        destroy_shm(shared);
+        close_pack(pack);
+        destroy_proxy(proxies);
+        exit(EXIT_FAILURE);
+    }
+    /**one watcher thread (of the master, when there are workers) keeps the shared metadata cache of all of them*/
+    if (watch && (watcher = create_fswatch(".")) != NULL) {
+        shared->watched = !fswatch_degraded(watcher);
+        if (!shared->watched || fswatch_subscribe(watcher, on_fs_change, NULL) < 0 || fswatch_start(watcher) < 0) {
+            shared->watched = 0;
+            destroy_fswatch(watcher);
+            watcher = NULL;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN); //prevent SIGPIPE raise
+    struct sigaction sa;
+    bzero(&sa, sizeof(sa));
+    sa.sa_handler = on_signal; //no SA_RESTART: the wait of the accept loop / the master is interrupted
+    sigaction(SIGUSR1, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL); //stop accepting and end like after the last request (the capture is written)
+    sigaction(SIGINT, &sa, NULL);
+
+    /**the welcome socket is created once, the workers inherit it and accept from it*/
+    args.main_sockfd = create_server(port);
+    int ret = EXIT_FAILURE;
+    if (args.main_sockfd != FAILED && num_workers == 0)
+        ret = serve(&args);
+    else if (args.main_sockfd != FAILED)
+        ret = supervise_workers(&args, num_workers);
+    if (args.main_sockfd != FAILED) {
+        shutdown(args.main_sockfd, SHUT_RDWR);
+        close(args.main_sockfd);
+    }
+    destroy_capture(capture_log); //writes what's left in the buffer
+    destroy_proxy(proxies);
+    destroy_fswatch(watcher); //before the segment, its thread changes the cache
+    destroy_shm(shared);
+    close_pack(pack);
+    return ret;
+}
+
+/**runs the server in this process (the whole server, or one worker of --workers) on the welcome socket:
+ *creates the threadpool, the engines and the proxy/TLS threads, serves its share of the requests and
+ *destroys them. returns EXIT_SUCCESS, or EXIT_FAILURE if it could not start*/
+int serve(server_args *args) {
+    accepted_conn *conns = (accepted_conn *) malloc(sizeof(accepted_conn) * args->max_requests);
+    if (conns == NULL) {
+        printf("malloc conns array failed\n");
+        return EXIT_FAILURE;
+    }
+
+    inflight = create_singleflight();
+    if (inflight == NULL) {
+        printf("malloc singleflight failed\n");
+        free(conns);
+        return EXIT_FAILURE;
+    }
 
-    threadpool *tp = create_threadpool(poolSize);
+    threadpool *tp = create_threadpool_lanes(args->pool_size, args->reserved);
     if (tp == NULL) {
         printf(USAGE_ERROR);
-        free(sock_fds);
-        exit(EXIT_FAILURE);
+        destroy_singleflight(inflight);
+        free(conns);
+        return EXIT_FAILURE;
     }
 
-    signal(SIGPIPE, SIG_IGN); //prevent SIGPIPE raise
+    pool = tp;
+    streams = create_streamer(STREAM_THREADS, &shared->workers[worker_id].stream); //when NULL large files are
+                                                                                    //sent by the threads as before
+    parking = create_h2_parking(tp); //when NULL every h2 connection holds its thread until it ends
 
-    int main_sockfd = create_server(port);
-    if (main_sockfd == FAILED) {
-        destroy_threadpool(tp);
-        free(sock_fds);
-        exit(EXIT_FAILURE);
+    int started = 1;
+    if (proxies != NULL && proxy_start(proxies, (size_t) args->proxy_cache_mb * 1024 * 1024) < 0) {
+        printf("starting the proxy failed\n");
+        started = 0;
+    } else if (args->cert_file != NULL &&
+               (tls = create_tls(args->cert_file, args->key_file, args->use_ktls, TLS_THREADS)) == NULL)
+        started = 0;
+    if (started)
+        accept_loop(args->main_sockfd, conns, args->max_requests);
+    h2_parking_stop(parking); //the parked h2 connections go back to the pool (or time out) before it's destroyed
+    destroy_threadpool(tp);
+    destroy_h2_parking(parking);
+    destroy_streamer(streams); //after the pool, its threads may still hand over transfers
+    destroy_tls(tls); //after the streamer, its transfers may still be relayed
+    destroy_singleflight(inflight);
+    free(conns);
+    return started ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**the master of --workers: forks num_workers workers that serve() on the same welcome socket, and waits.
+ *a worker killed by a signal is started again (unless all the requests were accepted already), a worker that
+ *could not start stops them all. SIGUSR1 prints the counters of the workers, SIGTERM/SIGINT stop them
+ *(they finish the requests in progress first).
+ *returns when all the workers exited: EXIT_SUCCESS, or EXIT_FAILURE if a worker could not start*/
+int supervise_workers(server_args *args, int num_workers) {
+    int running = 0, stopping = 0, failed = 0;
+    for (int i = 0; i < num_workers; i++)
+        if (start_worker(args, i) == 0)
+            running++;
+    if (running < num_workers) { //fork failed, the ones that were started are stopped below
+        stopping = 1;
+        failed = 1;
+        stop_workers();
     }
-    for (int i = 0; i < maxNumOfRequests; i++) {
-        if ((sock_fds[i] = accept(main_sockfd, NULL, NULL)) < 0) {
-            perror("accept");
+    while (running > 0) {
+        int status;
+        pthread_sigmask(SIG_SETMASK, &wait_mask, NULL); //the signals are taken only while waiting
+        pid_t pid = waitpid(-1, &status, 0);
+        pthread_sigmask(SIG_BLOCK, &handled_signals, NULL); //a forked worker starts with them blocked
+        if (stats_wanted) {
+            stats_wanted = 0;
+            print_stats();
+        }
+        if (stop_wanted && !stopping) {
+            stopping = 1;
+            stop_workers();
+        }
+        if (pid < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("waitpid");
             break;
         }
-        dispatch(tp, handel_request, &sock_fds[i]);
+        int id = 0;
+        while (id < num_workers && shared->workers[id].pid != pid)
+            id++;
+        if (id == num_workers) //not a worker
+            continue;
+        shared->workers[id].pid = 0;
+        running--;
+        if (stopping || (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS)) //done with the requests
+            continue;
+        if (WIFEXITED(status)) { //the worker could not start, no point in trying again
+            printf("worker %d could not start, stopping\n", id);
+            stopping = 1;
+            failed = 1;
+            stop_workers();
+            continue;
+        }
+        printf("worker %d (pid %d) was killed by signal %d\n", id, (int) pid, WTERMSIG(status));
+        if (shm_exhausted(shared))
+            continue;
+        if (time(NULL) - shared->workers[id].started < 1) //crashes right away: don't fork in a tight loop
+            sleep(1);
+        shared->workers[id].restarts++;
+        if (start_worker(args, id) == 0)
+            running++;
     }
-    destroy_threadpool(tp);
-    shutdown(main_sockfd, SHUT_RDWR);
-    close(main_sockfd);
-    free(sock_fds);
+    if (!failed)
+        print_stats();
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**forks worker id. returns 0 on succsess, FAILED o.w*/
+int start_worker(server_args *args, int id) {
+    fflush(stdout); //o.w the child prints what's buffered again
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork failed");
+        return FAILED;
+    }
+    if (pid == 0) {
+        signal(SIGUSR1, SIG_IGN); //the master prints the counters of all the workers
+        worker_id = id;
+        int ret = serve(args);
+        destroy_capture(capture_log); //the records of this worker that are still in its buffer
+        destroy_proxy(proxies); //after serve(), no request uses it anymore
+        close_pack(pack);
+        exit(ret);
+    }
+    shared->workers[id].pid = pid;
+    shared->workers[id].started = time(NULL);
     return 0;
 }
 
+/**sends SIGTERM to all the running workers*/
+void stop_workers() {
+    for (int i = 0; i < shared->num_workers; i++)
+        if (shared->workers[i].pid > 0)
+            kill(shared->workers[i].pid, SIGTERM);
+}
+
+/**SIGUSR1: print the counters, SIGTERM/SIGINT: stop the workers (the master), stop accepting and finish the
+ *requests in progress (a worker, or the server without --workers)*/
+void on_signal(int sig) {
+    if (sig == SIGUSR1)
+        stats_wanted = 1;
+    else
+        stop_wanted = 1;
+}
+
+/**prints the counters of the workers and how much of the hot files is in the page cache*/
+void print_stats() {
+    shm_print_stats(shared, stdout);
+    print_page_cache(stdout);
+}
+
+/**prints how much of the hot files (the files up to LARGE_FILE in the metadata cache, they were asked for lately)
+ *is in the page cache: the large files sent by the streamer should not push them out*/
+void print_page_cache(FILE *out) {
+    unsigned char vec[LARGE_FILE / 4096 + 1];
+    long page = sysconf(_SC_PAGESIZE), files = 0, pages = 0, resident = 0;
+    meta_entry e;
+    for (int i = 0; i < META_SLOTS; i++) {
+        if (!meta_entry_at(shared, i, &e) || e.route != ROUTE_FILE || e.size <= 0 || e.size > LARGE_FILE)
+            continue;
+        char path[META_PATH_MAX + sizeof(INDEX_FILE)];
+        snprintf(path, sizeof(path), "%s%s", e.path, e.index_html ? INDEX_FILE : "");
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+            continue;
+        void *map = mmap(NULL, e.size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED)
+            continue;
+        long n = (e.size + page - 1) / page;
+        if (mincore(map, e.size, vec) == 0) {
+            files++;
+            pages += n;
+            for (long j = 0; j < n; j++)
+                resident += vec[j] & 1;
+        }
+        munmap(map, e.size);
+    }
+    if (files > 0)
+        fprintf(out, "page cache: %ld of the %ld pages of %ld hot files are resident (%ld%%)\n", resident, pages,
+                files, resident * 100 / pages);
+    fflush(out);
+}
+
+/**accepts connections and dispatches them to the pool, until maxNumOfRequests connections were accepted
+ *(by all the workers together, see shm_claim).
+ *the welcome socket is non-blocking: every time it's readable all the pending connections are accepted
+ *(up to MAX_ACCEPT_BATCH) and queued with one dispatch_batch() call*/
+void accept_loop(int main_sockfd, accepted_conn *conns, int maxNumOfRequests) {
+    void *batch[MAX_ACCEPT_BATCH];
+    struct pollfd pfd;
+    pfd.fd = main_sockfd;
+    pfd.events = POLLIN;
+    struct timespec timeout;
+    timeout.tv_sec = ACCEPT_POLL_MS / 1000;
+    timeout.tv_nsec = (ACCEPT_POLL_MS % 1000) * 1000000L;
+    int accepted = 0, stop = 0;
+    while (accepted < maxNumOfRequests && !stop && !stop_wanted) { //stops on SIGTERM/SIGINT
+        int ready = ppoll(&pfd, 1, &timeout, &wait_mask); //the only place a signal is taken in this process
+        if (stats_wanted) { //SIGUSR1 without --workers
+            stats_wanted = 0;
+            print_stats();
+        }
+        if (ready < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+        if (ready == 0) {
+            if (shm_exhausted(shared)) //the other workers accepted the rest
+                break;
+            continue;
+        }
+        int quota = shm_claim(shared, MAX_ACCEPT_BATCH < maxNumOfRequests - accepted ? MAX_ACCEPT_BATCH :
+                                      maxNumOfRequests - accepted);
+        if (quota == 0)
+            break;
+        int n = 0;
+        while (n < quota) {
+            /*no SOCK_NONBLOCK: the handlers use blocking reads and writes (the streamer sets it by itself)*/
+            int fd = accept4(main_sockfd, NULL, NULL, SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    perror("accept");
+                    stop = 1;
+                }
+                break;
+            }
+            conns[accepted + n].sockfd = fd;
+            conns[accepted + n].arrived_us = capture_now(capture_log); //not at dequeue, not after the handshake
+            batch[n] = &conns[accepted + n];
+            n++;
+            COUNT(STAT_CONNECTIONS);
+        }
+        shm_unclaim(shared, quota - n);
+        if (n > 0 && dispatch_batch(pool, LANE_SMALL, handel_request, batch, n) < 0)
+            for (int i = 0; i < n; i++)
+                send_internal_error500(conns[accepted + i].sockfd);
+        accepted += n;
+    }
+}
+
 /**this method get port num and initialize the welcome socket. on succsess, the sockfd will return. o.w, exit program*/
 int create_server(int port) {
     int welcome_sock_fd;
@@ -173,35 +725,89 @@ int create_server(int port) {
         perror("bind failed\n");
         return FAILED;
     }
-    if (listen(welcome_sock_fd, 5) < 0) {
+    if (listen(welcome_sock_fd, LISTEN_BACKLOG) < 0) {
         perror("listen failed");
         return FAILED;
     }
+    int flags = fcntl(welcome_sock_fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(welcome_sock_fd, F_SETFL, flags | O_NONBLOCK) < 0) { //accept_loop drains it
+        perror("fcntl failed");
+        return FAILED;
+    }
     return welcome_sock_fd;
 }
 
 /**this method is used by threads when server get request from some client
- *this method reads the request and sends response to the client
+ *this method reads the request and sends response to the client (and records it, with --capture)
 */
-int handel_request(void *fd) {
-    if(fd == NULL)
+int handel_request(void *arg) {
+    if(arg == NULL)
         return 0;
-    int new_sockfd = *(int *) fd;
+    accepted_conn *conn = (accepted_conn *) arg;
+    if (capture_log == NULL) {
+        serve_request(conn->sockfd);
+        return 0;
+    }
+    capture_req creq;
+    capture_begin(capture_log, &creq, conn->arrived_us);
+    capturing = &creq;
+    serve_request(conn->sockfd);
+    if (capturing != NULL && creq.line[0] != '\0') //o.w it was handed over, or nothing was read
+        capture_end(capture_log, &creq);
+    capturing = NULL;
+    return 0;
+}
+
+/**reads the request of new_sockfd and sends the response*/
+void serve_request(int new_sockfd) {
+    /**HTTPS: after the handshake the connection is served on the kernel TLS socket or on a relay*/
+    if (tls != NULL && (new_sockfd = tls_accept(tls, new_sockfd)) < 0)
+        return;
     char *buff = (char *) malloc(sizeof(char) * BUFF_SIZE);
     if (!buff) {
         send_internal_error500(new_sockfd);
-        return 0;
+        return;
     }
     bzero(buff, BUFF_SIZE);
     struct stat stat_buffer;
-    int path_len = 0, folder_execute = 0;
+    int nread;
 
     //reading client request
-    if ((read(new_sockfd, buff, BUFF_SIZE - 1)) < 0) {
+    if ((nread = (int) read(new_sockfd, buff, BUFF_SIZE - 1)) < 0) {
         perror("read\n");
         send_internal_error500(new_sockfd);
         free(buff);
-        return 0;
+        return;
+    }
+    /**HTTP/2 with prior knowledge: the connection starts with the preface instead of a request line*/
+    if (h2_is_preface(buff, nread)) {
+        capturing = NULL; //the connection is not a request, h2_handle records its streams
+        h2_serve(new_sockfd, buff, nread, h2_handle, NULL, NULL, parking);
+        free(buff);
+        return;
+    }
+
+    COUNT(STAT_REQUESTS);
+    if (capturing != NULL) { //the request line, as it came
+        size_t line_len = strcspn(buff, "\r\n");
+        if (line_len >= CAPTURE_MAX_LINE)
+            line_len = CAPTURE_MAX_LINE - 1;
+        memcpy(capturing->line, buff, line_len);
+        capturing->line[line_len] = '\0';
+    }
+    /**proxied paths are forwarded as they are, with any method*/
+    int proxied = proxy_serve(proxies, new_sockfd, buff, nread, BUFF_SIZE);
+    if (proxied != PROXY_NOT_MINE)
+        COUNT(STAT_PROXIED);
+    if (proxied == PROXY_DONE) {
+        shutdown(new_sockfd, SHUT_RDWR);
+        close(new_sockfd);
+        free(buff);
+        return;
+    } else if (proxied != PROXY_NOT_MINE) {
+        send_error_response("", proxied, new_sockfd);
+        free(buff);
+        return;
     }
 
     /**1st check: there a 3 tokens at the first row and the last one is a valid http protocol*/
@@ -212,82 +818,226 @@ int handel_request(void *fd) {
         (strcmp(protocol, "HTTP/1.0") != 0 && strcmp(protocol, "HTTP/1.1") != 0)) {
         send_error_response(path, BAD_REQUEST, new_sockfd);
         free(buff);
-        return 0;
+        return;
     }
+    char *req_headers = protocol + strlen(protocol) + 1;
     /**2nd check: support only GET method*/
     if (strcmp(method, "GET") != 0) {
         send_error_response(path, NOT_SUPPORTED, new_sockfd);
         free(buff);
-        return 0;
-    }
-    path_len = strlen(path);
-    if (path_len > 1 && path[0] == '/') { //start path at index+1 ("remove" first '/')
-        path++;
-        path_len--;
+        return;
     }
-    else if (strcmp(path, "/") == 0) {
-        path = "./"; // means that the path is the current directory (contains the server file)
-        path_len = strlen(path);
+    /**HTTP/1.1 client asking to upgrade to h2c: the request is answered as stream 1 of the new connection*/
+    if (strcmp(protocol, "HTTP/1.1") == 0 && header_has_token(req_headers, "Upgrade", "h2c")) {
+        char settings[MAX_H2_SETTINGS];
+        if (get_header_value(req_headers, "HTTP2-Settings", settings, sizeof(settings)) == 0) {
+            h2_request upgrade = {method, path, NULL, 0, NULL, 0, 0};
+            capturing = NULL; //answered as an HTTP/2 stream, h2_handle records it
+            h2_serve(new_sockfd, NULL, 0, h2_handle, &upgrade, settings, parking);
+            free(buff);
+            return;
+        }
     }
-    /**3rd check: requested path does not exist*/
-    if ((stat(path, &stat_buffer)) < 0) {
-        send_error_response(path, NOT_FOUND, new_sockfd);
+    path = normalize_path(path);
+    /**paths in the asset pack need no stat, premission walk or open*/
+    pack_entry *packed = pack_lookup(pack, path);
+    if (packed != NULL) {
+        COUNT(STAT_PACKED);
+        send_packed(packed, path, req_headers, new_sockfd);
         free(buff);
-        return 0;
+        return;
     }
+    char *path_index_html = NULL;
+    char etag[META_ETAG_MAX];
+    int route = lookup_path(path, &stat_buffer, &path_index_html, etag);
+    if (route == ROUTE_FILE && header_matches_etag(req_headers, etag)) //client already has this version
+        send_not_modified(etag, 0, new_sockfd);
+    else if (route == ROUTE_FILE) {
+        COUNT(STAT_FILES);
+        send_file(path_index_html ? path_index_html : path, &stat_buffer, etag, new_sockfd);
+    } else if (route == ROUTE_DIR) {
+        COUNT(STAT_DIRS);
+        send_dir_content_later(path, &stat_buffer, new_sockfd);
+    }
+    else if (route == INTERNAL_SERVER_ERROR)
+        send_internal_error500(new_sockfd);
+    else
+        send_error_response(path, route, new_sockfd);
+    free(path_index_html);
+    free(buff);
+}
+
+/**returns the path as a file system path: without the first '/', and "./" for "/"*/
+char *normalize_path(char *path) {
+    if (strlen(path) > 1 && path[0] == '/') //start path at index+1 ("remove" first '/')
+        return path + 1;
+    if (strcmp(path, "/") == 0)
+        return "./"; // means that the path is the current directory (contains the server file)
+    return path;
+}
+
+/**runs the file system checks of a (normalized) path. returns ROUTE_FILE, ROUTE_DIR or an error status.
+ *on ROUTE_FILE, *index_html is the malloc'ed path of the index.html to send (NULL when it's the path itself),
+ *and statbuf is the stat of the file to send. on ROUTE_DIR statbuf is the stat of the directory*/
+int resolve_path(char *path, struct stat *statbuf, char **index_html) {
+    int path_len = strlen(path), folder_execute;
+    *index_html = NULL;
+    /**3rd check: requested path does not exist*/
+    if ((stat(path, statbuf)) < 0)
+        return NOT_FOUND;
     folder_execute = folderExecutePremession(path); //check the other execute premission for every folder at the path
-    if (S_ISDIR(stat_buffer.st_mode)) { //check if the path is directory
+    if (S_ISDIR(statbuf->st_mode)) { //check if the path is directory
         /**4th check: path is directory but doesn't finish with '/'  */
-        if (path_len >= 1 && path[path_len - 1] != '/') {
-            send_error_response(path, FOUND, new_sockfd);
-            free(buff);
-            return 0;
-        }
-        if (folder_execute == INTERNAL_ERROR) {
-            send_internal_error500(new_sockfd);
-            free(buff);
-            return 0;
-        }
-        if (folder_execute == NOT_FOUND) {
-            send_error_response(path, NOT_FOUND, new_sockfd);
-            free(buff);
-            return 0;
-        }
+        if (path_len >= 1 && path[path_len - 1] != '/')
+            return FOUND;
+        if (folder_execute == INTERNAL_ERROR)
+            return INTERNAL_SERVER_ERROR;
+        if (folder_execute == NOT_FOUND)
+            return NOT_FOUND;
         /**5th check: path is valid directory and other has execute premission*/
-        if (folder_execute == INVALID_PREMISSION) { //check for other premission to execute
-            send_error_response(path, FORBIDDEN, new_sockfd);
-            free(buff);
-            return 0;
-        }
+        if (folder_execute == INVALID_PREMISSION) //check for other premission to execute
+            return FORBIDDEN;
         /**first search for index.html file and return if found and other has read premission*/
         char *path_index_html = (char *) malloc(sizeof(char) * (path_len + strlen(INDEX_FILE) + 1));
         if (path_index_html == NULL) {
             printf("malloc failed\n");
-            send_internal_error500(new_sockfd);
-            free(buff);
-            return 0;
+            return INTERNAL_SERVER_ERROR;
         }
         sprintf(path_index_html, "%s"INDEX_FILE, path);
         struct stat stat_buffer2;
         if (stat(path_index_html, &stat_buffer2) >= 0 && S_ISREG(stat_buffer2.st_mode) &&
-            (stat_buffer2.st_mode & S_IROTH))
-            send_file(path_index_html, &stat_buffer2, new_sockfd);
-        else
-            send_dir_content(path, &stat_buffer, new_sockfd);
-
+            (stat_buffer2.st_mode & S_IROTH)) {
+            *statbuf = stat_buffer2;
+            *index_html = path_index_html;
+            return ROUTE_FILE;
+        }
         free(path_index_html);
-        free(buff);
-        return 0;
+        return ROUTE_DIR;
     }
     /**6th check: the file is regular, other has premission to execute all folders and read file*/
-    if (folder_execute == VALID_PREMISSION && S_ISREG(stat_buffer.st_mode) && (stat_buffer.st_mode & S_IROTH))
-        send_file(path, &stat_buffer, new_sockfd);
-    else
-        send_error_response(path, FORBIDDEN, new_sockfd);
-    free(buff);
-    return 0;
+    if (folder_execute == VALID_PREMISSION && S_ISREG(statbuf->st_mode) && (statbuf->st_mode & S_IROTH))
+        return ROUTE_FILE;
+    return FORBIDDEN;
+}
+
+/**resolve_path through the metadata cache of the shared segment: a path resolved lately (by any worker) is not
+ *looked up again, only statbuf's mode, size, mtime and inode are filled then.
+ *etag (META_ETAG_MAX bytes) is set to the ETag of the file on ROUTE_FILE, to an empty string o.w*/
+int lookup_path(char *path, struct stat *statbuf, char **index_html, char *etag) {
+    meta_entry e;
+    etag[0] = '\0';
+    *index_html = NULL;
+    if (meta_lookup(shared, worker_id, path, &e)) {
+        bzero(statbuf, sizeof(struct stat));
+        statbuf->st_mode = e.mode;
+        statbuf->st_size = e.size;
+        statbuf->st_mtime = e.mtime;
+        statbuf->st_ino = e.ino;
+        if (e.index_html) {
+            *index_html = (char *) malloc(sizeof(char) * (strlen(path) + strlen(INDEX_FILE) + 1));
+            if (*index_html == NULL) {
+                printf("malloc failed\n");
+                return INTERNAL_SERVER_ERROR;
+            }
+            sprintf(*index_html, "%s"INDEX_FILE, path);
+        }
+        strcpy(etag, e.etag);
+        return e.route;
+    }
+    uint64_t gen = meta_generation(shared); //a change the watcher sees from now on is not saved over
+    int route = resolve_path(path, statbuf, index_html);
+    remember_path(path, route, statbuf, *index_html != NULL, etag, gen);
+    return route;
 }
 
+/**sets etag to the ETag of the file on ROUTE_FILE, and saves what resolve_path found for path in the metadata
+ *cache: for META_WATCHED_TTL seconds when the watcher reports its changes, META_TTL o.w*/
+void remember_path(char *path, int route, struct stat *statbuf, int index_html, char *etag, uint64_t gen) {
+    meta_entry e;
+    etag[0] = '\0';
+    if (route == ROUTE_FILE) //changes when the file is replaced or written to
+        sprintf(etag, "\"%lx-%lx-%lx\"", (unsigned long) statbuf->st_ino, (unsigned long) statbuf->st_size,
+                (unsigned long) statbuf->st_mtime);
+    if (route == INTERNAL_SERVER_ERROR || strlen(path) >= META_PATH_MAX)
+        return;
+    bzero(&e, sizeof(e));
+    e.route = route;
+    e.index_html = index_html;
+    if (route == ROUTE_FILE || route == ROUTE_DIR) { //o.w statbuf may not be filled
+        e.mode = statbuf->st_mode;
+        e.size = statbuf->st_size;
+        e.mtime = statbuf->st_mtime;
+        e.ino = statbuf->st_ino;
+    }
+    strcpy(e.path, path);
+    strcpy(e.etag, etag);
+    int watched = __atomic_load_n(&shared->watched, __ATOMIC_ACQUIRE) && watched_path(path);
+    meta_store(shared, &e, watched ? META_WATCHED_TTL : META_TTL, gen);
+}
+
+/**returns 1 if the changes of path are reported by the watcher under this very name: "./" or names separated
+ *by single '/' (a trailing one too), none of them "." or "..". 0 o.w ("sub//a.html", "./a.html" are the same
+ *files, their entries are kept for META_TTL seconds only)*/
+int watched_path(char *path) {
+    if (strcmp(path, "./") == 0)
+        return 1;
+    while (*path != '\0') {
+        size_t len = strcspn(path, "/");
+        if (len == 0 || (len == 1 && path[0] == '.') || (len == 2 && path[0] == '.' && path[1] == '.'))
+            return 0;
+        path += len;
+        if (*path == '/')
+            path++;
+    }
+    return 1;
+}
+
+/**the subscriber of the watcher (runs on its thread). a change of path drops the entries it may change: the path
+ *itself, everything under it (a directory), and its directory with '/' (index.html, Last-Modified)*/
+void on_fs_change(int kind, char *path, void *arg) {
+    (void) arg;
+    __atomic_fetch_add(&shared->fs_changes, 1, __ATOMIC_RELAXED);
+    if (kind == FSW_DEGRADED) { //from now on the entries are looked at again every META_TTL seconds
+        __atomic_store_n(&shared->watched, 0, __ATOMIC_RELEASE);
+        meta_clear(shared);
+        return;
+    }
+    if (kind == FSW_ALL || path[0] == '\0') { //lost events, or the premissions of the root
+        __atomic_fetch_add(&shared->fs_dropped, meta_invalidate_tree(shared, ""), __ATOMIC_RELAXED);
+        return;
+    }
+    char key[META_PATH_MAX + 2];
+    size_t len = strlen(path);
+    if (kind == FSW_TREE && len < META_PATH_MAX) {
+        sprintf(key, "%s/", path);
+        __atomic_fetch_add(&shared->fs_dropped, meta_invalidate_tree(shared, key), __ATOMIC_RELAXED);
+    }
+    if (len < META_PATH_MAX)
+        refresh_path(path);
+    char *slash = strrchr(path, '/');
+    if (slash == NULL)
+        refresh_path("./");
+    else if (slash - path + 1 < META_PATH_MAX) {
+        memcpy(key, path, slash - path + 1);
+        key[slash - path + 1] = '\0';
+        refresh_path(key);
+    }
+}
+
+/**drops the entry of path, and if there was one (it was asked for lately) looks path up again right away,
+ *so the next request finds it ready*/
+void refresh_path(char *path) {
+    if (!meta_invalidate(shared, path))
+        return;
+    __atomic_fetch_add(&shared->fs_dropped, 1, __ATOMIC_RELAXED);
+    struct stat st;
+    char *index_html, etag[META_ETAG_MAX];
+    uint64_t gen = meta_generation(shared);
+    int route = resolve_path(path, &st, &index_html);
+    remember_path(path, route, &st, index_html != NULL, etag, gen);
+    free(index_html);
+    __atomic_fetch_add(&shared->fs_prewarmed, 1, __ATOMIC_RELAXED);
+}
 
 /**return VALID_PREMISSION if all folders at the path have x premission for other,INTERNAL_ERROR for malloc problem.
  *o.w return INVALID_PREMISSION*/
@@ -323,100 +1073,133 @@ int folderExecutePremession(char *path) {
     return VALID_PREMISSION;
 }
 
-/**this method return response string contains directory content*/
+/**this method sends the directory content. the listing itself is built once for all concurrent requests*/
 void send_dir_content(char *path, struct stat *statbuf, int sockfd) {
-    int response_size = dirContentSizeToAllocate(path);
-    if (response_size == INTERNAL_ERROR) {
+    char timebuf[128];
+    char header[MAX_HEADER];
+    char *key = make_sf_key('D', path);
+    if (key == NULL) {
         send_internal_error500(sockfd);
         return;
     }
-    DIR *dir;
-    struct dirent *de;
-    char *response, *pathbuf;
-    char timebuf[128];
-    int path_len = strlen(path);
-    response = (char *) malloc(sizeof(char) * response_size);
-    if (!response) {
+    sf_call *listing = sf_do(inflight, key, fill_dir_content, path);
+    free(key);
+    if (listing == NULL || listing->status == FAILED) {
+        sf_release(inflight, listing);
         send_internal_error500(sockfd);
         return;
     }
-    bzero(response, response_size);
-
+    bzero(header, MAX_HEADER);
     strftime(timebuf, sizeof(timebuf), RFC1123FMT, gmtime(&statbuf->st_mtime));
-    construct_headers(response, 200, "OK", NULL, "text/html", -1, timebuf);
-    sprintf(response + strlen(response), DIR_CONTENT_START, path, path); /**html start, table constructing..*/
-    dir = opendir(path);
-    while ((de = readdir(dir)) != NULL) {
-        int len = strlen(de->d_name);
-        int pathbuf_len = path_len + len + 1;
-        pathbuf = (char *) malloc(sizeof(char) * pathbuf_len);
-        if (pathbuf == NULL) {
-            printf("malloc failed\n");
-            closedir(dir);
-            free(response);
-            send_internal_error500(sockfd);
-            return;
-        }
-        bzero(pathbuf, pathbuf_len);
-        bzero(timebuf, sizeof(timebuf));
-        strcpy(pathbuf, path);
-        strcat(pathbuf, de->d_name);
-
-        if (stat(pathbuf, statbuf) < 0) {
-            free(pathbuf);
-            continue;
-        }
-        /**create <td> tag for each entity*/
-        strftime(timebuf, sizeof(timebuf), RFC1123FMT, gmtime(&statbuf->st_mtime));
-        if (S_ISDIR(statbuf->st_mode))
-            sprintf(response + strlen(response), DIR_CONTENT_FOLDER, de->d_name, de->d_name, timebuf);
-        else
-            sprintf(response + strlen(response), DIR_CONTENT_FILE, de->d_name, de->d_name, timebuf,
-                    statbuf->st_size);
-        free(pathbuf);
-    }
-    closedir(dir);
-    sprintf(response + strlen(response), DIR_CONTENT_END, SERVER);
-    if ((write(sockfd, response, strlen(response))) < 0) {
+    construct_headers(header, 200, "OK", NULL, "text/html", -1, timebuf, NULL);
+    captured(200, strlen(header) + listing->len);
+    if ((write(sockfd, header, strlen(header))) < 0 || (write(sockfd, listing->data, listing->len)) < 0) {
         perror("write failed");
-        free(response);
+        sf_release(inflight, listing);
         send_internal_error500(sockfd);
         return;
     }
-    free(response);
+    sf_release(inflight, listing);
     shutdown(sockfd, SHUT_RDWR);
     close(sockfd);
 }
 
-/**this functions caculate how many byes to allocate in order to build Dir content response*/
-int dirContentSizeToAllocate(char *path) {
-    int sum = 0, extra = 150;
-    struct dirent **namelist;
-    int n = scandir(path, &namelist, 0, alphasort);
-    if (n < 0)
-        return INTERNAL_ERROR;
+/**moves the directory listing to LANE_BULK, so big directories don't hold the threads reserved for short jobs.
+ * if it can't be queued (e.g the pool is being destroyed) the listing is sent right away*/
+void send_dir_content_later(char *path, struct stat *statbuf, int sockfd) {
+    dir_job *job = (dir_job *) malloc(sizeof(dir_job));
+    if (job != NULL)
+        job->path = (char *) malloc(sizeof(char) * (strlen(path) + 1));
+    if (job == NULL || job->path == NULL) {
+        free(job);
+        send_dir_content(path, statbuf, sockfd);
+        return;
+    }
+    strcpy(job->path, path);
+    job->st = *statbuf;
+    job->sockfd = sockfd;
+    job->creq = NULL;
+    if (capturing != NULL && (job->creq = (capture_req *) malloc(sizeof(capture_req))) != NULL)
+        memcpy(job->creq, capturing, sizeof(capture_req));
+    capture_req *handed = job->creq; //the job may be done (and freed) as soon as it's dispatched
+    if (dispatch_lane(pool, LANE_BULK, dir_content_job, job) < 0) {
+        free(job->creq);
+        free(job->path);
+        free(job);
+        send_dir_content(path, statbuf, sockfd);
+        return;
+    }
+    if (handed != NULL) //the job records it
+        capturing = NULL;
+}
+
+/**LANE_BULK job: sends a directory listing*/
+int dir_content_job(void *arg) {
+    dir_job *job = (dir_job *) arg;
+    capturing = job->creq;
+    send_dir_content(job->path, &job->st, job->sockfd);
+    if (job->creq != NULL)
+        capture_end(capture_log, job->creq);
+    capturing = NULL;
+    free(job->creq);
+    free(job->path);
+    free(job);
+    return 0;
+}
 
-    int table_td = strlen(DIR_CONTENT_FILE);
-    int table_start = strlen(DIR_CONTENT_START);
-    int table_end = strlen(DIR_CONTENT_END);
-    int timeAndSize_len = 100;
-    for (int i = 0; i < n; i++) {
-        sum += (int) strlen(namelist[i]->d_name) * 2 + timeAndSize_len + table_td;
-        free(namelist[i]);
+/**single flight fill function: builds the html table of directory arg into call->data.
+ * returns 0 on succsess, FAILED o.w*/
+int fill_dir_content(sf_call *call, void *arg) {
+    call->data = build_dir_content_on((char *) arg, &call->len, pool); //big directories are stat'ed in parallel
+    if (call->data == NULL)
+        return FAILED;
+    return 0;
+}
+
+/**single flight fill function: reads the whole (small) file arg into call->data.
+ * returns 0 on succsess, FAILED o.w*/
+int fill_file_content(sf_call *call, void *arg) {
+    char *path = (char *) arg;
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("read file failed");
+        return FAILED;
     }
-    free(namelist);
-    sum += table_start + table_end + extra;
-    return sum;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return FAILED;
+    }
+    char *content = (char *) malloc(sizeof(char) * (st.st_size + 1));
+    if (content == NULL) {
+        close(fd);
+        return FAILED;
+    }
+    int total = 0, nbytes;
+    while (total < st.st_size && (nbytes = (int) read(fd, content + total, st.st_size - total)) > 0)
+        total += nbytes;
+    close(fd);
+    call->data = content;
+    call->len = total;
+    return 0;
 }
 
+/**returns malloc'ed single flight key "<type>:<path>", NULL if malloc failed*/
+char *make_sf_key(char type, char *path) {
+    char *key = (char *) malloc(sizeof(char) * (strlen(path) + 3));
+    if (key == NULL)
+        return NULL;
+    sprintf(key, "%c:%s", type, path);
+    return key;
+}
 
-/**this method sends the user the wanted file if exists*/
-void send_file(char *path, struct stat *statbuf, int sockfd) {
+/**this method sends the user the wanted file if exists (etag may be NULL)*/
+void send_file(char *path, struct stat *statbuf, char *etag, int sockfd) {
     if (!path) {
         send_internal_error500(sockfd);
         return;
     }
-    int fileLength = (int)statbuf->st_size;
+    long fileLength = (long) statbuf->st_size;
     char timebuf[128];
     strftime(timebuf, sizeof(timebuf), RFC1123FMT, gmtime(&statbuf->st_mtime));
     int header_len = MAX_HEADER + (int) strlen(path);
@@ -427,7 +1210,13 @@ void send_file(char *path, struct stat *statbuf, int sockfd) {
         return;
     }
     bzero(header, header_len);
-    construct_headers(header, 200, "OK", NULL, get_mime_type(path), fileLength, timebuf);
+    if (statbuf->st_size <= MAX_SHARED_FILE) { //small file: read it once for all concurrent requests
+        send_small_file(path, header, timebuf, etag, sockfd);
+        free(header);
+        return;
+    }
+    construct_headers(header, 200, "OK", NULL, get_mime_type(path), fileLength, timebuf, etag);
+    captured(200, strlen(header) + fileLength);
     int fd = open(path, O_RDONLY);
     if (fd < 0) {
         perror("read file failed");
@@ -435,6 +1224,10 @@ void send_file(char *path, struct stat *statbuf, int sockfd) {
         free(header);
         return;
     }
+    if (statbuf->st_size > LARGE_FILE && stream_file(streams, sockfd, fd, statbuf->st_size, header,
+                                                     (int) strlen(header)) == 0)
+        return; //the streaming engine owns the socket, the file and the header now
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
     if ((send(sockfd, header, (int) strlen(header), 0) < 0)) { //send header
         perror("send failed");
         send_internal_error500(sockfd);
@@ -451,13 +1244,12 @@ void send_file(char *path, struct stat *statbuf, int sockfd) {
     }
     int nbytes;
     while ((nbytes = (int) read(fd, file_content, MAX_READ)) > 0) {
-        if ((send(sockfd, file_content, nbytes, MSG_NOSIGNAL) < 0) || nbytes < 0) {
+        if (write_all(sockfd, (char *) file_content, nbytes) < 0) {
             send_internal_error500(sockfd);
             free(file_content);
             close(fd);
             return;//error in sending
         }
-        bzero(file_content, MAX_READ);
     }
     shutdown(sockfd, SHUT_RDWR);
     close(sockfd);
@@ -465,9 +1257,582 @@ void send_file(char *path, struct stat *statbuf, int sockfd) {
     close(fd);
 }
 
+/**sends a small file from a shared single flight buffer. header is a zeroed buffer to build the headers at*/
+void send_small_file(char *path, char *header, char *last_modified, char *etag, int sockfd) {
+    char *key = make_sf_key('F', path);
+    if (key == NULL) {
+        send_internal_error500(sockfd);
+        return;
+    }
+    sf_call *file = sf_do(inflight, key, fill_file_content, path);
+    free(key);
+    if (file == NULL || file->status == FAILED) {
+        sf_release(inflight, file);
+        send_internal_error500(sockfd);
+        return;
+    }
+    construct_headers(header, 200, "OK", NULL, get_mime_type(path), file->len, last_modified, etag);
+    captured(200, strlen(header) + file->len);
+    if ((send(sockfd, header, (int) strlen(header), MSG_NOSIGNAL) < 0) ||
+        (file->len > 0 && send(sockfd, file->data, file->len, MSG_NOSIGNAL) < 0)) {
+        perror("send failed");
+        sf_release(inflight, file);
+        send_internal_error500(sockfd);
+        return;
+    }
+    sf_release(inflight, file);
+    shutdown(sockfd, SHUT_RDWR);
+    close(sockfd);
+}
+
+/**sends a response from the asset pack. req_headers are the request headers (after the request line)*/
+void send_packed(pack_entry *e, char *path, char *req_headers, int sockfd) {
+    if (e->kind == PACK_KIND_REDIRECT) {
+        send_error_response(path, FOUND, sockfd);
+        return;
+    }
+    if (header_matches_etag(req_headers, e->etag)) { //client already has this version
+        send_not_modified(e->etag, e->gzip_len > 0, sockfd);
+        return;
+    }
+    char header[MAX_HEADER];
+    char timebuf[128];
+    time_t now = time(NULL);
+    strftime(timebuf, sizeof(timebuf), RFC1123FMT, gmtime(&now));
+    char *headers = pack->base + e->headers_off, *body = pack->base + e->body_off;
+    size_t headers_len = e->headers_len, body_len = e->body_len;
+    if (e->gzip_len > 0 && header_has_token(req_headers, "Accept-Encoding", "gzip")) {
+        headers = pack->base + e->gzip_headers_off;
+        headers_len = e->gzip_headers_len;
+        body = pack->base + e->gzip_off;
+        body_len = e->gzip_len;
+    }
+    sprintf(header, "%s 200 OK\r\nServer: %s\r\nDate: %s\r\n", PROTOCOL, SERVER, timebuf);
+    captured(200, strlen(header) + headers_len + body_len);
+    if (write_all(sockfd, header, strlen(header)) == FAILED || write_all(sockfd, headers, headers_len) == FAILED ||
+        write_all(sockfd, body, body_len) == FAILED)
+        perror("send failed");
+    shutdown(sockfd, SHUT_RDWR);
+    close(sockfd);
+}
+
+/**sends "304 Not Modified" for a client that has the version etag already. vary is 1 when the 200 response
+ *would have "Vary: Accept-Encoding" (a packed entry with a gzip variant)*/
+void send_not_modified(char *etag, int vary, int sockfd) {
+    char header[MAX_HEADER];
+    char timebuf[128];
+    time_t now = time(NULL);
+    COUNT(STAT_NOT_MODIFIED);
+    strftime(timebuf, sizeof(timebuf), RFC1123FMT, gmtime(&now));
+    sprintf(header, "%s 304 Not Modified\r\nServer: %s\r\nDate: %s\r\nETag: %s\r\n%sConnection: close\r\n\r\n",
+            PROTOCOL, SERVER, timebuf, etag, vary ? "Vary: Accept-Encoding\r\n" : "");
+    captured(304, strlen(header));
+    write_all(sockfd, header, strlen(header));
+    shutdown(sockfd, SHUT_RDWR);
+    close(sockfd);
+}
+
+/**returns 1 if the request header name exists and its value (a comma separated list) has token, 0 o.w*/
+int header_has_token(char *headers, char *name, char *token) {
+    char *end;
+    char *v = find_header(headers, name, &end);
+    return v != NULL && token != NULL && list_has_token(v, end, token);
+}
+
+/**returns 1 if the request has If-None-Match that matches etag, 0 o.w*/
+int header_matches_etag(char *headers, char *etag) {
+    char *end;
+    char *v = find_header(headers, "If-None-Match", &end);
+    return v != NULL && etag != NULL && etag[0] != '\0' && etag_list_matches(v, end, etag);
+}
+
+/**copies the value of the request header name to out (cap bytes). returns 0 on succsess, FAILED if it's
+ *missing or too long*/
+int get_header_value(char *headers, char *name, char *out, size_t cap) {
+    char *end;
+    char *v = find_header(headers, name, &end);
+    if (v == NULL || out == NULL)
+        return FAILED;
+    size_t len = end - v;
+    if (len >= cap)
+        return FAILED;
+    memcpy(out, v, len);
+    out[len] = '\0';
+    return 0;
+}
+
+/**returns the value of the request header name (without the spaces around it) and sets *end to its end,
+ *or returns NULL if it's missing*/
+char *find_header(char *headers, char *name, char **end) {
+    if (headers == NULL || name == NULL)
+        return NULL;
+    size_t name_len = strlen(name);
+    char *line = headers;
+    while (*line != '\0') {
+        if (*line == '\n') { //the request line leaves its '\n' behind
+            line++;
+            continue;
+        }
+        char *line_end = strstr(line, "\r\n");
+        if (line_end == NULL)
+            line_end = line + strlen(line);
+        if (line_end == line) //empty line, end of headers
+            return NULL;
+        if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            char *v = line + name_len + 1;
+            while (v < line_end && (*v == ' ' || *v == '\t'))
+                v++;
+            while (line_end > v && (line_end[-1] == ' ' || line_end[-1] == '\t'))
+                line_end--;
+            *end = line_end;
+            return v;
+        }
+        line = (*line_end == '\0') ? line_end : line_end + 2;
+    }
+    return NULL;
+}
+
+/**returns 1 if the comma separated list [v, end) has token (whole, case insensitive) and doesn't refuse it
+ *with q=0, 0 o.w. "*" stands for every token that is not in the list (Accept-Encoding: *)*/
+int list_has_token(char *v, char *end, char *token) {
+    size_t token_len = strlen(token);
+    int star = 0;
+    while (v < end) {
+        char *item_end = memchr(v, ',', end - v);
+        if (item_end == NULL)
+            item_end = end;
+        while (v < item_end && (*v == ' ' || *v == '\t'))
+            v++;
+        char *name_end = v;
+        while (name_end < item_end && *name_end != ';' && *name_end != ' ' && *name_end != '\t')
+            name_end++;
+        size_t len = name_end - v;
+        if (len == token_len && strncasecmp(v, token, len) == 0)
+            return !refused_by_q(name_end, item_end);
+        if (len == 1 && *v == '*')
+            star = !refused_by_q(name_end, item_end);
+        v = item_end + 1;
+    }
+    return star;
+}
+
+/**returns 1 if the parameters [p, end) of a list item have q=0 (the item is refused), 0 o.w*/
+int refused_by_q(char *p, char *end) {
+    while (p < end && (p = memchr(p, ';', end - p)) != NULL) {
+        p++;
+        while (p < end && (*p == ' ' || *p == '\t'))
+            p++;
+        if (end - p >= 2 && (*p == 'q' || *p == 'Q') && p[1] == '=') {
+            p += 2;
+            if (p == end || *p != '0')
+                return 0;
+            for (p++; p < end && (*p == '0' || *p == '.'); p++); //0, 0.0, 0.000
+            return p == end || *p == ' ' || *p == '\t' || *p == ';';
+        }
+    }
+    return 0;
+}
+
+/**returns 1 if the If-None-Match list [v, end) matches etag: it's "*", or it has the same tag by the weak
+ *comparison (W/ is ignored on both sides), 0 o.w*/
+int etag_list_matches(char *v, char *end, char *etag) {
+    if (strncmp(etag, "W/", 2) == 0)
+        etag += 2;
+    size_t etag_len = strlen(etag);
+    while (v < end) {
+        while (v < end && (*v == ' ' || *v == '\t' || *v == ','))
+            v++;
+        if (v == end)
+            break;
+        if (*v == '*')
+            return 1;
+        if (end - v >= 2 && strncmp(v, "W/", 2) == 0)
+            v += 2;
+        char *tag_end = v;
+        if (v < end && *v == '"') { //a quoted tag may have commas in it
+            tag_end = memchr(v + 1, '"', end - v - 1);
+            if (tag_end == NULL)
+                return 0;
+            tag_end++;
+        } else
+            while (tag_end < end && *tag_end != ',')
+                tag_end++;
+        if ((size_t) (tag_end - v) == etag_len && memcmp(v, etag, etag_len) == 0)
+            return 1;
+        v = tag_end;
+    }
+    return 0;
+}
+
+/**the h2 engine handler: fills the response of one HTTP/2 request (and records it, with --capture)*/
+void h2_handle(h2_request *req, h2_response *res) {
+    if (capture_log == NULL) {
+        h2_respond(req, res);
+        return;
+    }
+    capture_req creq;
+    capture_begin(capture_log, &creq, capture_now(capture_log));
+    snprintf(creq.line, sizeof(creq.line), "%s %s HTTP/2", req->method, req->path);
+    h2_respond(req, res);
+    creq.rec.status = (uint16_t) res->status;
+    creq.rec.bytes = res->body != NULL ? res->body_len : (uint64_t) res->fd_len;
+    creq.rec.flags = CAPTURE_H2;
+    capture_end(capture_log, &creq);
+}
+
+/**fills the response of one HTTP/2 request.
+ *it runs the same checks as handel_request, only the response is built for the engine instead of a socket*/
+void h2_respond(h2_request *req, h2_response *res) {
+    char timebuf[128];
+    time_t now = time(NULL);
+    COUNT(STAT_REQUESTS);
+    COUNT(STAT_H2_STREAMS);
+    if (proxy_is_proxied(proxies, req->path)) { //the backend sends its own server and date
+        COUNT(STAT_PROXIED);
+        h2_proxy_response(req, res);
+        return;
+    }
+    strftime(timebuf, sizeof(timebuf), RFC1123FMT, gmtime(&now));
+    h2_add_header(res, "server", SERVER);
+    h2_add_header(res, "date", timebuf);
+    if (strcmp(req->method, "GET") != 0) {
+        h2_error_response(req->path, NOT_SUPPORTED, res);
+        return;
+    }
+    char *path = normalize_path(req->path);
+    pack_entry *packed = pack_lookup(pack, path);
+    if (packed != NULL) {
+        COUNT(STAT_PACKED);
+        h2_packed_response(packed, path, req, res);
+        return;
+    }
+    struct stat stat_buffer;
+    char *path_index_html = NULL;
+    char etag[META_ETAG_MAX];
+    int route = lookup_path(path, &stat_buffer, &path_index_html, etag);
+    char *if_none_match = h2_request_header(req, "if-none-match");
+    if (route == ROUTE_FILE && if_none_match != NULL && etag[0] != '\0' &&
+        etag_list_matches(if_none_match, if_none_match + strlen(if_none_match), etag)) {
+        COUNT(STAT_NOT_MODIFIED);
+        res->status = 304;
+        h2_add_header(res, "etag", etag);
+    } else if (route == ROUTE_FILE) {
+        COUNT(STAT_FILES);
+        h2_file_response(path_index_html ? path_index_html : path, &stat_buffer, etag, res);
+    } else if (route == ROUTE_DIR) {
+        COUNT(STAT_DIRS);
+        h2_dir_response(path, &stat_buffer, res);
+    }
+    else
+        h2_error_response(path, route, res);
+    free(path_index_html);
+}
+
+/**HTTP/2 file response: small files come from the shared single flight buffer, the others are read by the
+ *engine from the file (one frame at a time, so they never hold the connection). etag may be NULL*/
+void h2_file_response(char *path, struct stat *statbuf, char *etag, h2_response *res) {
+    char timebuf[128], length[32];
+    strftime(timebuf, sizeof(timebuf), RFC1123FMT, gmtime(&statbuf->st_mtime));
+    if (statbuf->st_size <= MAX_SHARED_FILE) {
+        char *key = make_sf_key('F', path);
+        sf_call *file = (key != NULL) ? sf_do(inflight, key, fill_file_content, path) : NULL;
+        free(key);
+        if (file == NULL || file->status == FAILED) {
+            sf_release(inflight, file);
+            h2_error_response(path, INTERNAL_SERVER_ERROR, res);
+            return;
+        }
+        res->body = file->data;
+        res->body_len = file->len;
+        res->ctx = file;
+        res->release = h2_release_call;
+    } else {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            perror("read file failed");
+            h2_error_response(path, INTERNAL_SERVER_ERROR, res);
+            return;
+        }
+        h2_file *file = (h2_file *) malloc(sizeof(h2_file));
+        if (file == NULL) {
+            printf("malloc failed\n");
+            close(fd);
+            h2_error_response(path, INTERNAL_SERVER_ERROR, res);
+            return;
+        }
+        stream_cache_init(&file->cache, fd, statbuf->st_size); //read in frames, front to back
+        file->offset = 0;
+        res->fd = fd;
+        res->fd_len = statbuf->st_size;
+        res->ctx = file;
+        res->progress = h2_file_progress;
+        res->release = h2_release_file;
+    }
+    res->status = 200;
+    sprintf(length, "%ld", res->body ? (long) res->body_len : (long) res->fd_len);
+    if (get_mime_type(path) != NULL)
+        h2_add_header(res, "content-type", get_mime_type(path));
+    h2_add_header(res, "content-length", length);
+    h2_add_header(res, "last-modified", timebuf);
+    if (etag != NULL && etag[0] != '\0')
+        h2_add_header(res, "etag", etag);
+}
+
+/**HTTP/2 directory listing, built once for all concurrent requests*/
+void h2_dir_response(char *path, struct stat *statbuf, h2_response *res) {
+    char timebuf[128], length[32];
+    char *key = make_sf_key('D', path);
+    sf_call *listing = (key != NULL) ? sf_do(inflight, key, fill_dir_content, path) : NULL;
+    free(key);
+    if (listing == NULL || listing->status == FAILED) {
+        sf_release(inflight, listing);
+        h2_error_response(path, INTERNAL_SERVER_ERROR, res);
+        return;
+    }
+    res->status = 200;
+    res->body = listing->data;
+    res->body_len = listing->len;
+    res->ctx = listing;
+    res->release = h2_release_call;
+    strftime(timebuf, sizeof(timebuf), RFC1123FMT, gmtime(&statbuf->st_mtime));
+    sprintf(length, "%d", listing->len);
+    h2_add_header(res, "content-type", "text/html");
+    h2_add_header(res, "content-length", length);
+    h2_add_header(res, "last-modified", timebuf);
+}
+
+/**HTTP/2 response from the asset pack. the pre-rendered HTTP/1.0 headers are converted to lower case names,
+ *without the hop by hop headers (not allowed in HTTP/2)*/
+void h2_packed_response(pack_entry *e, char *path, h2_request *req, h2_response *res) {
+    if (e->kind == PACK_KIND_REDIRECT) {
+        h2_error_response(path, FOUND, res);
+        return;
+    }
+    char *if_none_match = h2_request_header(req, "if-none-match");
+    if (if_none_match != NULL && etag_list_matches(if_none_match, if_none_match + strlen(if_none_match), e->etag)) {
+        COUNT(STAT_NOT_MODIFIED); //client already has this version
+        res->status = 304;
+        h2_add_header(res, "etag", e->etag);
+        if (e->gzip_len > 0)
+            h2_add_header(res, "vary", "Accept-Encoding");
+        return;
+    }
+    char *headers = pack->base + e->headers_off;
+    size_t headers_len = e->headers_len;
+    res->body = pack->base + e->body_off;
+    res->body_len = e->body_len;
+    char *accept_encoding = h2_request_header(req, "accept-encoding");
+    if (e->gzip_len > 0 && accept_encoding != NULL &&
+        list_has_token(accept_encoding, accept_encoding + strlen(accept_encoding), "gzip")) {
+        headers = pack->base + e->gzip_headers_off;
+        headers_len = e->gzip_headers_len;
+        res->body = pack->base + e->gzip_off;
+        res->body_len = e->gzip_len;
+    }
+    res->status = 200;
+    if (h2_add_header_lines(res, headers, headers_len) == FAILED) {
+        res->body = NULL;
+        res->body_len = 0;
+        h2_error_response(path, INTERNAL_SERVER_ERROR, res);
+    }
+}
+
+/**HTTP/2 response from a backend of the reverse proxy. the request headers are sent as HTTP/1.1 headers
+ *(:authority as Host), and the collected HTTP/1.0 response is converted like the pack headers*/
+void h2_proxy_response(h2_request *req, h2_response *res) {
+    if (req->body_too_large) {
+        h2_error_response(req->path, PAYLOAD_TOO_LARGE, res);
+        return;
+    }
+    if (req->method[0] == '\0' || has_space_or_ctl(req->method) || has_space_or_ctl(req->path)) {
+        h2_error_response(req->path, BAD_REQUEST, res); //o.w it ends the request line of the backend early
+        return;
+    }
+    size_t cap = 64;
+    for (int i = 0; i < req->num_headers; i++)
+        cap += strlen(req->headers[i].name) + strlen(req->headers[i].value) + 4;
+    char *headers = (char *) malloc(cap);
+    if (headers == NULL) {
+        printf("malloc failed\n");
+        h2_error_response(req->path, INTERNAL_SERVER_ERROR, res);
+        return;
+    }
+    size_t len = 0;
+    headers[0] = '\0';
+    for (int i = 0; i < req->num_headers; i++) {
+        char *name = req->headers[i].name;
+        if (strcmp(name, ":authority") == 0)
+            name = "host";
+        else if (name[0] == ':') //the other pseudo headers are in the request line
+            continue;
+        len += sprintf(headers + len, "%s: %s\r\n", name, req->headers[i].value);
+    }
+    char *data;
+    size_t data_len;
+    int status = proxy_fetch(proxies, req->method, req->path, headers, req->body, req->body_len, &data, &data_len);
+    free(headers);
+    if (status != PROXY_DONE) {
+        h2_error_response(req->path, status == PROXY_NOT_MINE ? INTERNAL_SERVER_ERROR : status, res);
+        return;
+    }
+    char *status_end = memmem(data, data_len, "\r\n", 2);
+    char *head_end = memmem(data, data_len, "\r\n\r\n", 4);
+    if (data_len < 12 || status_end == NULL || head_end == NULL) {
+        free(data);
+        h2_error_response(req->path, BAD_GATEWAY, res);
+        return;
+    }
+    if (h2_add_header_lines(res, status_end + 2, head_end + 4 - (status_end + 2)) == FAILED) {
+        free(data);
+        h2_error_response(req->path, BAD_GATEWAY, res);
+        return;
+    }
+    res->status = atoi(data + 9);
+    res->body = head_end + 4;
+    res->body_len = data_len - (head_end + 4 - data);
+    res->ctx = data;
+    res->release = h2_release_buffer;
+}
+
+/**returns 1 if str holds a space or a control character (not allowed in a request line), 0 o.w*/
+int has_space_or_ctl(char *str) {
+    for (unsigned char *c = (unsigned char *) str; *c != '\0'; c++)
+        if (*c <= ' ' || *c == 0x7f)
+            return 1;
+    return 0;
+}
+
+/**adds HTTP/1.x "Name: value" lines as HTTP/2 headers: lower case names, without the hop by hop headers
+ *(Connection, Keep-Alive, Transfer-Encoding.. and the ones Connection names are not allowed in HTTP/2).
+ *stops at the empty line. returns 0 on succsess, FAILED on malloc failure (the headers that were
+ *added are dropped then, nothing is sent half)*/
+int h2_add_header_lines(h2_response *res, char *headers, size_t headers_len) {
+    char short_line[MAX_HEADER];
+    char *p = headers, *end = headers + headers_len;
+    while (p < end) {
+        char *eol = memchr(p, '\n', end - p);
+        if (eol == NULL)
+            break;
+        size_t len = eol - p;
+        if (len > 0 && p[len - 1] == '\r')
+            len--;
+        if (len == 0) //empty line, end of headers
+            break;
+        char *name = p;
+        p = eol + 1;
+        char *line = (len < sizeof(short_line)) ? short_line : (char *) malloc(len + 1); //long cookies..
+        if (line == NULL) {
+            res->num_headers = 0;
+            res->hbuf_used = 0;
+            return FAILED;
+        }
+        memcpy(line, name, len);
+        line[len] = '\0';
+        char *value = strchr(line, ':');
+        int rc = 0;
+        if (value != NULL) {
+            *value++ = '\0';
+            while (*value == ' ')
+                value++;
+            for (char *c = line; *c != '\0'; c++)
+                *c = (char) tolower((unsigned char) *c);
+            if (!is_hop_by_hop(headers, headers_len, line, strlen(line)))
+                rc = h2_add_header(res, line, value);
+        }
+        if (line != short_line)
+            free(line);
+        if (rc < 0) {
+            res->num_headers = 0;
+            res->hbuf_used = 0;
+            return FAILED;
+        }
+    }
+    return 0;
+}
+
+/**HTTP/2 error response, same body as send_error_response*/
+void h2_error_response(char *path, int status, h2_response *res) {
+    char *title, *text, length[32];
+    COUNT(STAT_ERRORS);
+    char *body = (char *) malloc(sizeof(char) * MAX_BODY_SIZE);
+    if (body == NULL) { //the status alone still tells the client what happened
+        printf("malloc failed\n");
+        res->status = status;
+        return;
+    }
+    error_strings(status, &title, &text);
+    sprintf(body, ERROR_RESPONSE_HTML, status, title, status, title, text);
+    res->status = status;
+    res->body = body;
+    res->body_len = strlen(body);
+    res->ctx = body;
+    res->release = h2_release_buffer;
+    if (status == FOUND && path != NULL) {
+        char *location = (char *) malloc(sizeof(char) * (strlen(path) + 3));
+        if (location != NULL) {
+            sprintf(location, "/%s/", path);
+            h2_add_header(res, "location", location);
+            free(location);
+        }
+    }
+    sprintf(length, "%ld", (long) res->body_len);
+    h2_add_header(res, "content-type", "text/html");
+    h2_add_header(res, "content-length", length);
+}
+
+/**h2 release: a single flight buffer*/
+void h2_release_call(h2_response *res) {
+    sf_release(inflight, (sf_call *) res->ctx);
+}
+
+/**h2 release: a malloc'ed buffer*/
+void h2_release_buffer(h2_response *res) {
+    free(res->ctx);
+}
+
+/**h2 progress of a large file: the read-ahead windows and the dropping of the streamer*/
+void h2_file_progress(h2_response *res, off_t offset) {
+    h2_file *file = (h2_file *) res->ctx;
+    stream_stats *stats = &shared->workers[worker_id].stream;
+    file->offset = offset;
+    stream_prefetch(&file->cache, offset, stats);
+    stream_drop_sent(&file->cache, offset, 0, stats);
+}
+
+/**h2 release: a large file, what was read is dropped from the page cache*/
+void h2_release_file(h2_response *res) {
+    h2_file *file = (h2_file *) res->ctx;
+    stream_drop_sent(&file->cache, file->offset, 1, &shared->workers[worker_id].stream);
+    free(file);
+    close(res->fd);
+}
+
+/**sets the status and the size of the response of the request being captured by this thread, if any*/
+void captured(int status, size_t bytes) {
+    if (capturing == NULL)
+        return;
+    capturing->rec.status = (uint16_t) status;
+    capturing->rec.bytes = bytes;
+}
+
+/**sends all len bytes of buf. returns 0 on succsess, FAILED o.w*/
+int write_all(int sockfd, char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(sockfd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return FAILED;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
 /**this function construct headers (at char *res) by the given parameters*/
-void
-construct_headers(char *res, int status, char *title, char *location, char *mime, int length, char *last_modified) {
+void construct_headers(char *res, int status, char *title, char *location, char *mime, long length, char *last_modified,
+                       char *etag) {
     time_t now;
     char timebuf[128];
     now = time(NULL);
@@ -475,8 +1840,9 @@ construct_headers(char *res, int status, char *title, char *location, char *mime
     sprintf(res, "%s %d %s\r\nServer: %s\r\nDate: %s\r\n", PROTOCOL, status, title, SERVER, timebuf);
     if (location) sprintf(res + strlen(res), "Location: /%s/\r\n", location);
     if (mime) sprintf(res + strlen(res), "Content-Type: %s\r\n", mime);
-    if (length >= 0) sprintf(res + strlen(res), "Content-Length: %d\r\n", length);
+    if (length >= 0) sprintf(res + strlen(res), "Content-Length: %ld\r\n", length);
     if (last_modified != NULL) sprintf(res + strlen(res), "Last-Modified: %s\r\n", last_modified);
+    if (etag != NULL && etag[0] != '\0') sprintf(res + strlen(res), "ETag: %s\r\n", etag);
     sprintf(res + strlen(res), "Connection: close\r\n\r\n");
 }
 
@@ -486,6 +1852,7 @@ void send_error_response(char *path, int status, int sockfd) {
         send_internal_error500(sockfd);
         return;
     }
+    COUNT(STAT_ERRORS);
     int response_size = MAX_ERROR_SIZE + (int) strlen(path);
     char *response = (char *) malloc(sizeof(char) * response_size);
     if (!response) {
@@ -503,45 +1870,77 @@ void send_error_response(char *path, int status, int sockfd) {
     }
     bzero(body, MAX_BODY_SIZE);
 
+    char *title, *text;
+    error_strings(status, &title, &text);
+    sprintf(body, ERROR_RESPONSE_HTML, status, title, status, title, text);
+    construct_headers(response, status, title, status == FOUND ? path : NULL, "text/html", (int) strlen(body), NULL,
+                      NULL);
+    strcat(response, body);
+    captured(status, strlen(response));
+    if ((write(sockfd, response, strlen(response))) < 0) {
+        perror("write failed");
+        send_internal_error500(sockfd); //send internal error closing sockfd
+    } else {
+        shutdown(sockfd, SHUT_RDWR);
+        close(sockfd);
+    }
+    free(response);
+    free(body);
+}
+
+/**sets the reason phrase and the html text of an error status*/
+void error_strings(int status, char **title, char **text) {
     switch (status) {
         case FOUND:
-            sprintf(body, ERROR_RESPONSE_HTML, 302, "Found", 302, "Found", "Directories must end with a slash.");
-            construct_headers(response, 302, "Found", path, "text/html", (int) strlen(body), NULL);
+            *title = "Found";
+            *text = "Directories must end with a slash.";
             break;
         case BAD_REQUEST:
-            sprintf(body, ERROR_RESPONSE_HTML, 400, "Bad Request", 400, "Bad Request", "Bad Request.");
-            construct_headers(response, 400, "Bad Request", NULL, "text/html", (int) strlen(body), NULL);
+            *title = "Bad Request";
+            *text = "Bad Request.";
             break;
         case FORBIDDEN:
-            sprintf(body, ERROR_RESPONSE_HTML, 403, "Forbidden", 403, "Forbidden", "Access denied.");
-            construct_headers(response, 403, "Forbidden", NULL, "text/html", (int) strlen(body), NULL);
+            *title = "Forbidden";
+            *text = "Access denied.";
             break;
         case NOT_FOUND:
-            sprintf(body, ERROR_RESPONSE_HTML, 404, "Not Found", 404, "Not Found", "File not found.");
-            construct_headers(response, 404, "Not Found", NULL, "text/html", (int) strlen(body), NULL);
+            *title = "Not Found";
+            *text = "File not found.";
+            break;
+        case PAYLOAD_TOO_LARGE:
+            *title = "Payload Too Large";
+            *text = "The request body is too large.";
+            break;
+        case HEADERS_TOO_LARGE:
+            *title = "Request Header Fields Too Large";
+            *text = "Headers are too large.";
             break;
         case NOT_SUPPORTED:
-            sprintf(body, ERROR_RESPONSE_HTML, 501, "Not supported", 501, "Not supported",
-                    "Method is not supported.");
-            construct_headers(response, 501, "Not supported", NULL, "text/html", (int) strlen(body), NULL);
+            *title = "Not supported";
+            *text = "Method is not supported.";
+            break;
+        case BAD_GATEWAY:
+            *title = "Bad Gateway";
+            *text = "Bad response from the upstream server.";
+            break;
+        case SERVICE_UNAVAILABLE:
+            *title = "Service Unavailable";
+            *text = "No upstream server is up.";
+            break;
+        case GATEWAY_TIMEOUT:
+            *title = "Gateway Timeout";
+            *text = "The upstream server timed out.";
             break;
         default:
+            *title = "Internal Server Error";
+            *text = "Some server side error.";
             break;
     }
-    strcat(response, body);
-    if ((write(sockfd, response, strlen(response))) < 0) {
-        perror("write failed");
-        send_internal_error500(sockfd); //send internal error closing sockfd
-    } else {
-        shutdown(sockfd, SHUT_RDWR);
-        close(sockfd);
-    }
-    free(response);
-    free(body);
 }
 
 /**this function sends an internal error response*/
 void send_internal_error500(int sockfd) {
+    COUNT(STAT_ERRORS);
     char *response = (char *) malloc(sizeof(char) * MAX_ERROR_SIZE);
     if (response == NULL) {
         printf("malloc failed\n");
@@ -561,8 +1960,9 @@ void send_internal_error500(int sockfd) {
     bzero(body, MAX_BODY_SIZE);
     sprintf(body, ERROR_RESPONSE_HTML, 500, "Internal Server Error", 500, "Internal Server Error",
             "Some server side error.");
-    construct_headers(response, 500, "Internal Server Error", NULL, "text/html", (int) strlen(body), NULL);
+    construct_headers(response, 500, "Internal Server Error", NULL, "text/html", (int) strlen(body), NULL, NULL);
     strcat(response, body);
+    captured(500, strlen(response));
     if ((write(sockfd, response, strlen(response))) < 0)
         perror("write failed");
 
@@ -572,24 +1972,6 @@ void send_internal_error500(int sockfd) {
     free(body);
 }
 
-char *get_mime_type(char *name) {
-    if (name == NULL)
-        return NULL;
-    char *ext = strrchr(name, '.');
-    if (!ext) return NULL;
-    if (strcmp(ext, ".html") == 0 || strcmp(ext, ".htm") == 0) return "text/html";
-    if (strcmp(ext, ".jpg") == 0 || strcmp(ext, ".jpeg") == 0) return "image/jpeg";
-    if (strcmp(ext, ".gif") == 0) return "image/gif";
-    if (strcmp(ext, ".png") == 0) return "image/png";
-    if (strcmp(ext, ".css") == 0) return "text/css";
-    if (strcmp(ext, ".au") == 0) return "audio/basic";
-    if (strcmp(ext, ".wav") == 0) return "audio/wav";
-    if (strcmp(ext, ".avi") == 0) return "video/x-msvideo";
-    if (strcmp(ext, ".mpeg") == 0 || strcmp(ext, ".mpg") == 0) return "video/mpeg";
-    if (strcmp(ext, ".mp3") == 0) return "audio/mpeg";
-    return NULL;
-}
-
 /**return 0 if str contains only digits(is a number), return -1 o.works only for positive numbers!*/
 int is_a_number(char *str) {
     int i = 0;
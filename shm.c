@@ -0,0 +1,359 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "shm.h"
+#include "pack.h"
+
+#define FLAG_OFF 0
+#define FLAG_ON 1
+#define READ_TRIES 4        //a reader that keeps meeting a writer gives up (a miss) after this many tries
+
+
+/**
+ * @author: Daniel Gabay
+ * shm.c
+ * --------------------------------------------------------------------------------
+ * This file implements the functionality of shm.h
+ * The segment is one anonymous shared mapping: it's inherited by every fork() of the master, restarted
+ * workers included, so there is no name to create or remove, and it's gone when the last process exits.
+ * Nothing in it holds a pointer (each process may map it at the same address, but no one relies on it).
+ * Note: 1)Quota: shm_claim takes requests with a compare and swap on accepted, a worker that could not
+ *         accept all of them gives the rest back with shm_unclaim.
+ *       2)Cache: a path hashes (pack_hash) to a set of META_WAYS entries. A reader copies an entry and
+ *         checks that its sequence number was even and did not change while copying, o.w the copy may be
+ *         torn and it tries again. Writers replace the same path, an expired entry, or the one that expires first.
+ *       3)Crashes: if a worker dies in the middle of a write, the next writer gets EOWNERDEAD from the robust
+ *         mutex, and drops every entry left with an odd sequence number before it goes on.
+ *       4)Invalidation: every invalidation bumps meta_gen (under the writers lock), and meta_store does not save
+ *         what was found before the last bump. so a path that changed while a worker was looking at it is not
+ *         saved with what the worker found, and missed, until the next change.
+ */
+
+/**forward declerations*/
+int lock_meta(shm_segment *seg);
+void repair_meta(shm_segment *seg);
+void drop_entry(meta_entry *e);
+int copy_entry(meta_entry *e, meta_entry *out);
+
+
+/**
+ * create_shm maps the segment for num_workers workers (1 when there are no workers) sharing
+ * max_requests requests. returns NULL on failure.
+ */
+shm_segment *create_shm(int num_workers, long max_requests) {
+    if (num_workers <= 0 || num_workers > MAX_WORKERS)
+        return NULL;
+    shm_segment *seg = (shm_segment *) mmap(NULL, sizeof(shm_segment), PROT_READ | PROT_WRITE,
+                                            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (seg == MAP_FAILED) {
+        perror("mmap shared segment failed");
+        return NULL;
+    }
+    //a new anonymous mapping is zeroed: no workers, no requests, an empty cache
+    seg->num_workers = num_workers;
+    seg->max_requests = max_requests;
+    pthread_mutexattr_t attr;
+    if (pthread_mutexattr_init(&attr) != 0) {
+        munmap(seg, sizeof(shm_segment));
+        return NULL;
+    }
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    int rc = pthread_mutex_init(&seg->meta_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (rc != 0) {
+        munmap(seg, sizeof(shm_segment));
+        return NULL;
+    }
+    return seg;
+}
+
+/**
+ * shm_claim reserves up to want requests of the quota. returns how many were reserved (0 when it's used up).
+ */
+int shm_claim(shm_segment *seg, int want) {
+    long cur = __atomic_load_n(&seg->accepted, __ATOMIC_RELAXED);
+    while (1) {
+        long left = seg->max_requests - cur;
+        long got = left < want ? left : want;
+        if (got <= 0)
+            return 0;
+        if (__atomic_compare_exchange_n(&seg->accepted, &cur, cur + got, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return (int) got;
+    }
+}
+
+/**
+ * shm_unclaim gives back n reserved requests that were not used.
+ */
+void shm_unclaim(shm_segment *seg, int n) {
+    if (n > 0)
+        __atomic_fetch_sub(&seg->accepted, n, __ATOMIC_RELAXED);
+}
+
+/**
+ * shm_exhausted returns 1 if all the requests of the quota were used.
+ */
+int shm_exhausted(shm_segment *seg) {
+    return __atomic_load_n(&seg->accepted, __ATOMIC_RELAXED) >= seg->max_requests;
+}
+
+/**
+ * shm_count adds 1 to counter stat of worker.
+ */
+void shm_count(shm_segment *seg, int worker, int stat) {
+    if (seg == NULL || worker < 0 || worker >= seg->num_workers || stat < 0 || stat >= SHM_NUM_STATS)
+        return;
+    __atomic_fetch_add(&seg->workers[worker].stats[stat], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * shm_print_stats prints the counters of every worker and their sum.
+ */
+void shm_print_stats(shm_segment *seg, FILE *out) {
+    long total[SHM_NUM_STATS], restarts = 0;
+    memset(total, 0, sizeof(total));
+    fprintf(out, "%-8s%-9s%-10s%-8s%-10s%-8s%-8s%-8s%-8s%-9s%-6s%-8s%-10s%s\n", "worker", "pid", "restarts",
+            "conns", "requests", "h2", "files", "dirs", "packed", "proxied", "304", "errors", "meta-hit",
+            "meta-miss");
+    for (int i = 0; i < seg->num_workers; i++) {
+        shm_worker *w = &seg->workers[i];
+        long s[SHM_NUM_STATS];
+        for (int j = 0; j < SHM_NUM_STATS; j++) {
+            s[j] = __atomic_load_n(&w->stats[j], __ATOMIC_RELAXED);
+            total[j] += s[j];
+        }
+        restarts += w->restarts;
+        fprintf(out, "%-8d%-9d%-10ld%-8ld%-10ld%-8ld%-8ld%-8ld%-8ld%-9ld%-6ld%-8ld%-10ld%ld\n", i, (int) w->pid,
+                w->restarts, s[STAT_CONNECTIONS], s[STAT_REQUESTS], s[STAT_H2_STREAMS], s[STAT_FILES],
+                s[STAT_DIRS], s[STAT_PACKED], s[STAT_PROXIED], s[STAT_NOT_MODIFIED], s[STAT_ERRORS],
+                s[STAT_META_HITS], s[STAT_META_MISSES]);
+    }
+    if (seg->num_workers > 1)
+        fprintf(out, "%-8s%-9s%-10ld%-8ld%-10ld%-8ld%-8ld%-8ld%-8ld%-9ld%-6ld%-8ld%-10ld%ld\n", "total", "",
+                restarts, total[STAT_CONNECTIONS], total[STAT_REQUESTS], total[STAT_H2_STREAMS], total[STAT_FILES],
+                total[STAT_DIRS], total[STAT_PACKED], total[STAT_PROXIED], total[STAT_NOT_MODIFIED],
+                total[STAT_ERRORS], total[STAT_META_HITS], total[STAT_META_MISSES]);
+    stream_stats st;
+    memset(&st, 0, sizeof(st));
+    for (int i = 0; i < seg->num_workers; i++) {
+        stream_stats *w = &seg->workers[i].stream;
+        st.transfers += __atomic_load_n(&w->transfers, __ATOMIC_RELAXED);
+        st.bytes += __atomic_load_n(&w->bytes, __ATOMIC_RELAXED);
+        st.windows += __atomic_load_n(&w->windows, __ATOMIC_RELAXED);
+        st.prefetched += __atomic_load_n(&w->prefetched, __ATOMIC_RELAXED);
+        st.grown += __atomic_load_n(&w->grown, __ATOMIC_RELAXED);
+        st.dropped += __atomic_load_n(&w->dropped, __ATOMIC_RELAXED);
+    }
+    fprintf(out, "streamer: %ld files, %ld MB sent, %ld read-ahead windows (%ld MB, grown %ld times), "
+                 "%ld MB dropped from the page cache\n", st.transfers, st.bytes >> 20, st.windows, st.prefetched >> 20,
+            st.grown, st.dropped >> 20);
+    long changes = __atomic_load_n(&seg->fs_changes, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&seg->watched, __ATOMIC_RELAXED))
+        fprintf(out, "metadata cache: watched, %ld changes, %ld entries dropped, %ld pre-warmed\n", changes,
+                __atomic_load_n(&seg->fs_dropped, __ATOMIC_RELAXED),
+                __atomic_load_n(&seg->fs_prewarmed, __ATOMIC_RELAXED));
+    else
+        fprintf(out, "metadata cache: not watched, entries expire after %d seconds\n", META_TTL);
+    fflush(out);
+}
+
+/**
+ * meta_entry_at copies entry i of the cache to out. returns 1 if it holds a fresh entry, 0 o.w
+ */
+int meta_entry_at(shm_segment *seg, int i, meta_entry *out) {
+    if (seg == NULL || i < 0 || i >= META_SLOTS)
+        return 0;
+    return copy_entry(&seg->meta[i], out) && out->expires > time(NULL);
+}
+
+/**
+ * meta_lookup copies the fresh entry of path to out. returns 1 if found, 0 o.w
+ * (the lookup is counted as a hit/miss of worker).
+ */
+int meta_lookup(shm_segment *seg, int worker, char *path, meta_entry *out) {
+    if (seg == NULL || path == NULL)
+        return 0;
+    size_t len = strlen(path);
+    if (len >= META_PATH_MAX) {
+        shm_count(seg, worker, STAT_META_MISSES);
+        return 0;
+    }
+    uint64_t h = pack_hash(path, len);
+    meta_entry *set = &seg->meta[(h % (META_SLOTS / META_WAYS)) * META_WAYS];
+    time_t now = time(NULL);
+    for (int i = 0; i < META_WAYS; i++) {
+        meta_entry *e = &set[i];
+        if (__atomic_load_n(&e->hash, __ATOMIC_RELAXED) != h) //cheap check before copying the whole entry
+            continue;
+        if (copy_entry(e, out) && out->hash == h && out->expires > now && strcmp(out->path, path) == 0) {
+            shm_count(seg, worker, STAT_META_HITS);
+            return 1;
+        }
+    }
+    shm_count(seg, worker, STAT_META_MISSES);
+    return 0;
+}
+
+/**
+ * meta_generation returns the generation of the cache, to pass to meta_store.
+ */
+uint64_t meta_generation(shm_segment *seg) {
+    return __atomic_load_n(&seg->meta_gen, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * meta_store saves e (e->path is the key) for ttl seconds, unless an entry was invalidated since generation gen.
+ */
+void meta_store(shm_segment *seg, meta_entry *e, int ttl, uint64_t gen) {
+    if (seg == NULL || e == NULL)
+        return;
+    size_t len = strnlen(e->path, META_PATH_MAX);
+    if (len >= META_PATH_MAX)
+        return;
+    uint64_t h = pack_hash(e->path, len);
+    meta_entry *set = &seg->meta[(h % (META_SLOTS / META_WAYS)) * META_WAYS];
+    time_t now = time(NULL);
+    if (lock_meta(seg) < 0)
+        return;
+    if (seg->meta_gen != gen) { //it may have changed after it was looked at
+        pthread_mutex_unlock(&seg->meta_lock);
+        return;
+    }
+    meta_entry *slot = NULL;
+    for (int i = 0; i < META_WAYS && slot == NULL; i++) //the same path
+        if (set[i].hash == h && set[i].expires != 0 && strcmp(set[i].path, e->path) == 0)
+            slot = &set[i];
+    for (int i = 0; i < META_WAYS && slot == NULL; i++) //an empty or expired entry
+        if (set[i].expires <= now)
+            slot = &set[i];
+    if (slot == NULL) { //the one that expires first
+        slot = &set[0];
+        for (int i = 1; i < META_WAYS; i++)
+            if (set[i].expires < slot->expires)
+                slot = &set[i];
+    }
+    uint32_t seq = slot->seq;
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&slot->hash, h, __ATOMIC_RELAXED);
+    slot->expires = now + ttl;
+    slot->route = e->route;
+    slot->index_html = e->index_html;
+    slot->mode = e->mode;
+    slot->size = e->size;
+    slot->mtime = e->mtime;
+    slot->ino = e->ino;
+    memcpy(slot->etag, e->etag, META_ETAG_MAX);
+    slot->etag[META_ETAG_MAX - 1] = '\0';
+    memcpy(slot->path, e->path, len + 1);
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&seg->meta_lock);
+}
+
+/**
+ * meta_invalidate drops the entry of path. returns 1 if there was one, 0 o.w
+ */
+int meta_invalidate(shm_segment *seg, char *path) {
+    size_t len = strlen(path);
+    uint64_t h = pack_hash(path, len);
+    meta_entry *set = &seg->meta[(h % (META_SLOTS / META_WAYS)) * META_WAYS];
+    int dropped = 0;
+    if (lock_meta(seg) < 0)
+        return 0;
+    __atomic_store_n(&seg->meta_gen, seg->meta_gen + 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < META_WAYS && len < META_PATH_MAX; i++)
+        if (set[i].hash == h && set[i].expires != 0 && strcmp(set[i].path, path) == 0) {
+            drop_entry(&set[i]);
+            dropped = 1;
+        }
+    pthread_mutex_unlock(&seg->meta_lock);
+    return dropped;
+}
+
+/**
+ * meta_invalidate_tree drops the entries of every path that starts with prefix. returns how many.
+ */
+int meta_invalidate_tree(shm_segment *seg, char *prefix) {
+    size_t len = strlen(prefix);
+    int dropped = 0;
+    if (lock_meta(seg) < 0)
+        return 0;
+    __atomic_store_n(&seg->meta_gen, seg->meta_gen + 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < META_SLOTS; i++)
+        if (seg->meta[i].expires != 0 && strncmp(seg->meta[i].path, prefix, len) == 0) {
+            drop_entry(&seg->meta[i]);
+            dropped++;
+        }
+    pthread_mutex_unlock(&seg->meta_lock);
+    return dropped;
+}
+
+/**
+ * meta_clear drops all the entries.
+ */
+void meta_clear(shm_segment *seg) {
+    meta_invalidate_tree(seg, "");
+}
+
+/**
+ * destroy_shm unmaps the segment.
+ */
+void destroy_shm(shm_segment *seg) {
+    if (seg == NULL)
+        return;
+    munmap(seg, sizeof(shm_segment));
+}
+
+/**takes the writers lock. if its last owner died holding it, the entries it was writing are dropped first.
+ * returns 0 on succsess, -1 o.w*/
+int lock_meta(shm_segment *seg) {
+    int rc = pthread_mutex_lock(&seg->meta_lock);
+    if (rc == EOWNERDEAD) {
+        repair_meta(seg);
+        pthread_mutex_consistent(&seg->meta_lock);
+        return 0;
+    }
+    return rc == 0 ? 0 : -1;
+}
+
+/**copies e to out without the lock. returns 1 if the copy is whole, 0 if a writer kept changing e*/
+int copy_entry(meta_entry *e, meta_entry *out) {
+    for (int tries = 0; tries < READ_TRIES; tries++) {
+        uint32_t seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) //a writer is in the middle of it
+            continue;
+        memcpy(out, e, sizeof(meta_entry));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq)
+            continue;
+        out->path[META_PATH_MAX - 1] = '\0';
+        out->etag[META_ETAG_MAX - 1] = '\0';
+        return 1;
+    }
+    return 0;
+}
+
+/**empties e, the way a writer changes an entry (called with the writers lock)*/
+void drop_entry(meta_entry *e) {
+    uint32_t seq = e->seq;
+    __atomic_store_n(&e->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&e->hash, 0, __ATOMIC_RELAXED);
+    e->expires = 0;
+    __atomic_store_n(&e->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/**drops the entries left in the middle of a write (odd sequence number). called with the writers lock*/
+void repair_meta(shm_segment *seg) {
+    for (int i = 0; i < META_SLOTS; i++) {
+        meta_entry *e = &seg->meta[i];
+        if ((e->seq & 1) == FLAG_OFF)
+            continue;
+        e->expires = 0;
+        e->hash = 0;
+        __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+    }
+}
@@ -0,0 +1,165 @@
+#ifndef EX3_SHM_H
+#define EX3_SHM_H
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include "streamer.h"
+
+/**
+ * shm.h
+ *
+ * This file declares the shared segment: one anonymous MAP_SHARED mapping created before the workers are
+ * forked, so all of them (and the master) see the same memory. It holds:
+ *      1) the request quota: <max-number-of-request> is counted across all the workers.
+ *      2) per worker counters, summed by the master (and printed on SIGUSR1), those of its streamer included.
+ *      3) the metadata cache: what resolve_path() found for a path (the route, the stat fields and the ETag),
+ *         so a path looked up by one worker is not stat'ed (and its folders walked) again by the others.
+ * The cache is read-mostly: readers take no lock (every entry has a sequence number, odd while it's being
+ * written), writers take a robust process-shared mutex, so a worker that dies holding it doesn't block the rest.
+ * While the file system watcher (see fswatch.h) sees every change of the served tree, entries are trusted for
+ * META_WATCHED_TTL seconds and are dropped by meta_invalidate* when their path changes.
+ */
+
+#define MAX_WORKERS 64
+#define META_SLOTS 4096             //entries of the metadata cache
+#define META_WAYS 4                 //a path can be in one of this many entries
+#define META_TTL 2                  //seconds an entry is trusted without looking at the file system again
+#define META_WATCHED_TTL 600        //the same, for an entry the watcher drops when its path changes
+#define META_PATH_MAX 256           //longer paths are not cached
+#define META_ETAG_MAX 64
+
+/**the counters of every worker*/
+#define STAT_CONNECTIONS 0
+#define STAT_REQUESTS 1             //HTTP/1.x requests and HTTP/2 streams
+#define STAT_H2_STREAMS 2
+#define STAT_FILES 3
+#define STAT_DIRS 4
+#define STAT_PACKED 5
+#define STAT_PROXIED 6
+#define STAT_NOT_MODIFIED 7
+#define STAT_ERRORS 8
+#define STAT_META_HITS 9
+#define STAT_META_MISSES 10
+#define SHM_NUM_STATS 11
+
+
+/**
+ * one worker (process) as seen by the master
+ */
+typedef struct shm_worker_st {
+    pid_t pid;                      //0 when not running
+    time_t started;
+    long restarts;
+    long stats[SHM_NUM_STATS];      //updated with atomic adds by the threads of the worker
+    stream_stats stream;            //the counters of its streaming engine
+} shm_worker;
+
+
+/**
+ * what resolve_path() found for a path
+ */
+typedef struct meta_entry_st {
+    uint32_t seq;                   //odd while the entry is being written
+    uint64_t hash;
+    time_t expires;                 //0 for an empty entry
+    int route;                      //ROUTE_FILE, ROUTE_DIR or an error status
+    int index_html;                 //1 if the route is the index.html of the directory
+    mode_t mode;
+    off_t size;
+    time_t mtime;
+    ino_t ino;
+    char etag[META_ETAG_MAX];
+    char path[META_PATH_MAX];
+} meta_entry;
+
+
+/**
+ * The segment
+ */
+typedef struct _shm_segment_st {
+    int num_workers;
+    long max_requests;
+    long accepted;                  //requests claimed by the workers so far
+    pthread_mutex_t meta_lock;      //robust and process shared, taken by the cache writers only
+    uint64_t meta_gen;              //bumped by every invalidation, see meta_store
+    int watched;                    //1 while the watcher sees every change of the served tree
+    long fs_changes;                //events of the watcher (updated by its thread only)
+    long fs_dropped;                //entries it invalidated
+    long fs_prewarmed;              //entries it looked up again right away
+    shm_worker workers[MAX_WORKERS];
+    meta_entry meta[META_SLOTS];
+} shm_segment;
+
+
+/**
+ * create_shm maps the segment for num_workers workers (1 when there are no workers) sharing
+ * max_requests requests. returns NULL on failure.
+ */
+shm_segment *create_shm(int num_workers, long max_requests);
+
+/**
+ * shm_claim reserves up to want requests of the quota. returns how many were reserved (0 when it's used up).
+ * shm_unclaim gives back n of them (reserved but not used).
+ */
+int shm_claim(shm_segment *seg, int want);
+
+void shm_unclaim(shm_segment *seg, int n);
+
+/**
+ * shm_exhausted returns 1 if all the requests of the quota were used.
+ */
+int shm_exhausted(shm_segment *seg);
+
+/**
+ * shm_count adds 1 to counter stat of worker.
+ */
+void shm_count(shm_segment *seg, int worker, int stat);
+
+/**
+ * shm_print_stats prints the counters of every worker and their sum.
+ */
+void shm_print_stats(shm_segment *seg, FILE *out);
+
+/**
+ * meta_entry_at copies entry i (0 to META_SLOTS-1) of the cache to out. returns 1 if it holds a fresh entry, 0 o.w
+ */
+int meta_entry_at(shm_segment *seg, int i, meta_entry *out);
+
+/**
+ * meta_lookup copies the fresh entry of path to out. returns 1 if found, 0 o.w
+ * (the lookup is counted as a hit/miss of worker).
+ */
+int meta_lookup(shm_segment *seg, int worker, char *path, meta_entry *out);
+
+/**
+ * meta_generation returns the generation of the cache, to pass to meta_store: it should be taken before
+ * looking at the file system.
+ */
+uint64_t meta_generation(shm_segment *seg);
+
+/**
+ * meta_store saves e (e->path is the key) for ttl seconds, unless an entry was invalidated since generation
+ * gen (what was found may be from before the change then).
+ */
+void meta_store(shm_segment *seg, meta_entry *e, int ttl, uint64_t gen);
+
+/**
+ * meta_invalidate drops the entry of path. returns 1 if there was one, 0 o.w
+ * meta_invalidate_tree drops the entries of every path that starts with prefix. returns how many.
+ * meta_clear drops all the entries.
+ */
+int meta_invalidate(shm_segment *seg, char *path);
+
+int meta_invalidate_tree(shm_segment *seg, char *prefix);
+
+void meta_clear(shm_segment *seg);
+
+/**
+ * destroy_shm unmaps the segment.
+ */
+void destroy_shm(shm_segment *seg);
+
+
+#endif
@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "singleflight.h"
+
+#define FLAG_OFF 0
+#define FLAG_ON 1
+
+
+/**
+ * @author: Daniel Gabay
+ * singleflight.c
+ * --------------------------------------------------------------------------------
+ * This file implements the functionality of singleflight.h
+ * The first caller for a key (the "leader") inserts a sf_call into the table, releases the lock
+ * and runs the fill function. Any caller that finds the key in the table while the call is in flight
+ * waits on the call's condition variable instead of doing the work again.
+ * When the leader is done, the call is removed from the table (so the next request after it will
+ * do a fresh fill) and the waiters are woken. The result is freed by the last one who releases it.
+ */
+
+/**forward declerations*/
+unsigned int sf_hash(char *key);
+sf_call *sf_find(singleflight *sf, char *key, unsigned int h);
+void sf_unlink(singleflight *sf, sf_call *call, unsigned int h);
+void free_call(sf_call *call);
+
+
+/**
+ * create_singleflight allocates and initialize an empty table. returns NULL on failure.
+ */
+singleflight *create_singleflight() {
+    singleflight *sf = (singleflight *) malloc(sizeof(singleflight));
+    if (sf == NULL)
+        return NULL;
+    for (int i = 0; i < SF_BUCKETS; i++)
+        sf->buckets[i] = NULL;
+    pthread_mutex_init(&sf->lock, NULL);
+    return sf;
+}
+
+/**
+ * sf_do runs fill(call, arg) for key unless there is already a call in flight for the same key,
+ * in that case it waits for that call and share its result.
+ */
+sf_call *sf_do(singleflight *sf, char *key, sf_fill_fn fill, void *arg) {
+    if (sf == NULL || key == NULL || fill == NULL)
+        return NULL;
+    unsigned int h = sf_hash(key);
+    pthread_mutex_lock(&sf->lock);
+    sf_call *call = sf_find(sf, key, h);
+    if (call != NULL) { //someone is already doing the work -> wait for him
+        call->refs++;
+        while (call->done == FLAG_OFF)
+            pthread_cond_wait(&call->cond_done, &sf->lock);
+        pthread_mutex_unlock(&sf->lock);
+        return call;
+    }
+    /*we are the leader, publish the call so others can join it*/
+    call = (sf_call *) malloc(sizeof(sf_call));
+    if (call == NULL) {
+        pthread_mutex_unlock(&sf->lock);
+        return NULL;
+    }
+    call->key = (char *) malloc(sizeof(char) * (strlen(key) + 1));
+    if (call->key == NULL) {
+        free(call);
+        pthread_mutex_unlock(&sf->lock);
+        return NULL;
+    }
+    strcpy(call->key, key);
+    call->data = NULL;
+    call->len = 0;
+    call->status = 0;
+    call->done = FLAG_OFF;
+    call->refs = 1;
+    pthread_cond_init(&call->cond_done, NULL);
+    call->next = sf->buckets[h];
+    sf->buckets[h] = call;
+    pthread_mutex_unlock(&sf->lock);
+
+    int status = fill(call, arg); //the actual work is done without holding the lock
+
+    pthread_mutex_lock(&sf->lock);
+    call->status = status;
+    call->done = FLAG_ON;
+    sf_unlink(sf, call, h); //new callers from now on will start a new flight
+    pthread_cond_broadcast(&call->cond_done);
+    pthread_mutex_unlock(&sf->lock);
+    return call;
+}
+
+/**
+ * sf_release gives back a result returned by sf_do. the last holder frees it.
+ */
+void sf_release(singleflight *sf, sf_call *call) {
+    if (sf == NULL || call == NULL)
+        return;
+    pthread_mutex_lock(&sf->lock);
+    call->refs--;
+    int last = (call->refs == 0);
+    pthread_mutex_unlock(&sf->lock);
+    if (last)
+        free_call(call);
+}
+
+/**
+ * destroy_singleflight frees the table. must be called when nothing is in flight.
+ */
+void destroy_singleflight(singleflight *sf) {
+    if (sf == NULL)
+        return;
+    pthread_mutex_destroy(&sf->lock);
+    free(sf);
+}
+
+/**
+ * djb2 hash of the key, reduced to bucket index
+ */
+unsigned int sf_hash(char *key) {
+    unsigned int h = 5381;
+    while (*key)
+        h = h * 33 + (unsigned char) *key++;
+    return h % SF_BUCKETS;
+}
+
+/**
+ * returns the call in flight for key, or NULL. must be called with the lock held.
+ */
+sf_call *sf_find(singleflight *sf, char *key, unsigned int h) {
+    for (sf_call *c = sf->buckets[h]; c != NULL; c = c->next)
+        if (strcmp(c->key, key) == 0)
+            return c;
+    return NULL;
+}
+
+/**
+ * remove call from its bucket. must be called with the lock held.
+ */
+void sf_unlink(singleflight *sf, sf_call *call, unsigned int h) {
+    sf_call **pp = &sf->buckets[h];
+    while (*pp != NULL) {
+        if (*pp == call) {
+            *pp = call->next;
+            call->next = NULL;
+            return;
+        }
+        pp = &(*pp)->next;
+    }
+}
+
+/**
+ * free a call and its result
+ */
+void free_call(sf_call *call) {
+    pthread_cond_destroy(&call->cond_done);
+    if (call->data != NULL)
+        free(call->data);
+    free(call->key);
+    free(call);
+}
@@ -0,0 +1,69 @@
+#ifndef EX3_SINGLEFLIGHT_H
+#define EX3_SINGLEFLIGHT_H
+#include <pthread.h>
+
+/**
+ * singleflight.h
+ *
+ * This file declares a "single flight" layer: concurrent callers that ask for the same key
+ * share one execution of the (expensive) fill function instead of running it each one.
+ * Nothing is cached - once the leader finished and all waiters took the result, the entry is gone.
+ */
+
+// number of buckets in the in-flight table
+#define SF_BUCKETS 64
+
+
+/**
+ * one in-flight call, shared by the leader and all the callers waiting on it
+ */
+typedef struct sf_call_st {
+    char *key;              //the key the call was made for
+    char *data;             //result buffer (built by the fill function), may be NULL
+    int len;                //number of bytes in data
+    int status;             //return value of the fill function
+    int done;               //1 when the leader finished the fill function
+    int refs;               //leader + waiters still holding the result
+    pthread_cond_t cond_done;   //waiters sleep here until done is on
+    struct sf_call_st *next;    //next call in the same bucket
+} sf_call;
+
+
+/**
+ * The in-flight table
+ */
+typedef struct _singleflight_st {
+    sf_call *buckets[SF_BUCKETS];   //calls currently in flight, by key hash
+    pthread_mutex_t lock;           //lock on the table and on every call's refs/done
+} singleflight;
+
+
+// "sf_fill_fn" is the function that does the real work for a key.
+// It should set call->data (malloc'ed, freed by the layer) and call->len,
+// and returns a status that is shared with all the waiters.
+typedef int (*sf_fill_fn)(sf_call *call, void *arg);
+
+/**
+ * create_singleflight allocates and initialize an empty table. returns NULL on failure.
+ */
+singleflight *create_singleflight();
+
+/**
+ * sf_do runs fill(call, arg) for key unless there is already a call in flight for the same key,
+ * in that case it waits for that call and share its result.
+ * The returned call must be given back with sf_release(). returns NULL on malloc failure.
+ */
+sf_call *sf_do(singleflight *sf, char *key, sf_fill_fn fill, void *arg);
+
+/**
+ * sf_release gives back a result returned by sf_do. the last holder frees it.
+ */
+void sf_release(singleflight *sf, sf_call *call);
+
+/**
+ * destroy_singleflight frees the table. must be called when nothing is in flight.
+ */
+void destroy_singleflight(singleflight *sf);
+
+
+#endif
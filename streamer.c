@@ -0,0 +1,367 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <time.h>
+#include "streamer.h"
+
+#define FLAG_OFF 0
+#define FLAG_ON 1
+#define MAX_EVENTS 64
+#define TRANSFER_AGAIN 0
+#define TRANSFER_DONE 1
+#define TRANSFER_FAILED -1
+
+
+/**
+ * @author: Daniel Gabay
+ * streamer.c
+ * --------------------------------------------------------------------------------
+ * This file implements the functionality of streamer.h
+ * A new transfer is given to the threads round robin. The thread registers the client socket
+ * for EPOLLOUT and "pumps" it whenever it's writable: first the rest of the header, then up to
+ * STREAM_CHUNK bytes of the file with sendfile(). epoll is level triggered, so a transfer that
+ * used its chunk and is still writable is simply reported again on the next epoll_wait,
+ * after the other ready transfers got their turn.
+ * Note: 1)the transfers list of a thread is changed only under its lock, because stream_file()
+ *         is called by the threadpool threads.
+ *       2)Read-ahead: the file is opened POSIX_FADV_SEQUENTIAL, and before the transfer gets to the end of what
+ *         was asked from the disk, the next window is asked for with POSIX_FADV_WILLNEED, which starts the reads
+ *         and returns, so sendfile() finds the pages in memory instead of waiting for the disk.
+ *       3)Dropping: POSIX_FADV_DONTNEED drops clean pages no one maps, for every reader of the file. a concurrent
+ *         transfer of the same file that is behind reads them from the disk again, which is the price of keeping
+ *         the hot files in memory.
+ */
+
+/**forward declerations*/
+void *stream_loop(void *p);
+int pump(streamer *s, transfer_t *t);
+void end_transfer(stream_worker *w, transfer_t *t);
+void drop_idle(stream_worker *w);
+int streamer_stopping(streamer *s);
+long now_ms();
+
+
+/**
+ * create_streamer creates the engine with num_threads threads, counting in stats. returns NULL on failure.
+ */
+streamer *create_streamer(int num_threads, stream_stats *stats) {
+    if (num_threads <= 0 || num_threads > MAXT_IN_STREAMER)
+        return NULL;
+    streamer *s = (streamer *) malloc(sizeof(streamer));
+    if (s == NULL)
+        return NULL;
+    s->workers = (stream_worker *) malloc(sizeof(stream_worker) * num_threads);
+    if (s->workers == NULL) {
+        free(s);
+        return NULL;
+    }
+    s->num_threads = 0;
+    s->next = 0;
+    s->shutdown = FLAG_OFF;
+    memset(&s->own_stats, 0, sizeof(stream_stats));
+    s->stats = stats != NULL ? stats : &s->own_stats;
+    pthread_mutex_init(&s->lock, NULL);
+    for (int i = 0; i < num_threads; i++) {
+        stream_worker *w = &s->workers[i];
+        w->head = NULL;
+        w->active = 0;
+        w->owner = s;
+        w->epfd = epoll_create1(EPOLL_CLOEXEC);
+        w->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL; //NULL is the wake up event
+        if (w->epfd < 0 || w->wakefd < 0 || epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->wakefd, &ev) < 0) {
+            perror("streamer epoll");
+            if (w->epfd >= 0) close(w->epfd);
+            if (w->wakefd >= 0) close(w->wakefd);
+            destroy_streamer(s);
+            return NULL;
+        }
+        pthread_mutex_init(&w->lock, NULL);
+        if (pthread_create(&w->thread, NULL, stream_loop, (void *) w) != 0) {
+            pthread_mutex_destroy(&w->lock);
+            close(w->epfd);
+            close(w->wakefd);
+            destroy_streamer(s);
+            return NULL;
+        }
+        s->num_threads++;
+    }
+    return s;
+}
+
+/**
+ * stream_file hands a response to the engine. on succsess the engine owns sockfd, filefd and header.
+ */
+int stream_file(streamer *s, int sockfd, int filefd, off_t size, char *header, int header_len) {
+    if (s == NULL || sockfd < 0 || filefd < 0)
+        return -1;
+    transfer_t *t = (transfer_t *) malloc(sizeof(transfer_t));
+    if (t == NULL)
+        return -1;
+    int flags = fcntl(sockfd, F_GETFL, 0);
+    if (flags < 0 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        free(t);
+        return -1;
+    }
+    t->sockfd = sockfd;
+    t->filefd = filefd;
+    t->offset = 0;
+    t->size = size;
+    t->header = header;
+    t->header_len = header ? header_len : 0;
+    t->header_sent = 0;
+    t->last_progress = time(NULL);
+    t->prev = NULL;
+    stream_cache_init(&t->cache, filefd, size);
+
+    pthread_mutex_lock(&s->lock);
+    stream_worker *w = &s->workers[s->next];
+    s->next = (s->next + 1) % s->num_threads;
+    pthread_mutex_unlock(&s->lock);
+
+    struct epoll_event ev;
+    ev.events = EPOLLOUT;
+    ev.data.ptr = t;
+    pthread_mutex_lock(&w->lock);
+    t->next = w->head;
+    if (w->head != NULL)
+        w->head->prev = t;
+    w->head = t;
+    w->active++;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, sockfd, &ev) < 0) {
+        /*undo, the caller still owns everything*/
+        w->head = t->next;
+        if (w->head != NULL)
+            w->head->prev = NULL;
+        w->active--;
+        pthread_mutex_unlock(&w->lock);
+        fcntl(sockfd, F_SETFL, flags);
+        free(t);
+        return -1;
+    }
+    pthread_mutex_unlock(&w->lock);
+    __atomic_fetch_add(&s->stats->transfers, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/**
+ * destroy_streamer waits for all transfers to finish, stops the threads and frees the engine.
+ */
+void destroy_streamer(streamer *s) {
+    if (s == NULL)
+        return;
+    pthread_mutex_lock(&s->lock);
+    s->shutdown = FLAG_ON;
+    pthread_mutex_unlock(&s->lock);
+    uint64_t one = 1;
+    for (int i = 0; i < s->num_threads; i++)
+        if (write(s->workers[i].wakefd, &one, sizeof(one)) < 0)
+            perror("streamer wake");
+    for (int i = 0; i < s->num_threads; i++) {
+        pthread_join(s->workers[i].thread, NULL);
+        close(s->workers[i].epfd);
+        close(s->workers[i].wakefd);
+        pthread_mutex_destroy(&s->workers[i].lock);
+    }
+    pthread_mutex_destroy(&s->lock);
+    free(s->workers);
+    free(s);
+}
+
+/**
+ * the work function of a streaming thread: pump every writable transfer until shutdown
+ * was asked and there are no transfers left.
+ */
+void *stream_loop(void *p) {
+    stream_worker *w = (stream_worker *) p;
+    struct epoll_event events[MAX_EVENTS];
+    time_t last_sweep = time(NULL);
+    while (1) {
+        pthread_mutex_lock(&w->lock);
+        int active = w->active;
+        pthread_mutex_unlock(&w->lock);
+        if (active == 0 && streamer_stopping(w->owner))
+            return NULL;
+
+        int n = epoll_wait(w->epfd, events, MAX_EVENTS, 1000);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            return NULL;
+        }
+        for (int i = 0; i < n; i++) {
+            transfer_t *t = (transfer_t *) events[i].data.ptr;
+            if (t == NULL) { //wake up, just check the shutdown flag again
+                uint64_t val;
+                if (read(w->wakefd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+                    perror("streamer wake");
+                continue;
+            }
+            int rc = (events[i].events & EPOLLERR) ? TRANSFER_FAILED : pump(w->owner, t);
+            if (rc != TRANSFER_AGAIN)
+                end_transfer(w, t);
+        }
+        time_t now = time(NULL);
+        if (now != last_sweep) {
+            drop_idle(w);
+            last_sweep = now;
+        }
+    }
+}
+
+/**
+ * sends what can be sent now. returns TRANSFER_DONE, TRANSFER_FAILED or TRANSFER_AGAIN
+ */
+int pump(streamer *s, transfer_t *t) {
+    while (t->header_sent < t->header_len) {
+        ssize_t n = send(t->sockfd, t->header + t->header_sent, t->header_len - t->header_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? TRANSFER_AGAIN : TRANSFER_FAILED;
+        }
+        t->header_sent += n;
+        t->last_progress = time(NULL);
+    }
+    off_t budget = STREAM_CHUNK, start = t->offset;
+    stream_prefetch(&t->cache, t->offset, s->stats);
+    while (t->offset < t->size && budget > 0) {
+        off_t left = t->size - t->offset;
+        ssize_t n = sendfile(t->sockfd, t->filefd, &t->offset, left < budget ? left : budget);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? TRANSFER_AGAIN : TRANSFER_FAILED;
+        }
+        if (n == 0) //the file got shorter than its Content-Length, nothing to do but close
+            return TRANSFER_FAILED;
+        budget -= n;
+        t->last_progress = time(NULL);
+    }
+    __atomic_fetch_add(&s->stats->bytes, (long) (t->offset - start), __ATOMIC_RELAXED);
+    if (t->offset >= t->size)
+        return TRANSFER_DONE;
+    stream_drop_sent(&t->cache, t->offset, 0, s->stats);
+    return TRANSFER_AGAIN;
+}
+
+/**
+ * stream_cache_init starts the page cache state of filefd, read from its start.
+ */
+void stream_cache_init(stream_cache *c, int filefd, off_t size) {
+    c->filefd = filefd;
+    c->size = size;
+    c->ra_end = 0;
+    c->ra_window = STREAM_RA_MIN;
+    c->ra_issued_ms = 0;
+    c->dropped = 0;
+    posix_fadvise(filefd, 0, 0, POSIX_FADV_SEQUENTIAL); //a bigger read-ahead of the kernel as well
+}
+
+/**
+ * stream_prefetch asks the disk for the next read-ahead window when the reader is in the middle of the last one.
+ * the window grows while the client uses a window faster than STREAM_RA_FAST_MS, and shrinks when it's slow
+ */
+void stream_prefetch(stream_cache *c, off_t offset, stream_stats *stats) {
+    if (c->ra_end >= c->size || offset + c->ra_window / 2 < c->ra_end)
+        return;
+    long now = now_ms();
+    if (c->ra_end > 0) { //the client got to the middle of the last window
+        if (now - c->ra_issued_ms < STREAM_RA_FAST_MS && c->ra_window < STREAM_RA_MAX) {
+            c->ra_window *= 2;
+            __atomic_fetch_add(&stats->grown, 1, __ATOMIC_RELAXED);
+        } else if (now - c->ra_issued_ms > STREAM_RA_SLOW_MS && c->ra_window > STREAM_RA_MIN)
+            c->ra_window /= 2;
+    }
+    off_t from = c->ra_end > offset ? c->ra_end : offset;
+    off_t len = c->size - from < c->ra_window ? c->size - from : c->ra_window;
+    if (posix_fadvise(c->filefd, from, len, POSIX_FADV_WILLNEED) != 0)
+        return;
+    c->ra_end = from + len;
+    c->ra_issued_ms = now;
+    __atomic_fetch_add(&stats->windows, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->prefetched, (long) len, __ATOMIC_RELAXED);
+}
+
+/**
+ * stream_drop_sent drops the pages that were sent from the page cache (files above STREAM_DROP_SIZE only):
+ * STREAM_DROP_STEP at a time and STREAM_DROP_STEP behind offset, or up to offset when the reader is done
+ */
+void stream_drop_sent(stream_cache *c, off_t offset, int done, stream_stats *stats) {
+    if (c->size <= STREAM_DROP_SIZE || (!done && offset - c->dropped < 2 * STREAM_DROP_STEP))
+        return;
+    off_t upto = done ? offset : offset - STREAM_DROP_STEP;
+    if (upto <= c->dropped)
+        return;
+    if (posix_fadvise(c->filefd, c->dropped, upto - c->dropped, POSIX_FADV_DONTNEED) != 0)
+        return;
+    __atomic_fetch_add(&stats->dropped, (long) (upto - c->dropped), __ATOMIC_RELAXED);
+    c->dropped = upto;
+}
+
+/**
+ * returns the time in milliseconds (CLOCK_MONOTONIC)
+ */
+long now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * removes the transfer from its thread, closes the client and the file and frees the transfer
+ */
+void end_transfer(stream_worker *w, transfer_t *t) {
+    pthread_mutex_lock(&w->lock);
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, t->sockfd, NULL);
+    if (t->prev != NULL)
+        t->prev->next = t->next;
+    else
+        w->head = t->next;
+    if (t->next != NULL)
+        t->next->prev = t->prev;
+    w->active--;
+    pthread_mutex_unlock(&w->lock);
+    stream_drop_sent(&t->cache, t->offset, 1, w->owner->stats); //what's still in the socket buffer stays (its pages are in use)
+    shutdown(t->sockfd, SHUT_RDWR);
+    close(t->sockfd);
+    close(t->filefd);
+    if (t->header != NULL)
+        free(t->header);
+    free(t);
+}
+
+/**
+ * ends the transfers that did not make progress for STREAM_IDLE_TIMEOUT seconds
+ */
+void drop_idle(stream_worker *w) {
+    time_t now = time(NULL);
+    pthread_mutex_lock(&w->lock);
+    transfer_t *t = w->head;
+    pthread_mutex_unlock(&w->lock);
+    while (t != NULL) { //only this thread removes transfers, so the list can be walked without the lock
+        transfer_t *next = t->next;
+        if (now - t->last_progress > STREAM_IDLE_TIMEOUT)
+            end_transfer(w, t);
+        t = next;
+    }
+}
+
+/**
+ * returns 1 if destroy_streamer was called
+ */
+int streamer_stopping(streamer *s) {
+    pthread_mutex_lock(&s->lock);
+    int stop = s->shutdown;
+    pthread_mutex_unlock(&s->lock);
+    return stop;
+}
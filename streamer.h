@@ -0,0 +1,141 @@
+#ifndef EX3_STREAMER_H
+#define EX3_STREAMER_H
+#include <pthread.h>
+#include <sys/types.h>
+#include <time.h>
+
+/**
+ * streamer.h
+ *
+ * This file declares the streaming engine: a few threads that send large files to many clients at once.
+ * Each thread owns an epoll instance and a list of transfers. The client sockets are non-blocking,
+ * a transfer sends its header and then the file with sendfile() whenever its socket is writable,
+ * at most STREAM_CHUNK bytes at a time so slow clients never hold a thread.
+ * Page cache: the file is read ahead of the transfer a window at a time (the window grows while the client keeps
+ * up with it), and the part of a file above STREAM_DROP_SIZE that was sent is dropped from the page cache, so one
+ * big download doesn't push the small hot files out of it.
+ */
+
+// maximum number of streaming threads
+#define MAXT_IN_STREAMER 16
+// bytes sent from one transfer before moving to the next ready one
+#define STREAM_CHUNK (256 * 1024)
+// a transfer that did not make progress for this many seconds is dropped
+#define STREAM_IDLE_TIMEOUT 60
+// read-ahead window of a transfer: asked from the disk (POSIX_FADV_WILLNEED) when the transfer is in the middle
+// of the last one. doubled when the client used the last window in less than STREAM_RA_FAST_MS, halved when it
+// took more than STREAM_RA_SLOW_MS
+#define STREAM_RA_MIN (512 * 1024)
+#define STREAM_RA_MAX (8 * 1024 * 1024)
+#define STREAM_RA_FAST_MS 250
+#define STREAM_RA_SLOW_MS 2000
+// the sent part of files above this size is dropped from the page cache (POSIX_FADV_DONTNEED), this many bytes
+// at a time, and not the last STREAM_DROP_STEP bytes sent (they may still be in the socket buffer)
+#define STREAM_DROP_SIZE (64 * 1024 * 1024)
+#define STREAM_DROP_STEP (4 * 1024 * 1024)
+
+
+/**
+ * counters of the engine, updated with atomic adds by its threads (they may live in the shared segment)
+ */
+typedef struct stream_stats_st {
+    long transfers;         //files handed to the engine
+    long bytes;             //bytes of the files sent
+    long windows;           //read-ahead windows asked for
+    long prefetched;        //bytes of those windows
+    long grown;             //times a window was doubled
+    long dropped;           //bytes dropped from the page cache after they were sent
+} stream_stats;
+
+
+/**
+ * the page cache state of a file that is read front to back: a transfer, or a file body of HTTP/2
+ */
+typedef struct stream_cache_st {
+    int filefd;
+    off_t size;
+    off_t ra_end;           //the file was asked for up to here
+    off_t ra_window;        //size of the next read-ahead window
+    long ra_issued_ms;      //when the last window was asked for
+    off_t dropped;          //the file was dropped from the page cache up to here
+} stream_cache;
+
+
+/**
+ * one file being sent to one client
+ */
+typedef struct transfer_st {
+    int sockfd;             //client socket (non-blocking from now on)
+    int filefd;             //the file to send
+    off_t offset;           //next byte of the file to send
+    off_t size;             //size of the file
+    char *header;           //response header (malloc'ed), sent before the file
+    int header_len;
+    int header_sent;        //bytes of the header already sent
+    time_t last_progress;   //last time some bytes were sent
+    stream_cache cache;
+    struct transfer_st *prev, *next;    //list of the transfers of the same thread
+} transfer_t;
+
+
+/**
+ * one streaming thread and its transfers
+ */
+typedef struct stream_worker_st {
+    pthread_t thread;
+    int epfd;               //epoll instance of the transfers of this thread
+    int wakefd;             //eventfd used to wake the thread (on shutdown)
+    transfer_t *head;       //transfers in progress, owned by this thread
+    int active;             //number of transfers in progress
+    pthread_mutex_t lock;   //protects head/active against stream_file() of other threads
+    struct _streamer_st *owner;
+} stream_worker;
+
+
+/**
+ * The engine
+ */
+typedef struct _streamer_st {
+    int num_threads;
+    stream_worker *workers;
+    int next;               //round robin index for new transfers
+    int shutdown;           //1 if destroy was called: finish the transfers and exit
+    pthread_mutex_t lock;   //protects next
+    stream_stats own_stats; //the counters, when the creator did not give others
+    stream_stats *stats;
+} streamer;
+
+
+/**
+ * create_streamer creates the engine with num_threads threads, counting in stats (NULL: counters of its own).
+ * returns NULL on failure.
+ */
+streamer *create_streamer(int num_threads, stream_stats *stats);
+
+/**
+ * stream_file hands a response to the engine: header (malloc'ed, may be NULL) and then size bytes of filefd.
+ * The engine owns sockfd, filefd and header from now on and closes/frees them when the transfer ends.
+ * returns 0 on succsess, -1 o.w (in that case nothing is owned by the engine).
+ */
+int stream_file(streamer *s, int sockfd, int filefd, off_t size, char *header, int header_len);
+
+/**
+ * stream_cache_init starts the page cache state of filefd (size bytes), which will be read from its start.
+ */
+void stream_cache_init(stream_cache *c, int filefd, off_t size);
+
+/**
+ * stream_prefetch asks the disk for the next read-ahead window when the reader, at offset, is in the middle of
+ * the last one. stream_drop_sent drops what's well behind offset from the page cache, or all of it up to offset
+ * when done is 1 (files above STREAM_DROP_SIZE only). both count in stats.
+ */
+void stream_prefetch(stream_cache *c, off_t offset, stream_stats *stats);
+void stream_drop_sent(stream_cache *c, off_t offset, int done, stream_stats *stats);
+
+/**
+ * destroy_streamer waits for all transfers to finish, stops the threads and frees the engine.
+ */
+void destroy_streamer(streamer *s);
+
+
+#endif
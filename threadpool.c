@@ -22,14 +22,32 @@
  *         When the thread "handel" the job, it's actualy calls the function with the argument.
  *       2)In oreder to enalbe a clean working multithreaded program, each time a thread want's to get access
  *         to the queue/threadpool var's, it thread must get the mutex lock, o.w he need to wait.
+ *       3)There is a queue per lane (LANE_SMALL, LANE_BULK). Threads always take LANE_SMALL jobs first,
+ *         and the first num_reserved threads never take LANE_BULK jobs, so a burst of long jobs
+ *         can't make the short ones wait behind them.
+ *       4)Task groups: a helper job holds a reference to its group, because it may run after the group was
+ *         waited for and destroyed (the waiter ran its task). the last one to drop a reference frees the group.
  */
 
 /**forward declerations*/
 work_t *createWorkObj(threadpool *tp, dispatch_fn dispatch_to_here, void *arg);
-void enqueue(threadpool *tp, work_t *job);
-work_t *dequeue(threadpool *tp);
+void enqueue(threadpool *tp, int lane, work_t *job);
+work_t *dequeue(threadpool *tp, int lane);
 void free_queue(work_t *w_head);
 void free_threadpool(threadpool *tp);
+int task_helper(void *arg);
+int run_next_task(task_group *g);
+void release_task_group(task_group *g);
+int run_range(void *arg);
+
+/**
+ * one chunk of parallel_for
+ */
+typedef struct range_task_st {
+    range_fn fn;
+    void *arg;
+    int begin, end;
+} range_task;
 
 
 /**
@@ -43,24 +61,41 @@ void free_threadpool(threadpool *tp);
  * 4. create the threads, the thread init function is do_work and its argument is the initialized threadpool.
  */
 threadpool *create_threadpool(int num_threads_in_pool) {
+    return create_threadpool_lanes(num_threads_in_pool, 0);
+}
+
+/**
+ * create_threadpool_lanes is like create_threadpool, but the first num_reserved threads
+ * serve only LANE_SMALL jobs.
+ */
+threadpool *create_threadpool_lanes(int num_threads_in_pool, int num_reserved) {
     /*input check*/
     if (num_threads_in_pool <= 0 || num_threads_in_pool > MAXT_IN_POOL)
         return NULL;
+    if (num_reserved < 0 || num_reserved >= num_threads_in_pool)
+        return NULL;
     threadpool *tp = (threadpool *) malloc(sizeof(threadpool));
     if (tp == NULL)
         return NULL;
 
     /*initializing vars*/
     tp->num_threads = num_threads_in_pool;
+    tp->num_reserved = num_reserved;
+    tp->next_id = 0;
+    tp->idle_reserved = 0;
     tp->qsize = 0;
 
     /*both head and tail points to NULL*/
-    tp->qhead = NULL;
-    tp->qtail = NULL;
+    for (int i = 0; i < NUM_LANES; i++) {
+        tp->lane_size[i] = 0;
+        tp->qhead[i] = NULL;
+        tp->qtail[i] = NULL;
+    }
 
     pthread_mutex_init(&tp->qlock, NULL);
     pthread_cond_init(&tp->q_empty, NULL);
     pthread_cond_init(&tp->q_not_empty, NULL);
+    pthread_cond_init(&tp->small_not_empty, NULL);
     tp->shutdown = FLAG_OFF;
     tp->dont_accept = FLAG_OFF;
 
@@ -96,21 +131,28 @@ void *do_work(void *p) {
     if(p == NULL)
         return NULL;
     threadpool *tp = (threadpool *) p;
+    pthread_mutex_lock(&tp->qlock);
+    int reserved = (tp->next_id++ < tp->num_reserved); //the first threads to start are the reserved ones
+    pthread_mutex_unlock(&tp->qlock);
     while (1) {
         pthread_mutex_lock(&tp->qlock); //lock mutex
-        if (tp->shutdown == FLAG_ON) {  //destroy is called -> unlock mutex and exit
-            pthread_mutex_unlock(&tp->qlock);
-            return NULL;
+        /*while there is no job this thread may take, wait until signal*/
+        while (tp->shutdown == FLAG_OFF && (reserved ? tp->lane_size[LANE_SMALL] : tp->qsize) == 0) {
+            if (reserved) {
+                tp->idle_reserved++;
+                pthread_cond_wait(&tp->small_not_empty, &tp->qlock);
+                tp->idle_reserved--;
+            } else
+                pthread_cond_wait(&tp->q_not_empty, &tp->qlock);
         }
-        if (tp->qsize == 0) //if there are no jobs, wait until signal
-            pthread_cond_wait(&tp->q_not_empty, &tp->qlock);
-
-        if (tp->shutdown == FLAG_ON) { //check who wakes the thread destroy(if flag is on) or queue_not_empty(flag is off)
+        if (tp->shutdown == FLAG_ON) { //destroy is called -> unlock mutex and exit
             pthread_mutex_unlock(&tp->qlock);
             return NULL;
         }
 
-        work_t *w = dequeue(tp); //get the first job from queue
+        work_t *w = dequeue(tp, LANE_SMALL); //small jobs first
+        if (w == NULL && !reserved)
+            w = dequeue(tp, LANE_BULK);
         if (tp->qsize == 0 && tp->dont_accept == FLAG_ON) //when dont_accept is on and qsize is 0, signal on q_empty to start destroy
             pthread_cond_signal(&tp->q_empty);
         pthread_mutex_unlock(&tp->qlock); //unlock mutex before call the routine
@@ -133,21 +175,83 @@ void *do_work(void *p) {
  * 4. unlock mutex
  */
 void dispatch(threadpool *from_me, dispatch_fn dispatch_to_here, void *arg) {
-    if (from_me == NULL || dispatch_to_here == NULL)
-        return;
+    dispatch_lane(from_me, LANE_SMALL, dispatch_to_here, arg);
+}
+
+/**
+ * dispatch_lane is like dispatch, but enters the job to the queue of the given lane.
+ */
+int dispatch_lane(threadpool *from_me, int lane, dispatch_fn dispatch_to_here, void *arg) {
+    if (from_me == NULL || dispatch_to_here == NULL || lane < 0 || lane >= NUM_LANES)
+        return -1;
     pthread_mutex_lock(&from_me->qlock);
     if (from_me->dont_accept == FLAG_ON) {
         pthread_mutex_unlock(&from_me->qlock);
-        return;
+        return -1;
     }
     work_t *job = createWorkObj(from_me, dispatch_to_here, arg);
     if (!job) {
         pthread_mutex_unlock(&from_me->qlock);
-        return;
+        return -1;
     }
-    enqueue(from_me, job);
-    pthread_cond_signal(&from_me->q_not_empty);
+    enqueue(from_me, lane, job);
+    /*wake a reserved thread only if the idle reserved threads can cover all the small jobs,
+     *o.w (and for bulk jobs) wake one of the other threads*/
+    if (lane == LANE_SMALL && from_me->idle_reserved >= from_me->lane_size[LANE_SMALL])
+        pthread_cond_signal(&from_me->small_not_empty);
+    else
+        pthread_cond_signal(&from_me->q_not_empty);
     pthread_mutex_unlock(&from_me->qlock);
+    return 0;
+}
+
+/**
+ * dispatch_batch enters n jobs to the queue of lane under one lock, and wakes at most n threads.
+ */
+int dispatch_batch(threadpool *from_me, int lane, dispatch_fn dispatch_to_here, void **args, int n) {
+    if (from_me == NULL || dispatch_to_here == NULL || args == NULL || n <= 0 || lane < 0 || lane >= NUM_LANES)
+        return -1;
+    /*the jobs are created before taking the lock, so the lock is held only to link them*/
+    work_t *first = NULL, *last = NULL;
+    for (int i = 0; i < n; i++) {
+        work_t *job = (args[i] != NULL) ? (work_t *) malloc(sizeof(work_t)) : NULL;
+        if (job == NULL) {
+            free_queue(first);
+            return -1;
+        }
+        job->routine = dispatch_to_here;
+        job->arg = args[i];
+        job->next = NULL;
+        if (first == NULL)
+            first = job;
+        else
+            last->next = job;
+        last = job;
+    }
+    pthread_mutex_lock(&from_me->qlock);
+    if (from_me->dont_accept == FLAG_ON) {
+        pthread_mutex_unlock(&from_me->qlock);
+        free_queue(first);
+        return -1;
+    }
+    if (from_me->qhead[lane] == NULL)
+        from_me->qhead[lane] = first;
+    else
+        from_me->qtail[lane]->next = first;
+    from_me->qtail[lane] = last;
+    from_me->qsize += n;
+    from_me->lane_size[lane] += n;
+    /*one wake up per job: idle reserved threads first (small jobs only), then the others*/
+    int wake = (n < from_me->num_threads) ? n : from_me->num_threads;
+    int reserved_wake = (lane == LANE_SMALL) ? from_me->idle_reserved : 0;
+    for (int i = 0; i < wake; i++) {
+        if (i < reserved_wake)
+            pthread_cond_signal(&from_me->small_not_empty);
+        else
+            pthread_cond_signal(&from_me->q_not_empty);
+    }
+    pthread_mutex_unlock(&from_me->qlock);
+    return 0;
 }
 
 /**
@@ -160,12 +264,13 @@ void destroy_threadpool(threadpool *destroyme) {
         return;
     pthread_mutex_lock(&destroyme->qlock);
     destroyme->dont_accept = FLAG_ON; //don't accept any more jobs.
-    if (destroyme->qsize != 0)
-        pthread_cond_wait(&destroyme->q_empty, &destroyme->qlock); //wait until the queue is empty
+    while (destroyme->qsize != 0) //wait until the queue is empty (in a loop, wakeups may be spurious)
+        pthread_cond_wait(&destroyme->q_empty, &destroyme->qlock);
 
     destroyme->shutdown = FLAG_ON; //set shutdown flag on after the queue is empty
     pthread_mutex_unlock(&destroyme->qlock);
     pthread_cond_broadcast(&destroyme->q_not_empty);
+    pthread_cond_broadcast(&destroyme->small_not_empty);
 
     for (int i = 0; i < destroyme->num_threads; i++)
         pthread_join(destroyme->threads[i], NULL); //join all threads
@@ -190,37 +295,39 @@ work_t *createWorkObj(threadpool *tp, dispatch_fn dispatch_to_here, void *arg) {
 }
 
 /**
- * insert job into the queue and update qsize.
+ * insert job into the queue of lane and update qsize.
  */
-void enqueue(threadpool *tp, work_t *job) {
+void enqueue(threadpool *tp, int lane, work_t *job) {
     if(tp == NULL || job == NULL)
         return;
     tp->qsize++;
-    if (tp->qhead == NULL) {
+    tp->lane_size[lane]++;
+    if (tp->qhead[lane] == NULL) {
         /*both head and tail points to the new job*/
-        tp->qhead = job;
-        tp->qtail = job;
+        tp->qhead[lane] = job;
+        tp->qtail[lane] = job;
         return;
     }
     /*set current last job to the new job and promote qtail to point the new last job*/
-    tp->qtail->next = job;
-    tp->qtail = job;
+    tp->qtail[lane]->next = job;
+    tp->qtail[lane] = job;
 
 }
 
 /**
- * when queue is not empty, returns the first job from the queue and update qsize.
+ * when the queue of lane is not empty, returns the first job from it and update qsize.
  */
-work_t *dequeue(threadpool *tp) {
+work_t *dequeue(threadpool *tp, int lane) {
     if(tp == NULL)
         return NULL;
-    if (tp->qhead == NULL)
+    if (tp->qhead[lane] == NULL)
         return NULL;
-    work_t *temp = tp->qhead;
-    tp->qhead = tp->qhead->next;
-    if (tp->qhead == NULL) //means that both qhead && qtail point to the one and only job in queue.
-        tp->qtail = NULL;
+    work_t *temp = tp->qhead[lane];
+    tp->qhead[lane] = tp->qhead[lane]->next;
+    if (tp->qhead[lane] == NULL) //means that both qhead && qtail point to the one and only job in queue.
+        tp->qtail[lane] = NULL;
     tp->qsize--;
+    tp->lane_size[lane]--;
     return temp;
 }
 
@@ -246,6 +353,169 @@ void free_threadpool(threadpool *tp) {
     pthread_mutex_destroy(&tp->qlock);
     pthread_cond_destroy(&tp->q_empty);
     pthread_cond_destroy(&tp->q_not_empty);
-    free_queue(tp->qhead); //just in case of a problem, queue is supposed to be empty already
+    pthread_cond_destroy(&tp->small_not_empty);
+    for (int i = 0; i < NUM_LANES; i++)
+        free_queue(tp->qhead[i]); //just in case of a problem, queue is supposed to be empty already
     free(tp);
 }
+
+/**
+ * create_task_group creates an empty group whose helper jobs are dispatched to lane of tp.
+ */
+task_group *create_task_group(threadpool *tp, int lane) {
+    if (lane < 0 || lane >= NUM_LANES)
+        return NULL;
+    task_group *g = (task_group *) malloc(sizeof(task_group));
+    if (g == NULL)
+        return NULL;
+    g->tp = tp;
+    g->lane = lane;
+    g->head = NULL;
+    g->tail = NULL;
+    g->pending = 0;
+    g->refs = 1; //the owner
+    pthread_mutex_init(&g->lock, NULL);
+    pthread_cond_init(&g->done, NULL);
+    return g;
+}
+
+/**
+ * task_group_spawn adds the task routine(arg) to the group and dispatches a helper job to run it.
+ */
+int task_group_spawn(task_group *g, dispatch_fn routine, void *arg) {
+    if (g == NULL || routine == NULL)
+        return -1;
+    work_t *task = (work_t *) malloc(sizeof(work_t));
+    if (task == NULL)
+        return -1;
+    task->routine = routine;
+    task->arg = arg;
+    task->next = NULL;
+    pthread_mutex_lock(&g->lock);
+    if (g->tail == NULL)
+        g->head = task;
+    else
+        g->tail->next = task;
+    g->tail = task;
+    g->pending++;
+    g->refs++; //the helper's
+    pthread_mutex_unlock(&g->lock);
+    if (g->tp == NULL || dispatch_lane(g->tp, g->lane, task_helper, g) < 0) //the waiter runs it
+        release_task_group(g);
+    return 0;
+}
+
+/**
+ * task_group_wait returns when all the tasks spawned so far finished, running the ones still queued itself.
+ */
+void task_group_wait(task_group *g) {
+    if (g == NULL)
+        return;
+    while (run_next_task(g))
+        ;
+    pthread_mutex_lock(&g->lock);
+    while (g->pending > 0) //the rest are running on other threads
+        pthread_cond_wait(&g->done, &g->lock);
+    pthread_mutex_unlock(&g->lock);
+}
+
+/**
+ * destroy_task_group waits for the tasks and releases the group.
+ */
+void destroy_task_group(task_group *g) {
+    if (g == NULL)
+        return;
+    task_group_wait(g);
+    release_task_group(g);
+}
+
+/**
+ * parallel_for runs fn on chunks of [begin, end) on the threads of tp and the calling thread, and waits for them.
+ */
+int parallel_for(threadpool *tp, int lane, int begin, int end, int chunk, range_fn fn, void *arg) {
+    if (fn == NULL || end < begin)
+        return -1;
+    int n = end - begin, threads = (tp != NULL) ? tp->num_threads : 1;
+    if (chunk <= 0)
+        chunk = (n + threads * CHUNKS_PER_THREAD - 1) / (threads * CHUNKS_PER_THREAD);
+    if (n <= chunk || tp == NULL) { //one chunk: no one to share it with
+        if (n > 0)
+            fn(begin, end, arg);
+        return 0;
+    }
+    int num_chunks = (n + chunk - 1) / chunk;
+    range_task *ranges = (range_task *) malloc(sizeof(range_task) * num_chunks);
+    task_group *g = create_task_group(tp, lane);
+    if (ranges == NULL || g == NULL) {
+        free(ranges);
+        destroy_task_group(g);
+        return -1;
+    }
+    for (int i = 0; i < num_chunks; i++) {
+        ranges[i].fn = fn;
+        ranges[i].arg = arg;
+        ranges[i].begin = begin + i * chunk;
+        ranges[i].end = (ranges[i].begin + chunk < end) ? ranges[i].begin + chunk : end;
+        if (task_group_spawn(g, run_range, &ranges[i]) < 0)
+            run_range(&ranges[i]); //no memory for the task: run it here
+    }
+    destroy_task_group(g);
+    free(ranges);
+    return 0;
+}
+
+/**
+ * the job of a task: runs the next task of its group (if the waiter did not take it already)
+ */
+int task_helper(void *arg) {
+    task_group *g = (task_group *) arg;
+    run_next_task(g);
+    release_task_group(g);
+    return 0;
+}
+
+/**
+ * takes the first queued task of g and runs it. returns 1 if there was one, 0 o.w
+ */
+int run_next_task(task_group *g) {
+    pthread_mutex_lock(&g->lock);
+    work_t *task = g->head;
+    if (task != NULL) {
+        g->head = task->next;
+        if (g->head == NULL)
+            g->tail = NULL;
+    }
+    pthread_mutex_unlock(&g->lock);
+    if (task == NULL)
+        return 0;
+    task->routine(task->arg);
+    free(task);
+    pthread_mutex_lock(&g->lock);
+    if (--g->pending == 0)
+        pthread_cond_broadcast(&g->done);
+    pthread_mutex_unlock(&g->lock);
+    return 1;
+}
+
+/**
+ * drops a reference to g, and frees it if it was the last one
+ */
+void release_task_group(task_group *g) {
+    pthread_mutex_lock(&g->lock);
+    int last = (--g->refs == 0);
+    pthread_mutex_unlock(&g->lock);
+    if (!last)
+        return;
+    pthread_mutex_destroy(&g->lock);
+    pthread_cond_destroy(&g->done);
+    free(g);
+}
+
+/**
+ * a chunk of parallel_for
+ */
+int run_range(void *arg) {
+    range_task *r = (range_task *) arg;
+    r->fn(r->begin, r->end, r->arg);
+    return 0;
+}
@@ -11,6 +11,14 @@
 // maximum number of threads allowed in a pool
 #define MAXT_IN_POOL 200
 
+// scheduling lanes. every lane is a FIFO of its own, LANE_SMALL is always served first
+#define NUM_LANES 2
+#define LANE_SMALL 0    //short jobs: new connections, small files, errors
+#define LANE_BULK 1     //long jobs: directory listings and other slow work
+
+// parallel_for splits a range into about this many chunks per thread, when the caller gives no chunk size
+#define CHUNKS_PER_THREAD 4
+
 
 /**
  * the pool holds a queue of this structure
@@ -27,12 +35,17 @@ typedef struct work_st{
  */
 typedef struct _threadpool_st {
     int num_threads;	//number of active threads
-    int qsize;	        //number in the queue
+    int num_reserved;   //the first num_reserved threads take only LANE_SMALL jobs
+    int next_id;        //used by the threads to know if they are reserved
+    int idle_reserved;  //reserved threads that are waiting on small_not_empty
+    int qsize;	        //number in all the queues
+    int lane_size[NUM_LANES];   //number in each queue
     pthread_t *threads;	//pointer to threads
-    work_t* qhead;		//queue head pointer
-    work_t* qtail;		//queue tail pointer
+    work_t* qhead[NUM_LANES];		//queue head pointer of each lane
+    work_t* qtail[NUM_LANES];		//queue tail pointer of each lane
     pthread_mutex_t qlock;		//lock on the queue list
     pthread_cond_t q_not_empty;	//non empty and empty condidtion vairiables
+    pthread_cond_t small_not_empty; //reserved threads wait here for LANE_SMALL jobs
     pthread_cond_t q_empty;
     int shutdown;            //1 if the pool is in distruction process
     int dont_accept;       //1 if destroy function has begun
@@ -47,6 +60,57 @@ typedef struct _threadpool_st {
 
 typedef int (*dispatch_fn)(void *);
 
+
+/**
+ * a task group: tasks spawned together and waited for together.
+ * The tasks wait in the group's own queue, and every task dispatches one helper job that runs the next task
+ * of the queue. The waiter runs the tasks that are still queued itself, so waiting from a thread of the pool
+ * (even when all the others are busy) never deadlocks.
+ */
+typedef struct task_group_st {
+    threadpool *tp;             //NULL: the tasks run in task_group_wait
+    int lane;                   //the lane of the helper jobs
+    work_t *head, *tail;        //tasks no one started yet
+    int pending;                //tasks that did not finish
+    int refs;                   //the owner and the helper jobs that were not run yet, freed at 0
+    pthread_mutex_t lock;       //protects all of the above
+    pthread_cond_t done;        //pending got to 0
+} task_group;
+
+
+// "range_fn" is what parallel_for runs on every chunk [begin, end) of its range
+typedef void (*range_fn)(int begin, int end, void *arg);
+
+
+/**
+ * create_task_group creates an empty group whose helper jobs are dispatched to lane of tp.
+ * returns NULL on failure.
+ */
+task_group* create_task_group(threadpool* tp, int lane);
+
+/**
+ * task_group_spawn adds the task routine(arg) to the group.
+ * returns 0 if it was added (it runs, at the latest in task_group_wait), -1 o.w
+ */
+int task_group_spawn(task_group* g, dispatch_fn routine, void *arg);
+
+/**
+ * task_group_wait returns when all the tasks spawned so far finished, running the ones still queued itself.
+ */
+void task_group_wait(task_group* g);
+
+/**
+ * destroy_task_group waits for the tasks and releases the group (it's freed when its last helper job ran).
+ */
+void destroy_task_group(task_group* g);
+
+/**
+ * parallel_for runs fn on chunks of [begin, end) of at most chunk numbers (chunk <= 0: CHUNKS_PER_THREAD
+ * chunks per thread of tp) on the threads of tp and the calling thread, and returns when all of them finished.
+ * returns 0 on succsess, -1 o.w (then nothing was run)
+ */
+int parallel_for(threadpool* tp, int lane, int begin, int end, int chunk, range_fn fn, void *arg);
+
 /**
  * create_threadpool creates a fixed-sized thread
  * pool.  If the function succeeds, it returns a (non-NULL)
@@ -59,6 +123,13 @@ typedef int (*dispatch_fn)(void *);
  */
 threadpool* create_threadpool(int num_threads_in_pool);
 
+/**
+ * create_threadpool_lanes is like create_threadpool, but the first num_reserved threads
+ * serve only LANE_SMALL jobs, so long jobs can never occupy the whole pool.
+ * num_reserved must be smaller than num_threads_in_pool.
+ */
+threadpool* create_threadpool_lanes(int num_threads_in_pool, int num_reserved);
+
 
 /**
  * dispatch enter a "job" of type work_t into the queue.
@@ -73,6 +144,20 @@ threadpool* create_threadpool(int num_threads_in_pool);
  */
 void dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg);
 
+/**
+ * dispatch_lane is like dispatch, but enters the job to the queue of the given lane.
+ * dispatch(...) is dispatch_lane(..., LANE_SMALL, ...)
+ * returns 0 if the job was queued, -1 o.w (bad input, no memory or the pool is being destroyed)
+ */
+int dispatch_lane(threadpool* from_me, int lane, dispatch_fn dispatch_to_here, void *arg);
+
+/**
+ * dispatch_batch enters n jobs to the queue of lane, all with the same function (args[i] is the argument
+ * of job i). The jobs are queued under one lock, and at most n threads are woken up.
+ * returns 0 if all the jobs were queued, -1 o.w (in that case none of them was queued)
+ */
+int dispatch_batch(threadpool* from_me, int lane, dispatch_fn dispatch_to_here, void **args, int n);
+
 /**
  * The work function of the thread
  * this function should:
@@ -0,0 +1,478 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <openssl/err.h>
+#include "tls.h"
+
+#define FLAG_OFF 0
+#define FLAG_ON 1
+#define MAX_EVENTS 64
+#define RELAY_AGAIN 0
+#define RELAY_DONE 1
+/**the ciphers the kernel can take over (AES-GCM)*/
+#define KTLS_CIPHERS "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:" \
+                     "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384"
+
+
+/**
+ * @author: Daniel Gabay
+ * tls.c
+ * --------------------------------------------------------------------------------
+ * This file implements the functionality of tls.h
+ * kTLS: with SSL_OP_ENABLE_KTLS OpenSSL installs the keys into the kernel itself at the end of the handshake
+ * (TCP_ULP "tls" + TLS_TX/TLS_RX). When both directions were offloaded and OpenSSL holds no buffered bytes,
+ * the SSL object is freed (its socket BIO doesn't close the socket) and the server uses the socket directly.
+ * The relay threads work like the streamer (see streamer.c): every thread owns an epoll instance, a relay is
+ * "pumped" in both directions whenever one of its two sockets is ready, and then registers only the events
+ * it waits for (a socket with nothing to wait for is removed from epoll, so its HUP can't spin the thread).
+ * Note: 1)OpenSSL 3.0/3.1 offloads receiving only for TLS 1.2, so with kTLS on the server offers TLS 1.2
+ *         with AES-GCM (the ciphers of the kernel) and the userspace path is left for the rest.
+ *       2)ALPN offers "h2" and "http/1.1": an h2 client starts with the preface and is served by the h2 engine.
+ *       3)A kTLS connection is closed without close_notify (the SSL object is gone by then), HTTP/1.0
+ *         responses have Content-Length so clients don't rely on the end of the connection.
+ */
+
+/**forward declerations*/
+int select_alpn(SSL *ssl, const unsigned char **out, unsigned char *outlen, const unsigned char *in,
+                unsigned int inlen, void *arg);
+int start_relay(tls_server *t, SSL *ssl, int sockfd);
+void *relay_loop(void *p);
+int relay_pump(tls_relay *r);
+int relay_events(tls_worker *w, tls_relay *r);
+int set_events(int epfd, int fd, int *current, int wanted, void *ptr);
+void end_relay(tls_worker *w, tls_relay *r);
+void drop_idle_relays(tls_worker *w);
+int tls_stopping(tls_server *t);
+int set_nonblocking(int fd);
+
+
+/**
+ * create_tls loads the certificate and the key and starts the relay threads. returns NULL on failure.
+ */
+tls_server *create_tls(char *cert_file, char *key_file, int use_ktls, int num_threads) {
+    if (num_threads <= 0 || num_threads > MAXT_IN_TLS)
+        return NULL;
+    tls_server *t = (tls_server *) malloc(sizeof(tls_server));
+    if (t == NULL)
+        return NULL;
+    t->workers = (tls_worker *) malloc(sizeof(tls_worker) * num_threads);
+    t->ctx = SSL_CTX_new(TLS_server_method());
+    if (t->workers == NULL || t->ctx == NULL) {
+        printf("malloc tls failed\n");
+        SSL_CTX_free(t->ctx);
+        free(t->workers);
+        free(t);
+        return NULL;
+    }
+    t->use_ktls = use_ktls;
+    t->num_threads = 0;
+    t->next = 0;
+    t->shutdown = FLAG_OFF;
+    t->ktls_conns = 0;
+    t->relay_conns = 0;
+    t->warned = FLAG_OFF;
+    pthread_mutex_init(&t->lock, NULL);
+    if (SSL_CTX_use_certificate_chain_file(t->ctx, cert_file) != 1 ||
+        SSL_CTX_use_PrivateKey_file(t->ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(t->ctx) != 1) {
+        fprintf(stderr, "tls: can't load %s / %s\n", cert_file, key_file);
+        ERR_print_errors_fp(stderr);
+        destroy_tls(t);
+        return NULL;
+    }
+    SSL_CTX_set_options(t->ctx, SSL_OP_NO_RENEGOTIATION | SSL_OP_IGNORE_UNEXPECTED_EOF);
+    SSL_CTX_set_min_proto_version(t->ctx, TLS1_2_VERSION);
+    if (use_ktls) {
+        SSL_CTX_set_options(t->ctx, SSL_OP_ENABLE_KTLS);
+#if OPENSSL_VERSION_NUMBER < 0x30200000L
+        SSL_CTX_set_max_proto_version(t->ctx, TLS1_2_VERSION);
+#endif
+        SSL_CTX_set_cipher_list(t->ctx, KTLS_CIPHERS);
+    }
+    SSL_CTX_set_alpn_select_cb(t->ctx, select_alpn, NULL);
+    for (int i = 0; i < num_threads; i++) {
+        tls_worker *w = &t->workers[i];
+        w->head = NULL;
+        w->active = 0;
+        w->owner = t;
+        w->epfd = epoll_create1(EPOLL_CLOEXEC);
+        w->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL; //NULL is the wake up event
+        if (w->epfd < 0 || w->wakefd < 0 || epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->wakefd, &ev) < 0) {
+            perror("tls epoll");
+            if (w->epfd >= 0) close(w->epfd);
+            if (w->wakefd >= 0) close(w->wakefd);
+            destroy_tls(t);
+            return NULL;
+        }
+        pthread_mutex_init(&w->lock, NULL);
+        if (pthread_create(&w->thread, NULL, relay_loop, (void *) w) != 0) {
+            pthread_mutex_destroy(&w->lock);
+            close(w->epfd);
+            close(w->wakefd);
+            destroy_tls(t);
+            return NULL;
+        }
+        t->num_threads++;
+    }
+    return t;
+}
+
+/**
+ * tls_accept runs the handshake. returns the descriptor to serve the connection on, -1 on failure.
+ */
+int tls_accept(tls_server *t, int sockfd) {
+    SSL *ssl = SSL_new(t->ctx);
+    if (ssl == NULL || SSL_set_fd(ssl, sockfd) != 1) {
+        SSL_free(ssl);
+        shutdown(sockfd, SHUT_RDWR);
+        close(sockfd);
+        return -1;
+    }
+    struct timeval tv;
+    tv.tv_sec = TLS_HANDSHAKE_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (SSL_accept(ssl) != 1) { //not TLS, timed out, or no common cipher
+        SSL_free(ssl);
+        shutdown(sockfd, SHUT_RDWR);
+        close(sockfd);
+        return -1;
+    }
+    tv.tv_sec = 0;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (t->use_ktls && BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl)) &&
+        !SSL_has_pending(ssl)) {
+        SSL_free(ssl); //the kernel keeps the keys, sockfd stays open
+        pthread_mutex_lock(&t->lock);
+        t->ktls_conns++;
+        pthread_mutex_unlock(&t->lock);
+        return sockfd;
+    }
+    pthread_mutex_lock(&t->lock);
+    t->relay_conns++;
+    int warn = t->use_ktls && !t->warned;
+    t->warned = FLAG_ON;
+    pthread_mutex_unlock(&t->lock);
+    if (warn)
+        fprintf(stderr, "tls: kernel TLS is not available for this connection, encrypting in userspace\n");
+    return start_relay(t, ssl, sockfd);
+}
+
+/**
+ * destroy_tls waits for all the relays to finish, stops the threads and frees everything.
+ */
+void destroy_tls(tls_server *t) {
+    if (t == NULL)
+        return;
+    pthread_mutex_lock(&t->lock);
+    t->shutdown = FLAG_ON;
+    pthread_mutex_unlock(&t->lock);
+    uint64_t one = 1;
+    for (int i = 0; i < t->num_threads; i++)
+        if (write(t->workers[i].wakefd, &one, sizeof(one)) < 0)
+            perror("tls wake");
+    for (int i = 0; i < t->num_threads; i++) {
+        pthread_join(t->workers[i].thread, NULL);
+        close(t->workers[i].epfd);
+        close(t->workers[i].wakefd);
+        pthread_mutex_destroy(&t->workers[i].lock);
+    }
+    if (t->ktls_conns + t->relay_conns > 0)
+        fprintf(stderr, "tls: %ld connections encrypted by the kernel, %ld in userspace\n", t->ktls_conns,
+                t->relay_conns);
+    pthread_mutex_destroy(&t->lock);
+    SSL_CTX_free(t->ctx);
+    free(t->workers);
+    free(t);
+}
+
+/**ALPN: h2 if the client offers it, o.w http/1.1*/
+int select_alpn(SSL *ssl, const unsigned char **out, unsigned char *outlen, const unsigned char *in,
+                unsigned int inlen, void *arg) {
+    (void) ssl;
+    (void) arg;
+    static const unsigned char protos[] = "\x02h2\x08http/1.1";
+    if (SSL_select_next_proto((unsigned char **) out, outlen, protos, sizeof(protos) - 1, in, inlen) ==
+        OPENSSL_NPN_NEGOTIATED)
+        return SSL_TLSEXT_ERR_OK;
+    return SSL_TLSEXT_ERR_NOACK;
+}
+
+/**hands the connection to a relay thread. returns the server end of the relay, -1 on failure*/
+int start_relay(tls_server *t, SSL *ssl, int sockfd) {
+    int sv[2];
+    tls_relay *r = (tls_relay *) malloc(sizeof(tls_relay));
+    if (r == NULL || socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        perror("tls relay");
+        free(r);
+        SSL_free(ssl);
+        shutdown(sockfd, SHUT_RDWR);
+        close(sockfd);
+        return -1;
+    }
+    r->ssl = ssl;
+    r->net_fd = sockfd;
+    r->app_fd = sv[0];
+    r->up_pos = 0;
+    r->up_len = 0;
+    r->down_len = 0;
+    r->up_done = FLAG_OFF;
+    r->up_want = EPOLLIN;
+    r->down_want = 0;
+    r->net_events = 0;
+    r->app_events = 0;
+    r->last_progress = time(NULL);
+    r->prev = NULL;
+    set_nonblocking(sockfd);
+    set_nonblocking(sv[0]);
+
+    pthread_mutex_lock(&t->lock);
+    tls_worker *w = &t->workers[t->next];
+    t->next = (t->next + 1) % t->num_threads;
+    pthread_mutex_unlock(&t->lock);
+
+    pthread_mutex_lock(&w->lock);
+    r->next = w->head;
+    if (w->head != NULL)
+        w->head->prev = r;
+    w->head = r;
+    w->active++;
+    pthread_mutex_unlock(&w->lock);
+    /*app_fd first: nobody holds sv[1] yet, so it can't be ready and the relay thread doesn't see r*/
+    if (set_events(w->epfd, sv[0], &r->app_events, EPOLLIN, r) < 0) {
+        end_relay(w, r);
+        free(r);
+        close(sv[1]);
+        return -1;
+    }
+    /*net_fd last: from here on r belongs to the relay thread, don't touch it*/
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = r;
+    r->net_events = EPOLLIN;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, sockfd, &ev) < 0) {
+        perror("tls epoll_ctl");
+        r->net_events = 0;
+        close(sv[1]); //the relay thread sees the end of app_fd and ends the relay
+        return -1;
+    }
+    return sv[1];
+}
+
+/**
+ * the work function of a relay thread: pump every ready relay until shutdown was asked and
+ * there are no relays left.
+ */
+void *relay_loop(void *p) {
+    tls_worker *w = (tls_worker *) p;
+    struct epoll_event events[MAX_EVENTS];
+    tls_relay *ended[MAX_EVENTS];
+    time_t last_sweep = time(NULL);
+    while (1) {
+        pthread_mutex_lock(&w->lock);
+        int active = w->active;
+        pthread_mutex_unlock(&w->lock);
+        if (active == 0 && tls_stopping(w->owner))
+            return NULL;
+
+        int n = epoll_wait(w->epfd, events, MAX_EVENTS, 1000);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            return NULL;
+        }
+        int num_ended = 0;
+        for (int i = 0; i < n; i++) {
+            tls_relay *r = (tls_relay *) events[i].data.ptr;
+            if (r == NULL) { //wake up, just check the shutdown flag again
+                uint64_t val;
+                if (read(w->wakefd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+                    perror("tls wake");
+                continue;
+            }
+            if (r->net_fd < 0) //ended earlier in this round (both of its sockets were ready)
+                continue;
+            if (relay_pump(r) == RELAY_DONE || relay_events(w, r) < 0) {
+                end_relay(w, r);
+                ended[num_ended++] = r;
+            }
+        }
+        for (int i = 0; i < num_ended; i++) //after the round, a later event may still point to them
+            free(ended[i]);
+        time_t now = time(NULL);
+        if (now != last_sweep) {
+            drop_idle_relays(w);
+            last_sweep = now;
+        }
+    }
+}
+
+/**
+ * moves what can be moved now in both directions. returns RELAY_DONE when the connection is over, o.w RELAY_AGAIN
+ */
+int relay_pump(tls_relay *r) {
+    int progress = 1;
+    while (progress) {
+        progress = 0;
+        /*client -> server: SSL_read, then write the plain bytes to app_fd*/
+        if (!r->up_done && r->up_pos == r->up_len) {
+            int n = SSL_read(r->ssl, r->up, TLS_RELAY_BUF);
+            if (n > 0) {
+                r->up_pos = 0;
+                r->up_len = n;
+                progress = 1;
+            } else {
+                int err = SSL_get_error(r->ssl, n);
+                if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+                    r->up_want = (err == SSL_ERROR_WANT_READ) ? EPOLLIN : EPOLLOUT;
+                else { //close_notify, EOF or a broken record: the server sees the end of the request stream
+                    r->up_done = FLAG_ON;
+                    shutdown(r->app_fd, SHUT_WR);
+                }
+            }
+        }
+        if (!r->up_done && r->up_pos < r->up_len) {
+            ssize_t n = send(r->app_fd, r->up + r->up_pos, r->up_len - r->up_pos, MSG_NOSIGNAL);
+            if (n > 0) {
+                r->up_pos += (int) n;
+                progress = 1;
+            } else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                return RELAY_DONE; //the server closed its end
+        }
+        /*server -> client: read the plain bytes from app_fd, then SSL_write*/
+        if (r->down_len == 0) {
+            ssize_t n = recv(r->app_fd, r->down, TLS_RELAY_BUF, 0);
+            if (n == 0) { //the response is over
+                SSL_shutdown(r->ssl);
+                return RELAY_DONE;
+            }
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                return RELAY_DONE;
+            if (n > 0) {
+                r->down_len = (int) n;
+                progress = 1;
+            }
+        }
+        if (r->down_len > 0) {
+            int n = SSL_write(r->ssl, r->down, r->down_len); //all of it or nothing (no partial writes)
+            if (n > 0) {
+                r->down_len = 0;
+                progress = 1;
+            } else {
+                int err = SSL_get_error(r->ssl, n);
+                if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)
+                    return RELAY_DONE; //the client is gone
+                r->down_want = (err == SSL_ERROR_WANT_READ) ? EPOLLIN : EPOLLOUT;
+            }
+        }
+        if (progress)
+            r->last_progress = time(NULL);
+    }
+    return RELAY_AGAIN;
+}
+
+/**registers the events r waits for now. returns 0 on succsess, -1 o.w*/
+int relay_events(tls_worker *w, tls_relay *r) {
+    int net = 0, app = 0;
+    if (!r->up_done) {
+        if (r->up_pos < r->up_len)
+            app |= EPOLLOUT;
+        else
+            net |= r->up_want;
+    }
+    if (r->down_len == 0)
+        app |= EPOLLIN;
+    else
+        net |= r->down_want;
+    if (set_events(w->epfd, r->net_fd, &r->net_events, net, r) < 0 ||
+        set_events(w->epfd, r->app_fd, &r->app_events, app, r) < 0)
+        return -1;
+    return 0;
+}
+
+/**changes the epoll registration of fd from *current to wanted (0 = not registered). returns 0 or -1*/
+int set_events(int epfd, int fd, int *current, int wanted, void *ptr) {
+    if (*current == wanted)
+        return 0;
+    struct epoll_event ev;
+    ev.events = wanted;
+    ev.data.ptr = ptr;
+    int op = (wanted == 0) ? EPOLL_CTL_DEL : (*current == 0) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    if (epoll_ctl(epfd, op, fd, &ev) < 0) {
+        perror("tls epoll_ctl");
+        return -1;
+    }
+    *current = wanted;
+    return 0;
+}
+
+/**
+ * removes the relay from its thread and closes both sockets (the caller frees it)
+ */
+void end_relay(tls_worker *w, tls_relay *r) {
+    pthread_mutex_lock(&w->lock);
+    if (r->net_events != 0)
+        epoll_ctl(w->epfd, EPOLL_CTL_DEL, r->net_fd, NULL);
+    if (r->app_events != 0)
+        epoll_ctl(w->epfd, EPOLL_CTL_DEL, r->app_fd, NULL);
+    if (r->prev != NULL)
+        r->prev->next = r->next;
+    else
+        w->head = r->next;
+    if (r->next != NULL)
+        r->next->prev = r->prev;
+    w->active--;
+    pthread_mutex_unlock(&w->lock);
+    SSL_free(r->ssl);
+    shutdown(r->net_fd, SHUT_RDWR);
+    close(r->net_fd);
+    close(r->app_fd);
+    r->net_fd = -1;
+}
+
+/**
+ * ends the relays that did not make progress for TLS_IDLE_TIMEOUT seconds
+ */
+void drop_idle_relays(tls_worker *w) {
+    time_t now = time(NULL);
+    pthread_mutex_lock(&w->lock);
+    tls_relay *r = w->head;
+    pthread_mutex_unlock(&w->lock);
+    while (r != NULL) { //only this thread removes relays, so the list can be walked without the lock
+        tls_relay *next = r->next;
+        if (now - r->last_progress > TLS_IDLE_TIMEOUT) {
+            end_relay(w, r);
+            free(r);
+        }
+        r = next;
+    }
+}
+
+/**
+ * returns 1 if destroy_tls was called
+ */
+int tls_stopping(tls_server *t) {
+    pthread_mutex_lock(&t->lock);
+    int stop = t->shutdown;
+    pthread_mutex_unlock(&t->lock);
+    return stop;
+}
+
+/**makes fd non-blocking. returns 0 on succsess, -1 o.w*/
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        return -1;
+    return 0;
+}
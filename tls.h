@@ -0,0 +1,98 @@
+#ifndef EX3_TLS_H
+#define EX3_TLS_H
+#include <pthread.h>
+#include <time.h>
+#include <openssl/ssl.h>
+
+/**
+ * tls.h
+ *
+ * This file declares HTTPS support. The handshake is done by OpenSSL in userspace, and then the session keys
+ * are installed into the kernel (kTLS, setsockopt TCP_ULP "tls"): from there on the socket encrypts what is
+ * written to it and decrypts what is read from it, so the rest of the server (sendfile, the streamer, h2,
+ * the proxy) works on it exactly like on a plain TCP socket, with no copy through user memory.
+ * Where kTLS is not available (kernel without the tls module, cipher the kernel doesn't support, --no-ktls)
+ * the connection is encrypted in userspace: the server gets one end of a socketpair, and a relay thread
+ * moves the bytes between it and the client with SSL_read/SSL_write.
+ */
+
+// maximum number of relay threads
+#define MAXT_IN_TLS 16
+// bytes moved at once in each direction of a relay (one TLS record at most)
+#define TLS_RELAY_BUF 16384
+// a handshake that takes longer than this (seconds) is dropped
+#define TLS_HANDSHAKE_TIMEOUT 10
+// a relay that did not make progress for this many seconds is dropped
+#define TLS_IDLE_TIMEOUT 60
+
+
+/**
+ * one connection encrypted in userspace
+ */
+typedef struct tls_relay_st {
+    SSL *ssl;
+    int net_fd;                 //the client socket (non-blocking), carries TLS records
+    int app_fd;                 //our end of the socketpair, carries plain HTTP (non-blocking)
+    char up[TLS_RELAY_BUF];     //decrypted from the client, waiting to be written to app_fd
+    int up_pos, up_len;
+    char down[TLS_RELAY_BUF];   //read from app_fd, waiting for SSL_write
+    int down_len;
+    int up_done;                //the client closed (or failed), app_fd was shut down for writing
+    int up_want, down_want;     //what SSL waits for on net_fd (EPOLLIN/EPOLLOUT) in each direction
+    int net_events, app_events; //the events registered in epoll right now
+    time_t last_progress;
+    struct tls_relay_st *prev, *next;   //list of the relays of the same thread
+} tls_relay;
+
+
+/**
+ * one relay thread and its connections
+ */
+typedef struct tls_worker_st {
+    pthread_t thread;
+    int epfd;
+    int wakefd;                 //eventfd used to wake the thread (on shutdown)
+    tls_relay *head;
+    int active;
+    pthread_mutex_t lock;       //protects head/active against tls_accept() of other threads
+    struct _tls_server_st *owner;
+} tls_worker;
+
+
+/**
+ * The TLS configuration, relay threads and counters
+ */
+typedef struct _tls_server_st {
+    SSL_CTX *ctx;
+    int use_ktls;               //0 when kTLS was turned off (--no-ktls)
+    int num_threads;
+    tls_worker *workers;
+    int next;                   //round robin index for new relays
+    int shutdown;
+    long ktls_conns;            //connections served on the kernel socket
+    long relay_conns;           //connections encrypted in userspace
+    int warned;                 //the "no kTLS" message was printed
+    pthread_mutex_t lock;       //protects next, shutdown and the counters
+} tls_server;
+
+
+/**
+ * create_tls loads the certificate chain and the private key (PEM files) and starts num_threads relay threads.
+ * use_ktls 0 forces userspace encryption. returns NULL on failure (a message is printed).
+ */
+tls_server *create_tls(char *cert_file, char *key_file, int use_ktls, int num_threads);
+
+/**
+ * tls_accept runs the server handshake on sockfd (blocking, at most TLS_HANDSHAKE_TIMEOUT seconds).
+ * returns the descriptor to serve the connection on: sockfd itself when the kernel encrypts it, o.w the
+ * server end of a relay. returns -1 if the handshake failed (sockfd is closed).
+ */
+int tls_accept(tls_server *t, int sockfd);
+
+/**
+ * destroy_tls waits for all the relays to finish, stops the threads and frees everything.
+ */
+void destroy_tls(tls_server *t);
+
+
+#endif
@@ -0,0 +1,616 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include "threadpool.h"
+
+#define JOB_EMPTY 0
+#define JOB_CPU 1
+#define JOB_SLEEP 2
+#define CPU_JOB_NS 20000        //a cpu bound job spins this long
+#define SLEEP_JOB_US 1000       //a sleep bound job sleeps this long
+#define WAKEUP_SAMPLES 2000
+#define WAKEUP_GAP_US 200       //pause between wakeup samples, so the threads are really idle
+#define STRESS_ROUNDS 30
+#define STRESS_PRODUCERS 8
+#define STRESS_JOBS 2000        //per producer per round
+#define STRESS_BATCH 8          //jobs of a dispatch_batch() of the stress test
+#define GROUP_ROUNDS 16
+#define GROUP_WAITERS 32        //jobs that wait for a task group, more than the threads of the pool
+#define GROUP_TASKS 200         //tasks spawned by every waiter
+#define GROUP_RANGE 5000        //numbers of the parallel_for of every waiter
+#define BENCH_BATCH 64          //jobs of a dispatch_batch() of the benchmark (like MAX_ACCEPT_BATCH of server.c)
+#define USAGE_ERROR "Usage: tpbench [--quick] [--stress]\n"
+
+
+/**
+ * @author: Daniel Gabay
+ * tpbench.c
+ * --------------------------------------------------------------------------------
+ * Microbenchmark and stress test of threadpool.c (make bench / make stress).
+ * Benchmark (default):
+ *      1)throughput: producers dispatch empty, cpu bound (CPU_JOB_NS spin) and sleep bound (SLEEP_JOB_US)
+ *        jobs to pools of 1..MAXT_IN_POOL threads. reports jobs/s (first dispatch to last job done)
+ *        and the latency percentiles of the dispatch() call itself.
+ *      2)wakeup latency: one job at a time to an idle pool, time from dispatch() to the job start.
+ *      3)destroy drain: a deep queue of empty jobs, then destroy_threadpool(). reports how long it takes.
+ *      4)the MAXT_IN_POOL limit: a pool of MAXT_IN_POOL threads is created, one more is refused.
+ *      5)dispatch() one job at a time vs dispatch_batch() of BENCH_BATCH jobs: jobs/s until all ran.
+ * Stress (--stress, built with -fsanitize=thread as tpstress):
+ *      many producers dispatch (single jobs and batches) to both lanes of pools with reserved threads,
+ *      jobs dispatch more jobs, and the pool is destroyed while the queue is still deep and the jobs
+ *      are still dispatching.
+ *      every job that dispatch accepted must run exactly once, o.w the program exits with 1.
+ *      task groups: more jobs than threads spawn tasks and a parallel_for, and wait for them from inside the
+ *      pool. every task and every number of the range must run exactly once, and the waits must not deadlock.
+ * --quick runs smaller benchmarks.
+ */
+
+/**
+ * one benchmark run: what the producers dispatch and the completion counter
+ */
+typedef struct run_st {
+    threadpool *tp;
+    int job_type;
+    long jobs_per_producer;
+    long total_jobs;
+    long done;                  //jobs that finished
+    pthread_mutex_t lock;       //protects done
+    pthread_cond_t all_done;
+    uint64_t *samples;          //dispatch() latency of every job
+} run_t;
+
+/**
+ * a producer thread of a run
+ */
+typedef struct producer_st {
+    run_t *run;
+    long first;                 //index of its first sample
+    pthread_t thread;
+} producer_t;
+
+/**
+ * the job of the wakeup benchmark
+ */
+typedef struct wakeup_job_st {
+    uint64_t dispatched;        //time of the dispatch
+    uint64_t started;           //time the job started
+    int done;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} wakeup_job;
+
+/**
+ * holds all the threads of a pool busy until it's opened
+ */
+typedef struct gate_st {
+    int open;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} gate_t;
+
+/**
+ * stress test state
+ */
+typedef struct stress_st {
+    threadpool *tp;
+    long accepted;              //jobs that dispatch accepted
+    long ran;                   //jobs that ran
+    pthread_mutex_t lock;
+    unsigned int seed;
+} stress_t;
+
+/**
+ * the task group stress test of one pool
+ */
+typedef struct group_stress_st {
+    threadpool *tp;
+    long ran;                   //tasks, and numbers of the ranges, that ran
+    int waiters_done;
+    pthread_mutex_t lock;       //protects ran and waiters_done
+    pthread_cond_t all_done;
+} group_stress_t;
+
+/**forward declerations*/
+uint64_t now_ns();
+int cmp_u64(const void *a, const void *b);
+uint64_t percentile(uint64_t *sorted, long n, double p);
+void print_percentiles(uint64_t *samples, long n, double unit);
+void bench_throughput(int quick);
+int run_jobs(int threads, int producers, int job_type, long total, double *jobs_per_sec, uint64_t **samples);
+void *producer_loop(void *arg);
+int bench_job(void *arg);
+void bench_wakeup(int quick);
+int wakeup_job_fn(void *arg);
+void bench_drain(int quick);
+int empty_job(void *arg);
+int gate_job(void *arg);
+void bench_limits();
+void bench_batch(int quick);
+int stress();
+void *stress_producer(void *arg);
+int stress_job(void *arg);
+void stress_dispatch(stress_t *s, unsigned int *seed);
+int stress_groups();
+int group_waiter(void *arg);
+int group_task(void *arg);
+void group_range(int begin, int end, void *arg);
+
+/**the arg of jobs that don't need one (dispatch refuses NULL)*/
+int dummy_arg = 0;
+
+
+int main(int argc, char *argv[]) {
+    int quick = 0, stress_mode = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quick") == 0)
+            quick = 1;
+        else if (strcmp(argv[i], "--stress") == 0)
+            stress_mode = 1;
+        else {
+            printf(USAGE_ERROR);
+            return 1;
+        }
+    }
+    if (stress_mode)
+        return stress();
+    bench_limits();
+    bench_throughput(quick);
+    bench_wakeup(quick);
+    bench_drain(quick);
+    bench_batch(quick);
+    return 0;
+}
+
+/**monotonic clock in ns*/
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**qsort compare of uint64_t*/
+int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/**returns the p (0..100) percentile of n sorted samples*/
+uint64_t percentile(uint64_t *sorted, long n, double p) {
+    long i = (long) (p / 100.0 * (double) (n - 1) + 0.5);
+    return sorted[i];
+}
+
+/**sorts the samples and prints p50 p90 p99 p99.9 max, divided by unit*/
+void print_percentiles(uint64_t *samples, long n, double unit) {
+    if (n == 0) {
+        printf("%9s %9s %9s %9s %9s\n", "-", "-", "-", "-", "-");
+        return;
+    }
+    qsort(samples, n, sizeof(uint64_t), cmp_u64);
+    printf("%9.1f %9.1f %9.1f %9.1f %9.1f\n", percentile(samples, n, 50) / unit, percentile(samples, n, 90) / unit,
+           percentile(samples, n, 99) / unit, percentile(samples, n, 99.9) / unit, samples[n - 1] / unit);
+}
+
+/**throughput and dispatch latency, for every job type, thread count and producer count*/
+void bench_throughput(int quick) {
+    int threads[] = {1, 4, 16, 64, MAXT_IN_POOL};
+    int producers[] = {1, 4, 16};
+    const char *names[] = {"empty", "cpu", "sleep"};
+    int num_threads = quick ? 3 : 5;
+    printf("== throughput, and latency of the dispatch() call (us)\n");
+    printf("%-6s %7s %9s %11s %9s %9s %9s %9s %9s\n", "job", "threads", "producers", "jobs/s",
+           "p50", "p90", "p99", "p99.9", "max");
+    for (int type = JOB_EMPTY; type <= JOB_SLEEP; type++) {
+        for (int t = 0; t < num_threads; t++) {
+            for (int p = 0; p < 3; p++) {
+                long total;
+                if (type == JOB_EMPTY)
+                    total = quick ? 50000 : 400000;
+                else if (type == JOB_CPU)
+                    total = (quick ? 5000 : 20000) * (threads[t] < 8 ? threads[t] : 8) / 4 + 1000;
+                else //every thread sleeps ~20ms (50ms) in total
+                    total = (quick ? 20 : 50) * threads[t];
+                total -= total % producers[p];
+                double jobs_per_sec;
+                uint64_t *samples;
+                if (run_jobs(threads[t], producers[p], type, total, &jobs_per_sec, &samples) < 0) {
+                    printf("%-6s %7d %9d failed\n", names[type], threads[t], producers[p]);
+                    continue;
+                }
+                printf("%-6s %7d %9d %11.0f ", names[type], threads[t], producers[p], jobs_per_sec);
+                print_percentiles(samples, total, 1000.0);
+                free(samples);
+            }
+        }
+    }
+}
+
+/**dispatches total jobs from producers threads to a new pool and waits for all of them.
+ * returns 0 on succsess (*samples is malloc'ed), -1 o.w*/
+int run_jobs(int threads, int producers, int job_type, long total, double *jobs_per_sec, uint64_t **samples) {
+    run_t run;
+    producer_t *prod = (producer_t *) malloc(sizeof(producer_t) * producers);
+    run.tp = create_threadpool(threads);
+    run.samples = (uint64_t *) malloc(sizeof(uint64_t) * total);
+    if (prod == NULL || run.tp == NULL || run.samples == NULL) {
+        destroy_threadpool(run.tp);
+        free(run.samples);
+        free(prod);
+        return -1;
+    }
+    run.job_type = job_type;
+    run.jobs_per_producer = total / producers;
+    run.total_jobs = total;
+    run.done = 0;
+    pthread_mutex_init(&run.lock, NULL);
+    pthread_cond_init(&run.all_done, NULL);
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < producers; i++) {
+        prod[i].run = &run;
+        prod[i].first = i * run.jobs_per_producer;
+        pthread_create(&prod[i].thread, NULL, producer_loop, &prod[i]);
+    }
+    for (int i = 0; i < producers; i++)
+        pthread_join(prod[i].thread, NULL);
+    pthread_mutex_lock(&run.lock);
+    while (run.done < total)
+        pthread_cond_wait(&run.all_done, &run.lock);
+    pthread_mutex_unlock(&run.lock);
+    uint64_t elapsed = now_ns() - start;
+
+    destroy_threadpool(run.tp);
+    free(prod);
+    pthread_mutex_destroy(&run.lock);
+    pthread_cond_destroy(&run.all_done);
+    *jobs_per_sec = (double) total / ((double) elapsed / 1e9);
+    *samples = run.samples;
+    return 0;
+}
+
+/**a producer: dispatches its share of the jobs and records how long every dispatch() took*/
+void *producer_loop(void *arg) {
+    producer_t *p = (producer_t *) arg;
+    run_t *run = p->run;
+    for (long i = 0; i < run->jobs_per_producer; i++) {
+        uint64_t t0 = now_ns();
+        dispatch(run->tp, bench_job, run);
+        run->samples[p->first + i] = now_ns() - t0;
+    }
+    return NULL;
+}
+
+/**the job of the throughput benchmark*/
+int bench_job(void *arg) {
+    run_t *run = (run_t *) arg;
+    if (run->job_type == JOB_CPU) {
+        uint64_t end = now_ns() + CPU_JOB_NS;
+        while (now_ns() < end);
+    } else if (run->job_type == JOB_SLEEP)
+        usleep(SLEEP_JOB_US);
+    pthread_mutex_lock(&run->lock);
+    if (++run->done == run->total_jobs)
+        pthread_cond_signal(&run->all_done);
+    pthread_mutex_unlock(&run->lock);
+    return 0;
+}
+
+/**wakeup latency: time from dispatch() until an idle thread starts the job*/
+void bench_wakeup(int quick) {
+    int threads[] = {1, 4, 16, 64, MAXT_IN_POOL};
+    int num_threads = quick ? 3 : 5, n = quick ? WAKEUP_SAMPLES / 4 : WAKEUP_SAMPLES;
+    uint64_t *samples = (uint64_t *) malloc(sizeof(uint64_t) * n);
+    if (samples == NULL)
+        return;
+    printf("\n== wakeup latency of an idle pool (us)\n");
+    printf("%7s %9s %9s %9s %9s %9s\n", "threads", "p50", "p90", "p99", "p99.9", "max");
+    for (int t = 0; t < num_threads; t++) {
+        threadpool *tp = create_threadpool(threads[t]);
+        if (tp == NULL)
+            continue;
+        wakeup_job job;
+        pthread_mutex_init(&job.lock, NULL);
+        pthread_cond_init(&job.cond, NULL);
+        usleep(10000); //let all the threads reach their wait
+        for (int i = 0; i < n; i++) {
+            job.done = 0;
+            job.dispatched = now_ns();
+            dispatch(tp, wakeup_job_fn, &job);
+            pthread_mutex_lock(&job.lock);
+            while (!job.done)
+                pthread_cond_wait(&job.cond, &job.lock);
+            pthread_mutex_unlock(&job.lock);
+            samples[i] = job.started - job.dispatched;
+            usleep(WAKEUP_GAP_US);
+        }
+        destroy_threadpool(tp);
+        pthread_mutex_destroy(&job.lock);
+        pthread_cond_destroy(&job.cond);
+        printf("%7d ", threads[t]);
+        print_percentiles(samples, n, 1000.0);
+    }
+    free(samples);
+}
+
+/**the job of the wakeup benchmark*/
+int wakeup_job_fn(void *arg) {
+    wakeup_job *job = (wakeup_job *) arg;
+    uint64_t started = now_ns();
+    pthread_mutex_lock(&job->lock);
+    job->started = started;
+    job->done = 1;
+    pthread_cond_signal(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+    return 0;
+}
+
+/**destroy_threadpool() with a deep queue: it must run all the queued jobs before it returns.
+ * the threads are held by gate jobs while the queue is filled, so it's really deep when destroy starts*/
+void bench_drain(int quick) {
+    int threads[] = {1, 4, 16, 64, MAXT_IN_POOL};
+    long depths[] = {10000, 100000, 1000000};
+    int num_threads = quick ? 3 : 5, num_depths = quick ? 2 : 3;
+    printf("\n== destroy_threadpool() with a deep queue of empty jobs\n");
+    printf("%7s %9s %11s %11s\n", "threads", "queued", "destroy ms", "jobs/s");
+    for (int t = 0; t < num_threads; t++) {
+        for (int d = 0; d < num_depths; d++) {
+            threadpool *tp = create_threadpool(threads[t]);
+            if (tp == NULL)
+                continue;
+            gate_t gate;
+            gate.open = 0;
+            pthread_mutex_init(&gate.lock, NULL);
+            pthread_cond_init(&gate.cond, NULL);
+            for (int i = 0; i < threads[t]; i++)
+                dispatch(tp, gate_job, &gate);
+            for (long i = 0; i < depths[d]; i++)
+                dispatch(tp, empty_job, &dummy_arg);
+            uint64_t start = now_ns();
+            pthread_mutex_lock(&gate.lock);
+            gate.open = 1;
+            pthread_cond_broadcast(&gate.cond);
+            pthread_mutex_unlock(&gate.lock);
+            destroy_threadpool(tp);
+            double ms = (double) (now_ns() - start) / 1e6;
+            printf("%7d %9ld %11.2f %11.0f\n", threads[t], depths[d], ms, ms > 0 ? depths[d] / (ms / 1000.0) : 0);
+            pthread_mutex_destroy(&gate.lock);
+            pthread_cond_destroy(&gate.cond);
+        }
+    }
+}
+
+/**empty jobs dispatched one by one vs in batches, from one producer (like the accept loop of the server)*/
+void bench_batch(int quick) {
+    int threads[] = {1, 4, 16, 64, MAXT_IN_POOL};
+    int num_threads = quick ? 3 : 5;
+    long total = quick ? 64000 : 640000;
+    run_t run;
+    void *args[BENCH_BATCH];
+    printf("\n== dispatch() vs dispatch_batch() of %d jobs, empty jobs (jobs/s)\n", BENCH_BATCH);
+    printf("%7s %11s %11s\n", "threads", "dispatch", "batch");
+    for (int i = 0; i < BENCH_BATCH; i++)
+        args[i] = &run;
+    for (int t = 0; t < num_threads; t++) {
+        double rate[2];
+        for (int batched = 0; batched <= 1; batched++) {
+            run.tp = create_threadpool(threads[t]);
+            if (run.tp == NULL)
+                return;
+            run.job_type = JOB_EMPTY;
+            run.total_jobs = total;
+            run.done = 0;
+            pthread_mutex_init(&run.lock, NULL);
+            pthread_cond_init(&run.all_done, NULL);
+            uint64_t start = now_ns();
+            if (batched)
+                for (long i = 0; i < total; i += BENCH_BATCH)
+                    dispatch_batch(run.tp, LANE_SMALL, bench_job, args, BENCH_BATCH);
+            else
+                for (long i = 0; i < total; i++)
+                    dispatch(run.tp, bench_job, &run);
+            pthread_mutex_lock(&run.lock);
+            while (run.done < total)
+                pthread_cond_wait(&run.all_done, &run.lock);
+            pthread_mutex_unlock(&run.lock);
+            rate[batched] = (double) total / ((double) (now_ns() - start) / 1e9);
+            destroy_threadpool(run.tp);
+            pthread_mutex_destroy(&run.lock);
+            pthread_cond_destroy(&run.all_done);
+        }
+        printf("%7d %11.0f %11.0f\n", threads[t], rate[0], rate[1]);
+    }
+}
+
+/**a job that does nothing*/
+int empty_job(void *arg) {
+    (void) arg;
+    return 0;
+}
+
+/**a job that waits until the gate is opened*/
+int gate_job(void *arg) {
+    gate_t *gate = (gate_t *) arg;
+    pthread_mutex_lock(&gate->lock);
+    while (!gate->open)
+        pthread_cond_wait(&gate->cond, &gate->lock);
+    pthread_mutex_unlock(&gate->lock);
+    return 0;
+}
+
+/**the MAXT_IN_POOL limit and the cost of creating/destroying a full pool*/
+void bench_limits() {
+    printf("== MAXT_IN_POOL (%d)\n", MAXT_IN_POOL);
+    uint64_t start = now_ns();
+    threadpool *tp = create_threadpool(MAXT_IN_POOL);
+    double create_ms = (double) (now_ns() - start) / 1e6;
+    if (tp == NULL) {
+        printf("create_threadpool(%d) failed\n", MAXT_IN_POOL);
+        return;
+    }
+    start = now_ns();
+    destroy_threadpool(tp);
+    double destroy_ms = (double) (now_ns() - start) / 1e6;
+    threadpool *too_big = create_threadpool(MAXT_IN_POOL + 1);
+    printf("create %.2f ms, destroy (empty queue) %.2f ms, create_threadpool(%d) %s\n\n", create_ms, destroy_ms,
+           MAXT_IN_POOL + 1, too_big == NULL ? "refused" : "NOT refused");
+    destroy_threadpool(too_big);
+}
+
+/**the stress test. returns 0 if every accepted job ran exactly once, 1 o.w*/
+int stress() {
+    int failed = 0;
+    for (int round = 0; round < STRESS_ROUNDS; round++) {
+        int threads = 1 + round % 16;
+        stress_t s;
+        pthread_t producers[STRESS_PRODUCERS];
+        s.tp = create_threadpool_lanes(threads, round % threads); //0..threads-1 reserved
+        if (s.tp == NULL) {
+            printf("round %d: create_threadpool_lanes failed\n", round);
+            return 1;
+        }
+        s.accepted = 0;
+        s.ran = 0;
+        s.seed = round;
+        pthread_mutex_init(&s.lock, NULL);
+        for (int i = 0; i < STRESS_PRODUCERS; i++)
+            pthread_create(&producers[i], NULL, stress_producer, &s);
+        /*the pool is freed by destroy, so the producers must be done before it. the jobs keep dispatching
+         *more jobs from inside the pool while destroy runs*/
+        for (int i = 0; i < STRESS_PRODUCERS; i++)
+            pthread_join(producers[i], NULL);
+        if (round % 2 == 0) //odd rounds: destroy with a deep queue
+            usleep(1000);
+        destroy_threadpool(s.tp);
+        /*after destroy returned no job may run anymore, and all the accepted ones must have run*/
+        pthread_mutex_lock(&s.lock);
+        long accepted = s.accepted, ran = s.ran;
+        pthread_mutex_unlock(&s.lock);
+        printf("round %2d: threads %2d reserved %2d accepted %6ld ran %6ld %s\n", round, threads, round % threads,
+               accepted, ran, accepted == ran ? "ok" : "MISMATCH");
+        if (accepted != ran)
+            failed = 1;
+        pthread_mutex_destroy(&s.lock);
+    }
+    if (stress_groups())
+        failed = 1;
+    printf(failed ? "stress: FAILED\n" : "stress: ok\n");
+    return failed;
+}
+
+/**the task group stress test. returns 0 if every task and every number ran exactly once, 1 o.w*/
+int stress_groups() {
+    int failed = 0;
+    long expected = (long) GROUP_WAITERS * (GROUP_TASKS + GROUP_RANGE);
+    for (int round = 0; round < GROUP_ROUNDS; round++) {
+        int threads = 1 + round % 8;
+        group_stress_t s;
+        s.tp = create_threadpool_lanes(threads, round % threads);
+        if (s.tp == NULL) {
+            printf("groups round %d: create_threadpool_lanes failed\n", round);
+            return 1;
+        }
+        s.ran = 0;
+        s.waiters_done = 0;
+        pthread_mutex_init(&s.lock, NULL);
+        pthread_cond_init(&s.all_done, NULL);
+        uint64_t start = now_ns();
+        for (int i = 0; i < GROUP_WAITERS; i++)
+            dispatch_lane(s.tp, LANE_BULK, group_waiter, &s);
+        pthread_mutex_lock(&s.lock);
+        while (s.waiters_done < GROUP_WAITERS)
+            pthread_cond_wait(&s.all_done, &s.lock);
+        long ran = s.ran;
+        pthread_mutex_unlock(&s.lock);
+        double ms = (now_ns() - start) / 1e6;
+        destroy_threadpool(s.tp);
+        printf("groups round %2d: threads %d reserved %d ran %7ld of %7ld in %7.2f ms %s\n", round, threads,
+               round % threads, ran, expected, ms, ran == expected ? "ok" : "MISMATCH");
+        if (ran != expected)
+            failed = 1;
+        pthread_cond_destroy(&s.all_done);
+        pthread_mutex_destroy(&s.lock);
+    }
+    return failed;
+}
+
+/**a job that spawns GROUP_TASKS tasks and a parallel_for of GROUP_RANGE numbers, and waits for them*/
+int group_waiter(void *arg) {
+    group_stress_t *s = (group_stress_t *) arg;
+    task_group *g = create_task_group(s->tp, LANE_BULK);
+    for (int i = 0; i < GROUP_TASKS; i++)
+        if (task_group_spawn(g, group_task, s) < 0)
+            group_task(s);
+    if (parallel_for(s->tp, LANE_BULK, 0, GROUP_RANGE, 0, group_range, s) < 0)
+        group_range(0, GROUP_RANGE, s);
+    destroy_task_group(g);
+    pthread_mutex_lock(&s->lock);
+    if (++s->waiters_done == GROUP_WAITERS)
+        pthread_cond_signal(&s->all_done);
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+
+/**a task of a group*/
+int group_task(void *arg) {
+    group_stress_t *s = (group_stress_t *) arg;
+    pthread_mutex_lock(&s->lock);
+    s->ran++;
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+
+/**a chunk of a parallel_for*/
+void group_range(int begin, int end, void *arg) {
+    group_stress_t *s = (group_stress_t *) arg;
+    pthread_mutex_lock(&s->lock);
+    s->ran += end - begin;
+    pthread_mutex_unlock(&s->lock);
+}
+
+/**a stress producer: dispatches STRESS_JOBS jobs to random lanes (until the pool refuses)*/
+void *stress_producer(void *arg) {
+    stress_t *s = (stress_t *) arg;
+    pthread_mutex_lock(&s->lock);
+    unsigned int seed = s->seed++;
+    pthread_mutex_unlock(&s->lock);
+    for (int i = 0; i < STRESS_JOBS; i++)
+        stress_dispatch(s, &seed);
+    return NULL;
+}
+
+/**dispatches one stress job (or a batch of STRESS_BATCH) to a random lane, counts them if they were accepted*/
+void stress_dispatch(stress_t *s, unsigned int *seed) {
+    int lane = rand_r(seed) % NUM_LANES, n = (rand_r(seed) % 4 == 0) ? STRESS_BATCH : 1;
+    void *args[STRESS_BATCH];
+    for (int i = 0; i < n; i++)
+        args[i] = s;
+    /*count before the dispatch: the jobs may run (and count themselves) before the dispatch returns*/
+    pthread_mutex_lock(&s->lock);
+    s->accepted += n;
+    pthread_mutex_unlock(&s->lock);
+    int rc = (n == 1) ? dispatch_lane(s->tp, lane, stress_job, s) : dispatch_batch(s->tp, lane, stress_job, args, n);
+    if (rc < 0) {
+        pthread_mutex_lock(&s->lock);
+        s->accepted -= n;
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+/**a stress job: a little work, and sometimes more jobs*/
+int stress_job(void *arg) {
+    stress_t *s = (stress_t *) arg;
+    unsigned int seed = (unsigned int) (uintptr_t) &seed ^ (unsigned int) now_ns();
+    int r = rand_r(&seed) % 100;
+    if (r < 5)
+        usleep(50);
+    else if (r < 10) //nested dispatch, from inside the pool
+        stress_dispatch(s, &seed);
+    pthread_mutex_lock(&s->lock);
+    s->ran++;
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}